@@ -0,0 +1,221 @@
+#include "addr_table.h"
+
+static void tlb_addr_mask(u32 *addr, int words, int prefix_len)
+{
+	int i, bits;
+
+	for (i = 0; i < words; i++) {
+		bits = clamp(prefix_len - 32 * i, 0, 32);
+		if (bits == 0)
+			addr[i] = 0;
+		else if (bits < 32)
+			addr[i] &= htonl(~0U << (32 - bits));
+	}
+}
+
+int tlb_addr_key_init(struct tlb_addr_key *key, struct sockaddr_storage *addr, int prefix4, int prefix6)
+{
+	memset(key, 0, sizeof(*key));
+	key->family = addr->ss_family;
+	switch (addr->ss_family) {
+	case AF_INET:
+		key->addr[0] = ((struct sockaddr_in *)addr)->sin_addr.s_addr;
+		key->prefix_len = prefix4;
+		tlb_addr_mask(key->addr, 1, prefix4);
+		return 0;
+	case AF_INET6:
+		memcpy(key->addr, &((struct sockaddr_in6 *)addr)->sin6_addr, sizeof(key->addr));
+		key->prefix_len = prefix6;
+		tlb_addr_mask(key->addr, 4, prefix6);
+		return 0;
+	default:
+		return -EAFNOSUPPORT;
+	}
+}
+
+static u32 tlb_addr_key_hash(struct tlb_addr_key *key)
+{
+	return jhash2((u32 *)key, sizeof(*key) / sizeof(u32), 0);
+}
+
+static struct tlb_addr_entry *tlb_addr_table_entry(struct tlb_addr_table *table, int i)
+{
+	return table->entries + i * table->entry_size;
+}
+
+int tlb_addr_table_init(struct tlb_addr_table *table, int nr_entries, size_t data_size)
+{
+	struct tlb_addr_shard *shard;
+	struct tlb_addr_entry *entry;
+	int i, j;
+
+	table->entry_size = ALIGN(sizeof(struct tlb_addr_entry) + data_size, sizeof(long));
+	table->nr_entries = nr_entries;
+	table->entries = vzalloc(nr_entries * table->entry_size);
+	if (!table->entries)
+		return -ENOMEM;
+
+	for (i = 0; i < TLB_ADDR_TABLE_SHARDS; i++) {
+		shard = &table->shard[i];
+		spin_lock_init(&shard->lock);
+		for (j = 0; j < ARRAY_SIZE(shard->hash); j++)
+			INIT_HLIST_HEAD(&shard->hash[j]);
+		INIT_LIST_HEAD(&shard->lru_list);
+		INIT_LIST_HEAD(&shard->free_list);
+	}
+
+	for (i = 0; i < nr_entries; i++) {
+		entry = tlb_addr_table_entry(table, i);
+		list_add_tail(&entry->lru_entry, &table->shard[i % TLB_ADDR_TABLE_SHARDS].free_list);
+	}
+
+	return 0;
+}
+
+void tlb_addr_table_deinit(struct tlb_addr_table *table)
+{
+	vfree(table->entries);
+	table->entries = NULL;
+}
+
+static struct tlb_addr_entry *tlb_addr_shard_alloc(struct tlb_addr_table *table, struct tlb_addr_shard *shard)
+{
+	struct tlb_addr_entry *entry;
+
+	if (!list_empty(&shard->free_list)) {
+		entry = list_first_entry(&shard->free_list, struct tlb_addr_entry, lru_entry);
+		list_del(&entry->lru_entry);
+		return entry;
+	}
+
+	list_for_each_entry(entry, &shard->lru_list, lru_entry) {
+		if (!entry->pins) {
+			list_del(&entry->lru_entry);
+			hlist_del_init(&entry->hash_entry);
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Look the key up, creating it if asked, and run fn on the entry under the
+ * shard lock. Returns -ENOENT if there's no entry, -ENOSPC if every entry
+ * of the shard is pinned, otherwise what fn returns.
+ */
+int tlb_addr_table_update(struct tlb_addr_table *table, struct tlb_addr_key *key, bool create,
+			  tlb_addr_table_fn fn, void *arg)
+{
+	u32 hash = tlb_addr_key_hash(key);
+	struct tlb_addr_shard *shard = &table->shard[hash % TLB_ADDR_TABLE_SHARDS];
+	struct hlist_head *head = &shard->hash[hash_32(hash, TLB_ADDR_TABLE_HASH_BITS)];
+	struct tlb_addr_entry *entry;
+	bool created = false;
+	int r;
+
+	spin_lock_bh(&shard->lock);
+	hlist_for_each_entry(entry, head, hash_entry) {
+		if (!memcmp(&entry->key, key, sizeof(*key)))
+			goto found;
+	}
+
+	if (!create) {
+		r = -ENOENT;
+		goto unlock;
+	}
+
+	entry = tlb_addr_shard_alloc(table, shard);
+	if (!entry) {
+		r = -ENOSPC;
+		goto unlock;
+	}
+	memset(entry, 0, table->entry_size);
+	entry->key = *key;
+	hlist_add_head(&entry->hash_entry, head);
+	list_add_tail(&entry->lru_entry, &shard->lru_list);
+	created = true;
+
+found:
+	list_move_tail(&entry->lru_entry, &shard->lru_list);
+	r = fn(entry, created, arg);
+unlock:
+	spin_unlock_bh(&shard->lock);
+	return r;
+}
+
+/* fn may be NULL, it runs under the shard lock before the pin is dropped */
+void tlb_addr_table_unpin(struct tlb_addr_table *table, struct tlb_addr_entry *entry,
+			  tlb_addr_table_fn fn, void *arg)
+{
+	u32 hash = tlb_addr_key_hash(&entry->key);
+	struct tlb_addr_shard *shard = &table->shard[hash % TLB_ADDR_TABLE_SHARDS];
+
+	spin_lock_bh(&shard->lock);
+	if (fn)
+		fn(entry, false, arg);
+	WARN_ON(entry->pins <= 0);
+	entry->pins--;
+	spin_unlock_bh(&shard->lock);
+}
+
+/* drop every unpinned entry */
+void tlb_addr_table_clear(struct tlb_addr_table *table)
+{
+	struct tlb_addr_entry *entry, *tmp;
+	struct tlb_addr_shard *shard;
+	int i;
+
+	for (i = 0; i < TLB_ADDR_TABLE_SHARDS; i++) {
+		shard = &table->shard[i];
+		spin_lock_bh(&shard->lock);
+		list_for_each_entry_safe(entry, tmp, &shard->lru_list, lru_entry) {
+			if (entry->pins)
+				continue;
+			hlist_del_init(&entry->hash_entry);
+			list_move_tail(&entry->lru_entry, &shard->free_list);
+		}
+		spin_unlock_bh(&shard->lock);
+	}
+}
+
+/* drop the entry of the key even if it's pinned */
+int tlb_addr_table_delete(struct tlb_addr_table *table, struct tlb_addr_key *key)
+{
+	u32 hash = tlb_addr_key_hash(key);
+	struct tlb_addr_shard *shard = &table->shard[hash % TLB_ADDR_TABLE_SHARDS];
+	struct hlist_head *head = &shard->hash[hash_32(hash, TLB_ADDR_TABLE_HASH_BITS)];
+	struct tlb_addr_entry *entry;
+	int r = -ENOENT;
+
+	spin_lock_bh(&shard->lock);
+	hlist_for_each_entry(entry, head, hash_entry) {
+		if (!memcmp(&entry->key, key, sizeof(*key))) {
+			hlist_del_init(&entry->hash_entry);
+			list_move_tail(&entry->lru_entry, &shard->free_list);
+			r = 0;
+			break;
+		}
+	}
+	spin_unlock_bh(&shard->lock);
+	return r;
+}
+
+/*
+ * Run fn on the i-th entry under its shard lock, entries never leave the
+ * shard they were put in at init. Returns -ENOENT if the entry is free.
+ */
+int tlb_addr_table_slot(struct tlb_addr_table *table, int i, tlb_addr_table_fn fn, void *arg)
+{
+	struct tlb_addr_shard *shard = &table->shard[i % TLB_ADDR_TABLE_SHARDS];
+	struct tlb_addr_entry *entry = tlb_addr_table_entry(table, i);
+	int r;
+
+	spin_lock_bh(&shard->lock);
+	if (hlist_unhashed(&entry->hash_entry))
+		r = -ENOENT;
+	else
+		r = fn(entry, false, arg);
+	spin_unlock_bh(&shard->lock);
+	return r;
+}
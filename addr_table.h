@@ -0,0 +1,62 @@
+#pragma once
+
+#include "base.h"
+
+#define TLB_ADDR_TABLE_SHARDS 64
+#define TLB_ADDR_TABLE_HASH_BITS 8
+
+/* an address masked to a prefix length, usable as a hash key */
+struct tlb_addr_key {
+	u32 addr[4];
+	u16 family;
+	u16 prefix_len;
+};
+
+struct tlb_addr_entry {
+	struct hlist_node hash_entry;
+	struct list_head lru_entry;
+	struct tlb_addr_key key;
+	/* pinned entries are never evicted */
+	int pins;
+	u8 data[];
+};
+
+/*
+ * Sharded by key hash, each shard has its own lock, a fixed set of
+ * preallocated entries and an LRU list that evicts the oldest unpinned
+ * entry when it runs out of them. Nothing is allocated after init.
+ */
+struct tlb_addr_shard {
+	spinlock_t lock;
+	struct hlist_head hash[1 << TLB_ADDR_TABLE_HASH_BITS];
+	struct list_head lru_list;
+	struct list_head free_list;
+} ____cacheline_aligned_in_smp;
+
+struct tlb_addr_table {
+	struct tlb_addr_shard shard[TLB_ADDR_TABLE_SHARDS];
+	void *entries;
+	size_t entry_size;
+	int nr_entries;
+};
+
+/* called under the shard lock, created is true for a fresh zeroed entry */
+typedef int (*tlb_addr_table_fn)(struct tlb_addr_entry *entry, bool created, void *arg);
+
+int tlb_addr_key_init(struct tlb_addr_key *key, struct sockaddr_storage *addr, int prefix4, int prefix6);
+
+int tlb_addr_table_init(struct tlb_addr_table *table, int nr_entries, size_t data_size);
+
+void tlb_addr_table_deinit(struct tlb_addr_table *table);
+
+int tlb_addr_table_update(struct tlb_addr_table *table, struct tlb_addr_key *key, bool create,
+			  tlb_addr_table_fn fn, void *arg);
+
+void tlb_addr_table_unpin(struct tlb_addr_table *table, struct tlb_addr_entry *entry,
+			  tlb_addr_table_fn fn, void *arg);
+
+void tlb_addr_table_clear(struct tlb_addr_table *table);
+
+int tlb_addr_table_delete(struct tlb_addr_table *table, struct tlb_addr_key *key);
+
+int tlb_addr_table_slot(struct tlb_addr_table *table, int i, tlb_addr_table_fn fn, void *arg);
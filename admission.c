@@ -0,0 +1,197 @@
+#include "admission.h"
+
+struct tlb_admission_data {
+	struct tlb_tbucket tb;
+	u32 cons;
+};
+
+struct tlb_admission_arg {
+	struct tlb_admission_limit *limit;
+	u64 now;
+	struct tlb_addr_entry *entry;
+};
+
+int tlb_admission_init(struct tlb_admission *adm)
+{
+	int r;
+
+	memset(adm, 0, sizeof(*adm));
+	spin_lock_init(&adm->lock);
+	adm->prefix4 = TLB_ADMISSION_PREFIX4;
+	adm->prefix6 = TLB_ADMISSION_PREFIX6;
+
+	r = tlb_addr_table_init(&adm->ip_table, TLB_ADMISSION_ENTRIES, sizeof(struct tlb_admission_data));
+	if (r)
+		return r;
+
+	r = tlb_addr_table_init(&adm->prefix_table, TLB_ADMISSION_ENTRIES, sizeof(struct tlb_admission_data));
+	if (r) {
+		tlb_addr_table_deinit(&adm->ip_table);
+		return r;
+	}
+
+	return 0;
+}
+
+void tlb_admission_deinit(struct tlb_admission *adm)
+{
+	tlb_addr_table_deinit(&adm->prefix_table);
+	tlb_addr_table_deinit(&adm->ip_table);
+}
+
+static int tlb_admission_take(struct tlb_addr_entry *entry, bool created, void *arg)
+{
+	struct tlb_admission_data *data = (struct tlb_admission_data *)entry->data;
+	struct tlb_admission_arg *aarg = arg;
+	struct tlb_admission_limit *limit = aarg->limit;
+
+	if (created)
+		tlb_tbucket_init(&data->tb, limit->burst, aarg->now);
+
+	if (limit->max_cons && data->cons >= limit->max_cons)
+		return -EBUSY;
+
+	if (!tlb_tbucket_take(&data->tb, limit->rate, limit->burst, 1, aarg->now))
+		return -EAGAIN;
+
+	data->cons++;
+	entry->pins++;
+	aarg->entry = entry;
+	return 0;
+}
+
+static int tlb_admission_put(struct tlb_addr_entry *entry, bool created, void *arg)
+{
+	struct tlb_admission_data *data = (struct tlb_admission_data *)entry->data;
+
+	data->cons--;
+	return 0;
+}
+
+static int tlb_admission_check_table(struct tlb_admission *adm, struct tlb_addr_table *table,
+				     struct tlb_addr_key *key, struct tlb_admission_limit *limit,
+				     u64 now, struct tlb_addr_entry **pentry)
+{
+	struct tlb_admission_arg arg;
+	int r;
+
+	*pentry = NULL;
+	if (!limit->rate && !limit->max_cons)
+		return 0;
+
+	arg.limit = limit;
+	arg.now = now;
+	arg.entry = NULL;
+	r = tlb_addr_table_update(table, key, true, tlb_admission_take, &arg);
+	switch (r) {
+	case 0:
+		*pentry = arg.entry;
+		break;
+	case -ENOSPC:
+		/* every tracked address is busy, let it through untracked */
+		atomic64_inc(&adm->table_full);
+		r = 0;
+		break;
+	case -EAGAIN:
+		atomic64_inc(&adm->rate_limited);
+		break;
+	case -EBUSY:
+		atomic64_inc(&adm->con_limited);
+		break;
+	}
+
+	return r;
+}
+
+int tlb_admission_check(struct tlb_admission *adm, struct sockaddr_storage *addr,
+			struct tlb_admission_ticket *ticket)
+{
+	struct tlb_admission_limit ip, prefix;
+	struct tlb_addr_key key;
+	int prefix4, prefix6, r;
+	u64 now;
+
+	ticket->ip = NULL;
+	ticket->prefix = NULL;
+	if (!READ_ONCE(adm->enabled))
+		goto accept;
+
+	spin_lock(&adm->lock);
+	ip = adm->ip;
+	prefix = adm->prefix;
+	prefix4 = adm->prefix4;
+	prefix6 = adm->prefix6;
+	spin_unlock(&adm->lock);
+
+	now = ktime_get_ns();
+	if (tlb_addr_key_init(&key, addr, 32, 128))
+		goto accept;
+
+	r = tlb_admission_check_table(adm, &adm->ip_table, &key, &ip, now, &ticket->ip);
+	if (r)
+		return r;
+
+	tlb_addr_key_init(&key, addr, prefix4, prefix6);
+	r = tlb_admission_check_table(adm, &adm->prefix_table, &key, &prefix, now, &ticket->prefix);
+	if (r) {
+		tlb_admission_release(adm, ticket);
+		return r;
+	}
+
+accept:
+	atomic64_inc(&adm->accepted);
+	return 0;
+}
+
+void tlb_admission_release(struct tlb_admission *adm, struct tlb_admission_ticket *ticket)
+{
+	if (ticket->ip) {
+		tlb_addr_table_unpin(&adm->ip_table, ticket->ip, tlb_admission_put, NULL);
+		ticket->ip = NULL;
+	}
+	if (ticket->prefix) {
+		tlb_addr_table_unpin(&adm->prefix_table, ticket->prefix, tlb_admission_put, NULL);
+		ticket->prefix = NULL;
+	}
+}
+
+void tlb_admission_set_limit(struct tlb_admission *adm, bool prefix, struct tlb_admission_limit *limit)
+{
+	spin_lock(&adm->lock);
+	if (prefix)
+		adm->prefix = *limit;
+	else
+		adm->ip = *limit;
+	adm->enabled = adm->ip.rate || adm->ip.max_cons || adm->prefix.rate || adm->prefix.max_cons;
+	spin_unlock(&adm->lock);
+}
+
+void tlb_admission_get_limit(struct tlb_admission *adm, bool prefix, struct tlb_admission_limit *limit)
+{
+	spin_lock(&adm->lock);
+	*limit = prefix ? adm->prefix : adm->ip;
+	spin_unlock(&adm->lock);
+}
+
+int tlb_admission_set_prefix(struct tlb_admission *adm, int prefix4, int prefix6)
+{
+	if (prefix4 < 0 || prefix4 > 32 || prefix6 < 0 || prefix6 > 128)
+		return -EINVAL;
+
+	spin_lock(&adm->lock);
+	adm->prefix4 = prefix4;
+	adm->prefix6 = prefix6;
+	spin_unlock(&adm->lock);
+
+	/* old prefixes would never match again, let them age out faster */
+	tlb_addr_table_clear(&adm->prefix_table);
+	return 0;
+}
+
+void tlb_admission_get_stats(struct tlb_admission *adm, struct tlb_admission_stats *stats)
+{
+	stats->accepted = atomic64_read(&adm->accepted);
+	stats->rate_limited = atomic64_read(&adm->rate_limited);
+	stats->con_limited = atomic64_read(&adm->con_limited);
+	stats->table_full = atomic64_read(&adm->table_full);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "base.h"
+#include "addr_table.h"
+#include "tbucket.h"
+
+#define TLB_ADMISSION_ENTRIES (16 * 1024)
+#define TLB_ADMISSION_PREFIX4 24
+#define TLB_ADMISSION_PREFIX6 56
+
+/* zero rate or max_cons means no limit */
+struct tlb_admission_limit {
+	u64 rate;
+	u64 burst;
+	u32 max_cons;
+};
+
+struct tlb_admission_stats {
+	u64 accepted;
+	u64 rate_limited;
+	u64 con_limited;
+	u64 table_full;
+};
+
+/*
+ * New connection admission by client address and by client prefix: a
+ * token bucket for the connection rate and a cap on concurrent connections
+ * for each. Checked right after accept, before a con is created.
+ */
+struct tlb_admission {
+	spinlock_t lock;
+	struct tlb_admission_limit ip;
+	struct tlb_admission_limit prefix;
+	int prefix4;
+	int prefix6;
+	bool enabled;
+
+	struct tlb_addr_table ip_table;
+	struct tlb_addr_table prefix_table;
+
+	atomic64_t accepted;
+	atomic64_t rate_limited;
+	atomic64_t con_limited;
+	atomic64_t table_full;
+};
+
+/* what an admitted connection holds until it's closed */
+struct tlb_admission_ticket {
+	struct tlb_addr_entry *ip;
+	struct tlb_addr_entry *prefix;
+};
+
+int tlb_admission_init(struct tlb_admission *adm);
+
+void tlb_admission_deinit(struct tlb_admission *adm);
+
+int tlb_admission_check(struct tlb_admission *adm, struct sockaddr_storage *addr,
+			struct tlb_admission_ticket *ticket);
+
+void tlb_admission_release(struct tlb_admission *adm, struct tlb_admission_ticket *ticket);
+
+void tlb_admission_set_limit(struct tlb_admission *adm, bool prefix, struct tlb_admission_limit *limit);
+
+void tlb_admission_get_limit(struct tlb_admission *adm, bool prefix, struct tlb_admission_limit *limit);
+
+int tlb_admission_set_prefix(struct tlb_admission *adm, int prefix4, int prefix6);
+
+void tlb_admission_get_stats(struct tlb_admission *adm, struct tlb_admission_stats *stats);
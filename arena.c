@@ -0,0 +1,167 @@
+#include "arena.h"
+
+/* lives in the first slot of its chunk */
+struct tlb_arena_chunk {
+	u32 magic;
+	int node;
+	struct list_head chunk_entry;
+	struct list_head partial_entry;
+	void *free;
+	int used;
+};
+
+int tlb_arena_init(struct tlb_arena *arena, const char *name, size_t obj_size)
+{
+	int i;
+
+	BUG_ON(!is_power_of_2(obj_size) || obj_size < sizeof(struct tlb_arena_chunk) ||
+	       obj_size >= TLB_ARENA_CHUNK_SIZE);
+
+	memset(arena, 0, sizeof(*arena));
+	arena->name = name;
+	arena->obj_size = obj_size;
+	atomic64_set(&arena->nr_chunks, 0);
+	atomic64_set(&arena->nr_fallbacks, 0);
+
+	arena->nodes = kcalloc(nr_node_ids, sizeof(*arena->nodes), GFP_KERNEL);
+	if (!arena->nodes)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_node_ids; i++) {
+		spin_lock_init(&arena->nodes[i].lock);
+		INIT_LIST_HEAD(&arena->nodes[i].chunk_list);
+		INIT_LIST_HEAD(&arena->nodes[i].partial_list);
+	}
+
+	/* aligned to its size too, coroutine stacks rely on that */
+	arena->fallback = kmem_cache_create(name, obj_size, obj_size, 0, NULL);
+	if (!arena->fallback) {
+		kfree(arena->nodes);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void tlb_arena_free_chunk(struct tlb_arena *arena, struct tlb_arena_chunk *chunk)
+{
+	atomic64_dec(&arena->nr_chunks);
+	__free_pages(virt_to_page(chunk), TLB_ARENA_CHUNK_ORDER);
+}
+
+void tlb_arena_deinit(struct tlb_arena *arena)
+{
+	struct tlb_arena_chunk *chunk, *tmp;
+	int i;
+
+	for (i = 0; i < nr_node_ids; i++) {
+		list_for_each_entry_safe(chunk, tmp, &arena->nodes[i].chunk_list, chunk_entry) {
+			WARN_ON(chunk->used);
+			list_del(&chunk->chunk_entry);
+			tlb_arena_free_chunk(arena, chunk);
+		}
+	}
+
+	kmem_cache_destroy(arena->fallback);
+	kfree(arena->nodes);
+}
+
+static struct tlb_arena_chunk *tlb_arena_new_chunk(struct tlb_arena *arena, int node)
+{
+	struct tlb_arena_chunk *chunk;
+	struct page *page;
+	void *obj;
+
+	page = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY,
+				TLB_ARENA_CHUNK_ORDER);
+	if (!page)
+		return NULL;
+
+	chunk = page_address(page);
+	chunk->magic = TLB_ARENA_MAGIC;
+	chunk->node = node;
+	chunk->used = 0;
+	chunk->free = NULL;
+	for (obj = (void *)chunk + TLB_ARENA_CHUNK_SIZE - arena->obj_size; obj > (void *)chunk;
+	     obj -= arena->obj_size) {
+		*(void **)obj = chunk->free;
+		chunk->free = obj;
+	}
+
+	atomic64_inc(&arena->nr_chunks);
+	return chunk;
+}
+
+void *tlb_arena_alloc(struct tlb_arena *arena, int node)
+{
+	struct tlb_arena_node *anode = &arena->nodes[node];
+	struct tlb_arena_chunk *chunk;
+	void *obj;
+
+	spin_lock(&anode->lock);
+	if (list_empty(&anode->partial_list)) {
+		spin_unlock(&anode->lock);
+		chunk = tlb_arena_new_chunk(arena, node);
+		if (!chunk) {
+			atomic64_inc(&arena->nr_fallbacks);
+			return kmem_cache_alloc_node(arena->fallback, GFP_KERNEL, node);
+		}
+		spin_lock(&anode->lock);
+		list_add(&chunk->chunk_entry, &anode->chunk_list);
+		list_add(&chunk->partial_entry, &anode->partial_list);
+	}
+
+	chunk = list_first_entry(&anode->partial_list, struct tlb_arena_chunk, partial_entry);
+	obj = chunk->free;
+	chunk->free = *(void **)obj;
+	chunk->used++;
+	if (!chunk->free)
+		list_del_init(&chunk->partial_entry);
+	spin_unlock(&anode->lock);
+	return obj;
+}
+
+static struct tlb_arena_chunk *tlb_arena_chunk_of(void *obj)
+{
+	struct page *head = compound_head(virt_to_page(obj));
+	struct tlb_arena_chunk *chunk;
+
+	/* slab pages of the fallback are never that large */
+	if (!PageCompound(head) || compound_order(head) != TLB_ARENA_CHUNK_ORDER)
+		return NULL;
+
+	chunk = (struct tlb_arena_chunk *)((unsigned long)obj & ~(TLB_ARENA_CHUNK_SIZE - 1));
+	if (chunk->magic != TLB_ARENA_MAGIC || (void *)chunk == obj)
+		return NULL;
+	return chunk;
+}
+
+void tlb_arena_free(struct tlb_arena *arena, void *obj)
+{
+	struct tlb_arena_chunk *chunk = tlb_arena_chunk_of(obj);
+	struct tlb_arena_node *anode;
+	bool release = false;
+
+	if (!chunk) {
+		kmem_cache_free(arena->fallback, obj);
+		return;
+	}
+
+	anode = &arena->nodes[chunk->node];
+	spin_lock(&anode->lock);
+	*(void **)obj = chunk->free;
+	chunk->free = obj;
+	chunk->used--;
+	if (list_empty(&chunk->partial_entry))
+		list_add(&chunk->partial_entry, &anode->partial_list);
+	/* keep one empty chunk around so a single connection can't thrash */
+	else if (!chunk->used && !list_is_singular(&anode->partial_list)) {
+		list_del(&chunk->partial_entry);
+		list_del(&chunk->chunk_entry);
+		release = true;
+	}
+	spin_unlock(&anode->lock);
+
+	if (release)
+		tlb_arena_free_chunk(arena, chunk);
+}
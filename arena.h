@@ -0,0 +1,38 @@
+#pragma once
+
+#include "base.h"
+
+#define TLB_ARENA_CHUNK_SHIFT 21
+#define TLB_ARENA_CHUNK_SIZE (1UL << TLB_ARENA_CHUNK_SHIFT)
+#define TLB_ARENA_CHUNK_ORDER (TLB_ARENA_CHUNK_SHIFT - PAGE_SHIFT)
+#define TLB_ARENA_MAGIC 0xA4E4A4E4
+
+struct tlb_arena_node {
+	spinlock_t lock;
+	struct list_head chunk_list;
+	/* chunks with free slots */
+	struct list_head partial_list;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Fixed size objects carved out of 2MB chunks, which the direct map covers
+ * with a single huge TLB entry, instead of slab pages scattered over many.
+ * Chunks are per NUMA node and naturally aligned, so objects are aligned to
+ * their size. When no 2MB block is free the slab cache serves instead.
+ */
+struct tlb_arena {
+	const char *name;
+	size_t obj_size;
+	struct kmem_cache *fallback;
+	struct tlb_arena_node *nodes;
+	atomic64_t nr_chunks;
+	atomic64_t nr_fallbacks;
+};
+
+int tlb_arena_init(struct tlb_arena *arena, const char *name, size_t obj_size);
+
+void tlb_arena_deinit(struct tlb_arena *arena);
+
+void *tlb_arena_alloc(struct tlb_arena *arena, int node);
+
+void tlb_arena_free(struct tlb_arena *arena, void *obj);
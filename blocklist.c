@@ -0,0 +1,255 @@
+#include "blocklist.h"
+
+struct tlb_block_arg {
+	unsigned long now;
+	unsigned long expires;
+	bool pin;
+	char *buf;
+	size_t size;
+	ssize_t off;
+	struct tlb_block_record *record;
+};
+
+int tlb_blocklist_init(struct tlb_blocklist *bl)
+{
+	memset(bl, 0, sizeof(*bl));
+	return tlb_addr_table_init(&bl->table, TLB_BLOCKLIST_ENTRIES, sizeof(struct tlb_block));
+}
+
+void tlb_blocklist_deinit(struct tlb_blocklist *bl)
+{
+	tlb_addr_table_deinit(&bl->table);
+}
+
+static bool tlb_block_expired(struct tlb_block *block, unsigned long now)
+{
+	return block->expires && time_after_eq(now, block->expires);
+}
+
+/* an expired block stays until evicted, unpinned so it can be */
+static int tlb_block_match(struct tlb_addr_entry *entry, bool created, void *arg)
+{
+	struct tlb_block *block = (struct tlb_block *)entry->data;
+	struct tlb_block_arg *barg = arg;
+
+	if (tlb_block_expired(block, barg->now)) {
+		entry->pins = 0;
+		return 0;
+	}
+	return 1;
+}
+
+/* a lookup per prefix length blocked in the family */
+bool tlb_blocklist_check(struct tlb_blocklist *bl, struct sockaddr_storage *addr)
+{
+	struct tlb_block_arg arg = { .now = jiffies };
+	struct tlb_addr_key key;
+	unsigned long *prefixes;
+	int len, bits;
+
+	switch (addr->ss_family) {
+	case AF_INET:
+		prefixes = bl->prefix4;
+		bits = 33;
+		break;
+	case AF_INET6:
+		prefixes = bl->prefix6;
+		bits = 129;
+		break;
+	default:
+		return false;
+	}
+
+	for_each_set_bit(len, prefixes, bits) {
+		if (tlb_addr_key_init(&key, addr, len, len))
+			return false;
+		if (tlb_addr_table_update(&bl->table, &key, false, tlb_block_match, &arg) > 0) {
+			atomic64_inc(&bl->blocked);
+			return true;
+		}
+	}
+	return false;
+}
+
+static int tlb_block_key(struct tlb_addr_key *key, struct sockaddr_storage *addr, int prefix_len)
+{
+	if (prefix_len < 0 || prefix_len > ((addr->ss_family == AF_INET) ? 32 : 128))
+		return -EINVAL;
+	return tlb_addr_key_init(key, addr, prefix_len, prefix_len);
+}
+
+/* automatic blocks don't shorten or unpin one added by hand */
+static int tlb_block_set(struct tlb_addr_entry *entry, bool created, void *arg)
+{
+	struct tlb_block *block = (struct tlb_block *)entry->data;
+	struct tlb_block_arg *barg = arg;
+
+	if (!barg->pin && entry->pins)
+		return 0;
+
+	block->expires = barg->expires;
+	if (barg->pin)
+		entry->pins = 1;
+	return 0;
+}
+
+static int __tlb_blocklist_add(struct tlb_blocklist *bl, struct sockaddr_storage *addr, int prefix_len,
+			       unsigned int ttl_ms, bool pin)
+{
+	struct tlb_block_arg arg = { .pin = pin };
+	struct tlb_addr_key key;
+	int r;
+
+	r = tlb_block_key(&key, addr, prefix_len);
+	if (r)
+		return r;
+
+	/* never zero if it expires */
+	arg.expires = ttl_ms ? (jiffies + msecs_to_jiffies(ttl_ms)) | 1 : 0;
+	r = tlb_addr_table_update(&bl->table, &key, true, tlb_block_set, &arg);
+	if (r)
+		return r;
+
+	set_bit(prefix_len, (key.family == AF_INET) ? bl->prefix4 : bl->prefix6);
+	return 0;
+}
+
+/*
+ * Zero ttl_ms blocks until deleted, re-adding updates the ttl. -ENOSPC if
+ * every entry of the shard is held by a block added by hand.
+ */
+int tlb_blocklist_add(struct tlb_blocklist *bl, struct sockaddr_storage *addr, int prefix_len, unsigned int ttl_ms)
+{
+	return __tlb_blocklist_add(bl, addr, prefix_len, ttl_ms, true);
+}
+
+int tlb_blocklist_del(struct tlb_blocklist *bl, struct sockaddr_storage *addr, int prefix_len)
+{
+	struct tlb_addr_key key;
+	int r;
+
+	r = tlb_block_key(&key, addr, prefix_len);
+	if (r)
+		return r;
+
+	return tlb_addr_table_delete(&bl->table, &key);
+}
+
+/* admission rate limited the address, keep it out for a while */
+void tlb_blocklist_flood(struct tlb_blocklist *bl, struct sockaddr_storage *addr)
+{
+	unsigned int ttl_ms = READ_ONCE(bl->flood_block_ms);
+	int r;
+
+	if (!ttl_ms)
+		return;
+
+	r = __tlb_blocklist_add(bl, addr, (addr->ss_family == AF_INET) ? 32 : 128, ttl_ms, false);
+	if (!r)
+		atomic64_inc(&bl->auto_blocks);
+	else if (r == -ENOSPC)
+		atomic64_inc(&bl->full);
+}
+
+static int tlb_block_show(struct tlb_addr_entry *entry, bool created, void *arg)
+{
+	struct tlb_block *block = (struct tlb_block *)entry->data;
+	struct tlb_block_arg *barg = arg;
+	unsigned int left;
+	char line[64];
+	int len;
+
+	if (tlb_block_expired(block, barg->now))
+		return 0;
+
+	left = block->expires ? jiffies_to_msecs(block->expires - barg->now) : 0;
+	if (entry->key.family == AF_INET)
+		len = scnprintf(line, sizeof(line), "%pI4/%u %u\n", entry->key.addr,
+				entry->key.prefix_len, left);
+	else
+		len = scnprintf(line, sizeof(line), "%pI6c/%u %u\n", entry->key.addr,
+				entry->key.prefix_len, left);
+	if (barg->off + len >= barg->size)
+		return -ENOSPC;
+
+	memcpy(barg->buf + barg->off, line, len);
+	barg->off += len;
+	return 0;
+}
+
+/*
+ * One "prefix/len ms_left" per line, 0 ms_left never expires. Stops at
+ * whole lines once the buffer is full, blocklist_dump has all of them.
+ */
+ssize_t tlb_blocklist_show(struct tlb_blocklist *bl, char *buf, size_t size)
+{
+	struct tlb_block_arg arg = { .now = jiffies, .buf = buf, .size = size };
+	int i;
+
+	for (i = 0; i < bl->table.nr_entries; i++) {
+		if (tlb_addr_table_slot(&bl->table, i, tlb_block_show, &arg) == -ENOSPC)
+			break;
+	}
+	return arg.off;
+}
+
+static int tlb_block_record(struct tlb_addr_entry *entry, bool created, void *arg)
+{
+	struct tlb_block *block = (struct tlb_block *)entry->data;
+	struct tlb_block_arg *barg = arg;
+	struct tlb_block_record *record = barg->record;
+
+	if (tlb_block_expired(block, barg->now))
+		return -ENOENT;
+
+	record->family = entry->key.family;
+	record->prefix_len = entry->key.prefix_len;
+	record->ms_left = block->expires ? jiffies_to_msecs(block->expires - barg->now) : 0;
+	memcpy(record->addr, entry->key.addr, sizeof(record->addr));
+	return 0;
+}
+
+/* whole tlb_block_record's only, one per table entry */
+ssize_t tlb_blocklist_dump(struct tlb_blocklist *bl, char *buf, loff_t off, size_t count)
+{
+	struct tlb_block_arg arg = { .now = jiffies };
+	struct tlb_block_record *record;
+	size_t written = 0;
+	int i;
+
+	if (off % sizeof(*record))
+		return -EINVAL;
+
+	for (i = off / sizeof(*record); i < bl->table.nr_entries; i++) {
+		if (count - written < sizeof(*record))
+			break;
+		record = (struct tlb_block_record *)(buf + written);
+		memset(record, 0, sizeof(*record));
+		arg.record = record;
+		tlb_addr_table_slot(&bl->table, i, tlb_block_record, &arg);
+		written += sizeof(*record);
+	}
+	return written;
+}
+
+static int tlb_block_count(struct tlb_addr_entry *entry, bool created, void *arg)
+{
+	struct tlb_block_arg *barg = arg;
+
+	return !tlb_block_expired((struct tlb_block *)entry->data, barg->now);
+}
+
+void tlb_blocklist_get_stats(struct tlb_blocklist *bl, struct tlb_block_stats *stats)
+{
+	struct tlb_block_arg arg = { .now = jiffies };
+	int i;
+
+	stats->blocked = atomic64_read(&bl->blocked);
+	stats->auto_blocks = atomic64_read(&bl->auto_blocks);
+	stats->full = atomic64_read(&bl->full);
+	stats->nr_blocks = 0;
+	for (i = 0; i < bl->table.nr_entries; i++) {
+		if (tlb_addr_table_slot(&bl->table, i, tlb_block_count, &arg) > 0)
+			stats->nr_blocks++;
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "base.h"
+#include "addr_table.h"
+
+/* as many as the XDP maps in bpf/xdp_block.bpf.c hold */
+#define TLB_BLOCKLIST_ENTRIES 4096
+
+struct tlb_block {
+	/* jiffies, zero never expires */
+	unsigned long expires;
+};
+
+/* blocklist_dump record per table entry, family 0 if it's unused or expired */
+struct tlb_block_record {
+	u16 family;
+	u16 prefix_len;
+	/* zero never expires */
+	u32 ms_left;
+	u8 addr[16];
+};
+
+struct tlb_block_stats {
+	u64 blocked;
+	u64 auto_blocks;
+	u64 full;
+	int nr_blocks;
+};
+
+/*
+ * Client prefixes reset right after accept. Added by hand or, with a
+ * non-zero flood_block_ms, for that long when admission rate limits an
+ * address. Blocks added by hand are pinned, automatic ones are evicted
+ * oldest first once a shard runs out of entries. The XDP program in bpf/
+ * drops their SYNs earlier once the list is synced to its map, see
+ * scripts/blocklist_sync.sh.
+ */
+struct tlb_blocklist {
+	struct tlb_addr_table table;
+	/* prefix lengths that were ever blocked, a lookup per set bit */
+	DECLARE_BITMAP(prefix4, 33);
+	DECLARE_BITMAP(prefix6, 129);
+	unsigned int flood_block_ms;
+
+	atomic64_t blocked;
+	atomic64_t auto_blocks;
+	atomic64_t full;
+};
+
+int tlb_blocklist_init(struct tlb_blocklist *bl);
+
+void tlb_blocklist_deinit(struct tlb_blocklist *bl);
+
+bool tlb_blocklist_check(struct tlb_blocklist *bl, struct sockaddr_storage *addr);
+
+int tlb_blocklist_add(struct tlb_blocklist *bl, struct sockaddr_storage *addr, int prefix_len, unsigned int ttl_ms);
+
+int tlb_blocklist_del(struct tlb_blocklist *bl, struct sockaddr_storage *addr, int prefix_len);
+
+void tlb_blocklist_flood(struct tlb_blocklist *bl, struct sockaddr_storage *addr);
+
+ssize_t tlb_blocklist_show(struct tlb_blocklist *bl, char *buf, size_t size);
+
+ssize_t tlb_blocklist_dump(struct tlb_blocklist *bl, char *buf, loff_t off, size_t count);
+
+void tlb_blocklist_get_stats(struct tlb_blocklist *bl, struct tlb_block_stats *stats);
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Target selection by power of two choices: the client address hashes to
+ * two targets and the one with fewer active connections wins. The pick is
+ * returned from tlb_select_target_hook() by bpf_override_return(), which
+ * needs CONFIG_BPF_KPROBE_OVERRIDE.
+ *
+ * clang -O2 -g -target bpf -D__TARGET_ARCH_x86 -c bpf/select_p2c.bpf.c -o bpf/select_p2c.bpf.o
+ */
+#include <linux/bpf.h>
+#include <linux/ptrace.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include "tlb_select.h"
+
+char LICENSE[] SEC("license") = "GPL";
+
+SEC("kprobe/tlb_select_target_hook")
+int BPF_KPROBE(select_p2c, struct tlb_select_ctx *sel)
+{
+	__u32 n = 0, addr = 0, hash, a, b;
+	__u64 load_a = 0, load_b = 0;
+	__u16 family = 0;
+
+	bpf_probe_read(&n, sizeof(n), &sel->nr_targets);
+	if (n == 0 || n > TLB_SELECT_MAX_TARGETS)
+		return 0;
+
+	/* sin_addr, or the low word of sin6_addr */
+	bpf_probe_read(&family, sizeof(family), &sel->client);
+	if (family == 2)
+		bpf_probe_read(&addr, sizeof(addr), (void *)&sel->client + 4);
+	else
+		bpf_probe_read(&addr, sizeof(addr), (void *)&sel->client + 20);
+
+	hash = addr * 2654435761u;
+	a = hash % n;
+	b = (hash >> 16) % n;
+	if (b == a)
+		b = (a + 1) % n;
+
+	bpf_probe_read(&load_a, sizeof(load_a), &sel->targets[a].active_cons);
+	bpf_probe_read(&load_b, sizeof(load_b), &sel->targets[b].active_cons);
+	bpf_override_return(ctx, load_b < load_a ? b : a);
+	return 0;
+}
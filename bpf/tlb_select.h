@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * What a target selection program gets, shared by select.c and the
+ * programs in this directory. Only uapi types: a kprobe program reads it
+ * with bpf_probe_read(), no module BTF is needed.
+ */
+#pragma once
+
+#include <linux/types.h>
+#include <linux/socket.h>
+
+#define TLB_SELECT_MAX_TARGETS 64
+
+/* read-only snapshot of a target handed to the selection program */
+struct tlb_select_target {
+	__u32 id;
+	__u32 port;
+	__u64 active_cons;
+	__u64 total_cons;
+	__u64 total_con_time_us;
+};
+
+struct tlb_select_ctx {
+	/* zeroed if the caller has no client */
+	struct __kernel_sockaddr_storage client;
+	__u32 listen_port;
+	__u32 mode;
+	__u32 cpu;
+	__u32 nr_targets;
+	struct tlb_select_target targets[TLB_SELECT_MAX_TARGETS];
+};
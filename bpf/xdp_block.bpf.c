@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Drops SYNs from blocked client prefixes before they reach the TCP stack.
+ * The maps are pinned by name under /sys/fs/bpf and filled from tlb's
+ * blocklist by scripts/blocklist_sync.sh. Everything but a SYN passes, so
+ * established connections of a freshly blocked client aren't broken here.
+ *
+ * clang -O2 -g -target bpf -c bpf/xdp_block.bpf.c -o bpf/xdp_block.bpf.o
+ */
+#include <stdbool.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/in.h>
+#include <linux/tcp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#define MAX_BLOCKS 4096
+
+struct key4 {
+	__u32 prefix_len;
+	__u8 addr[4];
+};
+
+struct key6 {
+	__u32 prefix_len;
+	__u8 addr[16];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, MAX_BLOCKS);
+	__type(key, struct key4);
+	__type(value, __u64);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} tlb_block4 SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, MAX_BLOCKS);
+	__type(key, struct key6);
+	__type(value, __u64);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} tlb_block6 SEC(".maps");
+
+char LICENSE[] SEC("license") = "GPL";
+
+static __always_inline bool tcp_syn(struct tcphdr *th, void *end)
+{
+	if ((void *)(th + 1) > end)
+		return false;
+	return th->syn && !th->ack;
+}
+
+/* the value counts drops */
+static __always_inline int drop(__u64 *drops)
+{
+	__sync_fetch_and_add(drops, 1);
+	return XDP_DROP;
+}
+
+SEC("xdp")
+int xdp_block(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *end = (void *)(long)ctx->data_end;
+	struct ethhdr *eth = data;
+	struct iphdr *iph;
+	struct ipv6hdr *ip6h;
+	struct key4 k4;
+	struct key6 k6;
+	__u64 *drops;
+
+	if ((void *)(eth + 1) > end)
+		return XDP_PASS;
+
+	if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+		iph = (void *)(eth + 1);
+		if ((void *)(iph + 1) > end || iph->protocol != IPPROTO_TCP)
+			return XDP_PASS;
+		if (!tcp_syn((void *)iph + iph->ihl * 4, end))
+			return XDP_PASS;
+		k4.prefix_len = 32;
+		__builtin_memcpy(k4.addr, &iph->saddr, sizeof(k4.addr));
+		drops = bpf_map_lookup_elem(&tlb_block4, &k4);
+		if (drops)
+			return drop(drops);
+	} else if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+		ip6h = (void *)(eth + 1);
+		/* extension headers aren't walked, such SYNs pass */
+		if ((void *)(ip6h + 1) > end || ip6h->nexthdr != IPPROTO_TCP)
+			return XDP_PASS;
+		if (!tcp_syn((void *)(ip6h + 1), end))
+			return XDP_PASS;
+		k6.prefix_len = 128;
+		__builtin_memcpy(k6.addr, &ip6h->saddr, sizeof(k6.addr));
+		drops = bpf_map_lookup_elem(&tlb_block6, &k6);
+		if (drops)
+			return drop(drops);
+	}
+
+	return XDP_PASS;
+}
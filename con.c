@@ -5,6 +5,7 @@
 
 void tlb_con_delete(struct tlb_con *con)
 {
+	struct tlb_server *srv;
 	s64 age;
 
 	BUG_ON(!list_empty(&con->list_entry));
@@ -15,12 +16,20 @@ void tlb_con_delete(struct tlb_con *con)
 			trace_con_too_long(con, age);
 	}
 
+	tlb_timeout_cancel(&con->timeout);
+	if (con->h2)
+		tlb_h2_session_free(con->h2);
+	if (con->kv)
+		tlb_kv_session_free(con->kv);
+	if (con->mirror)
+		tlb_mirror_delete(con->mirror);
 	if (con->target_con)
 		tlb_target_con_close(con->target_con);
 	if (con->target)
 		tlb_target_put(con->target);
 	if (con->buf)
-		kmem_cache_free(g_con_buf_cache, con->buf);
+		tlb_arena_free(&g_con_buf_arena, con->buf);
+	kfree(con->replay.buf);
 
 	if (con->sock) {
 		trace_con_sock_release(con);
@@ -28,13 +37,20 @@ void tlb_con_delete(struct tlb_con *con)
 		trace_con_sock_release_return(con);
 	}
 
+	tlb_admission_release(&con->srv->admission, &con->ticket);
+
 	trace_con_delete(con, con->co);
 
 	coroutine_deref(con->co);
+	srv = con->srv;
 	kmem_cache_free(g_con_cache, con);
+
+	atomic_dec(&srv->nr_cons);
+	if (wq_has_sleeper(&srv->cons_waitq))
+		wake_up(&srv->cons_waitq);
 }
 
-struct tlb_con *tlb_con_create(struct tlb_server *srv)
+struct tlb_con *tlb_con_create(struct tlb_server *srv, struct coroutine_thread *thread)
 {
 	struct tlb_con *con;
 
@@ -42,13 +58,14 @@ struct tlb_con *tlb_con_create(struct tlb_server *srv)
 	if (!con)
 		return NULL;
 	memset(con, 0, sizeof(*con));
-	atomic_inc(&srv->next_con_thread);
-	con->co = coroutine_create(&srv->con_thread[atomic_read(&srv->next_con_thread) % srv->nr_con_thread]);
+	con->co = coroutine_create(thread);
 	if (!con->co) {
 		kmem_cache_free(g_con_cache, con);
 		return NULL;
 	}
 	con->srv = srv;
+	coroutine_timer_init(&con->timeout.timer, con->co);
+	atomic_inc(&srv->nr_cons);
 	INIT_LIST_HEAD(&con->list_entry);
 	trace_con_create(con, con->co);
 	return con;
@@ -76,17 +93,102 @@ void tlb_con_state_change(struct sock *sk)
 	coroutine_signal(con->co);
 }
 
-static int copy_socket_coroutine(struct coroutine *co, struct socket *from, struct socket *to, char *buf, int buf_len, bool *closed)
+/* sleep until every limit has room, data waits in the socket meanwhile */
+static void tlb_con_shape(struct coroutine *co, struct tlb_shaper **shapers, int bytes)
+{
+	u64 wait_ns;
+	int i;
+
+	for (i = 0; shapers[i]; i++) {
+		while ((wait_ns = tlb_shaper_take(shapers[i], bytes)) != 0)
+			coroutine_sleep(co, nsecs_to_jiffies(wait_ns));
+	}
+}
+
+/*
+ * Both directions share a thread until the target->client one proves to be
+ * bulk, then it moves next door so a full duplex flow can use two CPUs.
+ * Timers can't follow a coroutine, the client side keeps watching idleness.
+ */
+static void tlb_con_check_split(struct tlb_target_con *con, struct coroutine *co, int bytes)
+{
+	struct tlb_server *srv = con->srv;
+	struct coroutine_thread *thread;
+	u64 rate = READ_ONCE(srv->split_rate);
+	u64 now, elapsed;
+
+	if (con->split || !rate)
+		return;
+
+	con->split_bytes += bytes;
+	now = ktime_get_ns();
+	elapsed = now - con->split_start_ns;
+	if (elapsed < TLB_SPLIT_WINDOW_MS * NSEC_PER_MSEC)
+		return;
+
+	if (div64_u64(con->split_bytes * NSEC_PER_SEC, elapsed) >= rate) {
+		thread = tlb_server_pick_sibling_thread(srv, co->thread);
+		if (thread) {
+			tlb_timeout_cancel(&con->timeout);
+			con->timeout.idle = 0;
+			con->timeout.min_rate = 0;
+			con->split = true;
+			atomic64_inc(&srv->split_cons);
+			coroutine_migrate(co, thread);
+			return;
+		}
+	}
+
+	con->split_bytes = 0;
+	con->split_start_ns = now;
+}
+
+/* client bytes are kept until anything comes back from the target */
+static void tlb_replay_note(struct tlb_replay *replay, struct socket *from, char *buf, int len)
+{
+	if (READ_ONCE(replay->responded))
+		return;
+
+	if (from != replay->sock) {
+		WRITE_ONCE(replay->responded, true);
+		return;
+	}
+
+	if (replay->overflow)
+		return;
+
+	if (len > replay->size - replay->len) {
+		replay->overflow = true;
+		return;
+	}
+
+	memcpy(replay->buf + replay->len, buf, len);
+	replay->len += len;
+}
+
+static int copy_socket_coroutine(struct coroutine *co, struct socket *from, struct socket *to, char *buf, int buf_len,
+				 struct tlb_mirror *mirror, struct tlb_timeout *timeout, struct tlb_shaper **shapers,
+				 struct tlb_target_con *target_con, struct tlb_replay *replay, bool *closed)
 {
 	int r, received, sent;
 
 	*closed = false;
 	for (;;) {
+		if (mirror)
+			tlb_mirror_poll(mirror, buf, buf_len);
+
 		trace_coroutine_recv(co, buf_len);
 		r = ksock_recv(from, buf, buf_len);
 		trace_coroutine_recv_return(co, r);
 		if (r < 0) {
 			if (r == -EAGAIN) {
+				if (replay && from == replay->sock && READ_ONCE(replay->reset)) {
+					r = -ECONNRESET;
+					break;
+				}
+				r = tlb_timeout_check(timeout);
+				if (r)
+					break;
 				coroutine_yield(co);
 				continue;
 			} else
@@ -97,6 +199,15 @@ static int copy_socket_coroutine(struct coroutine *co, struct socket *from, stru
 		}
 
 		received = r;
+		if (target_con && target_con->fault_left)
+			received = min_t(u64, received, target_con->fault_left);
+		tlb_timeout_account(timeout, received);
+		tlb_con_shape(co, shapers, received);
+		if (mirror)
+			tlb_mirror_write(mirror, buf, received);
+		if (replay)
+			tlb_replay_note(replay, from, buf, received);
+
 		sent = 0;
 		while (sent < received) {
 			trace_coroutine_send(co, received - sent);
@@ -104,15 +215,43 @@ static int copy_socket_coroutine(struct coroutine *co, struct socket *from, stru
 			trace_coroutine_send_return(co, r);
 			if (r < 0) {
 				if (r == -EAGAIN) {
+					/* a peer that stops reading stalls this side as well */
+					r = tlb_timeout_check(timeout);
+					if (r)
+						break;
 					coroutine_yield(co);
 					continue;
-				} else
+				} else {
+					/*
+					 * The target is gone, maybe before it responded. Its
+					 * coroutine usually took the RST and this send only
+					 * sees -EPIPE, so the reset is reported here too.
+					 */
+					if (replay && from == replay->sock && !READ_ONCE(replay->responded)) {
+						WRITE_ONCE(replay->reset, true);
+						r = -ECONNRESET;
+					}
 					break;
+				}
 			}
 			sent += r;
 		}
 		if (r < 0)
 			break;
+
+		if (target_con && target_con->fault_left) {
+			target_con->fault_left -= received;
+			if (!target_con->fault_left) {
+				atomic64_inc(&target_con->target->fault.resets);
+				WRITE_ONCE(target_con->fault_reset, true);
+				r = -ECONNRESET;
+				break;
+			}
+		}
+		if (target_con)
+			tlb_con_check_split(target_con, co, received);
+		if (coroutine_charge(co, received))
+			coroutine_resched(co);
 	}
 
 	return r;
@@ -127,39 +266,250 @@ static void *tlb_target_con_coroutine(struct coroutine *co, void *arg)
 	trace_target_con_co_enter(con, co);
 
 	con->buf_len = TLB_CON_BUF_SIZE;
-	con->buf = kmem_cache_alloc(g_con_buf_cache, GFP_KERNEL);
+	con->buf = tlb_arena_alloc(&g_con_buf_arena, numa_node_id());
 	if (!con->buf) {
 		r = -ENOMEM;
 		goto out;
 	}
 
 	for (;;) {
-		r = copy_socket_coroutine(co, con->sock, con->src_sock, con->buf, con->buf_len, &closed);
+		r = copy_socket_coroutine(co, con->sock, con->src_sock, con->buf, con->buf_len, NULL, &con->timeout,
+					  con->shapers, con, con->replay, &closed);
 		if (r)
 			break;
-		if (closed)
+		if (closed) {
+			con->closed = true;
 			break;
+		}
 	}
-
-	trace_con_sock_release(con);
-	ksock_release(con->sock);
-	trace_con_sock_release_return(con);
-
-	con->sock = NULL;
-	kmem_cache_free(g_con_buf_cache, con->buf);
+	tlb_timeout_cancel(&con->timeout);
+
+	/*
+	 * The client side may be idle, wake it up to tear the connection down
+	 * or, if nothing came back yet, to replay its bytes to another target.
+	 * It may also still be sending to the target socket, possibly from
+	 * another thread, so that one is only released with the connection.
+	 * After an injected reset the client side is only woken, without a FIN,
+	 * and resets its socket itself.
+	 */
+	if (r && r != -ETIMEDOUT && con->replay && !READ_ONCE(con->replay->responded)) {
+		WRITE_ONCE(con->replay->reset, true);
+		coroutine_signal(con->replay->co);
+	} else if (READ_ONCE(con->fault_reset))
+		kernel_sock_shutdown(con->src_sock, SHUT_RD);
+	else
+		kernel_sock_shutdown(con->src_sock, SHUT_RDWR);
+
+	tlb_arena_free(&g_con_buf_arena, con->buf);
 	con->buf = NULL;
 out:
 	trace_target_con_co_leave(con, co, r);
 	return ERR_PTR(r);
 }
 
-static void *tlb_con_coroutine(struct coroutine *co, void *arg)
+/* connect to con->target and start its direction, the target ref stays with con */
+static int tlb_con_connect_target(struct tlb_con *con, struct coroutine *co)
 {
-	struct tlb_con *con = (struct tlb_con *)arg;
 	struct tlb_server *srv = con->srv;
 	struct coroutine *target_con_co;
-	struct tlb_target *target;
+	struct ksock_opts opts;
+	struct tlb_src *src;
+	int r, prio;
+
+	atomic64_inc(&con->target->total_cons);
+	atomic64_inc(&con->target->active_cons);
+	r = tlb_target_fault_connect(con->target, co);
+	if (r)
+		return r;
+	prio = READ_ONCE(con->target->prio);
+	if (prio >= 0)
+		coroutine_set_prio(co, prio);
+
+	target_con_co = coroutine_create(co->thread);
+	if (!target_con_co)
+		return -ENOMEM;
+	coroutine_set_prio(target_con_co, co->prio);
+
+	tlb_server_get_opts(srv, &srv->target_opts, &opts);
+	if (srv->transparent && con->target->addr.ss_family != AF_UNIX)
+		r = tlb_target_connect(con->target, target_con_co, &con->peer_addr, KSOCK_BIND_TRANSPARENT, &opts,
+				       &con->target_con);
+	else {
+		src = tlb_srcpool_get(&srv->srcpool, con->target->addr.ss_family);
+		r = tlb_target_connect(con->target, target_con_co, src ? &src->addr : NULL, src ? KSOCK_BIND_NO_PORT : 0,
+				       &opts, &con->target_con);
+		if (src) {
+			if (r) {
+				if (r == -EADDRNOTAVAIL)
+					atomic64_inc(&src->exhausted);
+				tlb_src_put(src);
+			} else
+				con->target_con->src = src;
+		}
+	}
+	coroutine_deref(target_con_co);
+	if (r)
+		return r;
+
+	con->target_con->src_sock = con->sock;
+	con->target_con->srv = srv;
+	con->target_con->split_start_ns = ktime_get_ns();
+	con->target_con->fault_left = READ_ONCE(con->target->fault.reset_bytes);
+	con->shapers[0] = &srv->shaper;
+	con->shapers[1] = &con->target->shaper;
+	con->shapers[2] = &con->shaper;
+	con->target_con->shapers = con->shapers;
+	if (con->replay.buf)
+		con->target_con->replay = &con->replay;
+	tlb_timeout_init(&con->target_con->timeout, srv, con->target_con->co, READ_ONCE(srv->target_idle_ms), 0, 0);
+	con->timeout.peer = &con->target_con->timeout;
+	con->target_con->timeout.peer = &con->timeout;
+	return 0;
+}
+
+static void tlb_con_put_target(struct tlb_con *con)
+{
+	struct tlb_target *target = con->target;
 	u64 con_time_us;
+
+	atomic64_dec(&target->active_cons);
+
+	spin_lock(&target->lock);
+	con_time_us = ktime_us_delta(ktime_get(), con->start_time);
+	if (con_time_us > target->max_con_time_us)
+		target->max_con_time_us = con_time_us;
+	if (con_time_us < target->min_con_time_us)
+		target->min_con_time_us = con_time_us;
+	target->total_con_time_us += con_time_us;
+	resample_add(&target->con_time_sample, con_time_us);
+	spin_unlock(&target->lock);
+
+	tlb_target_put(target);
+	con->target = NULL;
+}
+
+static int tlb_con_send_all(struct coroutine *co, struct socket *sock, char *buf, int len,
+			    struct tlb_timeout *timeout)
+{
+	int r, sent = 0;
+
+	while (sent < len) {
+		r = ksock_send(sock, buf + sent, len - sent);
+		if (r == -EAGAIN) {
+			r = tlb_timeout_check(timeout);
+			if (r)
+				return r;
+			coroutine_yield(co);
+			continue;
+		}
+		if (r < 0)
+			return r;
+		sent += r;
+	}
+
+	return 0;
+}
+
+/* the target dropped the connection before responding, try another one */
+static int tlb_con_replay(struct tlb_con *con, struct coroutine *co)
+{
+	struct tlb_server *srv = con->srv;
+	struct tlb_replay *replay = &con->replay;
+	struct tlb_target *target;
+	int r;
+
+	coroutine_cancel(con->target_con->co);
+	con->timeout.peer = NULL;
+	tlb_target_con_close(con->target_con);
+	con->target_con = NULL;
+
+	if (replay->overflow || replay->tries >= TLB_REPLAY_TRIES)
+		return -ECONNRESET;
+	replay->tries++;
+	replay->reset = false;
+
+	target = tlb_server_select_other_target(srv, co->thread, &con->peer_addr, con->group[0] ? con->group : NULL,
+						con->target);
+	if (!target) {
+		r = -ENOENT;
+		goto fail;
+	}
+	tlb_con_put_target(con);
+	con->target = target;
+
+	r = tlb_con_connect_target(con, co);
+	if (r)
+		goto fail;
+
+	r = tlb_con_send_all(co, con->target_con->sock, replay->buf, replay->len, &con->timeout);
+	if (r) {
+		con->timeout.peer = NULL;
+		tlb_target_con_close(con->target_con);
+		con->target_con = NULL;
+		goto fail;
+	}
+
+	coroutine_start(con->target_con->co, tlb_target_con_coroutine, con->target_con);
+	atomic64_inc(&srv->replays);
+	return 0;
+
+fail:
+	atomic64_inc(&srv->replay_fails);
+	return r;
+}
+
+/*
+ * Reads until the first request head is complete, or the buffer is full,
+ * and looks its group up. Whatever isn't HTTP is balanced as usual.
+ */
+static int tlb_con_route(struct tlb_con *con, struct coroutine *co)
+{
+	struct tlb_http_req req;
+	int r;
+
+	for (;;) {
+		r = ksock_recv(con->sock, con->buf + con->head_len, con->buf_len - con->head_len);
+		if (r == -EAGAIN) {
+			r = tlb_timeout_check(&con->timeout);
+			if (r)
+				return r;
+			coroutine_yield(co);
+			continue;
+		}
+		if (r < 0)
+			return r;
+		if (r == 0)
+			return -ECONNRESET;
+
+		con->head_len += r;
+		tlb_timeout_account(&con->timeout, r);
+		r = tlb_http_parse_req(con->buf, con->head_len, &req);
+		if (r != -EAGAIN || con->head_len == con->buf_len)
+			break;
+	}
+
+	if (!r)
+		tlb_routes_match(&con->srv->routes, &req, con->group);
+	return 0;
+}
+
+/* what routing read goes out before anything else */
+static int tlb_con_forward_head(struct tlb_con *con, struct coroutine *co)
+{
+	if (!con->head_len)
+		return 0;
+
+	if (con->mirror)
+		tlb_mirror_write(con->mirror, con->buf, con->head_len);
+	if (con->replay.buf)
+		tlb_replay_note(&con->replay, con->sock, con->buf, con->head_len);
+	return tlb_con_send_all(co, con->target_con->sock, con->buf, con->head_len, &con->timeout);
+}
+
+static void *tlb_con_coroutine(struct coroutine *co, void *arg)
+{
+	struct tlb_con *con = (struct tlb_con *)arg;
+	struct tlb_server *srv = con->srv;
 	int r;
 	bool closed;
 
@@ -167,48 +517,83 @@ static void *tlb_con_coroutine(struct coroutine *co, void *arg)
 
 	trace_con_co_enter(con, co);
 
+	switch (READ_ONCE(srv->mode)) {
+	case TLB_SRV_MODE_H2:
+		r = tlb_h2_serve(con, &srv->h2_pool[tlb_server_thread_index(srv, co->thread)]);
+		goto out;
+	case TLB_SRV_MODE_MEMCACHE:
+		r = tlb_kv_serve(con, &srv->kv_pool[tlb_server_thread_index(srv, co->thread)], TLB_KV_MEMCACHE);
+		goto out;
+	case TLB_SRV_MODE_REDIS:
+		r = tlb_kv_serve(con, &srv->kv_pool[tlb_server_thread_index(srv, co->thread)], TLB_KV_REDIS);
+		goto out;
+	case TLB_SRV_MODE_HTTP:
+		r = tlb_http_serve(con, &srv->http_cache[tlb_server_thread_index(srv, co->thread)]);
+		goto out;
+	default:
+		break;
+	}
+
 	con->buf_len = TLB_CON_BUF_SIZE;
-	con->buf = kmem_cache_alloc(g_con_buf_cache, GFP_KERNEL);
+	con->buf = tlb_arena_alloc(&g_con_buf_arena, numa_node_id());
 	if (!con->buf) {
 		r = -ENOMEM;
 		goto out;
 	}
 
-	con->target = tlb_server_select_target(srv);
+	if (READ_ONCE(srv->replay_size)) {
+		con->replay.size = min_t(u32, READ_ONCE(srv->replay_size), TLB_REPLAY_MAX_SIZE);
+		con->replay.buf = kmalloc(con->replay.size, GFP_KERNEL);
+		if (!con->replay.buf) {
+			r = -ENOMEM;
+			goto free_buf;
+		}
+		con->replay.sock = con->sock;
+		con->replay.co = co;
+	}
+
+	tlb_timeout_init(&con->timeout, srv, co, READ_ONCE(srv->client_idle_ms),
+			 READ_ONCE(srv->min_rate), READ_ONCE(srv->min_rate_window_ms));
+	if (tlb_routes_enabled(&srv->routes)) {
+		r = tlb_con_route(con, co);
+		if (r)
+			goto free_buf;
+	}
+
+	if (con->group[0])
+		con->target = tlb_server_select_group_target(srv, co->thread, &con->peer_addr, con->group);
+	else
+		con->target = tlb_server_select_target(srv, co->thread, &con->peer_addr);
 	if (!con->target) {
 		r = -ENOENT;
 		goto free_buf;
 	}
-	atomic64_inc(&con->target->total_cons);
-	atomic64_inc(&con->target->active_cons);
 
-	target_con_co = coroutine_create(co->thread);
-	if (!target_con_co) {
-		r = -ENOMEM;
-		goto put_target;
-	}
-
-	r = tlb_target_connect(con->target, target_con_co, &con->target_con);
-	coroutine_deref(target_con_co);
+	tlb_shaper_init(&con->shaper, READ_ONCE(srv->con_rate), READ_ONCE(srv->con_burst));
+	r = tlb_con_connect_target(con, co);
 	if (r)
 		goto put_target;
-
-	con->target_con->src_sock = con->sock;
-	coroutine_start(target_con_co, tlb_target_con_coroutine, con->target_con);
-	for (;;) {
-		r = copy_socket_coroutine(co, con->sock, con->target_con->sock, con->buf, con->buf_len, &closed);
-		if (r)
-			break;
+	coroutine_start(con->target_con->co, tlb_target_con_coroutine, con->target_con);
+
+	con->mirror = tlb_mirror_create(srv, co);
+	r = tlb_con_forward_head(con, co);
+	while (!r) {
+		r = copy_socket_coroutine(co, con->sock, con->target_con->sock, con->buf, con->buf_len, con->mirror,
+					  &con->timeout, con->shapers, NULL, con->replay.buf ? &con->replay : NULL,
+					  &closed);
+		if (r == -ECONNRESET && READ_ONCE(con->replay.reset)) {
+			r = tlb_con_replay(con, co);
+			continue;
+		}
 		if (closed)
-			break;	
+			break;
 	}
-	trace_con_sock_release(con);
-	ksock_release(con->sock);
-	trace_con_sock_release_return(con);
-	con->sock = NULL;
-	if (r)
-		coroutine_cancel(con->target_con->co);
-	else {
+	tlb_timeout_cancel(&con->timeout);
+	/* waits for the target coroutine if it's running on a sibling thread */
+	if (r) {
+		if (con->target_con)
+			coroutine_cancel(con->target_con->co);
+	} else {
 		void *ret;
 		
 		coroutine_cancel(con->target_con->co);
@@ -216,27 +601,29 @@ static void *tlb_con_coroutine(struct coroutine *co, void *arg)
 		if (IS_ERR(ret))
 				r = PTR_ERR(ret);
 	}
+	trace_con_sock_release(con);
+	if (con->target_con && READ_ONCE(con->target_con->fault_reset))
+		ksock_reset(con->sock);
+	else
+		ksock_release(con->sock);
+	trace_con_sock_release_return(con);
+	con->sock = NULL;
 
-	tlb_target_con_close(con->target_con);
-	con->target_con = NULL;
+	if (con->target_con) {
+		tlb_target_con_close(con->target_con);
+		con->target_con = NULL;
+	}
+	atomic64_add(atomic64_read(&con->shaper.waits), &srv->con_shape_waits);
+	if (con->mirror) {
+		tlb_mirror_delete(con->mirror);
+		con->mirror = NULL;
+	}
 put_target:
-	target = con->target;
-	atomic64_dec(&target->active_cons);
-
-	spin_lock(&target->lock);
-	con_time_us = ktime_us_delta(ktime_get(), con->start_time);
-	if (con_time_us > target->max_con_time_us)
-		target->max_con_time_us = con_time_us;
-	if (con_time_us < target->min_con_time_us)
-		target->min_con_time_us = con_time_us;
-	target->total_con_time_us += con_time_us;
-	resample_add(&target->con_time_sample, con_time_us);
-	spin_unlock(&target->lock);
-
-	tlb_target_put(target);
-	con->target = NULL;
+	tlb_con_put_target(con);
 free_buf:
-	kmem_cache_free(g_con_buf_cache, con->buf);
+	kfree(con->replay.buf);
+	con->replay.buf = NULL;
+	tlb_arena_free(&g_con_buf_arena, con->buf);
 	con->buf = NULL;
 out:
 	trace_con_co_leave(con, co, r);
@@ -1,13 +1,44 @@
 #pragma once
 
 #include "coroutine.h"
+#include "admission.h"
+#include "timeout.h"
+#include "shaper.h"
+#include "route.h"
 
 struct tlb_server;
 struct tlb_target;
 struct tlb_target_con;
+struct tlb_h2_session;
+struct tlb_kv_session;
+struct tlb_mirror;
+
+/* listener, target and connection */
+#define TLB_CON_NR_SHAPERS 3
+#define TLB_REPLAY_MAX_SIZE (256 * 1024)
+#define TLB_REPLAY_TRIES 2
+
+/*
+ * Client bytes kept until the target sends its first byte. If the target
+ * drops the connection before that, they're replayed to another target.
+ */
+struct tlb_replay {
+	char *buf;
+	u32 len;
+	u32 size;
+	/* didn't fit, there's nothing to replay */
+	bool overflow;
+	bool responded;
+	/* set by either direction, the client side then reconnects */
+	bool reset;
+	int tries;
+	struct socket *sock;
+	struct coroutine *co;
+};
 
 struct tlb_con {
 	struct socket *sock;
+	struct sockaddr_storage peer_addr;
 	struct coroutine *co;
 	struct tlb_server *srv;
 	struct list_head list_entry;
@@ -16,9 +47,21 @@ struct tlb_con {
 	struct tlb_target *target;
 	struct tlb_target_con *target_con;
 	ktime_t start_time;
+	struct tlb_h2_session *h2;
+	struct tlb_kv_session *kv;
+	struct tlb_mirror *mirror;
+	struct tlb_admission_ticket ticket;
+	struct tlb_timeout timeout;
+	struct tlb_shaper shaper;
+	/* NULL terminated, shared by both directions */
+	struct tlb_shaper *shapers[TLB_CON_NR_SHAPERS + 1];
+	struct tlb_replay replay;
+	/* HTTP routing: the group the first request matched, bytes read for it */
+	char group[TLB_GROUP_NAME_SIZE];
+	u32 head_len;
 };
 
-struct tlb_con *tlb_con_create(struct tlb_server *srv);
+struct tlb_con *tlb_con_create(struct tlb_server *srv, struct coroutine_thread *thread);
 
 void tlb_con_start(struct tlb_con *con, struct socket *sock);
 
@@ -1,13 +1,25 @@
 #include "coroutine.h"
+#include "arena.h"
 #include "trace.h"
 
 struct coroutine_thread_work {
 	struct coroutine *co;
 	struct list_head list_entry;
+	u64 queued_ns;
+};
+
+/*
+ * Work items taken from each class per scheduling round while all classes
+ * are busy, so higher classes get most of the thread but none starves.
+ */
+static const int coroutine_prio_weight[COROUTINE_NR_PRIO] = {
+	[COROUTINE_PRIO_HIGH] = 16,
+	[COROUTINE_PRIO_NORMAL] = 4,
+	[COROUTINE_PRIO_LOW] = 1,
 };
 
 static struct kmem_cache *g_coroutine_cache;
-static struct kmem_cache *g_coroutine_stack_cache;
+static struct tlb_arena g_coroutine_stack_arena;
 static struct kmem_cache *g_coroutine_thread_work_cache;
 
 struct coroutine *coroutine_create(struct coroutine_thread *thread)
@@ -22,8 +34,10 @@ struct coroutine *coroutine_create(struct coroutine_thread *thread)
 	co->magic = COROUTINE_MAGIC;
 	co->thread = thread;
 	co->state = COROUTINE_INITED;
+	co->prio = COROUTINE_PRIO_NORMAL;
+	coroutine_timer_init(&co->sleep_timer, co);
 	atomic_set(&co->ref_count, 1);
-	co->stack = kmem_cache_alloc(g_coroutine_stack_cache, GFP_KERNEL);	
+	co->stack = tlb_arena_alloc(&g_coroutine_stack_arena, cpu_to_node(thread->cpu));
 	if (!co->stack) {
 		kmem_cache_free(g_coroutine_cache, co);
 		return NULL;
@@ -54,7 +68,7 @@ static void coroutine_delete(struct coroutine *co)
 
 	trace_coroutine_delete(co, co->stack, thread);
 
-	kmem_cache_free(g_coroutine_stack_cache, co->stack);
+	tlb_arena_free(&g_coroutine_stack_arena, co->stack);
 	kmem_cache_free(g_coroutine_cache, co);
 }
 
@@ -118,7 +132,7 @@ static __always_inline void coroutine_enter(struct coroutine *co)
 
 void coroutine_signal(struct coroutine *co)
 {
-	struct coroutine_thread *thread = co->thread;
+	struct coroutine_thread *thread = READ_ONCE(co->thread);
 	struct coroutine_thread_work *work;
 	unsigned long flags;
 
@@ -127,9 +141,11 @@ void coroutine_signal(struct coroutine *co)
 	BUG_ON(!work);
 	coroutine_ref(co);
 	work->co = co;
+	work->queued_ns = ktime_get_ns();
+	atomic_inc(&thread->nr_work);
 
 	spin_lock_irqsave(&thread->work_list_lock, flags);
-	list_add_tail(&work->list_entry, &thread->work_list);
+	list_add_tail(&work->list_entry, &thread->work_list[READ_ONCE(co->prio)]);
 	spin_unlock_irqrestore(&thread->work_list_lock, flags);
 
 	wake_up_interruptible(&thread->waitq);
@@ -145,35 +161,203 @@ void coroutine_cancel(struct coroutine *co)
 	mutex_unlock(&co->lock);
 }
 
+void coroutine_timer_init(struct coroutine_timer *timer, struct coroutine *co)
+{
+	INIT_LIST_HEAD(&timer->entry);
+	timer->co = co;
+	timer->expires = 0;
+	timer->expired = false;
+}
+
+void coroutine_timer_arm(struct coroutine_timer *timer, unsigned long expires)
+{
+	struct coroutine_thread *thread = timer->co->thread;
+	unsigned long tick;
+
+	timer->expired = false;
+	if (!list_empty(&timer->entry)) {
+		if (timer->expires == expires)
+			return;
+		list_del(&timer->entry);
+	} else {
+		coroutine_ref(timer->co);
+		thread->nr_timers++;
+	}
+
+	timer->expires = expires;
+	tick = (expires + (1UL << COROUTINE_WHEEL_SHIFT) - 1) >> COROUTINE_WHEEL_SHIFT;
+	if (time_before(tick, thread->wheel_tick))
+		tick = thread->wheel_tick;
+	list_add_tail(&timer->entry, &thread->wheel[tick & (COROUTINE_WHEEL_SIZE - 1)]);
+}
+
+void coroutine_timer_cancel(struct coroutine_timer *timer)
+{
+	if (list_empty(&timer->entry))
+		return;
+	list_del_init(&timer->entry);
+	timer->co->thread->nr_timers--;
+	coroutine_deref(timer->co);
+}
+
+/* other wakeups while asleep are ignored */
+void coroutine_sleep(struct coroutine *co, unsigned long delay)
+{
+	coroutine_timer_arm(&co->sleep_timer, jiffies + max(delay, 1UL));
+	while (!co->sleep_timer.expired)
+		coroutine_yield(co);
+}
+
+/*
+ * Continue on another thread. Called by the coroutine itself without armed
+ * timers, it resumes once the new thread picks up the signal, which can't
+ * happen before this thread is done with it as both take co->lock.
+ */
+void coroutine_migrate(struct coroutine *co, struct coroutine_thread *thread)
+{
+	struct coroutine_thread *old = co->thread;
+
+	BUG_ON(co->state != COROUTINE_RUNNING);
+	BUG_ON(!list_empty(&co->sleep_timer.entry));
+
+	if (thread == old)
+		return;
+
+	WRITE_ONCE(co->thread, thread);
+	coroutine_signal(co);
+	if (kernel_setjmp(&co->ctx) == 0)
+		kernel_longjmp(&old->ctx, 0x1);
+}
+
+static void coroutine_thread_expire_slot(struct coroutine_thread *thread, unsigned long slot, unsigned long now)
+{
+	struct coroutine_timer *timer, *tmp;
+
+	list_for_each_entry_safe(timer, tmp, &thread->wheel[slot], entry) {
+		if (time_before(now, timer->expires))
+			continue;
+		list_del_init(&timer->entry);
+		thread->nr_timers--;
+		timer->expired = true;
+		coroutine_signal(timer->co);
+		coroutine_deref(timer->co);
+	}
+}
+
+static void coroutine_thread_run_timers(struct coroutine_thread *thread)
+{
+	unsigned long now = jiffies;
+	unsigned long now_tick = now >> COROUTINE_WHEEL_SHIFT;
+	unsigned long slot;
+
+	if (!thread->nr_timers) {
+		thread->wheel_tick = now_tick;
+		return;
+	}
+
+	/* fell a whole round behind, every slot may hold expired timers */
+	if (time_after(now_tick, thread->wheel_tick + COROUTINE_WHEEL_SIZE)) {
+		for (slot = 0; slot < COROUTINE_WHEEL_SIZE; slot++)
+			coroutine_thread_expire_slot(thread, slot, now);
+		thread->wheel_tick = now_tick + 1;
+		return;
+	}
+
+	while (!time_after(thread->wheel_tick, now_tick)) {
+		coroutine_thread_expire_slot(thread, thread->wheel_tick & (COROUTINE_WHEEL_SIZE - 1), now);
+		thread->wheel_tick++;
+	}
+}
+
+static long coroutine_thread_wait_timeout(struct coroutine_thread *thread)
+{
+	unsigned long next = thread->wheel_tick << COROUTINE_WHEEL_SHIFT;
+
+	if (time_after(next, jiffies))
+		return next - jiffies;
+	return 1;
+}
+
+/* exponentially weighted over the last ~8 wakeups */
+static void coroutine_thread_account(struct coroutine_thread *thread, struct coroutine_thread_work *work)
+{
+	u64 latency = thread->latency_ns;
+	u64 now = ktime_get_ns();
+	u64 sample = (now > work->queued_ns) ? now - work->queued_ns : 0;
+
+	WRITE_ONCE(thread->latency_ns, latency - (latency >> 3) + (sample >> 3));
+	WRITE_ONCE(thread->sample_ns, now);
+}
+
+static bool coroutine_thread_has_work(struct coroutine_thread *thread)
+{
+	int prio;
+
+	for (prio = 0; prio < COROUTINE_NR_PRIO; prio++)
+		if (!list_empty(&thread->work_list[prio]))
+			return true;
+	return false;
+}
+
+/* one round: up to the class weight from each class, highest class first */
+static void coroutine_thread_take_work(struct coroutine_thread *thread, struct list_head *work_list)
+{
+	struct coroutine_thread_work *work;
+	unsigned long flags;
+	int prio, n;
+
+	spin_lock_irqsave(&thread->work_list_lock, flags);
+	for (prio = 0; prio < COROUTINE_NR_PRIO; prio++) {
+		for (n = 0; n < coroutine_prio_weight[prio]; n++) {
+			if (list_empty(&thread->work_list[prio]))
+				break;
+			work = list_first_entry(&thread->work_list[prio], struct coroutine_thread_work, list_entry);
+			list_move_tail(&work->list_entry, work_list);
+		}
+	}
+	spin_unlock_irqrestore(&thread->work_list_lock, flags);
+}
+
 static int coroutine_thread_routine(void *data)
 {
 	struct coroutine_thread *thread = (struct coroutine_thread *)data;
 	struct coroutine *co;
 	struct coroutine_thread_work *work, *work_tmp;
 	struct list_head work_list;
-	unsigned long flags;
 
 	for (;;) {
 		trace_coroutine_thread_wait(thread);
-		wait_event_interruptible(thread->waitq, (thread->stopping || !list_empty(&thread->work_list)));
+		if (thread->nr_timers)
+			wait_event_interruptible_timeout(thread->waitq,
+				(thread->stopping || coroutine_thread_has_work(thread)),
+				coroutine_thread_wait_timeout(thread));
+		else
+			wait_event_interruptible(thread->waitq, (thread->stopping || coroutine_thread_has_work(thread)));
 		trace_coroutine_thread_wait_return(thread);
 		if (thread->stopping)
 			break;
 
-		if (list_empty(&thread->work_list))
-			continue;
+		coroutine_thread_run_timers(thread);
 
 		INIT_LIST_HEAD(&work_list);
-		spin_lock_irqsave(&thread->work_list_lock, flags);
-		list_splice_init(&thread->work_list, &work_list);
-		spin_unlock_irqrestore(&thread->work_list_lock, flags);
+		coroutine_thread_take_work(thread, &work_list);
+		if (list_empty(&work_list))
+			continue;
 
 		list_for_each_entry_safe(work, work_tmp, &work_list, list_entry) {
 			list_del_init(&work->list_entry);
+			atomic_dec(&thread->nr_work);
+			coroutine_thread_account(thread, work);
 			co = work->co;
 			mutex_lock(&co->lock);
-			if (co->state == COROUTINE_READY) {
+			if (READ_ONCE(co->thread) != thread) {
+				/* queued before the coroutine migrated, pass it on */
+				if (co->state == COROUTINE_READY)
+					coroutine_signal(co);
+			} else if (co->state == COROUTINE_READY) {
 				co->state = COROUTINE_RUNNING;
+				co->deficit = min(co->deficit + COROUTINE_QUANTUM, COROUTINE_QUANTUM);
+				co->resume_ns = ktime_get_ns();
 				coroutine_enter(co);
 				if (co->state == COROUTINE_RUNNING)
 					co->state = COROUTINE_READY;
@@ -192,10 +376,15 @@ static int coroutine_thread_routine(void *data)
 int coroutine_thread_start(struct coroutine_thread *thread, const char *name, unsigned int cpu)
 {
 	struct task_struct *task;
+	int i;
 
 	memset(thread, 0, sizeof(*thread));
 	spin_lock_init(&thread->work_list_lock);
-	INIT_LIST_HEAD(&thread->work_list);
+	for (i = 0; i < COROUTINE_NR_PRIO; i++)
+		INIT_LIST_HEAD(&thread->work_list[i]);
+	for (i = 0; i < COROUTINE_WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&thread->wheel[i]);
+	thread->wheel_tick = jiffies >> COROUTINE_WHEEL_SHIFT;
 	init_waitqueue_head(&thread->waitq);
 	thread->stopping = false;
 
@@ -215,8 +404,10 @@ int coroutine_thread_start(struct coroutine_thread *thread, const char *name, un
 void coroutine_thread_stop(struct coroutine_thread *thread)
 {
 	struct coroutine_thread_work *work, *work_tmp;
+	struct coroutine_timer *timer, *timer_tmp;
 	struct list_head work_list;
 	unsigned long flags;
+	int prio, slot;
 
 	thread->stopping = true;
 	wake_up_interruptible(&thread->waitq);
@@ -224,7 +415,8 @@ void coroutine_thread_stop(struct coroutine_thread *thread)
 
 	INIT_LIST_HEAD(&work_list);
 	spin_lock_irqsave(&thread->work_list_lock, flags);
-	list_splice_init(&thread->work_list, &work_list);
+	for (prio = 0; prio < COROUTINE_NR_PRIO; prio++)
+		list_splice_init(&thread->work_list[prio], &work_list);
 	spin_unlock_irqrestore(&thread->work_list_lock, flags);
 
 	list_for_each_entry_safe(work, work_tmp, &work_list, list_entry) {
@@ -233,6 +425,11 @@ void coroutine_thread_stop(struct coroutine_thread *thread)
 		kmem_cache_free(g_coroutine_thread_work_cache, work);
 	}
 
+	for (slot = 0; slot < COROUTINE_WHEEL_SIZE; slot++) {
+		list_for_each_entry_safe(timer, timer_tmp, &thread->wheel[slot], entry)
+			coroutine_timer_cancel(timer);
+	}
+
 	put_task_struct(thread->task);
 }
 
@@ -242,24 +439,28 @@ int coroutine_init(void)
 	if (!g_coroutine_cache)
 		return -ENOMEM;
 
-	g_coroutine_stack_cache = kmem_cache_create("tlb_co_stack_cache", COROUTINE_STACK_SIZE, 0, 0, NULL);
-	if (!g_coroutine_cache) {
+	if (tlb_arena_init(&g_coroutine_stack_arena, "tlb_co_stack_cache", COROUTINE_STACK_SIZE)) {
 		kmem_cache_destroy(g_coroutine_cache);
 		return -ENOMEM;
 	}
 
 	g_coroutine_thread_work_cache = kmem_cache_create("tlb_co_thread_work_cache", sizeof(struct coroutine_thread_work), 0, 0, NULL);
 	if (!g_coroutine_thread_work_cache) {
-		kmem_cache_destroy(g_coroutine_stack_cache);
+		tlb_arena_deinit(&g_coroutine_stack_arena);
 		kmem_cache_destroy(g_coroutine_cache);
 		return -ENOMEM;
 	}
 	return 0;
 }
 
+struct tlb_arena *coroutine_stack_arena(void)
+{
+	return &g_coroutine_stack_arena;
+}
+
 void coroutine_deinit(void)
 {
 	kmem_cache_destroy(g_coroutine_thread_work_cache);
-	kmem_cache_destroy(g_coroutine_stack_cache);
+	tlb_arena_deinit(&g_coroutine_stack_arena);
 	kmem_cache_destroy(g_coroutine_cache);
 }
@@ -14,15 +14,45 @@
 #define COROUTINE_STACK_SHIFT ((ulong)(COROUTINE_PAGE_SHIFT + 2))
 #define COROUTINE_STACK_SIZE (1UL << COROUTINE_STACK_SHIFT)
 
+#define COROUTINE_LATENCY_STALE_NS (100 * NSEC_PER_MSEC)
+
+/* lower value is served first, see coroutine_prio_weight */
+enum {
+	COROUTINE_PRIO_HIGH = 0,
+	COROUTINE_PRIO_NORMAL,
+	COROUTINE_PRIO_LOW,
+	COROUTINE_NR_PRIO,
+};
+
+/* per resume budget: deficit round robin over bytes, bounded by time */
+#define COROUTINE_QUANTUM (64 * 1024)
+#define COROUTINE_SLICE_NS (500 * NSEC_PER_USEC)
+
+/* hashed timer wheel, one slot per 16 jiffies, later rounds stay in the slot */
+#define COROUTINE_WHEEL_SHIFT 4
+#define COROUTINE_WHEEL_SIZE 256
+
+struct tlb_arena;
+
 struct coroutine_thread {
 	struct task_struct *task;
 	struct kernel_jmp_buf ctx;
-	struct list_head work_list;
+	struct list_head work_list[COROUTINE_NR_PRIO];
 	spinlock_t work_list_lock;
 	struct wait_queue_head waitq;
 	bool stopping;
 	atomic_t signaled;
 	unsigned int cpu;
+
+	/* scheduler pressure: queued wakeups and smoothed wakeup latency */
+	atomic_t nr_work;
+	u64 latency_ns;
+	u64 sample_ns;
+
+	/* timers are only touched by the thread itself, no locking */
+	struct list_head wheel[COROUTINE_WHEEL_SIZE];
+	unsigned long wheel_tick;
+	int nr_timers;
 };
 
 enum {
@@ -33,6 +63,14 @@ enum {
 	COROUTINE_CANCELED
 };
 
+/* signals its coroutine once expires has passed, holds a ref while armed */
+struct coroutine_timer {
+	struct list_head entry;
+	struct coroutine *co;
+	unsigned long expires;
+	bool expired;
+};
+
 struct coroutine {
 	struct kernel_jmp_buf ctx;
 	struct coroutine_thread *thread;
@@ -44,6 +82,12 @@ struct coroutine {
 	int magic;
 	atomic_t ref_count;
 	struct mutex lock;
+	/* bytes left in this resume, overspending carries over as debt */
+	int deficit;
+	u64 resume_ns;
+	/* takes effect with the next signal */
+	int prio;
+	struct coroutine_timer sleep_timer;
 };
 
 struct coroutine *coroutine_create(struct coroutine_thread *thread);
@@ -69,10 +113,54 @@ void coroutine_signal(struct coroutine *co);
 
 void coroutine_cancel(struct coroutine *co);
 
+/* true once the coroutine should let others run */
+static inline bool coroutine_charge(struct coroutine *co, int bytes)
+{
+	co->deficit -= bytes;
+	return co->deficit <= 0 || ktime_get_ns() - co->resume_ns > COROUTINE_SLICE_NS;
+}
+
+/* requeue behind the already runnable coroutines */
+static inline void coroutine_resched(struct coroutine *co)
+{
+	coroutine_signal(co);
+	coroutine_yield(co);
+}
+
+void coroutine_timer_init(struct coroutine_timer *timer, struct coroutine *co);
+
+void coroutine_timer_arm(struct coroutine_timer *timer, unsigned long expires);
+
+void coroutine_timer_cancel(struct coroutine_timer *timer);
+
+void coroutine_sleep(struct coroutine *co, unsigned long delay);
+
+void coroutine_migrate(struct coroutine *co, struct coroutine_thread *thread);
+
+static inline void coroutine_set_prio(struct coroutine *co, int prio)
+{
+	WRITE_ONCE(co->prio, prio);
+}
+
+static inline int coroutine_thread_queue_len(struct coroutine_thread *thread)
+{
+	return atomic_read(&thread->nr_work);
+}
+
+/* a thread without recent wakeups isn't behind */
+static inline u64 coroutine_thread_latency_ns(struct coroutine_thread *thread)
+{
+	if (ktime_get_ns() - READ_ONCE(thread->sample_ns) > COROUTINE_LATENCY_STALE_NS)
+		return 0;
+	return READ_ONCE(thread->latency_ns);
+}
+
 int coroutine_thread_start(struct coroutine_thread *thread, const char *name, unsigned int cpu);
 
 void coroutine_thread_stop(struct coroutine_thread *thread);
 
 int coroutine_init(void);
 
+struct tlb_arena *coroutine_stack_arena(void);
+
 void coroutine_deinit(void);
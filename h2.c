@@ -0,0 +1,1013 @@
+#include "h2.h"
+#include "server.h"
+#include "trace.h"
+
+/*
+ * HTTP/2 stream level balancing. tlb terminates HTTP/2 framing on both
+ * sides: every client stream is forwarded as a stream of a persistent
+ * upstream connection to a target, picked per stream by the least number
+ * of outstanding streams. Upstreams live in a per coroutine thread pool
+ * and are shared by all sessions of that thread; since a thread runs one
+ * coroutine at a time and frames are processed without yielding, none of
+ * the structures below need locking.
+ *
+ * Flow control is terminated per hop. Connection windows of the sender are
+ * replenished as soon as DATA arrives, stream windows only once the bytes
+ * got past the receiver's windows and into its send queue, so per stream
+ * buffering is bounded by our initial window. A send queue over
+ * TLB_H2_MAX_OUT takes no DATA, and its connection isn't read until it
+ * drains, so a peer that doesn't read can't grow the acks either.
+ */
+
+static const u8 tlb_h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+#define TLB_H2_PREFACE_LEN (sizeof(tlb_h2_preface) - 1)
+
+static u32 tlb_h2_get24(const u8 *p)
+{
+	return ((u32)p[0] << 16) | ((u32)p[1] << 8) | p[2];
+}
+
+static u32 tlb_h2_get32(const u8 *p)
+{
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+static void tlb_h2_put32(u8 *p, u32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void tlb_h2_conn_fail(struct tlb_h2_conn *conn, int error)
+{
+	if (!conn->error) {
+		conn->error = error;
+		coroutine_signal(conn->co);
+	}
+}
+
+static void tlb_h2_conn_flush(struct tlb_h2_conn *conn)
+{
+	int r;
+
+	if (conn->error)
+		return;
+
+	r = tlb_sendq_flush(&conn->out, conn->sock);
+	if (r)
+		tlb_h2_conn_fail(conn, r);
+}
+
+static void tlb_h2_conn_write_kvec(struct tlb_h2_conn *conn, struct kvec *vec, int nr, u32 total)
+{
+	int r;
+
+	if (conn->error)
+		return;
+
+	r = tlb_sendq_write_kvec(&conn->out, conn->sock, vec, nr, total);
+	if (r)
+		tlb_h2_conn_fail(conn, r);
+}
+
+static void tlb_h2_conn_write(struct tlb_h2_conn *conn, u8 type, u8 flags, u32 id, const void *data, u32 len)
+{
+	u8 hdr[TLB_H2_FRAME_HEADER_SIZE];
+	struct kvec vec[2];
+
+	hdr[0] = len >> 16;
+	hdr[1] = len >> 8;
+	hdr[2] = len;
+	hdr[3] = type;
+	hdr[4] = flags;
+	tlb_h2_put32(hdr + 5, id & TLB_H2_MAX_WINDOW);
+
+	vec[0].iov_base = hdr;
+	vec[0].iov_len = sizeof(hdr);
+	vec[1].iov_base = (void *)data;
+	vec[1].iov_len = len;
+	tlb_h2_conn_write_kvec(conn, vec, len ? 2 : 1, sizeof(hdr) + len);
+}
+
+static void tlb_h2_write_window_update(struct tlb_h2_conn *conn, u32 id, u32 inc)
+{
+	u8 payload[4];
+
+	tlb_h2_put32(payload, inc);
+	tlb_h2_conn_write(conn, TLB_H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+static void tlb_h2_write_rst(struct tlb_h2_conn *conn, u32 id, u32 error)
+{
+	u8 payload[4];
+
+	tlb_h2_put32(payload, error);
+	tlb_h2_conn_write(conn, TLB_H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static void tlb_h2_write_goaway(struct tlb_h2_conn *conn, u32 last_id, u32 error)
+{
+	u8 payload[8];
+
+	tlb_h2_put32(payload, last_id);
+	tlb_h2_put32(payload + 4, error);
+	tlb_h2_conn_write(conn, TLB_H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+static void tlb_h2_write_setting(struct tlb_h2_conn *conn, u16 id, u32 value)
+{
+	u8 payload[6];
+
+	payload[0] = id >> 8;
+	payload[1] = id;
+	tlb_h2_put32(payload + 2, value);
+	tlb_h2_conn_write(conn, TLB_H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+/* a header block may be larger than a frame: HEADERS + CONTINUATION */
+static void tlb_h2_write_headers(struct tlb_h2_conn *conn, u32 id, u8 flags, const u8 *block, u32 len)
+{
+	u32 n = min_t(u32, len, TLB_H2_MAX_FRAME_SIZE);
+	u8 type = TLB_H2_HEADERS;
+
+	flags &= TLB_H2_FLAG_END_STREAM;
+	for (;;) {
+		if (n == len)
+			flags |= TLB_H2_FLAG_END_HEADERS;
+		tlb_h2_conn_write(conn, type, flags, id, block, n);
+		block += n;
+		len -= n;
+		if (!len)
+			break;
+		n = min_t(u32, len, TLB_H2_MAX_FRAME_SIZE);
+		type = TLB_H2_CONTINUATION;
+		flags = 0;
+	}
+}
+
+static struct hlist_head *tlb_h2_stream_bucket(struct tlb_h2_conn *conn, u32 id)
+{
+	return &conn->stream_hash[hash_32(id, TLB_H2_STREAM_HASH_BITS)];
+}
+
+static struct tlb_h2_half *tlb_h2_lookup_half(struct tlb_h2_conn *conn, u32 id)
+{
+	struct tlb_h2_half *half;
+
+	hlist_for_each_entry(half, tlb_h2_stream_bucket(conn, id), hash_entry) {
+		if (half->id == id)
+			return half;
+	}
+
+	return NULL;
+}
+
+static struct tlb_h2_half *tlb_h2_other_half(struct tlb_h2_half *half)
+{
+	struct tlb_h2_stream *stream = half->stream;
+
+	return (half == &stream->down) ? &stream->up : &stream->down;
+}
+
+static void tlb_h2_half_link(struct tlb_h2_half *half, struct tlb_h2_stream *stream,
+			     struct tlb_h2_conn *conn, u32 id)
+{
+	half->stream = stream;
+	half->conn = conn;
+	half->id = id;
+	half->window = conn->peer_initial_window;
+	INIT_LIST_HEAD(&half->pending);
+	INIT_LIST_HEAD(&half->blocked_entry);
+	hlist_add_head(&half->hash_entry, tlb_h2_stream_bucket(conn, id));
+	conn->nr_streams++;
+}
+
+static void tlb_h2_half_unlink(struct tlb_h2_half *half)
+{
+	struct tlb_h2_frame *frame, *tmp;
+
+	list_for_each_entry_safe(frame, tmp, &half->pending, list) {
+		list_del(&frame->list);
+		kfree(frame);
+	}
+	list_del_init(&half->blocked_entry);
+	hlist_del_init(&half->hash_entry);
+	half->conn->nr_streams--;
+}
+
+static void tlb_h2_stream_free(struct tlb_h2_stream *stream)
+{
+	tlb_h2_half_unlink(&stream->down);
+	tlb_h2_half_unlink(&stream->up);
+	atomic64_dec(&stream->target->active_cons);
+	kfree(stream);
+}
+
+/* abort the stream, telling the peer behind 'to' unless it is closed already */
+static void tlb_h2_stream_reset(struct tlb_h2_stream *stream, struct tlb_h2_half *to, u32 error)
+{
+	if (!to->end_sent || !to->end_recv)
+		tlb_h2_write_rst(to->conn, to->id, error);
+	tlb_h2_stream_free(stream);
+}
+
+static void tlb_h2_stream_check_done(struct tlb_h2_stream *stream)
+{
+	if (stream->down.end_sent && stream->up.end_sent)
+		tlb_h2_stream_free(stream);
+}
+
+/* give the sender back the stream window its bytes occupied on our side */
+static void tlb_h2_credit(struct tlb_h2_half *src, u32 n)
+{
+	if (n && !src->end_recv)
+		tlb_h2_write_window_update(src->conn, src->id, n);
+}
+
+/* returns true if the frame went out completely */
+static bool tlb_h2_half_emit(struct tlb_h2_half *half, struct tlb_h2_frame *frame)
+{
+	struct tlb_h2_conn *conn = half->conn;
+	s64 avail;
+	u32 n;
+	u8 flags;
+
+	switch (frame->type) {
+	case TLB_H2_DATA:
+		if (conn->out.bytes >= TLB_H2_MAX_OUT)
+			return false;
+		n = frame->len - frame->off;
+		if (n) {
+			avail = min_t(s64, half->window, conn->send_window);
+			if (avail <= 0)
+				return false;
+			n = min_t(s64, n, avail);
+		}
+		flags = (frame->off + n == frame->len) ? frame->flags : 0;
+		tlb_h2_conn_write(conn, TLB_H2_DATA, flags, half->id, frame->data + frame->off, n);
+		half->window -= n;
+		conn->send_window -= n;
+		frame->off += n;
+		tlb_h2_credit(tlb_h2_other_half(half), n);
+		if (frame->off < frame->len)
+			return false;
+		break;
+	case TLB_H2_HEADERS:
+		tlb_h2_write_headers(conn, half->id, frame->flags, frame->data, frame->len);
+		break;
+	default:
+		tlb_h2_conn_write(conn, frame->type, frame->flags, half->id, frame->data, frame->len);
+		break;
+	}
+
+	if (frame->flags & TLB_H2_FLAG_END_STREAM)
+		half->end_sent = true;
+	return true;
+}
+
+/* may free the stream */
+static void tlb_h2_half_pump(struct tlb_h2_half *half)
+{
+	struct tlb_h2_frame *frame;
+
+	while (!list_empty(&half->pending)) {
+		frame = list_first_entry(&half->pending, struct tlb_h2_frame, list);
+		if (!tlb_h2_half_emit(half, frame))
+			break;
+		list_del(&frame->list);
+		kfree(frame);
+	}
+
+	if (list_empty(&half->pending))
+		list_del_init(&half->blocked_entry);
+	else if (list_empty(&half->blocked_entry))
+		list_add_tail(&half->blocked_entry, &half->conn->blocked_list);
+
+	tlb_h2_stream_check_done(half->stream);
+}
+
+/* forward a frame to the peer behind half, may free the stream */
+static void tlb_h2_half_send(struct tlb_h2_half *half, u8 type, u8 flags, const u8 *data, u32 len)
+{
+	struct tlb_h2_frame local, *frame;
+
+	local.type = type;
+	local.flags = flags;
+	local.len = len;
+	local.off = 0;
+	local.data = data;
+	if (list_empty(&half->pending) && tlb_h2_half_emit(half, &local)) {
+		tlb_h2_stream_check_done(half->stream);
+		return;
+	}
+
+	frame = kmalloc(sizeof(*frame) + local.len - local.off, GFP_KERNEL);
+	if (!frame) {
+		tlb_h2_stream_reset(half->stream, half, TLB_H2_INTERNAL_ERROR);
+		return;
+	}
+	frame->type = type;
+	frame->flags = flags;
+	frame->len = local.len - local.off;
+	frame->off = 0;
+	frame->data = frame->buf;
+	memcpy(frame->buf, data + local.off, frame->len);
+	list_add_tail(&frame->list, &half->pending);
+	tlb_h2_half_pump(half);
+}
+
+static void tlb_h2_conn_pump_blocked(struct tlb_h2_conn *conn)
+{
+	struct tlb_h2_half *half, *tmp;
+
+	list_for_each_entry_safe(half, tmp, &conn->blocked_list, blocked_entry) {
+		if (conn->send_window <= 0 || conn->out.bytes >= TLB_H2_MAX_OUT)
+			break;
+		tlb_h2_half_pump(half);
+	}
+}
+
+static void tlb_h2_conn_init(struct tlb_h2_conn *conn, struct tlb_h2_pool *pool, bool upstream)
+{
+	int i;
+
+	conn->pool = pool;
+	conn->upstream = upstream;
+	tlb_sendq_init(&conn->out);
+	INIT_LIST_HEAD(&conn->blocked_list);
+	for (i = 0; i < ARRAY_SIZE(conn->stream_hash); i++)
+		INIT_HLIST_HEAD(&conn->stream_hash[i]);
+	conn->send_window = TLB_H2_DEFAULT_WINDOW;
+	conn->peer_initial_window = TLB_H2_DEFAULT_WINDOW;
+	conn->peer_max_streams = TLB_H2_DEFAULT_PEER_STREAMS;
+	tlb_hpack_init(&conn->hpack);
+}
+
+static void tlb_h2_conn_deinit(struct tlb_h2_conn *conn)
+{
+	tlb_sendq_purge(&conn->out);
+	tlb_hpack_deinit(&conn->hpack);
+	kfree(conn->hdr_buf);
+	kfree(conn->in_buf);
+}
+
+static struct tlb_h2_upstream *tlb_h2_pool_select(struct tlb_h2_pool *pool);
+
+static int tlb_h2_session_on_headers(struct tlb_h2_session *session, u32 id, u8 flags, const u8 *block, u32 len)
+{
+	struct tlb_h2_conn *conn = &session->conn;
+	struct tlb_h2_upstream *up;
+	struct tlb_h2_stream *stream;
+	struct tlb_h2_half *half;
+
+	half = tlb_h2_lookup_half(conn, id);
+	if (half) {
+		/* trailers */
+		if (half->end_recv)
+			return 0;
+		if (flags & TLB_H2_FLAG_END_STREAM)
+			half->end_recv = true;
+		tlb_h2_half_send(tlb_h2_other_half(half), TLB_H2_HEADERS, flags, block, len);
+		return 0;
+	}
+
+	if (!(id & 1) || id <= session->last_stream_id)
+		return (id & 1) ? 0 : TLB_H2_PROTOCOL_ERROR;
+	session->last_stream_id = id;
+
+	if (conn->nr_streams >= TLB_H2_MAX_CLIENT_STREAMS)
+		goto refuse;
+
+	up = tlb_h2_pool_select(conn->pool);
+	if (!up)
+		goto refuse;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		goto refuse;
+
+	stream->target = up->target;
+	atomic64_inc(&stream->target->total_cons);
+	atomic64_inc(&stream->target->active_cons);
+	tlb_h2_half_link(&stream->down, stream, conn, id);
+	tlb_h2_half_link(&stream->up, stream, &up->conn, up->next_stream_id);
+	up->next_stream_id += 2;
+	if (up->next_stream_id > TLB_H2_MAX_WINDOW)
+		up->draining = true;
+
+	if (flags & TLB_H2_FLAG_END_STREAM)
+		stream->down.end_recv = true;
+	tlb_h2_half_send(&stream->up, TLB_H2_HEADERS, flags, block, len);
+	return 0;
+
+refuse:
+	tlb_h2_write_rst(conn, id, TLB_H2_REFUSED_STREAM);
+	return 0;
+}
+
+static int tlb_h2_upstream_on_headers(struct tlb_h2_upstream *up, u32 id, u8 flags, const u8 *block, u32 len)
+{
+	struct tlb_h2_half *half;
+
+	half = tlb_h2_lookup_half(&up->conn, id);
+	if (!half || half->end_recv)
+		return 0;
+
+	if (flags & TLB_H2_FLAG_END_STREAM)
+		half->end_recv = true;
+	tlb_h2_half_send(tlb_h2_other_half(half), TLB_H2_HEADERS, flags, block, len);
+	return 0;
+}
+
+static int tlb_h2_on_header_block(struct tlb_h2_conn *conn, u32 id, u8 flags, const u8 *block, u32 len)
+{
+	u8 *out = conn->pool->scratch;
+	int r;
+
+	/* always decode, even for streams we drop: the table is per connection */
+	r = tlb_hpack_transcode(&conn->hpack, block, len, out, TLB_H2_MAX_HEADER_BLOCK);
+	if (r < 0)
+		return TLB_H2_COMPRESSION_ERROR;
+
+	if (conn->upstream)
+		return tlb_h2_upstream_on_headers(container_of(conn, struct tlb_h2_upstream, conn), id, flags, out, r);
+
+	return tlb_h2_session_on_headers(container_of(conn, struct tlb_h2_session, conn), id, flags, out, r);
+}
+
+static int tlb_h2_on_headers(struct tlb_h2_conn *conn, u32 id, u8 flags, const u8 *payload, u32 len)
+{
+	u32 pad = 0;
+
+	if (id == 0)
+		return TLB_H2_PROTOCOL_ERROR;
+
+	if (flags & TLB_H2_FLAG_PADDED) {
+		if (len < 1)
+			return TLB_H2_PROTOCOL_ERROR;
+		pad = payload[0];
+		payload++;
+		len--;
+	}
+	if (flags & TLB_H2_FLAG_PRIORITY) {
+		if (len < 5)
+			return TLB_H2_PROTOCOL_ERROR;
+		payload += 5;
+		len -= 5;
+	}
+	if (pad > len)
+		return TLB_H2_PROTOCOL_ERROR;
+	len -= pad;
+
+	if (flags & TLB_H2_FLAG_END_HEADERS)
+		return tlb_h2_on_header_block(conn, id, flags, payload, len);
+
+	if (!conn->hdr_buf) {
+		conn->hdr_buf = kmalloc(TLB_H2_MAX_HEADER_BLOCK, GFP_KERNEL);
+		if (!conn->hdr_buf)
+			return TLB_H2_INTERNAL_ERROR;
+	}
+
+	memcpy(conn->hdr_buf, payload, len);
+	conn->hdr_len = len;
+	conn->hdr_stream = id;
+	conn->hdr_flags = flags;
+	return 0;
+}
+
+static int tlb_h2_on_continuation(struct tlb_h2_conn *conn, u32 id, u8 flags, const u8 *payload, u32 len)
+{
+	int r;
+
+	if (!conn->hdr_stream || id != conn->hdr_stream)
+		return TLB_H2_PROTOCOL_ERROR;
+
+	if (len > TLB_H2_MAX_HEADER_BLOCK - conn->hdr_len)
+		return TLB_H2_INTERNAL_ERROR;
+
+	memcpy(conn->hdr_buf + conn->hdr_len, payload, len);
+	conn->hdr_len += len;
+	if (!(flags & TLB_H2_FLAG_END_HEADERS))
+		return 0;
+
+	conn->hdr_stream = 0;
+	r = tlb_h2_on_header_block(conn, id, conn->hdr_flags, conn->hdr_buf, conn->hdr_len);
+	conn->hdr_len = 0;
+	return r;
+}
+
+static int tlb_h2_on_data(struct tlb_h2_conn *conn, u32 id, u8 flags, const u8 *payload, u32 len)
+{
+	struct tlb_h2_half *half;
+	u32 pad = 0;
+
+	if (id == 0)
+		return TLB_H2_PROTOCOL_ERROR;
+
+	/* connection window is returned right away, streams bound the buffering */
+	if (len)
+		tlb_h2_write_window_update(conn, 0, len);
+
+	if (flags & TLB_H2_FLAG_PADDED) {
+		if (len < 1 || payload[0] >= len)
+			return TLB_H2_PROTOCOL_ERROR;
+		pad = payload[0] + 1;
+		payload++;
+		len -= pad;
+	}
+
+	half = tlb_h2_lookup_half(conn, id);
+	if (!half || half->end_recv)
+		return 0;
+
+	if (flags & TLB_H2_FLAG_END_STREAM)
+		half->end_recv = true;
+	else if (pad)
+		tlb_h2_write_window_update(conn, id, pad);
+
+	tlb_h2_half_send(tlb_h2_other_half(half), TLB_H2_DATA, flags & TLB_H2_FLAG_END_STREAM, payload, len);
+	return 0;
+}
+
+static int tlb_h2_on_settings(struct tlb_h2_conn *conn, u8 flags, const u8 *payload, u32 len)
+{
+	struct tlb_h2_half *half;
+	u32 value, i;
+	s32 delta;
+	u16 id;
+
+	if (flags & TLB_H2_FLAG_ACK)
+		return 0;
+
+	if (len % 6)
+		return TLB_H2_FRAME_SIZE_ERROR;
+
+	for (; len; payload += 6, len -= 6) {
+		id = ((u16)payload[0] << 8) | payload[1];
+		value = tlb_h2_get32(payload + 2);
+		switch (id) {
+		case TLB_H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+			conn->peer_max_streams = value;
+			break;
+		case TLB_H2_SETTINGS_INITIAL_WINDOW_SIZE:
+			if (value > TLB_H2_MAX_WINDOW)
+				return TLB_H2_FLOW_CONTROL_ERROR;
+			delta = value - conn->peer_initial_window;
+			conn->peer_initial_window = value;
+			for (i = 0; i < ARRAY_SIZE(conn->stream_hash); i++) {
+				hlist_for_each_entry(half, &conn->stream_hash[i], hash_entry)
+					half->window += delta;
+			}
+			break;
+		case TLB_H2_SETTINGS_MAX_FRAME_SIZE:
+			/* we never send frames over the default */
+			if (value < TLB_H2_MAX_FRAME_SIZE || value > 0xffffff)
+				return TLB_H2_PROTOCOL_ERROR;
+			break;
+		default:
+			break;
+		}
+	}
+
+	tlb_h2_conn_write(conn, TLB_H2_SETTINGS, TLB_H2_FLAG_ACK, 0, NULL, 0);
+	tlb_h2_conn_pump_blocked(conn);
+	return 0;
+}
+
+static int tlb_h2_on_window_update(struct tlb_h2_conn *conn, u32 id, const u8 *payload, u32 len)
+{
+	struct tlb_h2_half *half;
+	u32 inc;
+
+	if (len != 4)
+		return TLB_H2_FRAME_SIZE_ERROR;
+
+	inc = tlb_h2_get32(payload) & TLB_H2_MAX_WINDOW;
+	if (id == 0) {
+		if (!inc)
+			return TLB_H2_PROTOCOL_ERROR;
+		conn->send_window += inc;
+		if (conn->send_window > TLB_H2_MAX_WINDOW)
+			return TLB_H2_FLOW_CONTROL_ERROR;
+		tlb_h2_conn_pump_blocked(conn);
+		return 0;
+	}
+
+	half = tlb_h2_lookup_half(conn, id);
+	if (!half || !inc)
+		return 0;
+
+	half->window += inc;
+	tlb_h2_half_pump(half);
+	return 0;
+}
+
+static int tlb_h2_on_rst_stream(struct tlb_h2_conn *conn, u32 id, const u8 *payload, u32 len)
+{
+	struct tlb_h2_half *half;
+
+	if (len != 4)
+		return TLB_H2_FRAME_SIZE_ERROR;
+
+	half = tlb_h2_lookup_half(conn, id);
+	if (half)
+		tlb_h2_stream_reset(half->stream, tlb_h2_other_half(half), tlb_h2_get32(payload));
+	return 0;
+}
+
+static int tlb_h2_on_goaway(struct tlb_h2_conn *conn, const u8 *payload, u32 len)
+{
+	struct tlb_h2_upstream *up;
+	struct tlb_h2_half *half;
+	struct hlist_node *tmp;
+	u32 last_id, i;
+
+	if (len < 8)
+		return TLB_H2_FRAME_SIZE_ERROR;
+
+	/* a client going away just closes the session */
+	if (!conn->upstream)
+		return -ECONNRESET;
+
+	up = container_of(conn, struct tlb_h2_upstream, conn);
+	up->draining = true;
+	last_id = tlb_h2_get32(payload) & TLB_H2_MAX_WINDOW;
+	for (i = 0; i < ARRAY_SIZE(conn->stream_hash); i++) {
+		hlist_for_each_entry_safe(half, tmp, &conn->stream_hash[i], hash_entry) {
+			if (half->id > last_id)
+				tlb_h2_stream_reset(half->stream, tlb_h2_other_half(half), TLB_H2_REFUSED_STREAM);
+		}
+	}
+	return 0;
+}
+
+static int tlb_h2_on_frame(struct tlb_h2_conn *conn, u8 type, u8 flags, u32 id, const u8 *payload, u32 len)
+{
+	if (conn->hdr_stream && type != TLB_H2_CONTINUATION)
+		return TLB_H2_PROTOCOL_ERROR;
+
+	switch (type) {
+	case TLB_H2_DATA:
+		return tlb_h2_on_data(conn, id, flags, payload, len);
+	case TLB_H2_HEADERS:
+		return tlb_h2_on_headers(conn, id, flags, payload, len);
+	case TLB_H2_CONTINUATION:
+		return tlb_h2_on_continuation(conn, id, flags, payload, len);
+	case TLB_H2_RST_STREAM:
+		return tlb_h2_on_rst_stream(conn, id, payload, len);
+	case TLB_H2_SETTINGS:
+		if (id != 0)
+			return TLB_H2_PROTOCOL_ERROR;
+		return tlb_h2_on_settings(conn, flags, payload, len);
+	case TLB_H2_PING:
+		if (len != 8)
+			return TLB_H2_FRAME_SIZE_ERROR;
+		if (!(flags & TLB_H2_FLAG_ACK))
+			tlb_h2_conn_write(conn, TLB_H2_PING, TLB_H2_FLAG_ACK, 0, payload, len);
+		return 0;
+	case TLB_H2_WINDOW_UPDATE:
+		return tlb_h2_on_window_update(conn, id, payload, len);
+	case TLB_H2_GOAWAY:
+		return tlb_h2_on_goaway(conn, payload, len);
+	case TLB_H2_PUSH_PROMISE:
+		/* disabled towards upstreams, never valid from clients */
+		return TLB_H2_PROTOCOL_ERROR;
+	default:
+		/* PRIORITY and unknown extension frames */
+		return 0;
+	}
+}
+
+static int tlb_h2_conn_input(struct tlb_h2_conn *conn)
+{
+	struct tlb_h2_session *session;
+	u8 *p = conn->in_buf;
+	int left = conn->in_len;
+	u32 len, n;
+	int r = 0;
+
+	if (!conn->upstream) {
+		session = container_of(conn, struct tlb_h2_session, conn);
+		if (session->preface_len < TLB_H2_PREFACE_LEN) {
+			n = min_t(u32, left, TLB_H2_PREFACE_LEN - session->preface_len);
+			if (memcmp(p, tlb_h2_preface + session->preface_len, n))
+				return -EPROTO;
+			session->preface_len += n;
+			p += n;
+			left -= n;
+		}
+	}
+
+	while (left >= TLB_H2_FRAME_HEADER_SIZE) {
+		len = tlb_h2_get24(p);
+		if (len > TLB_H2_MAX_FRAME_SIZE) {
+			r = TLB_H2_FRAME_SIZE_ERROR;
+			break;
+		}
+		if (left < TLB_H2_FRAME_HEADER_SIZE + len)
+			break;
+
+		r = tlb_h2_on_frame(conn, p[3], p[4], tlb_h2_get32(p + 5) & TLB_H2_MAX_WINDOW,
+				    p + TLB_H2_FRAME_HEADER_SIZE, len);
+		if (r)
+			break;
+
+		p += TLB_H2_FRAME_HEADER_SIZE + len;
+		left -= TLB_H2_FRAME_HEADER_SIZE + len;
+	}
+
+	memmove(conn->in_buf, p, left);
+	conn->in_len = left;
+
+	if (r > 0) {
+		session = conn->upstream ? NULL : container_of(conn, struct tlb_h2_session, conn);
+		tlb_h2_write_goaway(conn, session ? session->last_stream_id : 0, r);
+		tlb_h2_conn_flush(conn);
+		r = -EPROTO;
+	}
+	return r;
+}
+
+static int tlb_h2_conn_io(struct tlb_h2_conn *conn, bool *closed)
+{
+	int r;
+
+	*closed = false;
+	for (;;) {
+		if (conn->error)
+			return conn->error;
+
+		/* stop reading while what we owe the peer piles up */
+		if (conn->out.bytes >= TLB_H2_MAX_OUT) {
+			tlb_h2_conn_flush(conn);
+			if (conn->error)
+				return conn->error;
+			if (conn->out.bytes >= TLB_H2_MAX_OUT)
+				break;
+		}
+
+		r = ksock_recv(conn->sock, conn->in_buf + conn->in_len, TLB_H2_IN_BUF_SIZE - conn->in_len);
+		if (r < 0) {
+			if (r == -EAGAIN)
+				break;
+			return r;
+		} else if (r == 0) {
+			*closed = true;
+			return 0;
+		}
+
+		conn->in_len += r;
+		r = tlb_h2_conn_input(conn);
+		if (r)
+			return r;
+	}
+
+	/* streams held back by the send queue go on once it drained */
+	tlb_h2_conn_flush(conn);
+	if (!list_empty(&conn->blocked_list) && conn->out.bytes < TLB_H2_MAX_OUT) {
+		tlb_h2_conn_pump_blocked(conn);
+		tlb_h2_conn_flush(conn);
+	}
+	return conn->error;
+}
+
+static void tlb_h2_upstream_sock_event(struct sock *sk)
+{
+	struct tlb_h2_upstream *up = sk->sk_user_data;
+
+	coroutine_signal(up->conn.co);
+}
+
+static void tlb_h2_upstream_free(struct tlb_h2_upstream *up)
+{
+	struct tlb_h2_conn *conn = &up->conn;
+	struct tlb_h2_half *half;
+	struct hlist_node *tmp;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(conn->stream_hash); i++) {
+		hlist_for_each_entry_safe(half, tmp, &conn->stream_hash[i], hash_entry)
+			tlb_h2_stream_reset(half->stream, tlb_h2_other_half(half), TLB_H2_INTERNAL_ERROR);
+	}
+
+	list_del_init(&up->pool_entry);
+	if (conn->sock)
+		ksock_release(conn->sock);
+	tlb_h2_conn_deinit(conn);
+	coroutine_deref(conn->co);
+	tlb_target_put(up->target);
+	kfree(up);
+}
+
+static void *tlb_h2_upstream_coroutine(struct coroutine *co, void *arg)
+{
+	struct tlb_h2_upstream *up = arg;
+	bool closed;
+	int r;
+
+	for (;;) {
+		r = tlb_h2_conn_io(&up->conn, &closed);
+		if (r || closed)
+			break;
+		if (READ_ONCE(up->target->removed))
+			up->draining = true;
+		if (up->draining && !up->conn.nr_streams)
+			break;
+		coroutine_yield(co);
+	}
+
+	tlb_h2_upstream_free(up);
+	return ERR_PTR(r);
+}
+
+static struct tlb_h2_upstream *tlb_h2_upstream_create(struct tlb_h2_pool *pool, struct tlb_target *target)
+{
+	struct tlb_h2_upstream *up;
+	struct ksock_callbacks callbacks;
+	struct ksock_opts opts;
+	int r;
+
+	up = kzalloc(sizeof(*up), GFP_KERNEL);
+	if (!up)
+		return ERR_PTR(-ENOMEM);
+
+	tlb_h2_conn_init(&up->conn, pool, true);
+	INIT_LIST_HEAD(&up->pool_entry);
+	up->next_stream_id = 1;
+	up->conn.in_buf = kmalloc(TLB_H2_IN_BUF_SIZE, GFP_KERNEL);
+	if (!up->conn.in_buf) {
+		r = -ENOMEM;
+		goto free_up;
+	}
+
+	up->conn.co = coroutine_create(pool->thread);
+	if (!up->conn.co) {
+		r = -ENOMEM;
+		goto free_up;
+	}
+
+	callbacks.user_data = up;
+	callbacks.data_ready = tlb_h2_upstream_sock_event;
+	callbacks.write_space = tlb_h2_upstream_sock_event;
+	callbacks.state_change = tlb_h2_upstream_sock_event;
+	tlb_server_get_opts(pool->srv, &pool->srv->target_opts, &opts);
+	r = ksock_connect_addr(&up->conn.sock, &target->addr, NULL, 0, &opts, &callbacks);
+	if (r)
+		goto deref_co;
+
+	tlb_target_get(target);
+	up->target = target;
+
+	/* queued until the connect completes */
+	if (tlb_sendq_append(&up->conn.out, tlb_h2_preface, TLB_H2_PREFACE_LEN))
+		tlb_h2_conn_fail(&up->conn, -ENOMEM);
+	tlb_h2_write_setting(&up->conn, TLB_H2_SETTINGS_ENABLE_PUSH, 0);
+
+	list_add_tail(&up->pool_entry, &pool->upstream_list);
+	coroutine_start(up->conn.co, tlb_h2_upstream_coroutine, up);
+	return up;
+
+deref_co:
+	coroutine_deref(up->conn.co);
+free_up:
+	tlb_h2_conn_deinit(&up->conn);
+	kfree(up);
+	return ERR_PTR(r);
+}
+
+/*
+ * Least outstanding streams over the upstreams of this thread. A target
+ * gets another connection while it has less than h2_pool_size of them
+ * and every existing candidate is busy.
+ */
+static struct tlb_h2_upstream *tlb_h2_pool_select(struct tlb_h2_pool *pool)
+{
+	struct tlb_server *srv = pool->srv;
+	unsigned int pool_size = READ_ONCE(srv->h2_pool_size);
+	struct tlb_h2_upstream *up, *best = NULL;
+	struct tlb_target *target, *grow = NULL;
+	struct tlb_subset *subset;
+	unsigned int nr, grow_nr = UINT_MAX;
+	bool outside;
+
+	read_lock(&srv->target_lock);
+	subset = tlb_server_subset(srv, pool->thread);
+	for (target = tlb_server_next_target(srv, NULL); target; target = tlb_server_next_target(srv, target)) {
+		/* connections to targets that left the subset finish their streams */
+		outside = subset && !tlb_subset_contains(subset, target);
+		nr = 0;
+		list_for_each_entry(up, &pool->upstream_list, pool_entry) {
+			if (up->target != target || up->draining || up->conn.error)
+				continue;
+			if (outside) {
+				up->draining = true;
+				coroutine_signal(up->conn.co);
+				continue;
+			}
+			nr++;
+			if (up->conn.nr_streams >= up->conn.peer_max_streams)
+				continue;
+			if (!best || up->conn.nr_streams < best->conn.nr_streams)
+				best = up;
+		}
+		if (!outside && nr < pool_size && nr < grow_nr) {
+			grow = target;
+			grow_nr = nr;
+		}
+	}
+
+	if (grow && (!best || best->conn.nr_streams))
+		tlb_target_get(grow);
+	else
+		grow = NULL;
+	read_unlock(&srv->target_lock);
+
+	if (grow) {
+		up = tlb_h2_upstream_create(pool, grow);
+		tlb_target_put(grow);
+		if (!IS_ERR(up))
+			return up;
+	}
+
+	return best;
+}
+
+void tlb_h2_session_free(struct tlb_h2_session *session)
+{
+	struct tlb_h2_conn *conn = &session->conn;
+	struct tlb_h2_half *half;
+	struct hlist_node *tmp;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(conn->stream_hash); i++) {
+		hlist_for_each_entry_safe(half, tmp, &conn->stream_hash[i], hash_entry)
+			tlb_h2_stream_reset(half->stream, tlb_h2_other_half(half), TLB_H2_CANCEL);
+	}
+
+	tlb_h2_conn_deinit(conn);
+	kfree(session);
+}
+
+int tlb_h2_serve(struct tlb_con *con, struct tlb_h2_pool *pool)
+{
+	struct tlb_h2_session *session;
+	bool closed;
+	int r;
+
+	if (!pool->scratch) {
+		pool->scratch = kmalloc(TLB_H2_MAX_HEADER_BLOCK, GFP_KERNEL);
+		if (!pool->scratch)
+			return -ENOMEM;
+	}
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
+		return -ENOMEM;
+
+	tlb_h2_conn_init(&session->conn, pool, false);
+	session->conn.sock = con->sock;
+	session->conn.co = con->co;
+	session->conn.in_buf = kmalloc(TLB_H2_IN_BUF_SIZE, GFP_KERNEL);
+	if (!session->conn.in_buf) {
+		tlb_h2_conn_deinit(&session->conn);
+		kfree(session);
+		return -ENOMEM;
+	}
+	con->h2 = session;
+
+	tlb_h2_write_setting(&session->conn, TLB_H2_SETTINGS_MAX_CONCURRENT_STREAMS, TLB_H2_MAX_CLIENT_STREAMS);
+	for (;;) {
+		r = tlb_h2_conn_io(&session->conn, &closed);
+		if (r || closed)
+			break;
+		coroutine_yield(con->co);
+	}
+
+	con->h2 = NULL;
+	tlb_h2_session_free(session);
+	return r;
+}
+
+void tlb_h2_pool_init(struct tlb_h2_pool *pool, struct tlb_server *srv, struct coroutine_thread *thread)
+{
+	pool->srv = srv;
+	pool->thread = thread;
+	INIT_LIST_HEAD(&pool->upstream_list);
+	pool->scratch = NULL;
+}
+
+/* coroutine threads are stopped and sessions gone */
+void tlb_h2_pool_deinit(struct tlb_h2_pool *pool)
+{
+	struct tlb_h2_upstream *up;
+
+	while (!list_empty(&pool->upstream_list)) {
+		up = list_first_entry(&pool->upstream_list, struct tlb_h2_upstream, pool_entry);
+		tlb_h2_upstream_free(up);
+	}
+	kfree(pool->scratch);
+	pool->scratch = NULL;
+}
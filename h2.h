@@ -0,0 +1,154 @@
+#pragma once
+
+#include "base.h"
+#include "ksock.h"
+#include "coroutine.h"
+#include "hpack.h"
+#include "sendq.h"
+
+struct tlb_server;
+struct tlb_target;
+struct tlb_con;
+
+#define TLB_H2_FRAME_HEADER_SIZE 9
+#define TLB_H2_MAX_FRAME_SIZE 16384
+#define TLB_H2_MAX_HEADER_BLOCK (64 * 1024)
+#define TLB_H2_IN_BUF_SIZE (TLB_H2_FRAME_HEADER_SIZE + TLB_H2_MAX_FRAME_SIZE)
+#define TLB_H2_DEFAULT_WINDOW 65535
+#define TLB_H2_MAX_WINDOW 0x7fffffff
+#define TLB_H2_MAX_CLIENT_STREAMS 128
+#define TLB_H2_DEFAULT_PEER_STREAMS 100
+#define TLB_H2_STREAM_HASH_BITS 6
+#define TLB_H2_POOL_SIZE 1
+#define TLB_H2_MAX_OUT (256 * 1024)
+
+enum {
+	TLB_H2_DATA = 0x0,
+	TLB_H2_HEADERS = 0x1,
+	TLB_H2_PRIORITY = 0x2,
+	TLB_H2_RST_STREAM = 0x3,
+	TLB_H2_SETTINGS = 0x4,
+	TLB_H2_PUSH_PROMISE = 0x5,
+	TLB_H2_PING = 0x6,
+	TLB_H2_GOAWAY = 0x7,
+	TLB_H2_WINDOW_UPDATE = 0x8,
+	TLB_H2_CONTINUATION = 0x9,
+};
+
+enum {
+	TLB_H2_FLAG_END_STREAM = 0x1,
+	TLB_H2_FLAG_ACK = 0x1,
+	TLB_H2_FLAG_END_HEADERS = 0x4,
+	TLB_H2_FLAG_PADDED = 0x8,
+	TLB_H2_FLAG_PRIORITY = 0x20,
+};
+
+enum {
+	TLB_H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	TLB_H2_SETTINGS_ENABLE_PUSH = 0x2,
+	TLB_H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	TLB_H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	TLB_H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+enum {
+	TLB_H2_NO_ERROR = 0x0,
+	TLB_H2_PROTOCOL_ERROR = 0x1,
+	TLB_H2_INTERNAL_ERROR = 0x2,
+	TLB_H2_FLOW_CONTROL_ERROR = 0x3,
+	TLB_H2_STREAM_CLOSED = 0x5,
+	TLB_H2_FRAME_SIZE_ERROR = 0x6,
+	TLB_H2_REFUSED_STREAM = 0x7,
+	TLB_H2_CANCEL = 0x8,
+	TLB_H2_COMPRESSION_ERROR = 0x9,
+};
+
+/* one HTTP/2 connection endpoint: a client session or a target upstream */
+struct tlb_h2_conn {
+	struct socket *sock;
+	struct coroutine *co;
+	struct tlb_h2_pool *pool;
+	bool upstream;
+	int error;
+
+	u8 *in_buf;
+	int in_len;
+	struct tlb_sendq out;
+
+	s64 send_window;
+	s32 peer_initial_window;
+	u32 peer_max_streams;
+
+	/* decoder for the header blocks this peer sends us */
+	struct tlb_hpack hpack;
+	u8 *hdr_buf;
+	int hdr_len;
+	u32 hdr_stream;
+	u8 hdr_flags;
+
+	struct hlist_head stream_hash[1 << TLB_H2_STREAM_HASH_BITS];
+	int nr_streams;
+	struct list_head blocked_list;
+};
+
+/* per coroutine thread, shared by all sessions of the thread */
+struct tlb_h2_pool {
+	struct tlb_server *srv;
+	struct coroutine_thread *thread;
+	struct list_head upstream_list;
+	u8 *scratch;
+};
+
+struct tlb_h2_session {
+	struct tlb_h2_conn conn;
+	u32 last_stream_id;
+	int preface_len;
+};
+
+struct tlb_h2_upstream {
+	struct tlb_h2_conn conn;
+	struct tlb_target *target;
+	struct list_head pool_entry;
+	u32 next_stream_id;
+	bool draining;
+};
+
+/*
+ * One direction of a proxied stream: what we send to conn on stream id.
+ * Frames that don't fit the flow control windows wait on pending in order.
+ */
+struct tlb_h2_half {
+	struct tlb_h2_stream *stream;
+	struct tlb_h2_conn *conn;
+	u32 id;
+	s32 window;
+	struct hlist_node hash_entry;
+	struct list_head pending;
+	struct list_head blocked_entry;
+	bool end_sent;
+	bool end_recv;
+};
+
+struct tlb_h2_frame {
+	struct list_head list;
+	u8 type;
+	u8 flags;
+	u32 len;
+	u32 off;
+	const u8 *data;
+	u8 buf[];
+};
+
+struct tlb_h2_stream {
+	struct tlb_h2_half down;
+	struct tlb_h2_half up;
+	struct tlb_target *target;
+};
+
+int tlb_h2_serve(struct tlb_con *con, struct tlb_h2_pool *pool);
+
+void tlb_h2_session_free(struct tlb_h2_session *session);
+
+void tlb_h2_pool_init(struct tlb_h2_pool *pool, struct tlb_server *srv, struct coroutine_thread *thread);
+
+void tlb_h2_pool_deinit(struct tlb_h2_pool *pool);
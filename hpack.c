@@ -0,0 +1,387 @@
+#include "hpack.h"
+
+/*
+ * Header blocks can't be forwarded verbatim between HTTP/2 connections:
+ * they reference the sender's dynamic table. tlb_hpack_transcode() tracks
+ * the sender's table and rewrites a block into an equivalent one that
+ * only uses the static table and literals "without indexing", which any
+ * receiver can decode regardless of its connection state.
+ */
+
+static const char * const tlb_hpack_static_name[TLB_HPACK_STATIC_ENTRIES + 1] = {
+	NULL, ":authority", ":method", ":method", ":path", ":path", ":scheme",
+	":scheme", ":status", ":status", ":status", ":status", ":status",
+	":status", ":status", "accept-charset", "accept-encoding",
+	"accept-language", "accept-ranges", "accept",
+	"access-control-allow-origin", "age", "allow", "authorization",
+	"cache-control", "content-disposition", "content-encoding",
+	"content-language", "content-length", "content-location",
+	"content-range", "content-type", "cookie", "date", "etag", "expect",
+	"expires", "from", "host", "if-match", "if-modified-since",
+	"if-none-match", "if-range", "if-unmodified-since", "last-modified",
+	"link", "location", "max-forwards", "proxy-authenticate",
+	"proxy-authorization", "range", "referer", "refresh", "retry-after",
+	"server", "set-cookie", "strict-transport-security",
+	"transfer-encoding", "user-agent", "vary", "via", "www-authenticate",
+};
+
+/* canonical Huffman code of RFC 7541 Appendix B: codes per length */
+static const u16 tlb_hpack_huff_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+	0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+/* first code of each length */
+static const u32 tlb_hpack_huff_first[31] = {
+	0, 0, 0, 0, 0, 0, 20, 92, 248, 508, 1016, 2042, 4090, 8184, 16380,
+	32764, 65534, 131068, 262136, 524272, 1048550, 2097116, 4194258,
+	8388568, 16777194, 33554412, 67108832, 134217694, 268435426,
+	536870910, 1073741820
+};
+
+#define TLB_HPACK_HUFF_EOS 0x3fffffff
+
+struct tlb_hpack_string {
+	const u8 *data;
+	u32 len;
+	u32 decoded_len;
+	bool huffman;
+};
+
+/* decoded length of a Huffman coded string, the symbols themselves aren't needed */
+static int tlb_hpack_huffman_len(const u8 *data, u32 len)
+{
+	u32 code = 0;
+	int bits = 0, n = 0, b;
+	u32 i;
+
+	for (i = 0; i < len; i++) {
+		for (b = 7; b >= 0; b--) {
+			code = (code << 1) | ((data[i] >> b) & 1);
+			bits++;
+			if (bits > 30)
+				return -EBADMSG;
+
+			if (code - tlb_hpack_huff_first[bits] < tlb_hpack_huff_count[bits]) {
+				if (bits == 30 && code == TLB_HPACK_HUFF_EOS)
+					return -EBADMSG;
+				n++;
+				code = 0;
+				bits = 0;
+			}
+		}
+	}
+
+	/* padding is the most significant bits of EOS: up to 7 ones */
+	if (bits > 7 || code != (1U << bits) - 1)
+		return -EBADMSG;
+
+	return n;
+}
+
+static int tlb_hpack_read_int(const u8 **pp, const u8 *end, int prefix, u32 *value)
+{
+	const u8 *p = *pp;
+	u32 mask = (1U << prefix) - 1;
+	u32 v;
+	int shift = 0;
+	u8 b;
+
+	if (p >= end)
+		return -EBADMSG;
+
+	v = *p++ & mask;
+	if (v == mask) {
+		do {
+			if (p >= end || shift > 21)
+				return -EBADMSG;
+			b = *p++;
+			v += (u32)(b & 0x7f) << shift;
+			shift += 7;
+		} while (b & 0x80);
+	}
+
+	*pp = p;
+	*value = v;
+	return 0;
+}
+
+static int tlb_hpack_write_int(u8 **pp, u8 *end, int prefix, u8 bits, u32 value)
+{
+	u8 *p = *pp;
+	u32 mask = (1U << prefix) - 1;
+
+	if (p >= end)
+		return -ENOSPC;
+
+	if (value < mask) {
+		*p++ = bits | value;
+	} else {
+		*p++ = bits | mask;
+		value -= mask;
+		while (value >= 0x80) {
+			if (p >= end)
+				return -ENOSPC;
+			*p++ = (value & 0x7f) | 0x80;
+			value >>= 7;
+		}
+		if (p >= end)
+			return -ENOSPC;
+		*p++ = value;
+	}
+
+	*pp = p;
+	return 0;
+}
+
+static int tlb_hpack_read_string(const u8 **pp, const u8 *end, struct tlb_hpack_string *str)
+{
+	const u8 *p = *pp;
+	int r;
+
+	if (p >= end)
+		return -EBADMSG;
+
+	str->huffman = (*p & 0x80) ? true : false;
+	r = tlb_hpack_read_int(&p, end, 7, &str->len);
+	if (r)
+		return r;
+
+	if (str->len > end - p)
+		return -EBADMSG;
+
+	str->data = p;
+	if (str->huffman) {
+		r = tlb_hpack_huffman_len(p, str->len);
+		if (r < 0)
+			return r;
+		str->decoded_len = r;
+	} else
+		str->decoded_len = str->len;
+
+	*pp = p + str->len;
+	return 0;
+}
+
+static int tlb_hpack_write_string(u8 **pp, u8 *end, const u8 *data, u32 len, bool huffman)
+{
+	int r;
+
+	r = tlb_hpack_write_int(pp, end, 7, huffman ? 0x80 : 0, len);
+	if (r)
+		return r;
+
+	if (len > end - *pp)
+		return -ENOSPC;
+
+	memcpy(*pp, data, len);
+	*pp += len;
+	return 0;
+}
+
+static struct tlb_hpack_entry *tlb_hpack_lookup(struct tlb_hpack *hpack, u32 index)
+{
+	u32 i = index - TLB_HPACK_STATIC_ENTRIES - 1;
+
+	if (index <= TLB_HPACK_STATIC_ENTRIES || i >= (u32)hpack->count)
+		return NULL;
+
+	return hpack->entry[(hpack->first + i) % TLB_HPACK_MAX_ENTRIES];
+}
+
+static void tlb_hpack_evict(struct tlb_hpack *hpack, u32 max_size)
+{
+	struct tlb_hpack_entry *entry;
+	int last;
+
+	while (hpack->count && hpack->size > max_size) {
+		last = (hpack->first + hpack->count - 1) % TLB_HPACK_MAX_ENTRIES;
+		entry = hpack->entry[last];
+		hpack->entry[last] = NULL;
+		hpack->size -= entry->size;
+		hpack->count--;
+		kfree(entry);
+	}
+}
+
+static int tlb_hpack_insert(struct tlb_hpack *hpack, u32 name_index, struct tlb_hpack_string *name,
+			    struct tlb_hpack_string *value)
+{
+	struct tlb_hpack_entry *entry;
+	u32 size = 32 + name->decoded_len + value->decoded_len;
+
+	if (size > hpack->max_size) {
+		/* an entry larger than the table just empties it */
+		tlb_hpack_evict(hpack, 0);
+		return 0;
+	}
+
+	/* copy before evicting: the name may live in an entry about to go */
+	entry = kmalloc(sizeof(*entry) + name->len + value->len, GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+
+	entry->size = size;
+	entry->name_index = name_index;
+	entry->name_decoded_len = name->decoded_len;
+	entry->name_len = name->len;
+	entry->name_huffman = name->huffman;
+	entry->value_len = value->len;
+	entry->value_huffman = value->huffman;
+	memcpy(entry->data, name->data, name->len);
+	memcpy(entry->data + name->len, value->data, value->len);
+
+	tlb_hpack_evict(hpack, hpack->max_size - size);
+
+	hpack->first = (hpack->first + TLB_HPACK_MAX_ENTRIES - 1) % TLB_HPACK_MAX_ENTRIES;
+	hpack->entry[hpack->first] = entry;
+	hpack->count++;
+	hpack->size += size;
+	return 0;
+}
+
+/*
+ * Resolve the name of a literal representation: a static index, a dynamic
+ * index (turned into the entry's own static index or literal) or a
+ * literal following the prefix.
+ */
+static int tlb_hpack_read_name(struct tlb_hpack *hpack, const u8 **pp, const u8 *end, int prefix,
+			       u32 *name_index, struct tlb_hpack_string *name)
+{
+	struct tlb_hpack_entry *entry;
+	u32 index;
+	int r;
+
+	r = tlb_hpack_read_int(pp, end, prefix, &index);
+	if (r)
+		return r;
+
+	if (index == 0) {
+		*name_index = 0;
+		return tlb_hpack_read_string(pp, end, name);
+	}
+
+	if (index <= TLB_HPACK_STATIC_ENTRIES) {
+		*name_index = index;
+		name->data = NULL;
+		name->len = 0;
+		name->huffman = false;
+		name->decoded_len = strlen(tlb_hpack_static_name[index]);
+		return 0;
+	}
+
+	entry = tlb_hpack_lookup(hpack, index);
+	if (!entry)
+		return -EBADMSG;
+
+	*name_index = entry->name_index;
+	name->data = entry->data;
+	name->len = entry->name_len;
+	name->huffman = entry->name_huffman;
+	name->decoded_len = entry->name_decoded_len;
+	return 0;
+}
+
+/* emit a literal header field without indexing (or never indexed) */
+static int tlb_hpack_write_literal(u8 **pp, u8 *end, bool never_indexed, u32 name_index,
+				   const u8 *name, u32 name_len, bool name_huffman,
+				   const u8 *value, u32 value_len, bool value_huffman)
+{
+	int r;
+
+	r = tlb_hpack_write_int(pp, end, 4, never_indexed ? 0x10 : 0x00, name_index);
+	if (r)
+		return r;
+
+	if (!name_index) {
+		r = tlb_hpack_write_string(pp, end, name, name_len, name_huffman);
+		if (r)
+			return r;
+	}
+
+	return tlb_hpack_write_string(pp, end, value, value_len, value_huffman);
+}
+
+int tlb_hpack_transcode(struct tlb_hpack *hpack, const u8 *in, int in_len, u8 *out, int out_size)
+{
+	const u8 *p = in, *end = in + in_len;
+	u8 *o = out, *o_end = out + out_size;
+	struct tlb_hpack_string name, value;
+	struct tlb_hpack_entry *entry;
+	u32 index, name_index;
+	bool never_indexed;
+	int r;
+
+	while (p < end) {
+		if (*p & 0x80) {
+			/* indexed header field */
+			r = tlb_hpack_read_int(&p, end, 7, &index);
+			if (r)
+				return r;
+			if (index == 0)
+				return -EBADMSG;
+
+			if (index <= TLB_HPACK_STATIC_ENTRIES) {
+				r = tlb_hpack_write_int(&o, o_end, 7, 0x80, index);
+			} else {
+				entry = tlb_hpack_lookup(hpack, index);
+				if (!entry)
+					return -EBADMSG;
+				r = tlb_hpack_write_literal(&o, o_end, false, entry->name_index,
+							    entry->data, entry->name_len, entry->name_huffman,
+							    entry->data + entry->name_len, entry->value_len,
+							    entry->value_huffman);
+			}
+		} else if ((*p & 0xc0) == 0x40) {
+			/* literal with incremental indexing */
+			r = tlb_hpack_read_name(hpack, &p, end, 6, &name_index, &name);
+			if (r)
+				return r;
+			r = tlb_hpack_read_string(&p, end, &value);
+			if (r)
+				return r;
+			r = tlb_hpack_write_literal(&o, o_end, false, name_index,
+						    name.data, name.len, name.huffman,
+						    value.data, value.len, value.huffman);
+			if (r)
+				return r;
+			r = tlb_hpack_insert(hpack, name_index, &name, &value);
+		} else if ((*p & 0xe0) == 0x20) {
+			/* dynamic table size update, meaningless to the receiver */
+			r = tlb_hpack_read_int(&p, end, 5, &index);
+			if (r)
+				return r;
+			if (index > TLB_HPACK_TABLE_SIZE)
+				return -EBADMSG;
+			hpack->max_size = index;
+			tlb_hpack_evict(hpack, index);
+		} else {
+			/* literal without indexing or never indexed */
+			never_indexed = (*p & 0x10) ? true : false;
+			r = tlb_hpack_read_name(hpack, &p, end, 4, &name_index, &name);
+			if (r)
+				return r;
+			r = tlb_hpack_read_string(&p, end, &value);
+			if (r)
+				return r;
+			r = tlb_hpack_write_literal(&o, o_end, never_indexed, name_index,
+						    name.data, name.len, name.huffman,
+						    value.data, value.len, value.huffman);
+		}
+		if (r)
+			return r;
+	}
+
+	return o - out;
+}
+
+void tlb_hpack_init(struct tlb_hpack *hpack)
+{
+	memset(hpack, 0, sizeof(*hpack));
+	hpack->max_size = TLB_HPACK_TABLE_SIZE;
+}
+
+void tlb_hpack_deinit(struct tlb_hpack *hpack)
+{
+	tlb_hpack_evict(hpack, 0);
+}
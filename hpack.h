@@ -0,0 +1,37 @@
+#pragma once
+
+#include "base.h"
+
+#define TLB_HPACK_TABLE_SIZE 4096
+#define TLB_HPACK_MAX_ENTRIES (TLB_HPACK_TABLE_SIZE / 32)
+#define TLB_HPACK_STATIC_ENTRIES 61
+
+/*
+ * A dynamic table entry keeps the strings exactly as the peer encoded
+ * them (possibly Huffman coded), so they can be re-emitted as literals
+ * without ever being decoded.
+ */
+struct tlb_hpack_entry {
+	u32 size;
+	u32 name_index;
+	u16 name_decoded_len;
+	u16 name_len;
+	u16 value_len;
+	bool name_huffman;
+	bool value_huffman;
+	u8 data[];
+};
+
+struct tlb_hpack {
+	struct tlb_hpack_entry *entry[TLB_HPACK_MAX_ENTRIES];
+	int first;
+	int count;
+	u32 size;
+	u32 max_size;
+};
+
+void tlb_hpack_init(struct tlb_hpack *hpack);
+
+void tlb_hpack_deinit(struct tlb_hpack *hpack);
+
+int tlb_hpack_transcode(struct tlb_hpack *hpack, const u8 *in, int in_len, u8 *out, int out_size);
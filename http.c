@@ -0,0 +1,377 @@
+#include "http.h"
+
+bool tlb_http_str_eq(struct tlb_http_str *str, const char *s)
+{
+	return strlen(s) == str->len && !memcmp(str->s, s, str->len);
+}
+
+bool tlb_http_str_caseeq(struct tlb_http_str *str, const char *s)
+{
+	return strlen(s) == str->len && !strncasecmp(str->s, s, str->len);
+}
+
+static const char *tlb_http_find_crlf(const char *p, const char *end)
+{
+	for (; p + 1 < end; p++) {
+		p = memchr(p, '\r', end - p - 1);
+		if (!p)
+			return NULL;
+		if (p[1] == '\n')
+			return p;
+	}
+	return NULL;
+}
+
+static void tlb_http_trim(struct tlb_http_str *str)
+{
+	while (str->len && (str->s[0] == ' ' || str->s[0] == '\t')) {
+		str->s++;
+		str->len--;
+	}
+	while (str->len && (str->s[str->len - 1] == ' ' || str->s[str->len - 1] == '\t'))
+		str->len--;
+}
+
+/* splits off the next token ending at sep, false if there's no sep */
+static bool tlb_http_token(struct tlb_http_str *line, char sep, struct tlb_http_str *token)
+{
+	const char *p = memchr(line->s, sep, line->len);
+
+	if (!p)
+		return false;
+
+	token->s = line->s;
+	token->len = p - line->s;
+	line->len -= token->len + 1;
+	line->s = p + 1;
+	return true;
+}
+
+/* the empty line may follow the first line right away */
+static const char *tlb_http_head_end(const char *eol, const char *end)
+{
+	const char *p;
+
+	for (p = eol; (p = tlb_http_find_crlf(p, end)) != NULL; p += 2) {
+		if (p + 4 <= end && !memcmp(p, "\r\n\r\n", 4))
+			return p;
+	}
+	return NULL;
+}
+
+/* -EAGAIN until the whole head is in buf, -EINVAL if it isn't HTTP */
+int tlb_http_parse_req(const char *buf, u32 len, struct tlb_http_req *req)
+{
+	const char *end = buf + len, *eol, *p;
+	struct tlb_http_str line;
+
+	memset(req, 0, sizeof(*req));
+	eol = tlb_http_find_crlf(buf, end);
+	if (!eol)
+		return -EAGAIN;
+
+	line.s = buf;
+	line.len = eol - buf;
+	if (!tlb_http_token(&line, ' ', &req->method) || !req->method.len)
+		return -EINVAL;
+	if (!tlb_http_token(&line, ' ', &req->path) || !req->path.len)
+		return -EINVAL;
+	if (line.len < 5 || memcmp(line.s, "HTTP/", 5))
+		return -EINVAL;
+	req->version = line;
+
+	p = tlb_http_head_end(eol, end);
+	if (!p)
+		return -EAGAIN;
+
+	req->headers.s = eol + 2;
+	req->headers.len = p + 2 - req->headers.s;
+	req->head_len = p + 4 - buf;
+
+	if (tlb_http_header(&req->headers, "Host", &req->host)) {
+		p = memchr(req->host.s, ':', req->host.len);
+		if (p)
+			req->host.len = p - req->host.s;
+	}
+	return 0;
+}
+
+/* the first header of that name, case insensitive */
+bool tlb_http_header(struct tlb_http_str *headers, const char *name, struct tlb_http_str *value)
+{
+	struct tlb_http_str rest = *headers, line, hname;
+	const char *eol;
+
+	while (rest.len) {
+		eol = tlb_http_find_crlf(rest.s, rest.s + rest.len);
+		if (!eol)
+			break;
+		line.s = rest.s;
+		line.len = eol - rest.s;
+		rest.len -= line.len + 2;
+		rest.s = eol + 2;
+
+		if (!tlb_http_token(&line, ':', &hname))
+			continue;
+		if (tlb_http_str_caseeq(&hname, name)) {
+			*value = line;
+			tlb_http_trim(value);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool tlb_http_cookie(struct tlb_http_str *headers, const char *name, struct tlb_http_str *value)
+{
+	struct tlb_http_str cookies, pair, cname;
+
+	if (!tlb_http_header(headers, "Cookie", &cookies))
+		return false;
+
+	while (cookies.len) {
+		if (!tlb_http_token(&cookies, ';', &pair)) {
+			pair = cookies;
+			cookies.len = 0;
+		}
+		if (!tlb_http_token(&pair, '=', &cname))
+			continue;
+		tlb_http_trim(&cname);
+		if (tlb_http_str_eq(&cname, name)) {
+			*value = pair;
+			tlb_http_trim(value);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int tlb_http_parse_resp(const char *buf, u32 len, struct tlb_http_resp *resp)
+{
+	const char *end = buf + len, *eol, *p;
+	struct tlb_http_str line, code;
+	u64 status;
+
+	memset(resp, 0, sizeof(*resp));
+	eol = tlb_http_find_crlf(buf, end);
+	if (!eol)
+		return -EAGAIN;
+
+	line.s = buf;
+	line.len = eol - buf;
+	if (!tlb_http_token(&line, ' ', &resp->version))
+		return -EINVAL;
+	if (resp->version.len < 5 || memcmp(resp->version.s, "HTTP/", 5))
+		return -EINVAL;
+	/* the reason phrase may be missing */
+	if (!tlb_http_token(&line, ' ', &code))
+		code = line;
+	if (code.len != 3 || !tlb_http_parse_u64(&code, &status))
+		return -EINVAL;
+	resp->status = status;
+
+	p = tlb_http_head_end(eol, end);
+	if (!p)
+		return -EAGAIN;
+
+	resp->headers.s = eol + 2;
+	resp->headers.len = p + 2 - resp->headers.s;
+	resp->head_len = p + 4 - buf;
+	return 0;
+}
+
+/* decimal digits only, no sign or spaces */
+bool tlb_http_parse_u64(struct tlb_http_str *str, u64 *val)
+{
+	u64 v = 0;
+	u32 i;
+
+	if (!str->len || str->len > 19)
+		return false;
+
+	for (i = 0; i < str->len; i++) {
+		if (str->s[i] < '0' || str->s[i] > '9')
+			return false;
+		v = v * 10 + (str->s[i] - '0');
+	}
+
+	*val = v;
+	return true;
+}
+
+/* a comma separated header value, like Connection, holds token */
+bool tlb_http_token_list(struct tlb_http_str *value, const char *token)
+{
+	struct tlb_http_str rest = *value, item;
+
+	while (rest.len) {
+		if (!tlb_http_token(&rest, ',', &item)) {
+			item = rest;
+			rest.len = 0;
+		}
+		tlb_http_trim(&item);
+		if (tlb_http_str_caseeq(&item, token))
+			return true;
+	}
+
+	return false;
+}
+
+/* a request without a length has no body, a response runs until close */
+int tlb_http_body_init(struct tlb_http_body *body, struct tlb_http_str *headers, bool resp)
+{
+	struct tlb_http_str value;
+
+	memset(body, 0, sizeof(*body));
+	if (tlb_http_header(headers, "Transfer-Encoding", &value)) {
+		if (!tlb_http_str_caseeq(&value, "chunked"))
+			return -EOPNOTSUPP;
+		body->framing = TLB_HTTP_BODY_CHUNKED;
+		return 0;
+	}
+
+	if (tlb_http_header(headers, "Content-Length", &value)) {
+		if (!tlb_http_parse_u64(&value, &body->left))
+			return -EINVAL;
+		body->framing = TLB_HTTP_BODY_LENGTH;
+		body->done = !body->left;
+		return 0;
+	}
+
+	body->framing = resp ? TLB_HTTP_BODY_CLOSE : TLB_HTTP_BODY_NONE;
+	body->done = !resp;
+	return 0;
+}
+
+enum {
+	TLB_HTTP_CHUNK_SIZE_START = 0,
+	TLB_HTTP_CHUNK_SIZE,
+	TLB_HTTP_CHUNK_EXT,
+	TLB_HTTP_CHUNK_DATA,
+	TLB_HTTP_CHUNK_DATA_END,
+	TLB_HTTP_CHUNK_TRAILER_START,
+	TLB_HTTP_CHUNK_TRAILER,
+};
+
+/*
+ * Consumes what belongs to the body out of the next len bytes, and sets
+ * done once it's complete. Chunks are only framed, never decoded.
+ */
+int tlb_http_body_scan(struct tlb_http_body *body, const char *buf, u32 len)
+{
+	u32 off = 0, n;
+	int digit;
+	char c;
+
+	switch (body->framing) {
+	case TLB_HTTP_BODY_NONE:
+		return 0;
+	case TLB_HTTP_BODY_CLOSE:
+		return len;
+	case TLB_HTTP_BODY_LENGTH:
+		n = min_t(u64, body->left, len);
+		body->left -= n;
+		body->done = !body->left;
+		return n;
+	default:
+		break;
+	}
+
+	while (off < len && !body->done) {
+		if (body->state == TLB_HTTP_CHUNK_DATA) {
+			n = min_t(u64, body->left, len - off);
+			body->left -= n;
+			off += n;
+			if (!body->left)
+				body->state = TLB_HTTP_CHUNK_DATA_END;
+			continue;
+		}
+
+		c = buf[off++];
+		switch (body->state) {
+		case TLB_HTTP_CHUNK_SIZE_START:
+		case TLB_HTTP_CHUNK_SIZE:
+			digit = hex_to_bin(c);
+			if (digit >= 0) {
+				if (body->left >> 59)
+					return -EINVAL;
+				body->left = (body->left << 4) | digit;
+				body->state = TLB_HTTP_CHUNK_SIZE;
+				break;
+			}
+			if (body->state == TLB_HTTP_CHUNK_SIZE_START)
+				return -EINVAL;
+			if (c == '\n')
+				goto size_done;
+			if (c != ';' && c != ' ' && c != '\t' && c != '\r')
+				return -EINVAL;
+			body->state = TLB_HTTP_CHUNK_EXT;
+			break;
+		case TLB_HTTP_CHUNK_EXT:
+			if (c == '\n')
+				goto size_done;
+			break;
+		case TLB_HTTP_CHUNK_DATA_END:
+			if (c == '\n')
+				body->state = TLB_HTTP_CHUNK_SIZE_START;
+			else if (c != '\r')
+				return -EINVAL;
+			break;
+		case TLB_HTTP_CHUNK_TRAILER_START:
+			if (c == '\n')
+				body->done = true;
+			else if (c != '\r')
+				body->state = TLB_HTTP_CHUNK_TRAILER;
+			break;
+		case TLB_HTTP_CHUNK_TRAILER:
+			if (c == '\n')
+				body->state = TLB_HTTP_CHUNK_TRAILER_START;
+			break;
+		}
+		continue;
+
+size_done:
+		body->state = body->left ? TLB_HTTP_CHUNK_DATA : TLB_HTTP_CHUNK_TRAILER_START;
+	}
+
+	return off;
+}
+
+/* seconds a shared cache may keep the response for, zero if it may not */
+u32 tlb_http_max_age(struct tlb_http_str *headers)
+{
+	struct tlb_http_str value, dir, name;
+	u64 max_age = 0, s_maxage = 0, v;
+	bool shared = false;
+
+	if (!tlb_http_header(headers, "Cache-Control", &value))
+		return 0;
+
+	while (value.len) {
+		if (!tlb_http_token(&value, ',', &dir)) {
+			dir = value;
+			value.len = 0;
+		}
+		if (!tlb_http_token(&dir, '=', &name)) {
+			name = dir;
+			dir.len = 0;
+		}
+		tlb_http_trim(&name);
+		tlb_http_trim(&dir);
+		if (tlb_http_str_caseeq(&name, "no-store") || tlb_http_str_caseeq(&name, "no-cache") ||
+		    tlb_http_str_caseeq(&name, "private"))
+			return 0;
+		if (!tlb_http_parse_u64(&dir, &v))
+			continue;
+		if (tlb_http_str_caseeq(&name, "max-age")) {
+			max_age = v;
+		} else if (tlb_http_str_caseeq(&name, "s-maxage")) {
+			s_maxage = v;
+			shared = true;
+		}
+	}
+
+	return min_t(u64, shared ? s_maxage : max_age, U32_MAX);
+}
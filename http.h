@@ -0,0 +1,69 @@
+#pragma once
+
+#include "base.h"
+
+/* a slice of the buffer the message was parsed from */
+struct tlb_http_str {
+	const char *s;
+	u32 len;
+};
+
+/* request head parsed in place, nothing is copied */
+struct tlb_http_req {
+	struct tlb_http_str method;
+	struct tlb_http_str path;
+	struct tlb_http_str version;
+	/* without the port */
+	struct tlb_http_str host;
+	/* header lines, each ending with CRLF */
+	struct tlb_http_str headers;
+	/* up to and including the empty line */
+	u32 head_len;
+};
+
+bool tlb_http_str_eq(struct tlb_http_str *str, const char *s);
+
+bool tlb_http_str_caseeq(struct tlb_http_str *str, const char *s);
+
+int tlb_http_parse_req(const char *buf, u32 len, struct tlb_http_req *req);
+
+bool tlb_http_header(struct tlb_http_str *headers, const char *name, struct tlb_http_str *value);
+
+bool tlb_http_cookie(struct tlb_http_str *headers, const char *name, struct tlb_http_str *value);
+
+struct tlb_http_resp {
+	struct tlb_http_str version;
+	u32 status;
+	struct tlb_http_str headers;
+	u32 head_len;
+};
+
+/* how the end of a message body is found */
+enum {
+	TLB_HTTP_BODY_NONE = 0,
+	TLB_HTTP_BODY_LENGTH,
+	TLB_HTTP_BODY_CHUNKED,
+	/* responses only, the body ends with the connection */
+	TLB_HTTP_BODY_CLOSE,
+};
+
+struct tlb_http_body {
+	int framing;
+	/* chunk scanner state */
+	int state;
+	/* bytes of the body or of the current chunk */
+	u64 left;
+	bool done;
+};
+
+int tlb_http_parse_resp(const char *buf, u32 len, struct tlb_http_resp *resp);
+
+bool tlb_http_parse_u64(struct tlb_http_str *str, u64 *val);
+
+bool tlb_http_token_list(struct tlb_http_str *value, const char *token);
+
+int tlb_http_body_init(struct tlb_http_body *body, struct tlb_http_str *headers, bool resp);
+
+int tlb_http_body_scan(struct tlb_http_body *body, const char *buf, u32 len);
+
+u32 tlb_http_max_age(struct tlb_http_str *headers);
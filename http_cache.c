@@ -0,0 +1,546 @@
+#include "http_cache.h"
+#include "server.h"
+
+void tlb_http_cache_init(struct tlb_http_cache *cache)
+{
+	cache->buckets = NULL;
+	INIT_LIST_HEAD(&cache->lru_list);
+	cache->bytes = 0;
+}
+
+static void tlb_http_cache_delete(struct tlb_http_cache *cache, struct tlb_http_cache_entry *entry)
+{
+	hlist_del(&entry->hash_entry);
+	list_del(&entry->lru_entry);
+	cache->bytes -= entry->key_len + entry->data_len;
+	kfree(entry);
+}
+
+void tlb_http_cache_deinit(struct tlb_http_cache *cache)
+{
+	struct tlb_http_cache_entry *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, &cache->lru_list, lru_entry)
+		tlb_http_cache_delete(cache, entry);
+	kfree(cache->buckets);
+	cache->buckets = NULL;
+}
+
+static u32 tlb_http_cache_hash(struct tlb_http_str *host, struct tlb_http_str *path)
+{
+	return jhash(path->s, path->len, jhash(host->s, host->len, 0));
+}
+
+static bool tlb_http_cache_match(struct tlb_http_cache_entry *entry, u32 hash, struct tlb_http_str *host,
+				 struct tlb_http_str *path)
+{
+	return entry->hash == hash && entry->key_len == host->len + 1 + path->len &&
+	       !memcmp(entry->buf, host->s, host->len) && entry->buf[host->len] == ' ' &&
+	       !memcmp(entry->buf + host->len + 1, path->s, path->len);
+}
+
+static struct tlb_http_cache_entry *__tlb_http_cache_lookup(struct tlb_http_cache *cache, u32 hash,
+							    struct tlb_http_str *host, struct tlb_http_str *path)
+{
+	struct tlb_http_cache_entry *entry;
+	struct hlist_head *head = &cache->buckets[hash_32(hash, TLB_HTTP_CACHE_BUCKETS_SHIFT)];
+
+	hlist_for_each_entry(entry, head, hash_entry) {
+		if (tlb_http_cache_match(entry, hash, host, path))
+			return entry;
+	}
+	return NULL;
+}
+
+/* valid until the coroutine yields, an expired entry is dropped */
+struct tlb_http_cache_entry *tlb_http_cache_lookup(struct tlb_http_cache *cache, struct tlb_http_str *host,
+						   struct tlb_http_str *path)
+{
+	struct tlb_http_cache_entry *entry = NULL;
+
+	if (cache->buckets)
+		entry = __tlb_http_cache_lookup(cache, tlb_http_cache_hash(host, path), host, path);
+	if (entry && time_after_eq(jiffies, entry->expires)) {
+		tlb_http_cache_delete(cache, entry);
+		entry = NULL;
+	}
+
+	if (entry)
+		list_move(&entry->lru_entry, &cache->lru_list);
+	return entry;
+}
+
+/* how many entries made room for it, negative if it wasn't stored */
+int tlb_http_cache_store(struct tlb_http_cache *cache, u64 max_bytes, struct tlb_http_str *host,
+			 struct tlb_http_str *path, const char *data, u32 data_len, u32 ttl)
+{
+	struct tlb_http_cache_entry *entry;
+	u32 hash = tlb_http_cache_hash(host, path);
+	u32 key_len = host->len + 1 + path->len;
+	int evicted = 0;
+
+	if (key_len + data_len > max_bytes)
+		return -E2BIG;
+
+	if (!cache->buckets) {
+		cache->buckets = kcalloc(1 << TLB_HTTP_CACHE_BUCKETS_SHIFT, sizeof(*cache->buckets), GFP_KERNEL);
+		if (!cache->buckets)
+			return -ENOMEM;
+	}
+
+	entry = __tlb_http_cache_lookup(cache, hash, host, path);
+	if (entry)
+		tlb_http_cache_delete(cache, entry);
+
+	/* the limit may have been lowered since the last store */
+	while (cache->bytes + key_len + data_len > max_bytes) {
+		tlb_http_cache_delete(cache, list_last_entry(&cache->lru_list, struct tlb_http_cache_entry,
+							     lru_entry));
+		evicted++;
+	}
+
+	entry = kmalloc(sizeof(*entry) + key_len + data_len, GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+
+	entry->hash = hash;
+	entry->key_len = key_len;
+	entry->data_len = data_len;
+	entry->expires = jiffies + min_t(u32, ttl, TLB_HTTP_CACHE_MAX_TTL) * HZ;
+	memcpy(entry->buf, host->s, host->len);
+	entry->buf[host->len] = ' ';
+	memcpy(entry->buf + host->len + 1, path->s, path->len);
+	memcpy(entry->buf + key_len, data, data_len);
+
+	hlist_add_head(&entry->hash_entry, &cache->buckets[hash_32(hash, TLB_HTTP_CACHE_BUCKETS_SHIFT)]);
+	list_add(&entry->lru_entry, &cache->lru_list);
+	cache->bytes += key_len + data_len;
+	return evicted;
+}
+
+/* one client connection of the HTTP mode and its current upstream */
+struct tlb_http_session {
+	struct tlb_con *con;
+	struct coroutine *co;
+	struct tlb_http_cache *cache;
+	u32 in_len;
+	char *out;
+	u32 out_len;
+
+	struct tlb_target *target;
+	struct socket *up;
+	char group[TLB_GROUP_NAME_SIZE];
+	/* served a request already, it may have timed out meanwhile */
+	bool up_reused;
+};
+
+static int tlb_http_recv(struct tlb_http_session *sess, struct socket *sock, char *buf, u32 size)
+{
+	int r;
+
+	for (;;) {
+		r = ksock_recv(sock, buf, size);
+		if (r != -EAGAIN)
+			break;
+		r = tlb_timeout_check(&sess->con->timeout);
+		if (r)
+			return r;
+		coroutine_yield(sess->co);
+	}
+
+	if (r > 0)
+		tlb_timeout_account(&sess->con->timeout, r);
+	return r;
+}
+
+static int tlb_http_send(struct tlb_http_session *sess, struct socket *sock, const char *buf, u32 len)
+{
+	u32 sent = 0;
+	int r;
+
+	while (sent < len) {
+		r = ksock_send(sock, (void *)buf + sent, len - sent);
+		if (r == -EAGAIN) {
+			r = tlb_timeout_check(&sess->con->timeout);
+			if (r)
+				return r;
+			coroutine_yield(sess->co);
+			continue;
+		}
+		if (r < 0)
+			return r;
+		sent += r;
+	}
+
+	return 0;
+}
+
+/* answers and ends the connection */
+static int tlb_http_error(struct tlb_http_session *sess, const char *status, int err)
+{
+	char resp[128];
+	int len;
+
+	len = scnprintf(resp, sizeof(resp), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+	tlb_http_send(sess, sess->con->sock, resp, len);
+	return err;
+}
+
+static bool tlb_http_keep_alive(struct tlb_http_str *version, struct tlb_http_str *headers)
+{
+	struct tlb_http_str value;
+	bool http10 = tlb_http_str_eq(version, "HTTP/1.0");
+
+	if (!tlb_http_header(headers, "Connection", &value))
+		return !http10;
+	if (tlb_http_token_list(&value, "close"))
+		return false;
+	return !http10 || tlb_http_token_list(&value, "keep-alive");
+}
+
+/* a GET without a body or credentials that doesn't ask to bypass caches */
+static bool tlb_http_req_cacheable(struct tlb_http_req *req, struct tlb_http_body *body)
+{
+	struct tlb_http_str value;
+
+	if (!tlb_http_str_eq(&req->method, "GET") || !body->done || !req->host.len)
+		return false;
+	if (tlb_http_header(&req->headers, "Authorization", &value))
+		return false;
+	if (tlb_http_header(&req->headers, "Cache-Control", &value) &&
+	    (tlb_http_token_list(&value, "no-cache") || tlb_http_token_list(&value, "no-store")))
+		return false;
+	if (tlb_http_header(&req->headers, "Pragma", &value) && tlb_http_token_list(&value, "no-cache"))
+		return false;
+	return true;
+}
+
+static void tlb_http_up_close(struct tlb_http_session *sess)
+{
+	if (!sess->up)
+		return;
+
+	ksock_release(sess->up);
+	sess->up = NULL;
+	atomic64_dec(&sess->target->active_cons);
+}
+
+static void tlb_http_put_target(struct tlb_http_session *sess)
+{
+	tlb_http_up_close(sess);
+	if (sess->target) {
+		tlb_target_put(sess->target);
+		sess->target = NULL;
+	}
+}
+
+/* the upstream is kept while requests stay in the same group */
+static int tlb_http_up_connect(struct tlb_http_session *sess, const char *group)
+{
+	struct tlb_con *con = sess->con;
+	struct tlb_server *srv = con->srv;
+	struct ksock_callbacks callbacks;
+	struct ksock_opts opts;
+	int r;
+
+	if (sess->up && !strcmp(sess->group, group) && !READ_ONCE(sess->target->removed))
+		return 0;
+
+	tlb_http_put_target(sess);
+	if (group[0])
+		sess->target = tlb_server_select_group_target(srv, sess->co->thread, &con->peer_addr, group);
+	else
+		sess->target = tlb_server_select_target(srv, sess->co->thread, &con->peer_addr);
+	if (!sess->target)
+		return -ENOENT;
+
+	r = tlb_target_fault_connect(sess->target, sess->co);
+	if (r)
+		return r;
+
+	/* both sockets wake the client coroutine */
+	callbacks.user_data = con;
+	callbacks.data_ready = tlb_con_data_ready;
+	callbacks.write_space = tlb_con_write_space;
+	callbacks.state_change = tlb_con_state_change;
+	tlb_server_get_opts(srv, &srv->target_opts, &opts);
+	r = ksock_connect_addr(&sess->up, &sess->target->addr, NULL, 0, &opts, &callbacks);
+	if (r) {
+		sess->up = NULL;
+		return r;
+	}
+
+	atomic64_inc(&sess->target->total_cons);
+	atomic64_inc(&sess->target->active_cons);
+	strscpy(sess->group, group, sizeof(sess->group));
+	sess->up_reused = false;
+	return 0;
+}
+
+/* request head and body as they arrive, what follows them stays in the buffer */
+static int tlb_http_forward_req(struct tlb_http_session *sess, struct tlb_http_req *req,
+				struct tlb_http_body *body, u32 *req_len)
+{
+	struct tlb_con *con = sess->con;
+	u32 off = req->head_len;
+	int r, n;
+
+	r = tlb_http_send(sess, sess->up, con->buf, off);
+	if (r)
+		return r;
+
+	/* the head stays in place, the cache key points into it */
+	for (;;) {
+		n = tlb_http_body_scan(body, con->buf + off, sess->in_len - off);
+		if (n < 0)
+			return n;
+		r = tlb_http_send(sess, sess->up, con->buf + off, n);
+		if (r)
+			return r;
+		off += n;
+		if (body->done)
+			break;
+
+		if (req->head_len == con->buf_len)
+			return -E2BIG;
+		sess->in_len = off = req->head_len;
+		r = tlb_http_recv(sess, con->sock, con->buf + off, con->buf_len - off);
+		if (r <= 0)
+			return r ? r : -ECONNRESET;
+		sess->in_len += r;
+	}
+
+	*req_len = off;
+	return 0;
+}
+
+/* the whole response is read into the buffer, stored and sent */
+static int tlb_http_cache_resp(struct tlb_http_session *sess, struct tlb_http_req *req, u32 len, u32 ttl)
+{
+	struct tlb_server *srv = sess->con->srv;
+	int r;
+
+	while (sess->out_len < len) {
+		r = tlb_http_recv(sess, sess->up, sess->out + sess->out_len, len - sess->out_len);
+		if (r <= 0)
+			return r ? r : -ECONNRESET;
+		sess->out_len += r;
+	}
+
+	r = tlb_http_cache_store(sess->cache, READ_ONCE(srv->http_cache_size) / srv->nr_con_thread,
+				 &req->host, &req->path, sess->out, len, ttl);
+	if (r >= 0) {
+		atomic64_inc(&srv->http_cache_stores);
+		atomic64_add(r, &srv->http_cache_evictions);
+	}
+
+	return tlb_http_send(sess, sess->con->sock, sess->out, len);
+}
+
+/*
+ * Relays the response to req, caching it when both sides allow. Returns
+ * -EPIPE if the upstream went away before a single byte of it.
+ */
+static int tlb_http_forward_resp(struct tlb_http_session *sess, struct tlb_http_req *req, bool cacheable,
+				 bool *keep_alive)
+{
+	struct tlb_con *con = sess->con;
+	struct tlb_http_resp resp;
+	struct tlb_http_body body;
+	struct tlb_http_str value;
+	u32 ttl = 0;
+	int r, n;
+
+	sess->out_len = 0;
+	for (;;) {
+		r = tlb_http_parse_resp(sess->out, sess->out_len, &resp);
+		if (r == -EAGAIN) {
+			if (sess->out_len == TLB_HTTP_BUF_SIZE)
+				return -E2BIG;
+			r = tlb_http_recv(sess, sess->up, sess->out + sess->out_len, TLB_HTTP_BUF_SIZE - sess->out_len);
+			if (r <= 0) {
+				if (!sess->out_len)
+					return -EPIPE;
+				return r ? r : -ECONNRESET;
+			}
+			sess->out_len += r;
+			continue;
+		}
+		if (r)
+			return r;
+		if (resp.status >= 200)
+			break;
+
+		/* interim responses go through as they are */
+		r = tlb_http_send(sess, con->sock, sess->out, resp.head_len);
+		if (r)
+			return r;
+		sess->out_len -= resp.head_len;
+		memmove(sess->out, sess->out + resp.head_len, sess->out_len);
+	}
+
+	if (tlb_http_str_eq(&req->method, "HEAD") || resp.status == 204 || resp.status == 304) {
+		memset(&body, 0, sizeof(body));
+		body.done = true;
+	} else {
+		r = tlb_http_body_init(&body, &resp.headers, true);
+		if (r)
+			return r;
+	}
+	*keep_alive = tlb_http_keep_alive(&resp.version, &resp.headers) && body.framing != TLB_HTTP_BODY_CLOSE;
+
+	if (cacheable && *keep_alive && resp.status == 200 && body.framing == TLB_HTTP_BODY_LENGTH &&
+	    body.left <= TLB_HTTP_BUF_SIZE - resp.head_len && !tlb_http_header(&resp.headers, "Set-Cookie", &value) &&
+	    !tlb_http_header(&resp.headers, "Vary", &value))
+		ttl = tlb_http_max_age(&resp.headers);
+	if (ttl)
+		return tlb_http_cache_resp(sess, req, resp.head_len + body.left, ttl);
+
+	n = tlb_http_body_scan(&body, sess->out + resp.head_len, sess->out_len - resp.head_len);
+	if (n < 0)
+		return n;
+	r = tlb_http_send(sess, con->sock, sess->out, resp.head_len + n);
+	if (r)
+		return r;
+
+	while (!body.done) {
+		r = tlb_http_recv(sess, sess->up, sess->out, TLB_HTTP_BUF_SIZE);
+		if (r == 0 && body.framing == TLB_HTTP_BODY_CLOSE)
+			break;
+		if (r <= 0)
+			return r ? r : -ECONNRESET;
+
+		n = tlb_http_body_scan(&body, sess->out, r);
+		if (n < 0)
+			return n;
+		r = tlb_http_send(sess, con->sock, sess->out, n);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+static int tlb_http_request(struct tlb_http_session *sess, bool *keep_alive)
+{
+	struct tlb_con *con = sess->con;
+	struct tlb_server *srv = con->srv;
+	struct tlb_http_cache_entry *entry;
+	struct tlb_http_req req;
+	struct tlb_http_body body;
+	struct tlb_http_str value;
+	char group[TLB_GROUP_NAME_SIZE] = "";
+	bool cacheable, up_keep_alive, retried = false;
+	u32 req_len;
+	int r;
+
+	*keep_alive = false;
+	for (;;) {
+		r = tlb_http_parse_req(con->buf, sess->in_len, &req);
+		if (r != -EAGAIN)
+			break;
+		if (sess->in_len == con->buf_len)
+			return tlb_http_error(sess, "431 Request Header Fields Too Large", -E2BIG);
+		/* a client closing between requests is done */
+		r = tlb_http_recv(sess, con->sock, con->buf + sess->in_len, con->buf_len - sess->in_len);
+		if (r <= 0)
+			return r;
+		sess->in_len += r;
+	}
+	if (r)
+		return tlb_http_error(sess, "400 Bad Request", r);
+
+	r = tlb_http_body_init(&body, &req.headers, false);
+	if (r == -EOPNOTSUPP || tlb_http_header(&req.headers, "Upgrade", &value))
+		return tlb_http_error(sess, "501 Not Implemented", -EOPNOTSUPP);
+	if (r)
+		return tlb_http_error(sess, "400 Bad Request", r);
+	*keep_alive = tlb_http_keep_alive(&req.version, &req.headers);
+
+	cacheable = READ_ONCE(srv->http_cache_size) && tlb_http_req_cacheable(&req, &body);
+	if (cacheable) {
+		entry = tlb_http_cache_lookup(sess->cache, &req.host, &req.path);
+		if (entry) {
+			atomic64_inc(&srv->http_cache_hits);
+			/* the entry may go while the client is slow */
+			memcpy(sess->out, entry->buf + entry->key_len, entry->data_len);
+			req_len = req.head_len;
+			r = tlb_http_send(sess, con->sock, sess->out, entry->data_len);
+			goto consume;
+		}
+		atomic64_inc(&srv->http_cache_misses);
+	}
+
+	if (tlb_routes_enabled(&srv->routes))
+		tlb_routes_match(&srv->routes, &req, group);
+
+retry:
+	r = tlb_http_up_connect(sess, group);
+	if (r)
+		return tlb_http_error(sess, "503 Service Unavailable", r);
+
+	r = tlb_http_forward_req(sess, &req, &body, &req_len);
+	if (!r)
+		r = tlb_http_forward_resp(sess, &req, cacheable, &up_keep_alive);
+	if (r) {
+		tlb_http_up_close(sess);
+		/* an idle upstream closed under a request that can be sent again */
+		if (r == -EPIPE && sess->up_reused && !retried && body.framing == TLB_HTTP_BODY_NONE) {
+			retried = true;
+			goto retry;
+		}
+		if (r == -EPIPE || r == -E2BIG || r == -EINVAL || r == -EOPNOTSUPP)
+			return tlb_http_error(sess, "502 Bad Gateway", r);
+		return r;
+	}
+
+	if (up_keep_alive)
+		sess->up_reused = true;
+	else
+		tlb_http_up_close(sess);
+	*keep_alive = *keep_alive && up_keep_alive;
+
+consume:
+	sess->in_len -= req_len;
+	memmove(con->buf, con->buf + req_len, sess->in_len);
+	return r;
+}
+
+/*
+ * HTTP/1.1 in front of the targets: one upstream connection per client,
+ * cacheable GETs are answered from this thread's cache when they can be.
+ */
+int tlb_http_serve(struct tlb_con *con, struct tlb_http_cache *cache)
+{
+	struct tlb_server *srv = con->srv;
+	struct tlb_http_session sess = {};
+	bool keep_alive;
+	int r;
+
+	con->buf_len = TLB_CON_BUF_SIZE;
+	con->buf = tlb_arena_alloc(&g_con_buf_arena, numa_node_id());
+	if (!con->buf)
+		return -ENOMEM;
+
+	sess.out = kmalloc(TLB_HTTP_BUF_SIZE, GFP_KERNEL);
+	if (!sess.out) {
+		r = -ENOMEM;
+		goto free_buf;
+	}
+	sess.con = con;
+	sess.co = con->co;
+	sess.cache = cache;
+
+	tlb_timeout_init(&con->timeout, srv, con->co, READ_ONCE(srv->client_idle_ms), 0, 0);
+	do {
+		r = tlb_http_request(&sess, &keep_alive);
+	} while (!r && keep_alive);
+	tlb_timeout_cancel(&con->timeout);
+
+	tlb_http_put_target(&sess);
+	kfree(sess.out);
+free_buf:
+	tlb_arena_free(&g_con_buf_arena, con->buf);
+	con->buf = NULL;
+	return r;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "base.h"
+#include "http.h"
+
+struct tlb_con;
+
+#define TLB_HTTP_CACHE_BUCKETS_SHIFT 10
+/* the whole response must fit the buffer it's read into */
+#define TLB_HTTP_BUF_SIZE (16 * 1024)
+#define TLB_HTTP_CACHE_MAX_TTL (24 * 3600)
+
+struct tlb_http_cache_entry {
+	struct hlist_node hash_entry;
+	struct list_head lru_entry;
+	u32 hash;
+	u32 key_len;
+	u32 data_len;
+	unsigned long expires;
+	/* the key, then the response as the target sent it */
+	char buf[];
+};
+
+/*
+ * Per coroutine thread, so neither lookups nor stores take a lock. Keys are
+ * "host path", the least recently used entries go when bytes reach the limit.
+ */
+struct tlb_http_cache {
+	struct hlist_head *buckets;
+	struct list_head lru_list;
+	u64 bytes;
+};
+
+void tlb_http_cache_init(struct tlb_http_cache *cache);
+
+void tlb_http_cache_deinit(struct tlb_http_cache *cache);
+
+struct tlb_http_cache_entry *tlb_http_cache_lookup(struct tlb_http_cache *cache, struct tlb_http_str *host,
+						   struct tlb_http_str *path);
+
+int tlb_http_cache_store(struct tlb_http_cache *cache, u64 max_bytes, struct tlb_http_str *host,
+			  struct tlb_http_str *path, const char *data, u32 data_len, u32 ttl);
+
+int tlb_http_serve(struct tlb_con *con, struct tlb_http_cache *cache);
@@ -13,18 +13,10 @@
 
 int ksock_set_nodelay(struct socket *sock, bool no_delay)
 {
-	int option;
-	int error;
-	mm_segment_t oldmm = get_fs();
-
-	option = (no_delay) ? 1 : 0;
+	int option = (no_delay) ? 1 : 0;
 
-	set_fs(KERNEL_DS);
-	error = sock_setsockopt(sock, SOL_TCP, TCP_NODELAY,
-		(char *)&option, sizeof(option));
-	set_fs(oldmm);
-
-	return error;
+	/* sock_setsockopt() only knows SOL_SOCKET */
+	return kernel_setsockopt(sock, SOL_TCP, TCP_NODELAY, (char *)&option, sizeof(option));
 }
 
 int ksock_set_reuse_addr(struct socket *sock, bool reuse)
@@ -44,6 +36,11 @@ int ksock_set_reuse_addr(struct socket *sock, bool reuse)
 	return r;
 }
 
+static int ksock_setsockopt_int(struct socket *sock, int level, int optname, int value)
+{
+	return kernel_setsockopt(sock, level, optname, (char *)&value, sizeof(value));
+}
+
 int ksock_set_sendbufsize(struct socket *sock, int size)
 {
 	int option = size;
@@ -72,12 +69,93 @@ int ksock_set_rcvbufsize(struct socket *sock, int size)
 	return error;
 }
 
+int ksock_set_opts(struct socket *sock, struct ksock_opts *opts)
+{
+	int r;
+
+	if (sock->sk->sk_family != AF_INET && sock->sk->sk_family != AF_INET6)
+		return 0;
+
+	if (opts->sndbuf) {
+		r = ksock_setsockopt_int(sock, SOL_SOCKET, SO_SNDBUF, opts->sndbuf);
+		if (r)
+			return r;
+	}
+	if (opts->rcvbuf) {
+		r = ksock_setsockopt_int(sock, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf);
+		if (r)
+			return r;
+	}
+	if (opts->nodelay) {
+		r = ksock_set_nodelay(sock, true);
+		if (r)
+			return r;
+	}
+	if (opts->notsent_lowat) {
+		r = ksock_setsockopt_int(sock, SOL_TCP, TCP_NOTSENT_LOWAT, opts->notsent_lowat);
+		if (r)
+			return r;
+	}
+	if (opts->keepalive_idle) {
+		r = ksock_setsockopt_int(sock, SOL_SOCKET, SO_KEEPALIVE, 1);
+		if (!r)
+			r = ksock_setsockopt_int(sock, SOL_TCP, TCP_KEEPIDLE, opts->keepalive_idle);
+		if (!r && opts->keepalive_intvl)
+			r = ksock_setsockopt_int(sock, SOL_TCP, TCP_KEEPINTVL, opts->keepalive_intvl);
+		if (!r && opts->keepalive_cnt)
+			r = ksock_setsockopt_int(sock, SOL_TCP, TCP_KEEPCNT, opts->keepalive_cnt);
+		if (r)
+			return r;
+	}
+	if (opts->user_timeout_ms) {
+		r = ksock_setsockopt_int(sock, SOL_TCP, TCP_USER_TIMEOUT, opts->user_timeout_ms);
+		if (r)
+			return r;
+	}
+	if (opts->quickack) {
+		r = ksock_setsockopt_int(sock, SOL_TCP, TCP_QUICKACK, 1);
+		if (r)
+			return r;
+	}
+	if (opts->congestion[0]) {
+		r = kernel_setsockopt(sock, SOL_TCP, TCP_CONGESTION, opts->congestion, strlen(opts->congestion));
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+/* try a profile on a scratch socket, e.g. for an unknown congestion control */
+int ksock_check_opts(struct ksock_opts *opts)
+{
+	struct socket *sock;
+	int r;
+
+	r = sock_create(AF_INET, SOCK_STREAM, 0, &sock);
+	if (r)
+		return r;
+
+	r = ksock_set_opts(sock, opts);
+	sock_release(sock);
+	return r;
+}
+
 void ksock_release(struct socket *sock)
 {
 	kernel_sock_shutdown(sock, SHUT_RDWR);
 	sock_release(sock);
 }
 
+/* close with an RST right away instead of a FIN */
+void ksock_reset(struct socket *sock)
+{
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+	kernel_setsockopt(sock, SOL_SOCKET, SO_LINGER, (char *)&linger, sizeof(linger));
+	sock_release(sock);
+}
+
 int ksock_send(struct socket *sock, void *buf, int len)
 {
 	struct kvec iov = {buf, len};
@@ -90,6 +168,16 @@ int ksock_send(struct socket *sock, void *buf, int len)
 	return sock_sendmsg(sock, &msg);
 }
 
+int ksock_send_kvec(struct socket *sock, struct kvec *vec, int nr, int len)
+{
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+
+	return kernel_sendmsg(sock, &msg, vec, nr, len);
+}
+
 int ksock_recv(struct socket *sock, void *buf, int len)
 {
 	struct kvec iov = {buf, len};
@@ -102,6 +190,62 @@ int ksock_recv(struct socket *sock, void *buf, int len)
 	return sock_recvmsg(sock, &msg, msg.msg_flags);
 }
 
+int ksock_sendto(struct socket *sock, void *buf, int len, struct sockaddr_storage *addr)
+{
+	struct kvec iov = {buf, len};
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	if (addr) {
+		msg.msg_name = addr;
+		msg.msg_namelen = ksock_addr_len(addr);
+	}
+	msg.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+	iov_iter_kvec(&msg.msg_iter, WRITE | ITER_KVEC, &iov, 1, len);
+
+	return sock_sendmsg(sock, &msg);
+}
+
+int ksock_recvfrom(struct socket *sock, void *buf, int len, struct sockaddr_storage *addr)
+{
+	struct kvec iov = {buf, len};
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(addr, 0, sizeof(*addr));
+	msg.msg_name = addr;
+	msg.msg_namelen = sizeof(*addr);
+	msg.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+	iov_iter_kvec(&msg.msg_iter, READ | ITER_KVEC, &iov, 1, len);
+
+	return sock_recvmsg(sock, &msg, msg.msg_flags);
+}
+
+void ksock_set_callbacks(struct socket *sock, struct ksock_callbacks *callbacks)
+{
+	struct sock *sk = sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = callbacks->user_data;
+	sk->sk_data_ready = callbacks->data_ready;
+	sk->sk_write_space = callbacks->write_space;
+	sk->sk_state_change = callbacks->state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+/*
+ * Detach sk_user_data so that callbacks racing with the owner's teardown
+ * see NULL. Only callbacks that take sk_callback_lock are protected.
+ */
+void ksock_clear_callbacks(struct socket *sock)
+{
+	struct sock *sk = sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = NULL;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
 int ksock_accept(struct socket **newsockp, struct socket *sock, struct ksock_callbacks *callbacks)
 {
 	struct wait_queue_entry wait;
@@ -158,7 +302,7 @@ int ksock_ioctl(struct socket *sock, int cmd, unsigned long arg)
 	return err;
 }
 
-static void ksock_addr_set_port(struct sockaddr_storage *ss, int p)
+void ksock_addr_set_port(struct sockaddr_storage *ss, int p)
 {
 	switch (ss->ss_family) {
 	case AF_INET:
@@ -170,6 +314,37 @@ static void ksock_addr_set_port(struct sockaddr_storage *ss, int p)
 	}
 }
 
+/* same family and address, ports aside */
+bool ksock_addr_equal(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return false;
+
+	switch (a->ss_family) {
+	case AF_INET:
+		return ((struct sockaddr_in *)a)->sin_addr.s_addr == ((struct sockaddr_in *)b)->sin_addr.s_addr;
+	case AF_INET6:
+		return ipv6_addr_equal(&((struct sockaddr_in6 *)a)->sin6_addr, &((struct sockaddr_in6 *)b)->sin6_addr);
+	default:
+		return false;
+	}
+}
+
+int ksock_addr_len(struct sockaddr_storage *addr)
+{
+	switch (addr->ss_family) {
+	case AF_INET:
+		return sizeof(struct sockaddr_in);
+	case AF_INET6:
+		return sizeof(struct sockaddr_in6);
+	case AF_UNIX:
+		return offsetof(struct sockaddr_un, sun_path) +
+			strlen(((struct sockaddr_un *)addr)->sun_path) + 1;
+	default:
+		return sizeof(*addr);
+	}
+}
+
 static int ksock_pton(const char *ip, int ip_len, struct sockaddr_storage *ss)
 {
 	struct sockaddr_in *in4 = (struct sockaddr_in *) ss;
@@ -204,10 +379,35 @@ static int ksock_dns_resolve(const char *name, struct sockaddr_storage *ss)
 	return r;
 }
 
+static int ksock_unix_addr(const char *path, struct sockaddr_storage *ss)
+{
+	struct sockaddr_un *un = (struct sockaddr_un *)ss;
+
+	if (path[0] == '\0' || strlen(path) >= sizeof(un->sun_path))
+		return -EINVAL;
+
+	memset(ss, 0, sizeof(*ss));
+	un->sun_family = AF_UNIX;
+	memcpy(un->sun_path, path, strlen(path));
+	return 0;
+}
+
+bool ksock_is_unix_host(const char *host)
+{
+	return strncmp(host, KSOCK_UNIX_PREFIX, strlen(KSOCK_UNIX_PREFIX)) == 0;
+}
+
+/*
+ * host is an IP address, a DNS name or "unix:<path>" for a Unix domain
+ * stream socket, in which case port is ignored.
+ */
 int ksock_resolve_addr(const char *host, u16 port, struct sockaddr_storage *addr)
 {
 	int r;
 
+	if (ksock_is_unix_host(host))
+		return ksock_unix_addr(host + strlen(KSOCK_UNIX_PREFIX), addr);
+
 	r = ksock_pton(host, strlen(host), addr);
 	if (r) {
 		r = ksock_dns_resolve(host, addr);
@@ -218,6 +418,18 @@ int ksock_resolve_addr(const char *host, u16 port, struct sockaddr_storage *addr
 	return r;
 }
 
+int ksock_getpeername(struct socket *sock, struct sockaddr_storage *addr)
+{
+	int r;
+
+	memset(addr, 0, sizeof(*addr));
+	r = kernel_getpeername(sock, (struct sockaddr *)addr);
+	if (r < 0)
+		return r;
+
+	return 0;
+}
+
 int ksock_connect_host(struct socket **sockp, const char *host, u16 port, struct ksock_callbacks *callbacks)
 {
 	struct sockaddr_storage addr;
@@ -227,10 +439,48 @@ int ksock_connect_host(struct socket **sockp, const char *host, u16 port, struct
 	if (r)
 		return r;
 
-	return ksock_connect_addr(sockp, &addr, callbacks);
+	return ksock_connect_addr(sockp, &addr, NULL, 0, NULL, callbacks);
+}
+
+/*
+ * Bind the socket to src_addr before connect. With KSOCK_BIND_TRANSPARENT
+ * the source may be a foreign (client) address: IP_TRANSPARENT lets us
+ * bind it, and the return traffic has to be steered back to us by policy
+ * routing (see scripts/netns_transparent.sh). The port is always left to
+ * the kernel so we don't collide with the client's own 4-tuple.
+ */
+static int ksock_bind_src(struct socket *sock, struct sockaddr_storage *src_addr, int bind_flags)
+{
+	struct sockaddr_storage addr;
+	int r;
+
+	if (src_addr->ss_family != sock->sk->sk_family)
+		return -EAFNOSUPPORT;
+
+	if (bind_flags & KSOCK_BIND_TRANSPARENT) {
+		if (src_addr->ss_family == AF_INET)
+			r = ksock_setsockopt_int(sock, SOL_IP, IP_TRANSPARENT, 1);
+		else
+			r = ksock_setsockopt_int(sock, SOL_IPV6, IPV6_TRANSPARENT, 1);
+		if (r)
+			return r;
+	}
+
+	/* leave the port to connect(), unique per 4-tuple instead of per address */
+	if (bind_flags & KSOCK_BIND_NO_PORT) {
+		r = ksock_setsockopt_int(sock, SOL_IP, IP_BIND_ADDRESS_NO_PORT, 1);
+		if (r)
+			return r;
+	}
+
+	addr = *src_addr;
+	ksock_addr_set_port(&addr, 0);
+	return sock->ops->bind(sock, (struct sockaddr *)&addr, ksock_addr_len(&addr));
 }
 
-int ksock_connect_addr(struct socket **sockp, struct sockaddr_storage *addr, struct ksock_callbacks *callbacks)
+int ksock_connect_addr(struct socket **sockp, struct sockaddr_storage *addr,
+		       struct sockaddr_storage *src_addr, int bind_flags,
+		       struct ksock_opts *opts, struct ksock_callbacks *callbacks)
 {
 	int r;
 	struct socket *sock;
@@ -239,8 +489,17 @@ int ksock_connect_addr(struct socket **sockp, struct sockaddr_storage *addr, str
 	if (r)
 		return r;
 
-	r = sock->ops->connect(sock, (struct sockaddr *)addr,
-		(addr->ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6), O_NONBLOCK);
+	if (src_addr) {
+		r = ksock_bind_src(sock, src_addr, bind_flags);
+		if (r)
+			goto release_sock;
+	}
+
+	/* before the SYN as buffer sizes decide the window scale, best effort */
+	if (opts)
+		ksock_set_opts(sock, opts);
+
+	r = sock->ops->connect(sock, (struct sockaddr *)addr, ksock_addr_len(addr), O_NONBLOCK);
 	if (r) {
 		if (r != -EINPROGRESS)
 			goto release_sock;
@@ -276,8 +535,7 @@ int ksock_listen_addr(struct socket **sockp, struct sockaddr_storage *addr, int
 	if (r)
 		goto out_sock_release;
 
-	r = sock->ops->bind(sock, (struct sockaddr *)addr,
-		(addr->ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+	r = sock->ops->bind(sock, (struct sockaddr *)addr, ksock_addr_len(addr));
 
 	r = sock->ops->listen(sock, backlog);
 	if (r)
@@ -289,3 +547,58 @@ out_sock_release:
 	sock_release(sock);
 	return r;
 }
+
+int ksock_bind_udp(struct socket **sockp, struct sockaddr_storage *addr, struct ksock_callbacks *callbacks)
+{
+	int r, option = 1;
+	struct socket *sock = NULL;
+
+	r = sock_create(addr->ss_family, SOCK_DGRAM, IPPROTO_UDP, &sock);
+	if (r)
+		return r;
+
+	r = ksock_set_reuse_addr(sock, true);
+	if (r)
+		goto out_sock_release;
+
+	/* every worker binds its own socket, the stack spreads flows by 4-tuple */
+	r = kernel_setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&option, sizeof(option));
+	if (r)
+		goto out_sock_release;
+
+	r = sock->ops->bind(sock, (struct sockaddr *)addr, ksock_addr_len(addr));
+	if (r)
+		goto out_sock_release;
+
+	if (callbacks)
+		ksock_set_callbacks(sock, callbacks);
+
+	*sockp = sock;
+	return 0;
+out_sock_release:
+	sock_release(sock);
+	return r;
+}
+
+int ksock_connect_udp(struct socket **sockp, struct sockaddr_storage *addr, struct ksock_callbacks *callbacks)
+{
+	int r;
+	struct socket *sock = NULL;
+
+	r = sock_create(addr->ss_family, SOCK_DGRAM, IPPROTO_UDP, &sock);
+	if (r)
+		return r;
+
+	r = sock->ops->connect(sock, (struct sockaddr *)addr, ksock_addr_len(addr), 0);
+	if (r)
+		goto out_sock_release;
+
+	if (callbacks)
+		ksock_set_callbacks(sock, callbacks);
+
+	*sockp = sock;
+	return 0;
+out_sock_release:
+	sock_release(sock);
+	return r;
+}
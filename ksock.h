@@ -8,10 +8,18 @@ int ksock_set_rcvbufsize(struct socket *sock, int size);
 
 void ksock_release(struct socket *sock);
 
+void ksock_reset(struct socket *sock);
+
 int ksock_send(struct socket *sock, void *buf, int len);
 
+int ksock_send_kvec(struct socket *sock, struct kvec *vec, int nr, int len);
+
 int ksock_recv(struct socket *sock, void *buf, int len);
 
+int ksock_sendto(struct socket *sock, void *buf, int len, struct sockaddr_storage *addr);
+
+int ksock_recvfrom(struct socket *sock, void *buf, int len, struct sockaddr_storage *addr);
+
 struct ksock_callbacks {
 	void *user_data;
 	void (*data_ready)(struct sock *sk);
@@ -19,6 +27,10 @@ struct ksock_callbacks {
 	void (*state_change)(struct sock *sk);
 };
 
+void ksock_set_callbacks(struct socket *sock, struct ksock_callbacks *callbacks);
+
+void ksock_clear_callbacks(struct socket *sock);
+
 int ksock_accept(struct socket **newsockp, struct socket *sock, struct ksock_callbacks *callbacks);
 
 void ksock_abort_accept(struct socket *sock);
@@ -27,8 +39,51 @@ int ksock_ioctl(struct socket *sock, int cmd, unsigned long arg);
 
 int ksock_set_nodelay(struct socket *sock, bool no_delay);
 
+#define KSOCK_CONGESTION_MAX 16
+
+/* socket option profile, zero (or an empty name) leaves the kernel default */
+struct ksock_opts {
+	int nodelay;
+	int sndbuf;
+	int rcvbuf;
+	int notsent_lowat;
+	int keepalive_idle;
+	int keepalive_intvl;
+	int keepalive_cnt;
+	int user_timeout_ms;
+	int quickack;
+	char congestion[KSOCK_CONGESTION_MAX];
+};
+
+int ksock_set_opts(struct socket *sock, struct ksock_opts *opts);
+
+int ksock_check_opts(struct ksock_opts *opts);
+
+#define KSOCK_UNIX_PREFIX "unix:"
+
+bool ksock_is_unix_host(const char *host);
+
 int ksock_resolve_addr(const char *host, u16 port, struct sockaddr_storage *addr);
 
-int ksock_connect_addr(struct socket **sockp, struct sockaddr_storage *addr, struct ksock_callbacks *callbacks);
+int ksock_addr_len(struct sockaddr_storage *addr);
+
+void ksock_addr_set_port(struct sockaddr_storage *ss, int p);
+
+bool ksock_addr_equal(struct sockaddr_storage *a, struct sockaddr_storage *b);
+
+int ksock_getpeername(struct socket *sock, struct sockaddr_storage *addr);
+
+enum {
+	KSOCK_BIND_TRANSPARENT = 1 << 0,
+	KSOCK_BIND_NO_PORT = 1 << 1,
+};
+
+int ksock_connect_addr(struct socket **sockp, struct sockaddr_storage *addr,
+		       struct sockaddr_storage *src_addr, int bind_flags,
+		       struct ksock_opts *opts, struct ksock_callbacks *callbacks);
 
 int ksock_listen_addr(struct socket **sockp, struct sockaddr_storage *addr, int backlog);
+
+int ksock_bind_udp(struct socket **sockp, struct sockaddr_storage *addr, struct ksock_callbacks *callbacks);
+
+int ksock_connect_udp(struct socket **sockp, struct sockaddr_storage *addr, struct ksock_callbacks *callbacks);
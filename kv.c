@@ -0,0 +1,1192 @@
+#include "kv.h"
+#include "server.h"
+
+/*
+ * Key routed memcached (text protocol) and Redis (RESP) proxying. Client
+ * commands are parsed only as far as needed to find the key, hashed onto a
+ * consistent hash ring of targets and pipelined to a persistent connection
+ * per target. Responses are scanned, not parsed, and handed back in the
+ * order the client sent its commands. Sessions and upstreams of a pool run
+ * on the same coroutine thread, so nothing here is locked.
+ */
+
+static const char * const tlb_kv_no_target[TLB_KV_NR_PROTO] = {
+	[TLB_KV_MEMCACHE] = "SERVER_ERROR no target\r\n",
+	[TLB_KV_REDIS] = "-ERR no target\r\n",
+};
+
+static const char * const tlb_kv_target_failed[TLB_KV_NR_PROTO] = {
+	[TLB_KV_MEMCACHE] = "SERVER_ERROR target failed\r\n",
+	[TLB_KV_REDIS] = "-ERR target failed\r\n",
+};
+
+/*
+ * Stateful or blocking commands can't share a pipelined connection. Keyless,
+ * server wide and script commands have no key to route by, and commands
+ * with key positions that depend on their arguments aren't parsed.
+ */
+static const char * const tlb_kv_redis_unsupported[] = {
+	"multi", "exec", "discard", "watch", "unwatch", "select", "auth",
+	"subscribe", "psubscribe", "unsubscribe", "punsubscribe", "monitor",
+	"ssubscribe", "sunsubscribe", "blpop", "brpop", "brpoplpush", "blmove",
+	"bzpopmin", "bzpopmax", "blmpop", "bzmpop", "wait", "client", "reset",
+	"hello", "info", "config", "scan", "keys", "randomkey", "dbsize",
+	"flushall", "flushdb", "swapdb", "move", "migrate", "save", "bgsave",
+	"bgrewriteaof", "lastsave", "shutdown", "slaveof", "replicaof",
+	"failover", "sync", "psync", "debug", "slowlog", "latency", "memory",
+	"object", "command", "role", "time", "echo", "acl", "module", "cluster",
+	"readonly", "readwrite", "publish", "spublish", "pubsub", "eval",
+	"evalsha", "eval_ro", "evalsha_ro", "script", "fcall", "fcall_ro",
+	"function", "xread", "xreadgroup", "zunionstore", "zinterstore",
+	"zdiffstore", "zunion", "zinter", "zdiff", "zintercard", "sintercard",
+	"lmpop", "zmpop", "georadius", "georadiusbymember", "sort", "sort_ro",
+};
+
+/* commands of several keys, refused unless all of them hash to one target */
+struct tlb_kv_redis_keys {
+	const char *name;
+	int first;
+	int step;
+	/* the last key argument, -1 is the last argument */
+	int last;
+};
+
+static const struct tlb_kv_redis_keys tlb_kv_redis_multi[] = {
+	{ "mset", 1, 2, -1 },
+	{ "msetnx", 1, 2, -1 },
+	{ "rename", 1, 1, 2 },
+	{ "renamenx", 1, 1, 2 },
+	{ "copy", 1, 1, 2 },
+	{ "smove", 1, 1, 2 },
+	{ "rpoplpush", 1, 1, 2 },
+	{ "lmove", 1, 1, 2 },
+	{ "sinter", 1, 1, -1 },
+	{ "sunion", 1, 1, -1 },
+	{ "sdiff", 1, 1, -1 },
+	{ "sinterstore", 1, 1, -1 },
+	{ "sunionstore", 1, 1, -1 },
+	{ "sdiffstore", 1, 1, -1 },
+	{ "pfcount", 1, 1, -1 },
+	{ "pfmerge", 1, 1, -1 },
+	{ "bitop", 2, 1, -1 },
+};
+
+/* split per key, their integer replies are summed */
+static const char * const tlb_kv_redis_sum[] = {
+	"del", "exists", "unlink", "touch",
+};
+
+struct tlb_kv_token {
+	const u8 *p;
+	u32 len;
+};
+
+static bool tlb_kv_token_eq(struct tlb_kv_token *tok, const char *s)
+{
+	return tok->len == strlen(s) && !strncasecmp((const char *)tok->p, s, tok->len);
+}
+
+/* decimal with optional sign, len bytes, no terminator required */
+static int tlb_kv_atoi(const u8 *p, u32 len, s64 *value)
+{
+	bool neg = false;
+	s64 v = 0;
+	u32 i = 0;
+
+	if (len && p[0] == '-') {
+		neg = true;
+		i++;
+	}
+	if (i == len || len - i > 12)
+		return -EPROTO;
+
+	for (; i < len; i++) {
+		if (p[i] < '0' || p[i] > '9')
+			return -EPROTO;
+		v = v * 10 + (p[i] - '0');
+	}
+
+	*value = neg ? -v : v;
+	return 0;
+}
+
+/* length of the line at p including '\n', 0 if it's incomplete */
+static u32 tlb_kv_line_len(const u8 *p, u32 len)
+{
+	const u8 *eol = memchr(p, '\n', min_t(u32, len, TLB_KV_MAX_LINE));
+
+	return eol ? eol - p + 1 : 0;
+}
+
+static u32 tlb_kv_line_content(const u8 *p, u32 line_len)
+{
+	line_len--;
+	if (line_len && p[line_len - 1] == '\r')
+		line_len--;
+	return line_len;
+}
+
+static int tlb_kv_tokenize(const u8 *p, u32 len, struct tlb_kv_token *tok, int max)
+{
+	u32 i = 0;
+	int n = 0;
+
+	while (i < len) {
+		while (i < len && p[i] == ' ')
+			i++;
+		if (i == len)
+			break;
+		if (n == max)
+			return -E2BIG;
+		tok[n].p = p + i;
+		while (i < len && p[i] != ' ')
+			i++;
+		tok[n].len = p + i - tok[n].p;
+		n++;
+	}
+
+	return n;
+}
+
+/* a {tag} in the key, if any, is hashed instead so related keys colocate */
+static u32 tlb_kv_key_hash(const u8 *key, u32 len)
+{
+	const u8 *l, *r;
+
+	l = memchr(key, '{', len);
+	if (l) {
+		r = memchr(l + 1, '}', key + len - l - 1);
+		if (r && r > l + 1) {
+			key = l + 1;
+			len = r - key;
+		}
+	}
+
+	return jhash(key, len, 0);
+}
+
+static int tlb_kv_point_cmp(const void *a, const void *b)
+{
+	const struct tlb_kv_point *pa = a, *pb = b;
+
+	if (pa->hash < pb->hash)
+		return -1;
+	return (pa->hash > pb->hash) ? 1 : 0;
+}
+
+static void tlb_kv_pool_free_ring(struct tlb_kv_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->nr_slots; i++)
+		tlb_target_put(pool->slots[i].target);
+	kfree(pool->slots);
+	kvfree(pool->points);
+	pool->slots = NULL;
+	pool->nr_slots = 0;
+	pool->points = NULL;
+	pool->nr_points = 0;
+}
+
+static int tlb_kv_pool_build_ring(struct tlb_kv_pool *pool, int gen)
+{
+	struct tlb_server *srv = pool->srv;
+	struct tlb_kv_slot *slots;
+	struct tlb_kv_point *points;
+	struct tlb_target *target;
+	char name[80];
+	int nr, i, j, len;
+
+	for (;;) {
+		nr = 0;
+		read_lock(&srv->target_lock);
+		for (target = tlb_server_next_target(srv, NULL); target; target = tlb_server_next_target(srv, target))
+			nr++;
+		read_unlock(&srv->target_lock);
+
+		slots = kcalloc(max(nr, 1), sizeof(*slots), GFP_KERNEL);
+		points = kvmalloc_array(max(nr, 1) * TLB_KV_RING_POINTS, sizeof(*points), GFP_KERNEL);
+		if (!slots || !points) {
+			kfree(slots);
+			kvfree(points);
+			return -ENOMEM;
+		}
+
+		read_lock(&srv->target_lock);
+		if (atomic_read(&srv->target_gen) == gen)
+			break;
+		/* changed while allocating */
+		read_unlock(&srv->target_lock);
+		kfree(slots);
+		kvfree(points);
+		gen = atomic_read(&srv->target_gen);
+	}
+
+	i = 0;
+	for (target = tlb_server_next_target(srv, NULL); target; target = tlb_server_next_target(srv, target)) {
+		tlb_target_get(target);
+		slots[i++].target = target;
+	}
+	read_unlock(&srv->target_lock);
+
+	for (i = 0; i < nr; i++) {
+		target = slots[i].target;
+		len = snprintf(name, sizeof(name), "%s:%d", target->host, target->port);
+		for (j = 0; j < TLB_KV_RING_POINTS; j++) {
+			points[i * TLB_KV_RING_POINTS + j].hash = jhash(name, len, j);
+			points[i * TLB_KV_RING_POINTS + j].slot = i;
+		}
+	}
+	sort(points, nr * TLB_KV_RING_POINTS, sizeof(*points), tlb_kv_point_cmp, NULL);
+
+	tlb_kv_pool_free_ring(pool);
+	pool->slots = slots;
+	pool->nr_slots = nr;
+	pool->points = points;
+	pool->nr_points = nr * TLB_KV_RING_POINTS;
+	pool->ring_gen = gen;
+	return 0;
+}
+
+static struct tlb_kv_slot *tlb_kv_pool_lookup(struct tlb_kv_pool *pool, u32 hash)
+{
+	int gen = atomic_read(&pool->srv->target_gen);
+	int l, r, m;
+
+	if (gen != pool->ring_gen && tlb_kv_pool_build_ring(pool, gen))
+		return NULL;
+
+	if (!pool->nr_points)
+		return NULL;
+
+	/* first point clockwise from the hash */
+	l = 0;
+	r = pool->nr_points;
+	while (l < r) {
+		m = l + (r - l) / 2;
+		if (pool->points[m].hash < hash)
+			l = m + 1;
+		else
+			r = m;
+	}
+	if (l == pool->nr_points)
+		l = 0;
+
+	return &pool->slots[pool->points[l].slot];
+}
+
+static void tlb_kv_session_fail(struct tlb_kv_session *session, int error)
+{
+	if (!session->error) {
+		session->error = error;
+		coroutine_signal(session->co);
+	}
+}
+
+static void tlb_kv_req_free(struct tlb_kv_req *req)
+{
+	tlb_sendq_purge(&req->resp);
+	kfree(req);
+}
+
+static void tlb_kv_part_deliver(struct tlb_kv_req *req, const u8 *data, u32 len);
+
+static void tlb_kv_deliver(struct tlb_kv_req *req, const void *data, u32 len)
+{
+	struct tlb_kv_session *session = req->session;
+	int r;
+
+	req->started = true;
+	if (req->parent) {
+		tlb_kv_part_deliver(req, data, len);
+		return;
+	}
+	if (!session || session->error)
+		return;
+
+	if (req == list_first_entry(&session->req_list, struct tlb_kv_req, session_entry))
+		r = tlb_sendq_write(&session->out, session->sock, data, len);
+	else
+		r = tlb_sendq_append(&req->resp, data, len);
+	if (r)
+		tlb_kv_session_fail(session, r);
+}
+
+/* hand out buffered responses that are next in line */
+static void tlb_kv_session_advance(struct tlb_kv_session *session)
+{
+	struct tlb_kv_req *req;
+	int r;
+
+	while (!list_empty(&session->req_list)) {
+		req = list_first_entry(&session->req_list, struct tlb_kv_req, session_entry);
+		if (!tlb_sendq_empty(&req->resp)) {
+			tlb_sendq_splice(&session->out, &req->resp);
+			r = tlb_sendq_flush(&session->out, session->sock);
+			if (r)
+				tlb_kv_session_fail(session, r);
+		}
+		if (!req->done)
+			break;
+
+		list_del(&req->session_entry);
+		session->nr_reqs--;
+		tlb_kv_req_free(req);
+	}
+
+	if (session->throttled)
+		coroutine_signal(session->co);
+}
+
+static void tlb_kv_parts_put(struct tlb_kv_req *parent);
+
+static void tlb_kv_req_complete(struct tlb_kv_req *req)
+{
+	struct tlb_kv_req *parent = req->parent;
+
+	req->done = true;
+	if (parent) {
+		tlb_kv_req_free(req);
+		tlb_kv_parts_put(parent);
+	} else if (req->session)
+		tlb_kv_session_advance(req->session);
+	else
+		tlb_kv_req_free(req);
+}
+
+/* parts answer with one line each: an integer, or an error that wins */
+static void tlb_kv_part_deliver(struct tlb_kv_req *req, const u8 *data, u32 len)
+{
+	struct tlb_kv_req *parent = req->parent;
+	s64 value;
+
+	if (parent->failed)
+		return;
+
+	if (data[0] == ':' && !tlb_kv_atoi(data + 1, tlb_kv_line_content(data, len) - 1, &value)) {
+		parent->sum += value;
+		return;
+	}
+
+	parent->failed = true;
+	tlb_kv_deliver(parent, data, len);
+}
+
+static void tlb_kv_parts_put(struct tlb_kv_req *parent)
+{
+	char reply[24];
+	int len;
+
+	if (--parent->nr_parts)
+		return;
+
+	if (!parent->failed) {
+		len = snprintf(reply, sizeof(reply), ":%lld\r\n", parent->sum);
+		tlb_kv_deliver(parent, reply, len);
+	}
+	tlb_kv_req_complete(parent);
+}
+
+static struct tlb_kv_req *tlb_kv_req_create(struct tlb_kv_session *session)
+{
+	struct tlb_kv_req *req;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return NULL;
+
+	req->session = session;
+	tlb_sendq_init(&req->resp);
+	INIT_LIST_HEAD(&req->upstream_entry);
+	list_add_tail(&req->session_entry, &session->req_list);
+	session->nr_reqs++;
+	return req;
+}
+
+/* outside of the session's list, the parent holds the place */
+static struct tlb_kv_req *tlb_kv_part_create(struct tlb_kv_req *parent)
+{
+	struct tlb_kv_req *req;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return NULL;
+
+	req->parent = parent;
+	tlb_sendq_init(&req->resp);
+	INIT_LIST_HEAD(&req->session_entry);
+	INIT_LIST_HEAD(&req->upstream_entry);
+	parent->nr_parts++;
+	return req;
+}
+
+static int tlb_kv_reply(struct tlb_kv_session *session, const char *msg)
+{
+	struct tlb_kv_req *req;
+
+	req = tlb_kv_req_create(session);
+	if (!req)
+		return -ENOMEM;
+
+	tlb_kv_deliver(req, msg, strlen(msg));
+	tlb_kv_req_complete(req);
+	return 0;
+}
+
+static void tlb_kv_upstream_fail(struct tlb_kv_upstream *up, int error)
+{
+	if (!up->error) {
+		up->error = error;
+		coroutine_signal(up->co);
+	}
+}
+
+static void tlb_kv_upstream_sock_event(struct sock *sk)
+{
+	struct tlb_kv_upstream *up = sk->sk_user_data;
+
+	coroutine_signal(up->co);
+}
+
+static void tlb_kv_upstream_free(struct tlb_kv_upstream *up)
+{
+	struct tlb_kv_pool *pool = up->pool;
+	const char *msg = tlb_kv_target_failed[up->proto];
+	struct tlb_kv_req *req, *tmp;
+	int i;
+
+	list_for_each_entry_safe(req, tmp, &up->req_list, upstream_entry) {
+		list_del_init(&req->upstream_entry);
+		/* a partial response can't be completed, the client stream is lost */
+		if (req->started && req->session)
+			tlb_kv_session_fail(req->session, -ECONNRESET);
+		else
+			tlb_kv_deliver(req, msg, strlen(msg));
+		tlb_kv_req_complete(req);
+	}
+
+	for (i = 0; i < pool->nr_slots; i++) {
+		if (pool->slots[i].up[up->proto] == up)
+			pool->slots[i].up[up->proto] = NULL;
+	}
+	list_del_init(&up->pool_entry);
+
+	if (up->sock)
+		ksock_release(up->sock);
+	tlb_sendq_purge(&up->out);
+	kfree(up->in_buf);
+	coroutine_deref(up->co);
+	atomic64_dec(&up->target->active_cons);
+	tlb_target_put(up->target);
+	kfree(up);
+}
+
+static int tlb_kv_memcache_response_line(struct tlb_kv_upstream *up, struct tlb_kv_req *req, const u8 *p, u32 len)
+{
+	struct tlb_kv_token tok[5];
+	u32 content = tlb_kv_line_content(p, len);
+	s64 bytes;
+	int n;
+
+	n = tlb_kv_tokenize(p, content, tok, ARRAY_SIZE(tok));
+	if (n >= 4 && tlb_kv_token_eq(&tok[0], "VALUE")) {
+		if (tlb_kv_atoi(tok[3].p, tok[3].len, &bytes) || bytes < 0)
+			return -EPROTO;
+		up->bulk_left = bytes + 2;
+		tlb_kv_deliver(req, p, len);
+		return 0;
+	}
+
+	/* anything but a value line ends the response */
+	up->pending = 0;
+	if (req->strip_end && n == 1 && tlb_kv_token_eq(&tok[0], "END"))
+		return 0;
+	tlb_kv_deliver(req, p, len);
+	return 0;
+}
+
+static int tlb_kv_redis_response_line(struct tlb_kv_upstream *up, struct tlb_kv_req *req, const u8 *p, u32 len)
+{
+	u32 content = tlb_kv_line_content(p, len);
+	s64 n = 0;
+
+	if (!content)
+		return -EPROTO;
+
+	up->pending--;
+	switch (p[0]) {
+	case '$':
+	case '=':
+	case '!':
+		if (tlb_kv_atoi(p + 1, content - 1, &n))
+			return -EPROTO;
+		if (n >= 0)
+			up->bulk_left = n + 2;
+		break;
+	case '*':
+	case '~':
+	case '>':
+	case '%':
+		if (tlb_kv_atoi(p + 1, content - 1, &n))
+			return -EPROTO;
+		if (n > 0)
+			up->pending += (p[0] == '%') ? 2 * n : n;
+		break;
+	default:
+		break;
+	}
+
+	if (req->strip_head) {
+		req->strip_head = false;
+		if (p[0] == '*')
+			return 0;
+	}
+	tlb_kv_deliver(req, p, len);
+	return 0;
+}
+
+static int tlb_kv_upstream_input(struct tlb_kv_upstream *up)
+{
+	struct tlb_kv_req *req;
+	u8 *p = up->in_buf;
+	u32 left = up->in_len;
+	u32 n;
+	int r = 0;
+
+	while (left) {
+		if (list_empty(&up->req_list)) {
+			r = -EPROTO;
+			break;
+		}
+		req = list_first_entry(&up->req_list, struct tlb_kv_req, upstream_entry);
+
+		if (up->bulk_left) {
+			n = min(left, up->bulk_left);
+			tlb_kv_deliver(req, p, n);
+			up->bulk_left -= n;
+		} else {
+			n = tlb_kv_line_len(p, left);
+			if (!n) {
+				if (left >= TLB_KV_MAX_LINE)
+					r = -EPROTO;
+				break;
+			}
+			if (up->proto == TLB_KV_REDIS)
+				r = tlb_kv_redis_response_line(up, req, p, n);
+			else
+				r = tlb_kv_memcache_response_line(up, req, p, n);
+			if (r)
+				break;
+		}
+		p += n;
+		left -= n;
+
+		if (!up->bulk_left && !up->pending) {
+			list_del_init(&req->upstream_entry);
+			up->pending = 1;
+			tlb_kv_req_complete(req);
+		}
+	}
+
+	memmove(up->in_buf, p, left);
+	up->in_len = left;
+	return r;
+}
+
+static void *tlb_kv_upstream_coroutine(struct coroutine *co, void *arg)
+{
+	struct tlb_kv_upstream *up = arg;
+	int r;
+
+	for (;;) {
+		r = up->error;
+		if (r)
+			break;
+
+		r = tlb_sendq_flush(&up->out, up->sock);
+		if (r)
+			break;
+
+		r = ksock_recv(up->sock, up->in_buf + up->in_len, TLB_KV_BUF_SIZE - up->in_len);
+		if (r == -EAGAIN) {
+			if (READ_ONCE(up->target->removed) && list_empty(&up->req_list)) {
+				r = 0;
+				break;
+			}
+			coroutine_yield(co);
+			continue;
+		} else if (r <= 0)
+			break;
+
+		up->in_len += r;
+		r = tlb_kv_upstream_input(up);
+		if (r)
+			break;
+	}
+
+	tlb_kv_upstream_free(up);
+	return ERR_PTR(r);
+}
+
+static struct tlb_kv_upstream *tlb_kv_upstream_create(struct tlb_kv_pool *pool, struct tlb_target *target, int proto)
+{
+	struct tlb_kv_upstream *up;
+	struct ksock_callbacks callbacks;
+	struct ksock_opts opts;
+	int r;
+
+	up = kzalloc(sizeof(*up), GFP_KERNEL);
+	if (!up)
+		return ERR_PTR(-ENOMEM);
+
+	up->pool = pool;
+	up->proto = proto;
+	up->pending = 1;
+	INIT_LIST_HEAD(&up->pool_entry);
+	INIT_LIST_HEAD(&up->req_list);
+	tlb_sendq_init(&up->out);
+	up->in_buf = kmalloc(TLB_KV_BUF_SIZE, GFP_KERNEL);
+	if (!up->in_buf) {
+		r = -ENOMEM;
+		goto free_up;
+	}
+
+	up->co = coroutine_create(pool->thread);
+	if (!up->co) {
+		r = -ENOMEM;
+		goto free_buf;
+	}
+
+	callbacks.user_data = up;
+	callbacks.data_ready = tlb_kv_upstream_sock_event;
+	callbacks.write_space = tlb_kv_upstream_sock_event;
+	callbacks.state_change = tlb_kv_upstream_sock_event;
+	tlb_server_get_opts(pool->srv, &pool->srv->target_opts, &opts);
+	r = ksock_connect_addr(&up->sock, &target->addr, NULL, 0, &opts, &callbacks);
+	if (r)
+		goto deref_co;
+
+	tlb_target_get(target);
+	up->target = target;
+	atomic64_inc(&target->total_cons);
+	atomic64_inc(&target->active_cons);
+
+	list_add_tail(&up->pool_entry, &pool->upstream_list);
+	coroutine_start(up->co, tlb_kv_upstream_coroutine, up);
+	return up;
+
+deref_co:
+	coroutine_deref(up->co);
+free_buf:
+	kfree(up->in_buf);
+free_up:
+	kfree(up);
+	return ERR_PTR(r);
+}
+
+static struct tlb_kv_upstream *tlb_kv_route(struct tlb_kv_session *session, const u8 *key, u32 key_len)
+{
+	struct tlb_kv_slot *slot;
+	struct tlb_kv_upstream *up;
+
+	slot = tlb_kv_pool_lookup(session->pool, tlb_kv_key_hash(key, key_len));
+	if (!slot)
+		return NULL;
+
+	up = slot->up[session->proto];
+	if (up && !up->error)
+		return up;
+
+	/* the ring was rebuilt, the connection may still be there */
+	list_for_each_entry(up, &session->pool->upstream_list, pool_entry) {
+		if (up->target == slot->target && up->proto == session->proto && !up->error) {
+			slot->up[session->proto] = up;
+			return up;
+		}
+	}
+
+	up = tlb_kv_upstream_create(session->pool, slot->target, session->proto);
+	if (IS_ERR(up))
+		return NULL;
+
+	slot->up[session->proto] = up;
+	return up;
+}
+
+/* req is NULL for noreply, else it gets the response */
+static void __tlb_kv_forward(struct tlb_kv_session *session, const u8 *key, u32 key_len, struct tlb_kv_req *req,
+			     struct kvec *vec, int nr, u32 total)
+{
+	struct tlb_kv_upstream *up;
+	const char *msg;
+	int r;
+
+	up = tlb_kv_route(session, key, key_len);
+	if (!up) {
+		if (req) {
+			msg = tlb_kv_no_target[session->proto];
+			tlb_kv_deliver(req, msg, strlen(msg));
+			tlb_kv_req_complete(req);
+		}
+		return;
+	}
+
+	if (req)
+		list_add_tail(&req->upstream_entry, &up->req_list);
+	r = tlb_sendq_write_kvec(&up->out, up->sock, vec, nr, total);
+	if (r)
+		tlb_kv_upstream_fail(up, r);
+}
+
+static int tlb_kv_forward(struct tlb_kv_session *session, const u8 *key, u32 key_len,
+			  struct kvec *vec, int nr, u32 total, bool noreply, bool strip_end)
+{
+	struct tlb_kv_req *req = NULL;
+
+	if (!noreply) {
+		req = tlb_kv_req_create(session);
+		if (!req)
+			return -ENOMEM;
+		req->strip_end = strip_end;
+	}
+
+	__tlb_kv_forward(session, key, key_len, req, vec, nr, total);
+	return 0;
+}
+
+static int tlb_kv_forward_buf(struct tlb_kv_session *session, const u8 *key, u32 key_len,
+			      const u8 *buf, u32 len, bool noreply)
+{
+	struct kvec vec;
+
+	vec.iov_base = (void *)buf;
+	vec.iov_len = len;
+	return tlb_kv_forward(session, key, key_len, &vec, 1, len, noreply, false);
+}
+
+/* a multi key get is split per key, all but the last END are dropped */
+static int tlb_kv_memcache_get(struct tlb_kv_session *session, struct tlb_kv_token *tok, int n)
+{
+	struct kvec vec[4];
+	int i, r;
+
+	for (i = 1; i < n; i++) {
+		if (tok[i].len > TLB_KV_MAX_KEY)
+			return tlb_kv_reply(session, "CLIENT_ERROR bad command line format\r\n");
+	}
+
+	for (i = 1; i < n; i++) {
+		vec[0].iov_base = (void *)tok[0].p;
+		vec[0].iov_len = tok[0].len;
+		vec[1].iov_base = " ";
+		vec[1].iov_len = 1;
+		vec[2].iov_base = (void *)tok[i].p;
+		vec[2].iov_len = tok[i].len;
+		vec[3].iov_base = "\r\n";
+		vec[3].iov_len = 2;
+		r = tlb_kv_forward(session, tok[i].p, tok[i].len, vec, ARRAY_SIZE(vec),
+				   tok[0].len + tok[i].len + 3, false, i + 1 < n);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+/* returns bytes consumed, 0 if the command is incomplete */
+static int tlb_kv_memcache_parse(struct tlb_kv_session *session, const u8 *p, u32 len)
+{
+	struct tlb_kv_token tok[TLB_KV_MAX_TOKENS];
+	u32 line_len, total;
+	bool noreply;
+	s64 bytes;
+	int n, r;
+
+	line_len = tlb_kv_line_len(p, len);
+	if (!line_len)
+		return (len >= TLB_KV_MAX_LINE) ? -EPROTO : 0;
+
+	n = tlb_kv_tokenize(p, tlb_kv_line_content(p, line_len), tok, ARRAY_SIZE(tok));
+	if (n < 0) {
+		r = tlb_kv_reply(session, "CLIENT_ERROR line too long\r\n");
+		return r ? r : line_len;
+	}
+	if (n == 0) {
+		r = tlb_kv_reply(session, "ERROR\r\n");
+		return r ? r : line_len;
+	}
+	noreply = n > 1 && tlb_kv_token_eq(&tok[n - 1], "noreply");
+
+	if ((tlb_kv_token_eq(&tok[0], "get") || tlb_kv_token_eq(&tok[0], "gets")) && n >= 2) {
+		r = tlb_kv_memcache_get(session, tok, n);
+	} else if ((tlb_kv_token_eq(&tok[0], "set") || tlb_kv_token_eq(&tok[0], "add") ||
+		    tlb_kv_token_eq(&tok[0], "replace") || tlb_kv_token_eq(&tok[0], "append") ||
+		    tlb_kv_token_eq(&tok[0], "prepend") || tlb_kv_token_eq(&tok[0], "cas")) && n >= 5) {
+		if (tlb_kv_atoi(tok[4].p, tok[4].len, &bytes) || bytes < 0 || bytes > TLB_KV_MAX_VALUE)
+			return -EPROTO;
+		total = line_len + bytes + 2;
+		if (len < total)
+			return 0;
+		if (p[total - 2] != '\r' || p[total - 1] != '\n')
+			return -EPROTO;
+		r = tlb_kv_forward_buf(session, tok[1].p, tok[1].len, p, total, noreply);
+		return r ? r : total;
+	} else if ((tlb_kv_token_eq(&tok[0], "delete") || tlb_kv_token_eq(&tok[0], "incr") ||
+		    tlb_kv_token_eq(&tok[0], "decr") || tlb_kv_token_eq(&tok[0], "touch")) && n >= 2) {
+		r = tlb_kv_forward_buf(session, tok[1].p, tok[1].len, p, line_len, noreply);
+	} else if (tlb_kv_token_eq(&tok[0], "quit")) {
+		return -ESHUTDOWN;
+	} else
+		r = tlb_kv_reply(session, "ERROR\r\n");
+
+	return r ? r : line_len;
+}
+
+static int tlb_kv_redis_parse_len(const u8 *p, u32 len, u32 *pos, u8 type, s64 *value)
+{
+	u32 line_len;
+
+	line_len = tlb_kv_line_len(p + *pos, len - *pos);
+	if (!line_len)
+		return (len - *pos >= TLB_KV_MAX_LINE) ? -EPROTO : 0;
+
+	if (p[*pos] != type || tlb_kv_atoi(p + *pos + 1, tlb_kv_line_content(p + *pos, line_len) - 1, value))
+		return -EPROTO;
+
+	*pos += line_len;
+	return 1;
+}
+
+static bool tlb_kv_redis_cmd_in(struct tlb_kv_token *cmd, const char * const *names, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (tlb_kv_token_eq(cmd, names[i]))
+			return true;
+	}
+	return false;
+}
+
+static const struct tlb_kv_redis_keys *tlb_kv_redis_multi_cmd(struct tlb_kv_token *cmd)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tlb_kv_redis_multi); i++) {
+		if (tlb_kv_token_eq(cmd, tlb_kv_redis_multi[i].name))
+			return &tlb_kv_redis_multi[i];
+	}
+	return NULL;
+}
+
+/* walks the arguments of a command already checked to be complete */
+static void tlb_kv_redis_next_arg(const u8 *p, u32 len, u32 *pos, struct tlb_kv_token *arg)
+{
+	s64 n = 0;
+
+	tlb_kv_redis_parse_len(p, len, pos, '$', &n);
+	arg->p = p + *pos;
+	arg->len = n;
+	*pos += n + 2;
+}
+
+/* key is set to the first key argument, the one the command is routed by */
+static bool tlb_kv_redis_same_target(struct tlb_kv_session *session, const struct tlb_kv_redis_keys *keys,
+				     const u8 *p, u32 len, u32 pos, s64 nr, struct tlb_kv_token *key)
+{
+	s64 i, last = (keys->last < 0) ? nr - 1 : keys->last;
+	struct tlb_target *target = NULL;
+	struct tlb_kv_token arg;
+	struct tlb_kv_slot *slot;
+
+	for (i = 0; i < nr && i <= last; i++) {
+		tlb_kv_redis_next_arg(p, len, &pos, &arg);
+		if (i < keys->first || (i - keys->first) % keys->step)
+			continue;
+		if (i == keys->first)
+			*key = arg;
+		slot = tlb_kv_pool_lookup(session->pool, tlb_kv_key_hash(arg.p, arg.len));
+		/* no targets, forwarding replies with the error */
+		if (!slot)
+			return true;
+		if (target && slot->target != target)
+			return false;
+		target = slot->target;
+	}
+	return true;
+}
+
+/*
+ * MGET is sent as one MGET per key with the array headers of the replies
+ * dropped. DEL and the like are sent as parts of a request whose reply is
+ * the sum of theirs.
+ */
+static int tlb_kv_redis_split(struct tlb_kv_session *session, struct tlb_kv_token *cmd,
+			      const u8 *p, u32 len, u32 pos, s64 nr)
+{
+	bool mget = tlb_kv_token_eq(cmd, "mget");
+	struct tlb_kv_req *parent = NULL, *req;
+	char head[32], key_head[16];
+	struct tlb_kv_token key;
+	int head_len, key_head_len;
+	struct kvec vec[6];
+	int r = 0;
+	s64 i;
+
+	if (mget) {
+		snprintf(head, sizeof(head), "*%lld\r\n", nr - 1);
+		r = tlb_kv_reply(session, head);
+		if (r)
+			return r;
+	} else {
+		parent = tlb_kv_req_create(session);
+		if (!parent)
+			return -ENOMEM;
+		parent->nr_parts = 1;
+	}
+
+	head_len = snprintf(head, sizeof(head), "*2\r\n$%u\r\n", cmd->len);
+	/* the command itself */
+	tlb_kv_redis_next_arg(p, len, &pos, &key);
+	for (i = 1; i < nr; i++) {
+		tlb_kv_redis_next_arg(p, len, &pos, &key);
+		req = parent ? tlb_kv_part_create(parent) : tlb_kv_req_create(session);
+		if (!req) {
+			r = -ENOMEM;
+			break;
+		}
+		req->strip_head = mget;
+
+		key_head_len = snprintf(key_head, sizeof(key_head), "$%u\r\n", key.len);
+		vec[0].iov_base = head;
+		vec[0].iov_len = head_len;
+		vec[1].iov_base = (void *)cmd->p;
+		vec[1].iov_len = cmd->len;
+		vec[2].iov_base = "\r\n";
+		vec[2].iov_len = 2;
+		vec[3].iov_base = key_head;
+		vec[3].iov_len = key_head_len;
+		vec[4].iov_base = (void *)key.p;
+		vec[4].iov_len = key.len;
+		vec[5].iov_base = "\r\n";
+		vec[5].iov_len = 2;
+		__tlb_kv_forward(session, key.p, key.len, req, vec, ARRAY_SIZE(vec),
+				 head_len + cmd->len + key_head_len + key.len + 4);
+	}
+
+	if (parent)
+		tlb_kv_parts_put(parent);
+	return r;
+}
+
+/* only RESP arrays of bulk strings, as sent by every client library */
+static int tlb_kv_redis_parse(struct tlb_kv_session *session, const u8 *p, u32 len)
+{
+	const struct tlb_kv_redis_keys *keys;
+	struct tlb_kv_token arg[2];
+	u32 pos = 0, args, line_len;
+	s64 nr, i, n;
+	int r;
+
+	if (p[0] != '*') {
+		line_len = tlb_kv_line_len(p, len);
+		if (!line_len)
+			return (len >= TLB_KV_MAX_LINE) ? -EPROTO : 0;
+		r = tlb_kv_reply(session, "-ERR inline commands are not supported\r\n");
+		return r ? r : line_len;
+	}
+
+	r = tlb_kv_redis_parse_len(p, len, &pos, '*', &nr);
+	if (r <= 0)
+		return r;
+	if (nr <= 0)
+		return -EPROTO;
+
+	args = pos;
+	for (i = 0; i < nr; i++) {
+		r = tlb_kv_redis_parse_len(p, len, &pos, '$', &n);
+		if (r <= 0)
+			return r;
+		if (n < 0 || n > TLB_KV_MAX_VALUE)
+			return -EPROTO;
+		if (len - pos < n + 2)
+			return 0;
+		if (i < ARRAY_SIZE(arg)) {
+			arg[i].p = p + pos;
+			arg[i].len = n;
+		}
+		pos += n + 2;
+	}
+
+	keys = tlb_kv_redis_multi_cmd(&arg[0]);
+	if (tlb_kv_redis_cmd_in(&arg[0], tlb_kv_redis_unsupported, ARRAY_SIZE(tlb_kv_redis_unsupported)))
+		r = tlb_kv_reply(session, "-ERR command not supported by proxy\r\n");
+	else if (keys && !tlb_kv_redis_same_target(session, keys, p, pos, args, nr, &arg[1]))
+		r = tlb_kv_reply(session, "-ERR keys of a multi-key command must map to one target, use a {hash tag}\r\n");
+	else if (nr > 2 && (tlb_kv_token_eq(&arg[0], "mget") ||
+			    tlb_kv_redis_cmd_in(&arg[0], tlb_kv_redis_sum, ARRAY_SIZE(tlb_kv_redis_sum))))
+		r = tlb_kv_redis_split(session, &arg[0], p, pos, args, nr);
+	else if (nr >= 2)
+		/* the first key for the commands of tlb_kv_redis_multi, e.g. not BITOP's operation */
+		r = tlb_kv_forward_buf(session, arg[1].p, arg[1].len, p, pos, false);
+	else if (tlb_kv_token_eq(&arg[0], "ping"))
+		r = tlb_kv_reply(session, "+PONG\r\n");
+	else if (tlb_kv_token_eq(&arg[0], "quit"))
+		return -ESHUTDOWN;
+	else
+		r = tlb_kv_reply(session, "-ERR command not supported by proxy\r\n");
+
+	return r ? r : pos;
+}
+
+static int tlb_kv_session_input(struct tlb_kv_session *session)
+{
+	u8 *p = session->in_buf;
+	u32 left = session->in_len;
+	int r = 0;
+
+	while (left) {
+		if (session->proto == TLB_KV_REDIS)
+			r = tlb_kv_redis_parse(session, p, left);
+		else
+			r = tlb_kv_memcache_parse(session, p, left);
+		if (r <= 0)
+			break;
+
+		p += r;
+		left -= r;
+	}
+
+	memmove(session->in_buf, p, left);
+	session->in_len = left;
+	return (r < 0) ? r : 0;
+}
+
+/* a buffer full of an incomplete command grows up to the largest one */
+static int tlb_kv_session_grow(struct tlb_kv_session *session)
+{
+	u32 size;
+	u8 *buf;
+
+	if (session->in_size >= TLB_KV_MAX_REQUEST)
+		return -E2BIG;
+
+	size = min_t(u32, session->in_size * 2, TLB_KV_MAX_REQUEST);
+	buf = kvmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	memcpy(buf, session->in_buf, session->in_len);
+	kvfree(session->in_buf);
+	session->in_buf = buf;
+	session->in_size = size;
+	return 0;
+}
+
+void tlb_kv_session_free(struct tlb_kv_session *session)
+{
+	struct tlb_kv_req *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, &session->req_list, session_entry) {
+		list_del_init(&req->session_entry);
+		if (req->done)
+			tlb_kv_req_free(req);
+		else
+			req->session = NULL;
+	}
+
+	tlb_sendq_purge(&session->out);
+	kvfree(session->in_buf);
+	kfree(session);
+}
+
+int tlb_kv_serve(struct tlb_con *con, struct tlb_kv_pool *pool, int proto)
+{
+	struct tlb_kv_session *session;
+	int r;
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
+		return -ENOMEM;
+
+	session->sock = con->sock;
+	session->co = con->co;
+	session->pool = pool;
+	session->proto = proto;
+	INIT_LIST_HEAD(&session->req_list);
+	tlb_sendq_init(&session->out);
+	session->in_size = TLB_KV_BUF_SIZE;
+	session->in_buf = kvmalloc(session->in_size, GFP_KERNEL);
+	if (!session->in_buf) {
+		kfree(session);
+		return -ENOMEM;
+	}
+	con->kv = session;
+
+	for (;;) {
+		r = session->error;
+		if (r)
+			break;
+
+		r = tlb_sendq_flush(&session->out, session->sock);
+		if (r)
+			break;
+
+		/* stop reading while responses pile up */
+		if (session->nr_reqs >= TLB_KV_MAX_PIPELINE || session->out.bytes >= TLB_KV_MAX_OUT) {
+			session->throttled = true;
+			coroutine_yield(con->co);
+			continue;
+		}
+		session->throttled = false;
+
+		if (session->in_len == session->in_size) {
+			r = tlb_kv_session_grow(session);
+			if (r)
+				break;
+		}
+
+		r = ksock_recv(session->sock, session->in_buf + session->in_len, session->in_size - session->in_len);
+		if (r == -EAGAIN) {
+			coroutine_yield(con->co);
+			continue;
+		} else if (r <= 0)
+			break;
+
+		session->in_len += r;
+		r = tlb_kv_session_input(session);
+		if (r) {
+			if (r == -ESHUTDOWN)
+				r = 0;
+			break;
+		}
+	}
+
+	con->kv = NULL;
+	tlb_kv_session_free(session);
+	return r;
+}
+
+void tlb_kv_pool_init(struct tlb_kv_pool *pool, struct tlb_server *srv, struct coroutine_thread *thread)
+{
+	pool->srv = srv;
+	pool->thread = thread;
+	INIT_LIST_HEAD(&pool->upstream_list);
+	pool->ring_gen = -1;
+	pool->slots = NULL;
+	pool->nr_slots = 0;
+	pool->points = NULL;
+	pool->nr_points = 0;
+}
+
+/* coroutine threads are stopped and sessions gone */
+void tlb_kv_pool_deinit(struct tlb_kv_pool *pool)
+{
+	struct tlb_kv_upstream *up;
+
+	while (!list_empty(&pool->upstream_list)) {
+		up = list_first_entry(&pool->upstream_list, struct tlb_kv_upstream, pool_entry);
+		tlb_kv_upstream_free(up);
+	}
+	tlb_kv_pool_free_ring(pool);
+}
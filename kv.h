@@ -0,0 +1,122 @@
+#pragma once
+
+#include "base.h"
+#include "ksock.h"
+#include "coroutine.h"
+#include "sendq.h"
+
+struct tlb_server;
+struct tlb_target;
+struct tlb_con;
+struct tlb_kv_upstream;
+
+#define TLB_KV_BUF_SIZE (16 * 1024)
+#define TLB_KV_MAX_LINE 2048
+#define TLB_KV_MAX_VALUE (1024 * 1024)
+#define TLB_KV_MAX_REQUEST (TLB_KV_MAX_VALUE + TLB_KV_MAX_LINE)
+#define TLB_KV_MAX_KEY 250
+#define TLB_KV_MAX_TOKENS 64
+#define TLB_KV_MAX_PIPELINE 64
+#define TLB_KV_MAX_OUT (256 * 1024)
+#define TLB_KV_RING_POINTS 160
+
+enum {
+	TLB_KV_MEMCACHE = 0,
+	TLB_KV_REDIS,
+	TLB_KV_NR_PROTO,
+};
+
+/* one command waiting for its response, owned by the upstream until done */
+struct tlb_kv_req {
+	struct list_head session_entry;
+	struct list_head upstream_entry;
+	/* NULL once the client went away, the response is then dropped */
+	struct tlb_kv_session *session;
+	/* response bytes that arrived while earlier responses are outstanding */
+	struct tlb_sendq resp;
+	bool strip_end;
+	/* drops the array header of a one key MGET */
+	bool strip_head;
+	bool started;
+	bool done;
+
+	/* a part of a command split per key, its integer reply adds to parent's */
+	struct tlb_kv_req *parent;
+	/* parent only: parts still out, plus one while they're being sent */
+	int nr_parts;
+	s64 sum;
+	/* parent only: a part failed and its error is the reply */
+	bool failed;
+};
+
+struct tlb_kv_session {
+	struct socket *sock;
+	struct coroutine *co;
+	struct tlb_kv_pool *pool;
+	int proto;
+	int error;
+	bool throttled;
+
+	u8 *in_buf;
+	u32 in_len;
+	u32 in_size;
+	struct tlb_sendq out;
+
+	/* in client order */
+	struct list_head req_list;
+	int nr_reqs;
+};
+
+struct tlb_kv_upstream {
+	struct tlb_kv_pool *pool;
+	struct tlb_target *target;
+	struct list_head pool_entry;
+	struct socket *sock;
+	struct coroutine *co;
+	int proto;
+	int error;
+
+	struct tlb_sendq out;
+	/* in pipeline order */
+	struct list_head req_list;
+
+	u8 *in_buf;
+	u32 in_len;
+	/* response scanner: bytes of the current bulk, values still to come */
+	u32 bulk_left;
+	u32 pending;
+};
+
+struct tlb_kv_slot {
+	struct tlb_target *target;
+	struct tlb_kv_upstream *up[TLB_KV_NR_PROTO];
+};
+
+struct tlb_kv_point {
+	u32 hash;
+	u32 slot;
+};
+
+/*
+ * Per coroutine thread: a private copy of the consistent hash ring, rebuilt
+ * when the target set changes, and one pipelined connection per target.
+ */
+struct tlb_kv_pool {
+	struct tlb_server *srv;
+	struct coroutine_thread *thread;
+	struct list_head upstream_list;
+
+	int ring_gen;
+	struct tlb_kv_slot *slots;
+	int nr_slots;
+	struct tlb_kv_point *points;
+	int nr_points;
+};
+
+int tlb_kv_serve(struct tlb_con *con, struct tlb_kv_pool *pool, int proto);
+
+void tlb_kv_session_free(struct tlb_kv_session *session);
+
+void tlb_kv_pool_init(struct tlb_kv_pool *pool, struct tlb_server *srv, struct coroutine_thread *thread);
+
+void tlb_kv_pool_deinit(struct tlb_kv_pool *pool);
@@ -0,0 +1,154 @@
+#include "mirror.h"
+#include "server.h"
+
+static void tlb_mirror_sock_event(struct sock *sk)
+{
+	struct tlb_mirror *mirror = sk->sk_user_data;
+
+	coroutine_signal(mirror->co);
+}
+
+static void tlb_mirror_drop(struct tlb_mirror *mirror)
+{
+	if (!mirror->sock)
+		return;
+
+	ksock_release(mirror->sock);
+	mirror->sock = NULL;
+	tlb_sendq_purge(&mirror->out);
+	atomic64_inc(&mirror->srv->mirror_drops);
+	atomic64_dec(&mirror->target->active_cons);
+}
+
+struct tlb_mirror *tlb_mirror_create(struct tlb_server *srv, struct coroutine *co)
+{
+	struct ksock_callbacks callbacks;
+	struct ksock_opts opts;
+	struct tlb_mirror *mirror;
+	struct tlb_target *target;
+	int r;
+
+	spin_lock(&srv->mirror_lock);
+	target = srv->mirror;
+	if (target && prandom_u32_max(100) < srv->mirror_percent)
+		tlb_target_get(target);
+	else
+		target = NULL;
+	spin_unlock(&srv->mirror_lock);
+	if (!target)
+		return NULL;
+
+	mirror = kzalloc(sizeof(*mirror), GFP_KERNEL);
+	if (!mirror)
+		goto put_target;
+
+	mirror->srv = srv;
+	mirror->target = target;
+	mirror->co = co;
+	tlb_sendq_init(&mirror->out);
+
+	callbacks.user_data = mirror;
+	callbacks.data_ready = tlb_mirror_sock_event;
+	callbacks.write_space = tlb_mirror_sock_event;
+	callbacks.state_change = tlb_mirror_sock_event;
+	tlb_server_get_opts(srv, &srv->target_opts, &opts);
+	r = ksock_connect_addr(&mirror->sock, &target->addr, NULL, 0, &opts, &callbacks);
+	if (r)
+		goto free_mirror;
+
+	coroutine_ref(co);
+	atomic64_inc(&srv->mirror_cons);
+	atomic64_inc(&target->total_cons);
+	atomic64_inc(&target->active_cons);
+	return mirror;
+
+free_mirror:
+	kfree(mirror);
+put_target:
+	atomic64_inc(&srv->mirror_drops);
+	tlb_target_put(target);
+	return NULL;
+}
+
+/* called with every chunk received from the client, before it's forwarded */
+void tlb_mirror_write(struct tlb_mirror *mirror, void *buf, int len)
+{
+	if (!mirror->sock)
+		return;
+
+	if (tlb_sendq_write(&mirror->out, mirror->sock, buf, len) ||
+	    mirror->out.bytes > TLB_MIRROR_MAX_QUEUED)
+		tlb_mirror_drop(mirror);
+}
+
+/* flush what is queued and discard replies, buf is scratch */
+void tlb_mirror_poll(struct tlb_mirror *mirror, char *buf, int buf_len)
+{
+	int r;
+
+	if (!mirror->sock)
+		return;
+
+	if (tlb_sendq_flush(&mirror->out, mirror->sock)) {
+		tlb_mirror_drop(mirror);
+		return;
+	}
+
+	for (;;) {
+		r = ksock_recv(mirror->sock, buf, buf_len);
+		if (r == -EAGAIN)
+			break;
+		if (r <= 0) {
+			tlb_mirror_drop(mirror);
+			break;
+		}
+	}
+}
+
+void tlb_mirror_delete(struct tlb_mirror *mirror)
+{
+	if (mirror->sock) {
+		ksock_release(mirror->sock);
+		atomic64_dec(&mirror->target->active_cons);
+	}
+	tlb_sendq_purge(&mirror->out);
+	coroutine_deref(mirror->co);
+	tlb_target_put(mirror->target);
+	kfree(mirror);
+}
+
+int tlb_server_set_mirror(struct tlb_server *srv, const char *host, int port, unsigned int percent)
+{
+	struct tlb_target *target, *old;
+
+	if (percent > 100)
+		return -EINVAL;
+
+	target = tlb_target_create(host, port);
+	if (IS_ERR(target))
+		return PTR_ERR(target);
+
+	spin_lock(&srv->mirror_lock);
+	old = srv->mirror;
+	srv->mirror = target;
+	srv->mirror_percent = percent;
+	spin_unlock(&srv->mirror_lock);
+
+	if (old)
+		tlb_target_put(old);
+	return 0;
+}
+
+void tlb_server_clear_mirror(struct tlb_server *srv)
+{
+	struct tlb_target *old;
+
+	spin_lock(&srv->mirror_lock);
+	old = srv->mirror;
+	srv->mirror = NULL;
+	srv->mirror_percent = 0;
+	spin_unlock(&srv->mirror_lock);
+
+	if (old)
+		tlb_target_put(old);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "base.h"
+#include "ksock.h"
+#include "coroutine.h"
+#include "sendq.h"
+
+struct tlb_server;
+struct tlb_target;
+
+#define TLB_MIRROR_MAX_QUEUED (256 * 1024)
+
+/*
+ * Shadow copy of a client->target stream. Fed from the client's recv buffer,
+ * replies are read and dropped. Never blocks the primary flow: once more than
+ * TLB_MIRROR_MAX_QUEUED bytes are stuck the mirror is abandoned.
+ */
+struct tlb_mirror {
+	struct tlb_server *srv;
+	struct tlb_target *target;
+	struct socket *sock;
+	struct coroutine *co;
+	struct tlb_sendq out;
+};
+
+struct tlb_mirror *tlb_mirror_create(struct tlb_server *srv, struct coroutine *co);
+
+void tlb_mirror_write(struct tlb_mirror *mirror, void *buf, int len);
+
+void tlb_mirror_poll(struct tlb_mirror *mirror, char *buf, int buf_len);
+
+void tlb_mirror_delete(struct tlb_mirror *mirror);
+
+int tlb_server_set_mirror(struct tlb_server *srv, const char *host, int port, unsigned int percent);
+
+void tlb_server_clear_mirror(struct tlb_server *srv);
@@ -31,6 +31,7 @@ static int __init tlb_init(void)
 
 fail_server_deinit:
 	tlb_server_stop(&g_context.srv);
+	tlb_server_deinit(&g_context.srv);
 fail_server_cache_deinit:
 	tlb_server_cache_deinit();
 fail_coroutine_deinit:
@@ -46,6 +47,7 @@ static void __exit tlb_exit(void)
 
 	tlb_sysfs_deinit(&g_context.kobj_holder);
 	tlb_server_stop(&g_context.srv);
+	tlb_server_deinit(&g_context.srv);
 	tlb_server_cache_deinit();
 	coroutine_deinit();
 	pr_info("tlb: exited\n");
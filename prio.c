@@ -0,0 +1,126 @@
+#include "prio.h"
+
+const char * const tlb_prio_names[COROUTINE_NR_PRIO] = {
+	[COROUTINE_PRIO_HIGH] = "high",
+	[COROUTINE_PRIO_NORMAL] = "normal",
+	[COROUTINE_PRIO_LOW] = "low",
+};
+
+void tlb_prio_init(struct tlb_prio *prio)
+{
+	memset(prio, 0, sizeof(*prio));
+	spin_lock_init(&prio->lock);
+	prio->listener_prio = COROUTINE_PRIO_NORMAL;
+}
+
+static bool tlb_prio_rule_match(struct tlb_prio_rule *rule, struct sockaddr_storage *addr)
+{
+	struct tlb_addr_key key;
+
+	if (rule->key.family != addr->ss_family)
+		return false;
+	if (tlb_addr_key_init(&key, addr, rule->key.prefix_len, rule->key.prefix_len))
+		return false;
+	return memcmp(key.addr, rule->key.addr, sizeof(key.addr)) == 0;
+}
+
+int tlb_prio_classify(struct tlb_prio *prio, struct sockaddr_storage *addr)
+{
+	struct tlb_prio_rule *rule, *best = NULL;
+	int i, class;
+
+	spin_lock(&prio->lock);
+	for (i = 0; i < prio->nr_rules; i++) {
+		rule = &prio->rules[i];
+		if (best && rule->key.prefix_len <= best->key.prefix_len)
+			continue;
+		if (tlb_prio_rule_match(rule, addr))
+			best = rule;
+	}
+	class = best ? best->prio : prio->listener_prio;
+	spin_unlock(&prio->lock);
+	return class;
+}
+
+static int tlb_prio_rule_key(struct tlb_addr_key *key, struct sockaddr_storage *addr, int prefix_len)
+{
+	if (prefix_len < 0 || prefix_len > ((addr->ss_family == AF_INET) ? 32 : 128))
+		return -EINVAL;
+	return tlb_addr_key_init(key, addr, prefix_len, prefix_len);
+}
+
+static struct tlb_prio_rule *tlb_prio_find_rule(struct tlb_prio *prio, struct tlb_addr_key *key)
+{
+	int i;
+
+	for (i = 0; i < prio->nr_rules; i++)
+		if (memcmp(&prio->rules[i].key, key, sizeof(*key)) == 0)
+			return &prio->rules[i];
+	return NULL;
+}
+
+int tlb_prio_add_rule(struct tlb_prio *prio, struct sockaddr_storage *addr, int prefix_len, int class)
+{
+	struct tlb_prio_rule *rule;
+	struct tlb_addr_key key;
+	int r;
+
+	r = tlb_prio_rule_key(&key, addr, prefix_len);
+	if (r)
+		return r;
+
+	spin_lock(&prio->lock);
+	rule = tlb_prio_find_rule(prio, &key);
+	if (!rule) {
+		if (prio->nr_rules == TLB_PRIO_MAX_RULES) {
+			spin_unlock(&prio->lock);
+			return -ENOSPC;
+		}
+		rule = &prio->rules[prio->nr_rules++];
+		rule->key = key;
+	}
+	rule->prio = class;
+	spin_unlock(&prio->lock);
+	return 0;
+}
+
+int tlb_prio_del_rule(struct tlb_prio *prio, struct sockaddr_storage *addr, int prefix_len)
+{
+	struct tlb_prio_rule *rule;
+	struct tlb_addr_key key;
+	int r;
+
+	r = tlb_prio_rule_key(&key, addr, prefix_len);
+	if (r)
+		return r;
+
+	spin_lock(&prio->lock);
+	rule = tlb_prio_find_rule(prio, &key);
+	if (!rule) {
+		spin_unlock(&prio->lock);
+		return -ENOENT;
+	}
+	*rule = prio->rules[--prio->nr_rules];
+	spin_unlock(&prio->lock);
+	return 0;
+}
+
+ssize_t tlb_prio_show_rules(struct tlb_prio *prio, char *buf, size_t size)
+{
+	struct tlb_prio_rule *rule;
+	ssize_t off = 0;
+	int i;
+
+	spin_lock(&prio->lock);
+	for (i = 0; i < prio->nr_rules; i++) {
+		rule = &prio->rules[i];
+		if (rule->key.family == AF_INET)
+			off += scnprintf(buf + off, size - off, "%pI4/%u %s\n", rule->key.addr,
+					 rule->key.prefix_len, tlb_prio_names[rule->prio]);
+		else
+			off += scnprintf(buf + off, size - off, "%pI6c/%u %s\n", rule->key.addr,
+					 rule->key.prefix_len, tlb_prio_names[rule->prio]);
+	}
+	spin_unlock(&prio->lock);
+	return off;
+}
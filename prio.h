@@ -0,0 +1,36 @@
+#pragma once
+
+#include "base.h"
+#include "coroutine.h"
+#include "addr_table.h"
+
+#define TLB_PRIO_MAX_RULES 64
+
+struct tlb_prio_rule {
+	struct tlb_addr_key key;
+	int prio;
+};
+
+/*
+ * Scheduling class of new connections: the longest matching client prefix
+ * rule, else the listener class. A target class, when set, overrides both
+ * once the target is picked.
+ */
+struct tlb_prio {
+	spinlock_t lock;
+	int listener_prio;
+	struct tlb_prio_rule rules[TLB_PRIO_MAX_RULES];
+	int nr_rules;
+};
+
+extern const char * const tlb_prio_names[COROUTINE_NR_PRIO];
+
+void tlb_prio_init(struct tlb_prio *prio);
+
+int tlb_prio_classify(struct tlb_prio *prio, struct sockaddr_storage *addr);
+
+int tlb_prio_add_rule(struct tlb_prio *prio, struct sockaddr_storage *addr, int prefix_len, int class);
+
+int tlb_prio_del_rule(struct tlb_prio *prio, struct sockaddr_storage *addr, int prefix_len);
+
+ssize_t tlb_prio_show_rules(struct tlb_prio *prio, char *buf, size_t size);
@@ -0,0 +1,319 @@
+#include "route.h"
+
+void tlb_routes_init(struct tlb_routes *routes)
+{
+	memset(routes, 0, sizeof(*routes));
+	mutex_init(&routes->lock);
+}
+
+void tlb_routes_deinit(struct tlb_routes *routes)
+{
+	kvfree(rcu_dereference_protected(routes->router, true));
+	routes->router = NULL;
+}
+
+bool tlb_routes_enabled(struct tlb_routes *routes)
+{
+	return READ_ONCE(routes->nr_rules) != 0;
+}
+
+static struct tlb_route_name *tlb_router_name(struct tlb_route_name *names, int *nr_names, const char *name,
+					      bool add)
+{
+	int i;
+
+	for (i = 0; i < *nr_names; i++)
+		if (!strcasecmp(names[i].name, name))
+			return &names[i];
+	if (!add)
+		return NULL;
+
+	names[*nr_names].name = name;
+	return &names[(*nr_names)++];
+}
+
+static void tlb_router_add_path(struct tlb_router *router, const char *path, u64 bit)
+{
+	struct tlb_route_node *nodes = router->nodes;
+	int node = 0, child;
+
+	for (; *path; path++) {
+		for (child = nodes[node].child; child; child = nodes[child].next)
+			if (nodes[child].c == *path)
+				break;
+		if (!child) {
+			child = router->nr_nodes++;
+			nodes[child].c = *path;
+			nodes[child].next = nodes[node].child;
+			nodes[node].child = child;
+		}
+		node = child;
+	}
+	nodes[node].rules |= bit;
+}
+
+static struct tlb_router *tlb_router_build(struct tlb_route_rule *rules, int nr_rules)
+{
+	struct tlb_router *router;
+	struct tlb_route_rule *rule;
+	size_t nr_nodes = 1;
+	u64 bit;
+	int i;
+
+	for (i = 0; i < nr_rules; i++)
+		nr_nodes += strlen(rules[i].path);
+
+	router = kvzalloc(struct_size(router, nodes, nr_nodes), GFP_KERNEL);
+	if (!router)
+		return NULL;
+
+	router->nr_rules = nr_rules;
+	memcpy(router->rules, rules, nr_rules * sizeof(*rules));
+	router->nr_nodes = 1;
+	for (i = 0; i < nr_rules; i++) {
+		rule = &router->rules[i];
+		bit = 1ULL << i;
+		if (rule->host[0])
+			tlb_router_name(router->hosts, &router->nr_hosts, rule->host, true)->rules |= bit;
+		else
+			router->any_host |= bit;
+		if (rule->method[0])
+			tlb_router_name(router->methods, &router->nr_methods, rule->method, true)->rules |= bit;
+		else
+			router->any_method |= bit;
+		tlb_router_add_path(router, rule->path, bit);
+	}
+
+	return router;
+}
+
+/* under the lock, readers still on the old router are waited for */
+static int tlb_routes_rebuild(struct tlb_routes *routes)
+{
+	struct tlb_router *router = NULL, *old;
+
+	if (routes->nr_rules) {
+		router = tlb_router_build(routes->rules, routes->nr_rules);
+		if (!router)
+			return -ENOMEM;
+	}
+
+	old = rcu_dereference_protected(routes->router, lockdep_is_held(&routes->lock));
+	rcu_assign_pointer(routes->router, router);
+	synchronize_rcu();
+	kvfree(old);
+	return 0;
+}
+
+static int tlb_route_set(char *dst, size_t size, const char *src)
+{
+	if (!*src || strscpy(dst, src, size) < 0)
+		return -EINVAL;
+	return 0;
+}
+
+/* "group [host=h] [path=/p] [method=m] [header=name:value | cookie=name:value]" */
+int tlb_routes_parse_rule(char *str, struct tlb_route_rule *rule)
+{
+	char *token, *value, *sep;
+	int r;
+
+	memset(rule, 0, sizeof(*rule));
+	token = strsep(&str, " \n");
+	if (!token || tlb_route_set(rule->group, sizeof(rule->group), token))
+		return -EINVAL;
+
+	while ((token = strsep(&str, " \n")) != NULL) {
+		if (!*token)
+			continue;
+		value = strchr(token, '=');
+		if (!value)
+			return -EINVAL;
+		*value++ = '\0';
+
+		if (!strcmp(token, "host"))
+			r = tlb_route_set(rule->host, sizeof(rule->host), value);
+		else if (!strcmp(token, "path"))
+			r = tlb_route_set(rule->path, sizeof(rule->path), value);
+		else if (!strcmp(token, "method"))
+			r = tlb_route_set(rule->method, sizeof(rule->method), value);
+		else if (!strcmp(token, "header") || !strcmp(token, "cookie")) {
+			rule->kv_type = strcmp(token, "header") ? TLB_ROUTE_COOKIE : TLB_ROUTE_HEADER;
+			sep = strchr(value, ':');
+			if (!sep)
+				return -EINVAL;
+			*sep++ = '\0';
+			r = tlb_route_set(rule->kv_name, sizeof(rule->kv_name), value);
+			if (!r)
+				r = tlb_route_set(rule->kv_value, sizeof(rule->kv_value), sep);
+		} else
+			r = -EINVAL;
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+int tlb_routes_add(struct tlb_routes *routes, struct tlb_route_rule *rule)
+{
+	int r;
+
+	mutex_lock(&routes->lock);
+	if (routes->nr_rules == TLB_ROUTE_MAX_RULES) {
+		r = -ENOSPC;
+		goto unlock;
+	}
+
+	routes->rules[routes->nr_rules] = *rule;
+	WRITE_ONCE(routes->nr_rules, routes->nr_rules + 1);
+	r = tlb_routes_rebuild(routes);
+	if (r)
+		WRITE_ONCE(routes->nr_rules, routes->nr_rules - 1);
+unlock:
+	mutex_unlock(&routes->lock);
+	return r;
+}
+
+/* later rules move up, indexes are also priorities */
+int tlb_routes_del(struct tlb_routes *routes, int index)
+{
+	struct tlb_route_rule rule;
+	int r;
+
+	mutex_lock(&routes->lock);
+	if (index < 0 || index >= routes->nr_rules) {
+		r = -ENOENT;
+		goto unlock;
+	}
+
+	rule = routes->rules[index];
+	memmove(&routes->rules[index], &routes->rules[index + 1],
+		(routes->nr_rules - index - 1) * sizeof(routes->rules[0]));
+	WRITE_ONCE(routes->nr_rules, routes->nr_rules - 1);
+	r = tlb_routes_rebuild(routes);
+	if (r) {
+		memmove(&routes->rules[index + 1], &routes->rules[index],
+			(routes->nr_rules - index) * sizeof(routes->rules[0]));
+		routes->rules[index] = rule;
+		WRITE_ONCE(routes->nr_rules, routes->nr_rules + 1);
+	}
+unlock:
+	mutex_unlock(&routes->lock);
+	return r;
+}
+
+int tlb_routes_clear(struct tlb_routes *routes)
+{
+	int r;
+
+	mutex_lock(&routes->lock);
+	WRITE_ONCE(routes->nr_rules, 0);
+	r = tlb_routes_rebuild(routes);
+	mutex_unlock(&routes->lock);
+	return r;
+}
+
+ssize_t tlb_routes_show(struct tlb_routes *routes, char *buf, size_t size)
+{
+	struct tlb_route_rule *rule;
+	ssize_t off = 0;
+	int i;
+
+	mutex_lock(&routes->lock);
+	for (i = 0; i < routes->nr_rules; i++) {
+		rule = &routes->rules[i];
+		off += scnprintf(buf + off, size - off, "%d %s", i, rule->group);
+		if (rule->host[0])
+			off += scnprintf(buf + off, size - off, " host=%s", rule->host);
+		if (rule->path[0])
+			off += scnprintf(buf + off, size - off, " path=%s", rule->path);
+		if (rule->method[0])
+			off += scnprintf(buf + off, size - off, " method=%s", rule->method);
+		if (rule->kv_type != TLB_ROUTE_ANY)
+			off += scnprintf(buf + off, size - off, " %s=%s:%s",
+					 rule->kv_type == TLB_ROUTE_HEADER ? "header" : "cookie",
+					 rule->kv_name, rule->kv_value);
+		off += scnprintf(buf + off, size - off, "\n");
+	}
+	mutex_unlock(&routes->lock);
+	return off;
+}
+
+static u64 tlb_router_names_match(struct tlb_route_name *names, int nr_names, u64 any, struct tlb_http_str *str)
+{
+	int i;
+
+	for (i = 0; i < nr_names; i++)
+		if (tlb_http_str_caseeq(str, names[i].name))
+			return any | names[i].rules;
+	return any;
+}
+
+static u64 tlb_router_path_match(struct tlb_router *router, struct tlb_http_str *path)
+{
+	struct tlb_route_node *nodes = router->nodes;
+	u64 rules = nodes[0].rules;
+	int node = 0, child;
+	u32 i;
+
+	for (i = 0; i < path->len; i++) {
+		for (child = nodes[node].child; child; child = nodes[child].next)
+			if (nodes[child].c == path->s[i])
+				break;
+		if (!child)
+			break;
+		node = child;
+		rules |= nodes[node].rules;
+	}
+
+	return rules;
+}
+
+static bool tlb_route_kv_match(struct tlb_route_rule *rule, struct tlb_http_req *req)
+{
+	struct tlb_http_str value;
+
+	switch (rule->kv_type) {
+	case TLB_ROUTE_HEADER:
+		return tlb_http_header(&req->headers, rule->kv_name, &value) &&
+		       tlb_http_str_eq(&value, rule->kv_value);
+	case TLB_ROUTE_COOKIE:
+		return tlb_http_cookie(&req->headers, rule->kv_name, &value) &&
+		       tlb_http_str_eq(&value, rule->kv_value);
+	default:
+		return true;
+	}
+}
+
+/* copies the group of the first matching rule, group has TLB_GROUP_NAME_SIZE bytes */
+bool tlb_routes_match(struct tlb_routes *routes, struct tlb_http_req *req, char *group)
+{
+	struct tlb_router *router;
+	u64 rules;
+	bool found = false;
+	int i;
+
+	rcu_read_lock();
+	router = rcu_dereference(routes->router);
+	if (!router)
+		goto unlock;
+
+	rules = tlb_router_path_match(router, &req->path);
+	rules &= tlb_router_names_match(router->hosts, router->nr_hosts, router->any_host, &req->host);
+	rules &= tlb_router_names_match(router->methods, router->nr_methods, router->any_method, &req->method);
+	while (rules) {
+		i = __ffs64(rules);
+		rules &= rules - 1;
+		if (tlb_route_kv_match(&router->rules[i], req)) {
+			strscpy(group, router->rules[i].group, TLB_GROUP_NAME_SIZE);
+			found = true;
+			break;
+		}
+	}
+unlock:
+	rcu_read_unlock();
+
+	atomic64_inc(found ? &routes->matched : &routes->unmatched);
+	return found;
+}
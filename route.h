@@ -0,0 +1,87 @@
+#pragma once
+
+#include "base.h"
+#include "http.h"
+
+#define TLB_ROUTE_MAX_RULES 64
+#define TLB_GROUP_NAME_SIZE 32
+#define TLB_ROUTE_STR_SIZE 128
+#define TLB_ROUTE_METHOD_SIZE 16
+#define TLB_ROUTE_NAME_SIZE 64
+
+enum {
+	TLB_ROUTE_ANY = 0,
+	TLB_ROUTE_HEADER,
+	TLB_ROUTE_COOKIE,
+};
+
+/* empty strings match anything */
+struct tlb_route_rule {
+	char group[TLB_GROUP_NAME_SIZE];
+	char host[TLB_ROUTE_STR_SIZE];
+	char path[TLB_ROUTE_STR_SIZE];
+	char method[TLB_ROUTE_METHOD_SIZE];
+	int kv_type;
+	char kv_name[TLB_ROUTE_NAME_SIZE];
+	char kv_value[TLB_ROUTE_STR_SIZE];
+};
+
+/* a byte of a path prefix, with the rules whose prefix ends here */
+struct tlb_route_node {
+	u64 rules;
+	u16 child;
+	u16 next;
+	char c;
+};
+
+struct tlb_route_name {
+	const char *name;
+	u64 rules;
+};
+
+/*
+ * Rules compiled into bit sets: one per distinct host and method, and a
+ * path prefix trie whose walk collects the rules of every prefix on the
+ * way. The lowest rule left after and-ing them whose header or cookie
+ * matches wins. Immutable once built, replaced as a whole under RCU.
+ */
+struct tlb_router {
+	int nr_rules;
+	struct tlb_route_rule rules[TLB_ROUTE_MAX_RULES];
+	u64 any_host;
+	u64 any_method;
+	struct tlb_route_name hosts[TLB_ROUTE_MAX_RULES];
+	int nr_hosts;
+	struct tlb_route_name methods[TLB_ROUTE_MAX_RULES];
+	int nr_methods;
+	int nr_nodes;
+	struct tlb_route_node nodes[];
+};
+
+struct tlb_routes {
+	struct mutex lock;
+	struct tlb_route_rule rules[TLB_ROUTE_MAX_RULES];
+	int nr_rules;
+	struct tlb_router __rcu *router;
+
+	atomic64_t matched;
+	atomic64_t unmatched;
+};
+
+void tlb_routes_init(struct tlb_routes *routes);
+
+void tlb_routes_deinit(struct tlb_routes *routes);
+
+bool tlb_routes_enabled(struct tlb_routes *routes);
+
+int tlb_routes_parse_rule(char *str, struct tlb_route_rule *rule);
+
+int tlb_routes_add(struct tlb_routes *routes, struct tlb_route_rule *rule);
+
+int tlb_routes_del(struct tlb_routes *routes, int index);
+
+int tlb_routes_clear(struct tlb_routes *routes);
+
+ssize_t tlb_routes_show(struct tlb_routes *routes, char *buf, size_t size);
+
+bool tlb_routes_match(struct tlb_routes *routes, struct tlb_http_req *req, char *group);
@@ -0,0 +1,69 @@
+#!/bin/bash
+# Attaches bpf/xdp_block.bpf.o to $1 (generic XDP unless XDP_MODE=xdpdrv)
+# and mirrors /sys/fs/tlb/blocklist_dump into its pinned LPM maps once a second.
+set -e
+
+DEV=$1
+MODE=${XDP_MODE:-xdpgeneric}
+PIN=/sys/fs/bpf
+
+# maps are pinned by name under $PIN
+bpftool prog load bpf/xdp_block.bpf.o $PIN/tlb_xdp_block
+bpftool net attach $MODE pinned $PIN/tlb_xdp_block dev $DEV
+
+# "10.0.0.0/8" -> map name and LPM key bytes: prefix length (host order), address
+key() {
+	python3 - "$1" <<'PY'
+import ipaddress, struct, sys
+net = ipaddress.ip_network(sys.argv[1], strict=False)
+key = struct.pack("<I", net.prefixlen) + net.network_address.packed
+print("tlb_block%d" % (4 if net.version == 4 else 6), " ".join("%02x" % b for b in key))
+PY
+}
+
+# blocklist_dump records (family, prefix length, ms_left, address) -> "10.0.0.0/8"
+prefixes() {
+	python3 - <<'PY'
+import ipaddress, socket, struct
+data = open("/sys/fs/tlb/blocklist_dump", "rb").read()
+for off in range(0, len(data) - len(data) % 24, 24):
+    family, prefix_len, _, addr = struct.unpack_from("<HHI16s", data, off)
+    if family == socket.AF_INET:
+        print("%s/%d" % (ipaddress.IPv4Address(addr[:4]), prefix_len))
+    elif family == socket.AF_INET6:
+        print("%s/%d" % (ipaddress.IPv6Address(addr), prefix_len))
+PY
+}
+
+shutdown() {
+	bpftool net detach $MODE dev $DEV
+	rm -f $PIN/tlb_xdp_block $PIN/tlb_block4 $PIN/tlb_block6
+	exit 0
+}
+
+trap shutdown SIGINT
+trap shutdown SIGTERM
+
+declare -A synced
+while true; do
+	declare -A current=()
+	while read -r prefix; do
+		[ -n "$prefix" ] || continue
+		current[$prefix]=1
+		if [ -z "${synced[$prefix]}" ]; then
+			read -r map bytes <<< "$(key $prefix)"
+			bpftool map update pinned $PIN/$map key hex $bytes value hex 00 00 00 00 00 00 00 00 || true
+			synced[$prefix]=1
+		fi
+	done < <(prefixes)
+
+	for prefix in "${!synced[@]}"; do
+		if [ -z "${current[$prefix]}" ]; then
+			read -r map bytes <<< "$(key $prefix)"
+			bpftool map delete pinned $PIN/$map key hex $bytes || true
+			unset "synced[$prefix]"
+		fi
+	done
+	unset current
+	sleep 1
+done
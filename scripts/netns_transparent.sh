@@ -0,0 +1,71 @@
+#!/bin/bash
+# Client (tlb_cl) -> tlb (root ns) -> backend (tlb_be) with transparent
+# source IP: the backend must see 10.0.1.2, not 10.0.2.1.
+set -e
+
+CL_NS=tlb_cl
+BE_NS=tlb_be
+
+ip netns add $CL_NS
+ip netns add $BE_NS
+
+ip link add tlb_cl1 type veth peer name tlb_cl0
+ip link set tlb_cl0 netns $CL_NS
+ip link add tlb_be1 type veth peer name tlb_be0
+ip link set tlb_be0 netns $BE_NS
+
+ip addr add 10.0.1.1/24 dev tlb_cl1
+ip link set tlb_cl1 up
+ip addr add 10.0.2.1/24 dev tlb_be1
+ip link set tlb_be1 up
+
+ip netns exec $CL_NS ip addr add 10.0.1.2/24 dev tlb_cl0
+ip netns exec $CL_NS ip link set tlb_cl0 up
+ip netns exec $CL_NS ip link set lo up
+ip netns exec $CL_NS ip route add default via 10.0.1.1
+
+ip netns exec $BE_NS ip addr add 10.0.2.2/24 dev tlb_be0
+ip netns exec $BE_NS ip link set tlb_be0 up
+ip netns exec $BE_NS ip link set lo up
+ip netns exec $BE_NS ip route add default via 10.0.2.1
+
+# replies from the backend are addressed to the client: deliver them
+# locally to the transparent target socket instead of forwarding
+sysctl -q -w net.ipv4.ip_forward=1
+iptables -t mangle -A PREROUTING -i tlb_be1 -m socket --transparent -j MARK --set-mark 1
+ip rule add fwmark 1 lookup 100
+ip route add local 0.0.0.0/0 dev lo table 100
+
+modprobe dns-resolver
+insmod tlb.ko
+echo 1 > /sys/fs/tlb/transparent
+echo '10.0.1.1 7777' > /sys/fs/tlb/start_server
+echo '10.0.2.2 8080' > /sys/fs/tlb/add_target
+
+ip netns exec $BE_NS go run test/server.go -address 10.0.2.2:8080 2>1 1>/dev/null &
+BACK1=$!
+
+shutdown() {
+	kill $BACK1
+	rmmod tlb
+	ip route del local 0.0.0.0/0 dev lo table 100
+	ip rule del fwmark 1 lookup 100
+	iptables -t mangle -D PREROUTING -i tlb_be1 -m socket --transparent -j MARK --set-mark 1
+	ip link del tlb_cl1
+	ip link del tlb_be1
+	ip netns del $CL_NS
+	ip netns del $BE_NS
+	exit 0
+}
+
+trap shutdown SIGINT
+trap shutdown SIGTERM
+
+sleep 5
+ip netns exec $CL_NS curl -s http://10.0.1.1:7777/blank
+echo "backend peers (expect 10.0.1.2):"
+ip netns exec $BE_NS ss -tan | grep 10.0.2.2:8080 || true
+
+while true; do
+	sleep 1
+done
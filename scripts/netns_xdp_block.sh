@@ -0,0 +1,56 @@
+#!/bin/bash
+# Client (tlb_cl) -> tlb (root ns): once the client is on the blocklist its
+# SYNs must be dropped by generic XDP on tlb_cl1, then pass again when it's
+# taken off.
+set -e
+
+CL_NS=tlb_cl
+
+ip netns add $CL_NS
+ip link add tlb_cl1 type veth peer name tlb_cl0
+ip link set tlb_cl0 netns $CL_NS
+ip addr add 10.0.1.1/24 dev tlb_cl1
+ip link set tlb_cl1 up
+ip netns exec $CL_NS ip addr add 10.0.1.2/24 dev tlb_cl0
+ip netns exec $CL_NS ip link set tlb_cl0 up
+ip netns exec $CL_NS ip link set lo up
+
+clang -O2 -g -target bpf -c bpf/xdp_block.bpf.c -o bpf/xdp_block.bpf.o
+
+modprobe dns-resolver
+insmod tlb.ko
+echo '10.0.1.1 7777' > /sys/fs/tlb/start_server
+echo '127.0.0.1 8080' > /sys/fs/tlb/add_target
+
+go run test/server.go -address 127.0.0.1:8080 2>1 1>/dev/null &
+BACK1=$!
+scripts/blocklist_sync.sh tlb_cl1 &
+SYNC=$!
+
+shutdown() {
+	kill $SYNC
+	wait $SYNC || true
+	kill $BACK1
+	rmmod tlb
+	ip link del tlb_cl1
+	ip netns del $CL_NS
+}
+
+trap shutdown EXIT
+
+fetch() {
+	ip netns exec $CL_NS curl -s -o /dev/null --max-time 2 http://10.0.1.1:7777/blank
+}
+
+sleep 5
+fetch && echo "before block: ok" || echo "before block: FAIL"
+
+echo 'add 10.0.1.2/32' > /sys/fs/tlb/blocklist
+sleep 2
+fetch && echo "blocked: FAIL, connected" || echo "blocked: ok, dropped"
+bpftool map dump pinned /sys/fs/bpf/tlb_block4
+cat /sys/fs/tlb/block_stats
+
+echo 'del 10.0.1.2/32' > /sys/fs/tlb/blocklist
+sleep 2
+fetch && echo "unblocked: ok" || echo "unblocked: FAIL"
@@ -0,0 +1,71 @@
+#include "select.h"
+#include "server.h"
+
+struct tlb_select_buf {
+	struct tlb_select_ctx ctx;
+	struct tlb_target *targets[TLB_SELECT_MAX_TARGETS];
+};
+
+static DEFINE_PER_CPU(struct tlb_select_buf, tlb_select_bufs);
+
+/*
+ * The attach point, without a program nothing is picked. On the error
+ * injection list so a kprobe may override the return, modules have that
+ * since 4.16.
+ */
+noinline int tlb_select_target_hook(struct tlb_select_ctx *ctx)
+{
+	return -ENOENT;
+}
+ALLOW_ERROR_INJECTION(tlb_select_target_hook, ERRNO);
+
+/* under the target lock, which keeps the cpu and its buffer ours */
+struct tlb_select_ctx *tlb_select_begin(struct tlb_server *srv, struct sockaddr_storage *client)
+{
+	struct tlb_select_ctx *ctx = &this_cpu_ptr(&tlb_select_bufs)->ctx;
+
+	if (client)
+		ctx->client = *client;
+	else
+		memset(&ctx->client, 0, sizeof(ctx->client));
+	ctx->listen_port = srv->port;
+	ctx->mode = READ_ONCE(srv->mode);
+	ctx->cpu = smp_processor_id();
+	ctx->nr_targets = 0;
+	return ctx;
+}
+
+void tlb_select_add(struct tlb_select_ctx *ctx, struct tlb_target *target)
+{
+	struct tlb_select_buf *buf = container_of(ctx, struct tlb_select_buf, ctx);
+	struct tlb_select_target *st;
+
+	if (ctx->nr_targets >= TLB_SELECT_MAX_TARGETS)
+		return;
+
+	st = &ctx->targets[ctx->nr_targets];
+	st->id = target->id;
+	st->port = target->port;
+	st->active_cons = atomic64_read(&target->active_cons);
+	st->total_cons = atomic64_read(&target->total_cons);
+	st->total_con_time_us = READ_ONCE(target->total_con_time_us);
+	buf->targets[ctx->nr_targets++] = target;
+}
+
+struct tlb_target *tlb_select_run(struct tlb_server *srv, struct tlb_select_ctx *ctx)
+{
+	struct tlb_select_buf *buf = container_of(ctx, struct tlb_select_buf, ctx);
+	int i;
+
+	if (!ctx->nr_targets)
+		return NULL;
+
+	i = tlb_select_target_hook(ctx);
+	if (i < 0 || i >= ctx->nr_targets) {
+		atomic64_inc(&srv->select_fallbacks);
+		return NULL;
+	}
+
+	atomic64_inc(&srv->select_picks);
+	return buf->targets[i];
+}
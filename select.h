@@ -0,0 +1,21 @@
+#pragma once
+
+#include "base.h"
+#include "bpf/tlb_select.h"
+
+struct tlb_server;
+struct tlb_target;
+
+/*
+ * Called with a ctx filled under the target lock with preemption off. A
+ * kprobe program on it returns an index into ctx->targets[] through
+ * bpf_override_return(), anything else falls back to least connections.
+ * Only the first TLB_SELECT_MAX_TARGETS targets are offered.
+ */
+int tlb_select_target_hook(struct tlb_select_ctx *ctx);
+
+struct tlb_select_ctx *tlb_select_begin(struct tlb_server *srv, struct sockaddr_storage *client);
+
+void tlb_select_add(struct tlb_select_ctx *ctx, struct tlb_target *target);
+
+struct tlb_target *tlb_select_run(struct tlb_server *srv, struct tlb_select_ctx *ctx);
@@ -0,0 +1,128 @@
+#include "sendq.h"
+
+struct tlb_sendq_buf {
+	struct list_head list;
+	u32 len;
+	u32 off;
+	u8 data[];
+};
+
+void tlb_sendq_init(struct tlb_sendq *q)
+{
+	INIT_LIST_HEAD(&q->list);
+	q->bytes = 0;
+}
+
+void tlb_sendq_purge(struct tlb_sendq *q)
+{
+	struct tlb_sendq_buf *buf, *tmp;
+
+	list_for_each_entry_safe(buf, tmp, &q->list, list) {
+		list_del(&buf->list);
+		kfree(buf);
+	}
+	q->bytes = 0;
+}
+
+static struct tlb_sendq_buf *tlb_sendq_alloc(struct tlb_sendq *q, u32 len)
+{
+	struct tlb_sendq_buf *buf;
+
+	buf = kmalloc(sizeof(*buf) + len, GFP_KERNEL);
+	if (!buf)
+		return NULL;
+
+	buf->len = len;
+	buf->off = 0;
+	list_add_tail(&buf->list, &q->list);
+	q->bytes += len;
+	return buf;
+}
+
+int tlb_sendq_append(struct tlb_sendq *q, const void *data, u32 len)
+{
+	struct tlb_sendq_buf *buf;
+
+	if (!len)
+		return 0;
+
+	buf = tlb_sendq_alloc(q, len);
+	if (!buf)
+		return -ENOMEM;
+
+	memcpy(buf->data, data, len);
+	return 0;
+}
+
+void tlb_sendq_splice(struct tlb_sendq *q, struct tlb_sendq *from)
+{
+	list_splice_tail_init(&from->list, &q->list);
+	q->bytes += from->bytes;
+	from->bytes = 0;
+}
+
+/* send right away if nothing is queued, queue whatever didn't fit */
+int tlb_sendq_write_kvec(struct tlb_sendq *q, struct socket *sock, struct kvec *vec, int nr, u32 total)
+{
+	struct tlb_sendq_buf *buf;
+	u32 skip = 0, off, n;
+	int i, r;
+
+	if (list_empty(&q->list)) {
+		r = ksock_send_kvec(sock, vec, nr, total);
+		if (r < 0 && r != -EAGAIN)
+			return r;
+		if (r > 0)
+			skip = r;
+		if (skip == total)
+			return 0;
+	}
+
+	buf = tlb_sendq_alloc(q, total - skip);
+	if (!buf)
+		return -ENOMEM;
+
+	off = 0;
+	for (i = 0; i < nr; i++) {
+		if (skip >= vec[i].iov_len) {
+			skip -= vec[i].iov_len;
+			continue;
+		}
+		n = vec[i].iov_len - skip;
+		memcpy(buf->data + off, (u8 *)vec[i].iov_base + skip, n);
+		off += n;
+		skip = 0;
+	}
+	return 0;
+}
+
+int tlb_sendq_write(struct tlb_sendq *q, struct socket *sock, const void *data, u32 len)
+{
+	struct kvec vec;
+
+	vec.iov_base = (void *)data;
+	vec.iov_len = len;
+	return tlb_sendq_write_kvec(q, sock, &vec, 1, len);
+}
+
+int tlb_sendq_flush(struct tlb_sendq *q, struct socket *sock)
+{
+	struct tlb_sendq_buf *buf;
+	int r;
+
+	while (!list_empty(&q->list)) {
+		buf = list_first_entry(&q->list, struct tlb_sendq_buf, list);
+		r = ksock_send(sock, buf->data + buf->off, buf->len - buf->off);
+		if (r < 0)
+			return (r == -EAGAIN) ? 0 : r;
+
+		buf->off += r;
+		q->bytes -= r;
+		if (buf->off == buf->len) {
+			list_del(&buf->list);
+			kfree(buf);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "base.h"
+#include "ksock.h"
+
+/* bytes that didn't fit into a nonblocking socket, sent in order later */
+struct tlb_sendq {
+	struct list_head list;
+	u32 bytes;
+};
+
+void tlb_sendq_init(struct tlb_sendq *q);
+
+void tlb_sendq_purge(struct tlb_sendq *q);
+
+int tlb_sendq_append(struct tlb_sendq *q, const void *data, u32 len);
+
+void tlb_sendq_splice(struct tlb_sendq *q, struct tlb_sendq *from);
+
+int tlb_sendq_write_kvec(struct tlb_sendq *q, struct socket *sock, struct kvec *vec, int nr, u32 total);
+
+int tlb_sendq_write(struct tlb_sendq *q, struct socket *sock, const void *data, u32 len);
+
+int tlb_sendq_flush(struct tlb_sendq *q, struct socket *sock);
+
+static inline bool tlb_sendq_empty(struct tlb_sendq *q)
+{
+	return list_empty(&q->list);
+}
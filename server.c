@@ -3,7 +3,8 @@
 
 struct kmem_cache *g_con_cache;
 struct kmem_cache *g_target_con_cache;
-struct kmem_cache *g_con_buf_cache;
+struct tlb_arena g_con_buf_arena;
+struct kmem_cache *g_udp_flow_cache;
 
 void tlb_server_unlink_con(struct tlb_server *srv, struct tlb_con *con)
 {
@@ -12,31 +13,156 @@ void tlb_server_unlink_con(struct tlb_server *srv, struct tlb_con *con)
 	spin_unlock(&srv->con_list_lock);
 }
 
+static bool tlb_server_thread_overloaded(struct tlb_server *srv, struct coroutine_thread *thread)
+{
+	unsigned int queue_len = READ_ONCE(srv->overload_queue_len);
+	unsigned int latency_us = READ_ONCE(srv->overload_latency_us);
+
+	if (queue_len && coroutine_thread_queue_len(thread) >= queue_len)
+		return true;
+	if (latency_us && coroutine_thread_latency_ns(thread) >= (u64)latency_us * NSEC_PER_USEC)
+		return true;
+	return false;
+}
+
+/* round robin over the threads that keep up, NULL if none does */
+static struct coroutine_thread *tlb_server_pick_con_thread(struct tlb_server *srv)
+{
+	struct coroutine_thread *thread;
+	int i;
+
+	for (i = 0; i < srv->nr_con_thread; i++) {
+		thread = &srv->con_thread[(unsigned int)atomic_inc_return(&srv->next_con_thread) % srv->nr_con_thread];
+		if (!tlb_server_thread_overloaded(srv, thread))
+			return thread;
+	}
+
+	return NULL;
+}
+
+/*
+ * Least loaded thread on another core of the same package. The LLC masks
+ * aren't available to modules, on most machines the package shares one.
+ */
+struct coroutine_thread *tlb_server_pick_sibling_thread(struct tlb_server *srv, struct coroutine_thread *thread)
+{
+	struct coroutine_thread *sibling, *best = NULL;
+	int i;
+
+	for (i = 0; i < srv->nr_con_thread; i++) {
+		sibling = &srv->con_thread[i];
+		if (!cpumask_test_cpu(sibling->cpu, topology_core_cpumask(thread->cpu)) ||
+		    cpumask_test_cpu(sibling->cpu, topology_sibling_cpumask(thread->cpu)))
+			continue;
+		if (tlb_server_thread_overloaded(srv, sibling))
+			continue;
+		if (!best || coroutine_thread_queue_len(sibling) < coroutine_thread_queue_len(best))
+			best = sibling;
+	}
+
+	return best;
+}
+
+static bool tlb_server_overloaded(struct tlb_server *srv)
+{
+	int i;
+
+	for (i = 0; i < srv->nr_con_thread; i++) {
+		if (!tlb_server_thread_overloaded(srv, &srv->con_thread[i]))
+			return false;
+	}
+
+	return true;
+}
+
 static int tlb_server_listen_thread_routine(void *arg)
 {
 	struct tlb_server *srv = (struct tlb_server *)arg;
 	struct socket *sock;
 	struct ksock_callbacks callbacks;
+	struct sockaddr_storage peer_addr;
+	struct tlb_admission_ticket ticket;
+	struct ksock_opts opts;
+	struct coroutine_thread *thread;
 	struct tlb_con *con;
+	unsigned int max_cons;
 	int r;
 
 	while (!kthread_should_stop() && srv->state != TLB_SRV_STOPPING) {
-		con = tlb_con_create(srv);
-		if (!con)
-			break;
+		/* leave new clients in the backlog until the threads catch up */
+		if (READ_ONCE(srv->overload_action) == TLB_OVERLOAD_PAUSE && tlb_server_overloaded(srv)) {
+			atomic64_inc(&srv->accept_pauses);
+			msleep_interruptible(TLB_OVERLOAD_PAUSE_MS);
+			continue;
+		}
 
-		callbacks.user_data = con;
-		callbacks.state_change = tlb_con_state_change;
-		callbacks.data_ready = tlb_con_data_ready;
-		callbacks.write_space = tlb_con_write_space;
+		/* at the limit the backlog absorbs new clients, not our memory */
+		max_cons = READ_ONCE(srv->max_cons);
+		if (max_cons && atomic_read(&srv->nr_cons) >= max_cons) {
+			atomic64_inc(&srv->accept_waits);
+			wait_event_interruptible_timeout(srv->cons_waitq,
+				atomic_read(&srv->nr_cons) < READ_ONCE(srv->max_cons) ||
+				kthread_should_stop() || srv->state == TLB_SRV_STOPPING,
+				msecs_to_jiffies(100));
+			continue;
+		}
 
-		r = ksock_accept(&sock, srv->listen_sock, &callbacks);
+		r = ksock_accept(&sock, srv->listen_sock, NULL);
 		if (r) {
 			pr_err("tlb: accept r %d\n", r);
-			tlb_con_delete(con);
 			continue;
 		}
 
+		r = ksock_getpeername(sock, &peer_addr);
+		if (r) {
+			pr_err("tlb: getpeername r %d\n", r);
+			ksock_release(sock);
+			continue;
+		}
+
+		/* refused clients cost an accept and a reset, nothing more */
+		if (tlb_blocklist_check(&srv->blocklist, &peer_addr)) {
+			ksock_reset(sock);
+			continue;
+		}
+
+		r = tlb_admission_check(&srv->admission, &peer_addr, &ticket);
+		if (r) {
+			if (r == -EAGAIN)
+				tlb_blocklist_flood(&srv->blocklist, &peer_addr);
+			ksock_reset(sock);
+			continue;
+		}
+
+		thread = tlb_server_pick_con_thread(srv);
+		if (!thread) {
+			atomic64_inc(&srv->shed_cons);
+			tlb_admission_release(&srv->admission, &ticket);
+			if (READ_ONCE(srv->overload_action) == TLB_OVERLOAD_CLOSE)
+				ksock_release(sock);
+			else
+				ksock_reset(sock);
+			continue;
+		}
+
+		con = tlb_con_create(srv, thread);
+		if (!con) {
+			tlb_admission_release(&srv->admission, &ticket);
+			ksock_release(sock);
+			break;
+		}
+		con->peer_addr = peer_addr;
+		con->ticket = ticket;
+		tlb_server_get_opts(srv, &srv->client_opts, &opts);
+		ksock_set_opts(sock, &opts);
+		coroutine_set_prio(con->co, tlb_prio_classify(&srv->prio, &peer_addr));
+
+		callbacks.user_data = con;
+		callbacks.state_change = tlb_con_state_change;
+		callbacks.data_ready = tlb_con_data_ready;
+		callbacks.write_space = tlb_con_write_space;
+		ksock_set_callbacks(sock, &callbacks);
+
 		con->start_time = ktime_get();
 		spin_lock(&srv->con_list_lock);
 		list_add_tail(&con->list_entry, &srv->con_list);
@@ -48,10 +174,128 @@ static int tlb_server_listen_thread_routine(void *arg)
 	return 0;
 }
 
+/* client and target side each have a coroutine, a stack and a buffer */
+static unsigned int tlb_server_default_max_cons(void)
+{
+	struct sysinfo si;
+	u64 footprint, mem;
+
+	footprint = sizeof(struct tlb_con) + sizeof(struct tlb_target_con) +
+		    2 * (sizeof(struct coroutine) + COROUTINE_STACK_SIZE + TLB_CON_BUF_SIZE) +
+		    TLB_CON_SOCK_FOOTPRINT;
+
+	si_meminfo(&si);
+	mem = (u64)si.totalram * si.mem_unit / 4;
+	return min_t(u64, div64_u64(mem, footprint), INT_MAX);
+}
+
 int tlb_server_init(struct tlb_server *srv)
 {
+	int r;
+
 	mutex_init(&srv->lock);
 	srv->state = TLB_SRV_INITED;
+	srv->transparent = false;
+	spin_lock_init(&srv->sockopt_lock);
+	memset(&srv->client_opts, 0, sizeof(srv->client_opts));
+	memset(&srv->target_opts, 0, sizeof(srv->target_opts));
+	tlb_srcpool_init(&srv->srcpool);
+	srv->target_close = TLB_TARGET_CLOSE_FIN;
+	atomic64_set(&srv->target_resets, 0);
+	srv->max_cons = tlb_server_default_max_cons();
+	atomic_set(&srv->nr_cons, 0);
+	init_waitqueue_head(&srv->cons_waitq);
+	atomic64_set(&srv->accept_waits, 0);
+	srv->overload_queue_len = 0;
+	srv->overload_latency_us = 0;
+	srv->overload_action = TLB_OVERLOAD_RESET;
+	atomic64_set(&srv->shed_cons, 0);
+	atomic64_set(&srv->accept_pauses, 0);
+	srv->client_idle_ms = 0;
+	srv->target_idle_ms = 0;
+	srv->min_rate = 0;
+	srv->min_rate_window_ms = 0;
+	atomic64_set(&srv->idle_timeouts, 0);
+	atomic64_set(&srv->slow_timeouts, 0);
+	spin_lock_init(&srv->mirror_lock);
+	srv->mirror = NULL;
+	srv->mirror_percent = 0;
+	atomic64_set(&srv->mirror_cons, 0);
+	atomic64_set(&srv->mirror_drops, 0);
+	srv->mode = TLB_SRV_MODE_TCP;
+	srv->h2_pool_size = TLB_H2_POOL_SIZE;
+	srv->http_cache_size = 0;
+	atomic64_set(&srv->http_cache_hits, 0);
+	atomic64_set(&srv->http_cache_misses, 0);
+	atomic64_set(&srv->http_cache_stores, 0);
+	atomic64_set(&srv->http_cache_evictions, 0);
+	tlb_udp_server_init(&srv->udp, srv);
+	tlb_prio_init(&srv->prio);
+	tlb_sticky_init(&srv->sticky);
+	tlb_routes_init(&srv->routes);
+	tlb_shaper_init(&srv->shaper, 0, 0);
+	srv->con_rate = 0;
+	srv->con_burst = 0;
+	atomic64_set(&srv->con_shape_waits, 0);
+	srv->split_rate = 0;
+	atomic64_set(&srv->split_cons, 0);
+	srv->subset_size = 0;
+	srv->subset_threads = 1;
+	srv->subsets = NULL;
+	atomic64_set(&srv->subset_misses, 0);
+	srv->select_bpf = false;
+	atomic64_set(&srv->select_picks, 0);
+	atomic64_set(&srv->select_fallbacks, 0);
+	srv->replay_size = 0;
+	atomic64_set(&srv->replays, 0);
+	atomic64_set(&srv->replay_fails, 0);
+
+	r = tlb_blocklist_init(&srv->blocklist);
+	if (r)
+		return r;
+
+	r = tlb_admission_init(&srv->admission);
+	if (r) {
+		tlb_blocklist_deinit(&srv->blocklist);
+		return r;
+	}
+
+	return 0;
+}
+
+void tlb_server_deinit(struct tlb_server *srv)
+{
+	tlb_srcpool_deinit(&srv->srcpool);
+	tlb_sticky_deinit(&srv->sticky);
+	tlb_routes_deinit(&srv->routes);
+	tlb_admission_deinit(&srv->admission);
+	tlb_blocklist_deinit(&srv->blocklist);
+}
+
+int tlb_server_set_sticky(struct tlb_server *srv, int nr_entries, unsigned int ttl_ms, int prefix4, int prefix6)
+{
+	int r;
+
+	mutex_lock(&srv->lock);
+	if (srv->state != TLB_SRV_INITED)
+		r = -EBUSY;
+	else
+		r = tlb_sticky_set(&srv->sticky, nr_entries, ttl_ms, prefix4, prefix6);
+	mutex_unlock(&srv->lock);
+	return r;
+}
+
+/* cached subsets and kv rings are rebuilt on the next pick */
+int tlb_server_set_subset(struct tlb_server *srv, unsigned int size, unsigned int threads)
+{
+	if (size > TLB_SUBSET_MAX_SIZE || !threads)
+		return -EINVAL;
+
+	write_lock(&srv->target_lock);
+	srv->subset_size = size;
+	srv->subset_threads = threads;
+	atomic_inc(&srv->target_gen);
+	write_unlock(&srv->target_lock);
 	return 0;
 }
 
@@ -60,6 +304,7 @@ int tlb_server_start(struct tlb_server *srv, const char *host, int port)
 	int r, i;
 	unsigned int cpu;
 	struct sockaddr_storage addr;
+	struct ksock_opts opts, listen_opts = {};
 
 	if (strlen(host) >= ARRAY_SIZE(srv->host) || port <= 0 || port > 65535)
 		return -EINVAL;
@@ -96,6 +341,12 @@ int tlb_server_start(struct tlb_server *srv, const char *host, int port)
 	if (r)
 		goto deinit_targets;
 
+	/* accepted sockets inherit the buffer sizes their window scale came from */
+	tlb_server_get_opts(srv, &srv->client_opts, &opts);
+	listen_opts.sndbuf = opts.sndbuf;
+	listen_opts.rcvbuf = opts.rcvbuf;
+	ksock_set_opts(srv->listen_sock, &listen_opts);
+
 	for_each_cpu(cpu, cpu_online_mask) {
 		r = coroutine_thread_start(&srv->con_thread[srv->nr_con_thread], "tlb_coroutine", cpu);
 		if (r)
@@ -104,10 +355,37 @@ int tlb_server_start(struct tlb_server *srv, const char *host, int port)
 		srv->nr_con_thread++;
 	}
 
+	srv->h2_pool = kcalloc(srv->nr_con_thread, sizeof(*srv->h2_pool), GFP_KERNEL);
+	if (!srv->h2_pool) {
+		r = -ENOMEM;
+		goto stop_con_coroutine;
+	}
+	srv->kv_pool = kcalloc(srv->nr_con_thread, sizeof(*srv->kv_pool), GFP_KERNEL);
+	if (!srv->kv_pool) {
+		r = -ENOMEM;
+		goto free_h2_pool;
+	}
+	srv->http_cache = kcalloc(srv->nr_con_thread, sizeof(*srv->http_cache), GFP_KERNEL);
+	if (!srv->http_cache) {
+		r = -ENOMEM;
+		goto free_kv_pool;
+	}
+	srv->subsets = kcalloc(srv->nr_con_thread, sizeof(*srv->subsets), GFP_KERNEL);
+	if (!srv->subsets) {
+		r = -ENOMEM;
+		goto free_http_cache;
+	}
+	for (i = 0; i < srv->nr_con_thread; i++) {
+		tlb_h2_pool_init(&srv->h2_pool[i], srv, &srv->con_thread[i]);
+		tlb_kv_pool_init(&srv->kv_pool[i], srv, &srv->con_thread[i]);
+		tlb_http_cache_init(&srv->http_cache[i]);
+		tlb_subset_init(&srv->subsets[i]);
+	}
+
 	srv->listen_thread = kthread_create(tlb_server_listen_thread_routine, srv, "tlb_listen");
 	if (IS_ERR(srv->listen_thread)) {
 		r = PTR_ERR(srv->listen_thread);
-		goto stop_con_coroutine;
+		goto free_subsets;
 	}
 
 	get_task_struct(srv->listen_thread);
@@ -116,6 +394,18 @@ int tlb_server_start(struct tlb_server *srv, const char *host, int port)
 	mutex_unlock(&srv->lock);
 	return 0;
 
+free_subsets:
+	kfree(srv->subsets);
+	srv->subsets = NULL;
+free_http_cache:
+	kfree(srv->http_cache);
+	srv->http_cache = NULL;
+free_kv_pool:
+	kfree(srv->kv_pool);
+	srv->kv_pool = NULL;
+free_h2_pool:
+	kfree(srv->h2_pool);
+	srv->h2_pool = NULL;
 stop_con_coroutine:
 	for (i = 0; i < srv->nr_con_thread; i++)
 		coroutine_thread_stop(&srv->con_thread[i]);
@@ -149,6 +439,8 @@ int tlb_server_stop(struct tlb_server *srv)
 	put_task_struct(srv->listen_thread);
 	srv->listen_thread_stopping = false;
 
+	__tlb_udp_server_stop(&srv->udp);
+
 	for (i = 0; i < srv->nr_con_thread; i++)
 		coroutine_thread_stop(&srv->con_thread[i]);
 
@@ -159,7 +451,22 @@ int tlb_server_stop(struct tlb_server *srv)
 		tlb_con_delete(con);
 	}
 
+	for (i = 0; i < srv->nr_con_thread; i++) {
+		tlb_h2_pool_deinit(&srv->h2_pool[i]);
+		tlb_kv_pool_deinit(&srv->kv_pool[i]);
+		tlb_http_cache_deinit(&srv->http_cache[i]);
+	}
+	kfree(srv->h2_pool);
+	srv->h2_pool = NULL;
+	kfree(srv->kv_pool);
+	srv->kv_pool = NULL;
+	kfree(srv->http_cache);
+	srv->http_cache = NULL;
+	kfree(srv->subsets);
+	srv->subsets = NULL;
+
 	tlb_server_deinit_targets(srv);
+	tlb_server_clear_mirror(srv);
 
 	srv->state = TLB_SRV_INITED;
 	mutex_unlock(&srv->lock);
@@ -178,8 +485,15 @@ int tlb_server_cache_init(void)
 		return -ENOMEM;
 	}
 
-	g_con_buf_cache = kmem_cache_create("tlb_con_buf_cache", TLB_CON_BUF_SIZE, 0, 0, NULL);
-	if (!g_con_buf_cache) {
+	if (tlb_arena_init(&g_con_buf_arena, "tlb_con_buf_cache", TLB_CON_BUF_SIZE)) {
+		kmem_cache_destroy(g_target_con_cache);
+		kmem_cache_destroy(g_con_cache);
+		return -ENOMEM;
+	}
+
+	g_udp_flow_cache = kmem_cache_create("tlb_udp_flow_cache", sizeof(struct tlb_udp_flow), 0, 0, NULL);
+	if (!g_udp_flow_cache) {
+		tlb_arena_deinit(&g_con_buf_arena);
 		kmem_cache_destroy(g_target_con_cache);
 		kmem_cache_destroy(g_con_cache);
 		return -ENOMEM;
@@ -189,7 +503,8 @@ int tlb_server_cache_init(void)
 
 void tlb_server_cache_deinit(void)
 {
-	kmem_cache_destroy(g_con_buf_cache);
+	kmem_cache_destroy(g_udp_flow_cache);
+	tlb_arena_deinit(&g_con_buf_arena);
 	kmem_cache_destroy(g_target_con_cache);
 	kmem_cache_destroy(g_con_cache);
 }
@@ -5,6 +5,18 @@
 #include "coroutine.h"
 #include "target.h"
 #include "con.h"
+#include "udp.h"
+#include "h2.h"
+#include "kv.h"
+#include "http_cache.h"
+#include "mirror.h"
+#include "admission.h"
+#include "prio.h"
+#include "srcpool.h"
+#include "sticky.h"
+#include "subset.h"
+#include "blocklist.h"
+#include "arena.h"
 
 enum {
 	TLB_SRV_INITED = 1,
@@ -13,6 +25,28 @@ enum {
 	TLB_SRV_STOPPING
 };
 
+enum {
+	TLB_OVERLOAD_RESET = 0,
+	TLB_OVERLOAD_CLOSE,
+	TLB_OVERLOAD_PAUSE,
+};
+
+#define TLB_OVERLOAD_PAUSE_MS 10
+
+/* how target sockets are closed when the client went first */
+enum {
+	TLB_TARGET_CLOSE_FIN = 0,
+	TLB_TARGET_CLOSE_RST,
+};
+
+enum {
+	TLB_SRV_MODE_TCP = 0,
+	TLB_SRV_MODE_H2,
+	TLB_SRV_MODE_MEMCACHE,
+	TLB_SRV_MODE_REDIS,
+	TLB_SRV_MODE_HTTP,
+};
+
 struct tlb_server {
 	char host[64];
 	int port;
@@ -30,16 +64,125 @@ struct tlb_server {
 
 	rwlock_t target_lock;
 	struct rb_root target_tree;
+	atomic_t target_gen;
+
+	/* each group of subset_threads threads balances over subset_size targets */
+	unsigned int subset_size;
+	unsigned int subset_threads;
+	struct tlb_subset *subsets;
+	atomic64_t subset_misses;
+
+	bool transparent;
+
+	/* socket option profiles of accepted and of target connections */
+	spinlock_t sockopt_lock;
+	struct ksock_opts client_opts;
+	struct ksock_opts target_opts;
+
+	struct tlb_srcpool srcpool;
+	int target_close;
+	atomic64_t target_resets;
+
+	spinlock_t mirror_lock;
+	struct tlb_target *mirror;
+	unsigned int mirror_percent;
+	atomic64_t mirror_cons;
+	atomic64_t mirror_drops;
+
+	int mode;
+	unsigned int h2_pool_size;
+	struct tlb_h2_pool *h2_pool;
+	struct tlb_kv_pool *kv_pool;
+	struct tlb_http_cache *http_cache;
+
+	/* bytes of cached HTTP responses over all threads, zero disables */
+	unsigned int http_cache_size;
+	atomic64_t http_cache_hits;
+	atomic64_t http_cache_misses;
+	atomic64_t http_cache_stores;
+	atomic64_t http_cache_evictions;
+
+	struct tlb_udp_server udp;
+
+	struct tlb_blocklist blocklist;
+	struct tlb_admission admission;
+	struct tlb_prio prio;
+	struct tlb_sticky sticky;
+	struct tlb_routes routes;
+
+	/* all proxied bytes of the listener, and the limit of each connection */
+	struct tlb_shaper shaper;
+	u64 con_rate;
+	u64 con_burst;
+	atomic64_t con_shape_waits;
+
+	/* target->client directions faster than this move to a sibling thread */
+	u64 split_rate;
+	atomic64_t split_cons;
+
+	/* a BPF program attached to tlb_select_target_hook() picks targets */
+	bool select_bpf;
+	atomic64_t select_picks;
+	atomic64_t select_fallbacks;
+
+	/* client bytes kept for a replay to another target, zero disables */
+	unsigned int replay_size;
+	atomic64_t replays;
+	atomic64_t replay_fails;
+
+	/* zero is unlimited, defaults to what a quarter of RAM can hold */
+	unsigned int max_cons;
+	atomic_t nr_cons;
+	struct wait_queue_head cons_waitq;
+	atomic64_t accept_waits;
+
+	/* zero thresholds disable load shedding */
+	unsigned int overload_queue_len;
+	unsigned int overload_latency_us;
+	int overload_action;
+	atomic64_t shed_cons;
+	atomic64_t accept_pauses;
+
+	/* zero disables, only the plain TCP mode enforces them */
+	unsigned int client_idle_ms;
+	unsigned int target_idle_ms;
+	unsigned int min_rate;
+	unsigned int min_rate_window_ms;
+	atomic64_t idle_timeouts;
+	atomic64_t slow_timeouts;
 };
 
 #define TLB_CON_BUF_SIZE (16 * 1024)
+#define TLB_SPLIT_WINDOW_MS 100
+/* kernel memory of both sockets of a proxied connection, rough */
+#define TLB_CON_SOCK_FOOTPRINT (16 * 1024)
 
 int tlb_server_init(struct tlb_server *srv);
 
+void tlb_server_deinit(struct tlb_server *srv);
+
+int tlb_server_set_sticky(struct tlb_server *srv, int nr_entries, unsigned int ttl_ms, int prefix4, int prefix6);
+
+int tlb_server_set_subset(struct tlb_server *srv, unsigned int size, unsigned int threads);
+
 int tlb_server_start(struct tlb_server *srv, const char *host, int port);
 
 int tlb_server_stop(struct tlb_server *srv);
 
+static inline int tlb_server_thread_index(struct tlb_server *srv, struct coroutine_thread *thread)
+{
+	return thread - srv->con_thread;
+}
+
+static inline void tlb_server_get_opts(struct tlb_server *srv, struct ksock_opts *from, struct ksock_opts *opts)
+{
+	spin_lock(&srv->sockopt_lock);
+	*opts = *from;
+	spin_unlock(&srv->sockopt_lock);
+}
+
+struct coroutine_thread *tlb_server_pick_sibling_thread(struct tlb_server *srv, struct coroutine_thread *thread);
+
 void tlb_server_unlink_con(struct tlb_server *srv, struct tlb_con *con);
 
 int tlb_server_cache_init(void);
@@ -48,4 +191,5 @@ void tlb_server_cache_deinit(void);
 
 extern struct kmem_cache *g_con_cache;
 extern struct kmem_cache *g_target_con_cache;
-extern struct kmem_cache *g_con_buf_cache;
+extern struct tlb_arena g_con_buf_arena;
+extern struct kmem_cache *g_udp_flow_cache;
@@ -0,0 +1,50 @@
+#include "shaper.h"
+
+/* a burst of zero allows one second worth of bytes */
+static u64 tlb_shaper_burst(u64 rate, u64 burst)
+{
+	return burst ? burst : rate;
+}
+
+void tlb_shaper_init(struct tlb_shaper *shaper, u64 rate, u64 burst)
+{
+	spin_lock_init(&shaper->lock);
+	shaper->rate = rate;
+	shaper->burst = tlb_shaper_burst(rate, burst);
+	tlb_tbucket_init(&shaper->tb, shaper->burst, ktime_get_ns());
+	atomic64_set(&shaper->waits, 0);
+}
+
+void tlb_shaper_set(struct tlb_shaper *shaper, u64 rate, u64 burst)
+{
+	spin_lock(&shaper->lock);
+	shaper->burst = tlb_shaper_burst(rate, burst);
+	tlb_tbucket_init(&shaper->tb, shaper->burst, ktime_get_ns());
+	WRITE_ONCE(shaper->rate, rate);
+	spin_unlock(&shaper->lock);
+}
+
+void tlb_shaper_get(struct tlb_shaper *shaper, u64 *rate, u64 *burst)
+{
+	spin_lock(&shaper->lock);
+	*rate = shaper->rate;
+	*burst = shaper->burst;
+	spin_unlock(&shaper->lock);
+}
+
+/* zero once the bytes are taken, else nanoseconds until they'd be there */
+u64 tlb_shaper_take(struct tlb_shaper *shaper, u64 bytes)
+{
+	u64 wait_ns = 0;
+
+	if (!READ_ONCE(shaper->rate))
+		return 0;
+
+	spin_lock(&shaper->lock);
+	if (shaper->rate && !tlb_tbucket_take(&shaper->tb, shaper->rate, shaper->burst, bytes, ktime_get_ns()))
+		wait_ns = max_t(u64, tlb_tbucket_wait_ns(&shaper->tb, shaper->rate, bytes), 1);
+	spin_unlock(&shaper->lock);
+	if (wait_ns)
+		atomic64_inc(&shaper->waits);
+	return wait_ns;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "base.h"
+#include "tbucket.h"
+
+/* bandwidth limit in bytes per second, zero rate is unlimited */
+struct tlb_shaper {
+	spinlock_t lock;
+	struct tlb_tbucket tb;
+	u64 rate;
+	u64 burst;
+	atomic64_t waits;
+};
+
+void tlb_shaper_init(struct tlb_shaper *shaper, u64 rate, u64 burst);
+
+void tlb_shaper_set(struct tlb_shaper *shaper, u64 rate, u64 burst);
+
+void tlb_shaper_get(struct tlb_shaper *shaper, u64 *rate, u64 *burst);
+
+u64 tlb_shaper_take(struct tlb_shaper *shaper, u64 bytes);
@@ -0,0 +1,136 @@
+#include "srcpool.h"
+#include "ksock.h"
+
+void tlb_srcpool_init(struct tlb_srcpool *pool)
+{
+	memset(pool, 0, sizeof(*pool));
+	spin_lock_init(&pool->lock);
+}
+
+static void tlb_src_deref(struct tlb_src *src)
+{
+	if (atomic_dec_and_test(&src->ref_count))
+		kfree(src);
+}
+
+void tlb_srcpool_deinit(struct tlb_srcpool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->nr_srcs; i++)
+		tlb_src_deref(pool->srcs[i]);
+	pool->nr_srcs = 0;
+}
+
+static int tlb_srcpool_find(struct tlb_srcpool *pool, struct sockaddr_storage *addr)
+{
+	int i;
+
+	for (i = 0; i < pool->nr_srcs; i++)
+		if (ksock_addr_equal(&pool->srcs[i]->addr, addr))
+			return i;
+	return -1;
+}
+
+int tlb_srcpool_add(struct tlb_srcpool *pool, struct sockaddr_storage *addr)
+{
+	struct tlb_src *src;
+	int r;
+
+	if (addr->ss_family != AF_INET && addr->ss_family != AF_INET6)
+		return -EAFNOSUPPORT;
+
+	src = kzalloc(sizeof(*src), GFP_KERNEL);
+	if (!src)
+		return -ENOMEM;
+	src->addr = *addr;
+	ksock_addr_set_port(&src->addr, 0);
+	atomic_set(&src->ref_count, 1);
+
+	spin_lock(&pool->lock);
+	if (tlb_srcpool_find(pool, &src->addr) >= 0)
+		r = -EEXIST;
+	else if (pool->nr_srcs == TLB_SRCPOOL_MAX)
+		r = -ENOSPC;
+	else {
+		pool->srcs[pool->nr_srcs++] = src;
+		r = 0;
+	}
+	spin_unlock(&pool->lock);
+
+	if (r)
+		kfree(src);
+	return r;
+}
+
+/* connections still bound to it keep it until they close */
+int tlb_srcpool_remove(struct tlb_srcpool *pool, struct sockaddr_storage *addr)
+{
+	struct tlb_src *src;
+	int i;
+
+	spin_lock(&pool->lock);
+	i = tlb_srcpool_find(pool, addr);
+	if (i < 0) {
+		spin_unlock(&pool->lock);
+		return -ENOENT;
+	}
+	src = pool->srcs[i];
+	pool->srcs[i] = pool->srcs[--pool->nr_srcs];
+	spin_unlock(&pool->lock);
+
+	tlb_src_deref(src);
+	return 0;
+}
+
+/* NULL when the pool has no address of this family, the kernel picks then */
+struct tlb_src *tlb_srcpool_get(struct tlb_srcpool *pool, int family)
+{
+	struct tlb_src *src, *best = NULL;
+	int i;
+
+	if (!READ_ONCE(pool->nr_srcs))
+		return NULL;
+
+	spin_lock(&pool->lock);
+	for (i = 0; i < pool->nr_srcs; i++) {
+		src = pool->srcs[i];
+		if (src->addr.ss_family != family)
+			continue;
+		if (!best || atomic64_read(&src->active) < atomic64_read(&best->active))
+			best = src;
+	}
+	if (best) {
+		atomic_inc(&best->ref_count);
+		atomic64_inc(&best->active);
+		atomic64_inc(&best->total);
+	}
+	spin_unlock(&pool->lock);
+	return best;
+}
+
+void tlb_src_put(struct tlb_src *src)
+{
+	atomic64_dec(&src->active);
+	tlb_src_deref(src);
+}
+
+ssize_t tlb_srcpool_show(struct tlb_srcpool *pool, char *buf, size_t size)
+{
+	struct tlb_src *src;
+	ssize_t off = 0;
+	int i;
+
+	spin_lock(&pool->lock);
+	for (i = 0; i < pool->nr_srcs; i++) {
+		src = pool->srcs[i];
+		if (src->addr.ss_family == AF_INET)
+			off += scnprintf(buf + off, size - off, "%pI4", &((struct sockaddr_in *)&src->addr)->sin_addr);
+		else
+			off += scnprintf(buf + off, size - off, "%pI6c", &((struct sockaddr_in6 *)&src->addr)->sin6_addr);
+		off += scnprintf(buf + off, size - off, " %llu %llu %llu\n", atomic64_read(&src->active),
+				 atomic64_read(&src->total), atomic64_read(&src->exhausted));
+	}
+	spin_unlock(&pool->lock);
+	return off;
+}
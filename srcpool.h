@@ -0,0 +1,40 @@
+#pragma once
+
+#include "base.h"
+
+#define TLB_SRCPOOL_MAX 64
+
+/* a local address target connections are bound to, kept while in use */
+struct tlb_src {
+	struct sockaddr_storage addr;
+	atomic_t ref_count;
+	atomic64_t active;
+	atomic64_t total;
+	atomic64_t exhausted;
+};
+
+/*
+ * Local source addresses for target connections. Each connection takes the
+ * least used address of the target's family and binds it with
+ * IP_BIND_ADDRESS_NO_PORT, so the port is picked at connect time per
+ * destination and every address adds a full ephemeral range per target.
+ */
+struct tlb_srcpool {
+	spinlock_t lock;
+	struct tlb_src *srcs[TLB_SRCPOOL_MAX];
+	int nr_srcs;
+};
+
+void tlb_srcpool_init(struct tlb_srcpool *pool);
+
+void tlb_srcpool_deinit(struct tlb_srcpool *pool);
+
+int tlb_srcpool_add(struct tlb_srcpool *pool, struct sockaddr_storage *addr);
+
+int tlb_srcpool_remove(struct tlb_srcpool *pool, struct sockaddr_storage *addr);
+
+struct tlb_src *tlb_srcpool_get(struct tlb_srcpool *pool, int family);
+
+void tlb_src_put(struct tlb_src *src);
+
+ssize_t tlb_srcpool_show(struct tlb_srcpool *pool, char *buf, size_t size);
@@ -0,0 +1,124 @@
+#include "sticky.h"
+
+struct tlb_sticky_data {
+	u32 target_id;
+	unsigned long expires;
+};
+
+struct tlb_sticky_arg {
+	u32 target_id;
+	unsigned long ttl;
+};
+
+void tlb_sticky_init(struct tlb_sticky *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->prefix4 = TLB_STICKY_PREFIX4;
+	st->prefix6 = TLB_STICKY_PREFIX6;
+}
+
+void tlb_sticky_deinit(struct tlb_sticky *st)
+{
+	if (st->nr_entries)
+		tlb_addr_table_deinit(&st->table);
+	st->nr_entries = 0;
+}
+
+/* the caller makes sure there are no lookups in flight */
+int tlb_sticky_set(struct tlb_sticky *st, int nr_entries, unsigned int ttl_ms, int prefix4, int prefix6)
+{
+	int r;
+
+	if (nr_entries < 0 || prefix4 < 0 || prefix4 > 32 || prefix6 < 0 || prefix6 > 128)
+		return -EINVAL;
+
+	tlb_sticky_deinit(st);
+	if (nr_entries) {
+		r = tlb_addr_table_init(&st->table, nr_entries, sizeof(struct tlb_sticky_data));
+		if (r)
+			return r;
+	}
+
+	st->nr_entries = nr_entries;
+	st->ttl_ms = ttl_ms;
+	st->prefix4 = prefix4;
+	st->prefix6 = prefix6;
+	return 0;
+}
+
+static int tlb_sticky_get(struct tlb_addr_entry *entry, bool created, void *arg)
+{
+	struct tlb_sticky_data *data = (struct tlb_sticky_data *)entry->data;
+	struct tlb_sticky_arg *sarg = arg;
+
+	if (sarg->ttl) {
+		if (time_after_eq(jiffies, data->expires))
+			return -ETIMEDOUT;
+		data->expires = jiffies + sarg->ttl;
+	}
+
+	sarg->target_id = data->target_id;
+	return 0;
+}
+
+static int tlb_sticky_set_entry(struct tlb_addr_entry *entry, bool created, void *arg)
+{
+	struct tlb_sticky_data *data = (struct tlb_sticky_data *)entry->data;
+	struct tlb_sticky_arg *sarg = arg;
+
+	data->target_id = sarg->target_id;
+	data->expires = jiffies + sarg->ttl;
+	return 0;
+}
+
+static bool tlb_sticky_key(struct tlb_sticky *st, struct sockaddr_storage *addr, struct tlb_addr_key *key,
+			   struct tlb_sticky_arg *arg)
+{
+	if (!st->nr_entries)
+		return false;
+
+	if (tlb_addr_key_init(key, addr, st->prefix4, st->prefix6))
+		return false;
+
+	arg->ttl = msecs_to_jiffies(st->ttl_ms);
+	return true;
+}
+
+/* zero if the client has no live entry, a hit also extends its ttl */
+u32 tlb_sticky_lookup(struct tlb_sticky *st, struct sockaddr_storage *addr)
+{
+	struct tlb_addr_key key;
+	struct tlb_sticky_arg arg;
+	int r;
+
+	if (!tlb_sticky_key(st, addr, &key, &arg))
+		return 0;
+
+	arg.target_id = 0;
+	r = tlb_addr_table_update(&st->table, &key, false, tlb_sticky_get, &arg);
+	if (r == -ETIMEDOUT)
+		atomic64_inc(&st->expired);
+	else if (r)
+		atomic64_inc(&st->misses);
+	return arg.target_id;
+}
+
+void tlb_sticky_update(struct tlb_sticky *st, struct sockaddr_storage *addr, u32 target_id)
+{
+	struct tlb_addr_key key;
+	struct tlb_sticky_arg arg;
+
+	if (!tlb_sticky_key(st, addr, &key, &arg))
+		return;
+
+	arg.target_id = target_id;
+	tlb_addr_table_update(&st->table, &key, true, tlb_sticky_set_entry, &arg);
+}
+
+void tlb_sticky_get_stats(struct tlb_sticky *st, struct tlb_sticky_stats *stats)
+{
+	stats->hits = atomic64_read(&st->hits);
+	stats->misses = atomic64_read(&st->misses);
+	stats->expired = atomic64_read(&st->expired);
+	stats->stale = atomic64_read(&st->stale);
+}
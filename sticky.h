@@ -0,0 +1,45 @@
+#pragma once
+
+#include "base.h"
+#include "addr_table.h"
+
+#define TLB_STICKY_PREFIX4 32
+#define TLB_STICKY_PREFIX6 128
+
+struct tlb_sticky_stats {
+	u64 hits;
+	u64 misses;
+	u64 expired;
+	u64 stale;
+};
+
+/*
+ * Client address or prefix -> id of the target it was last sent to. The
+ * table is bounded, LRU evicted and only (re)sized while the server is
+ * stopped. Entries of removed targets aren't purged, their id just no
+ * longer matches any target and the next pick overwrites them.
+ */
+struct tlb_sticky {
+	int nr_entries;
+	unsigned int ttl_ms;
+	int prefix4;
+	int prefix6;
+	struct tlb_addr_table table;
+
+	atomic64_t hits;
+	atomic64_t misses;
+	atomic64_t expired;
+	atomic64_t stale;
+};
+
+void tlb_sticky_init(struct tlb_sticky *st);
+
+void tlb_sticky_deinit(struct tlb_sticky *st);
+
+int tlb_sticky_set(struct tlb_sticky *st, int nr_entries, unsigned int ttl_ms, int prefix4, int prefix6);
+
+u32 tlb_sticky_lookup(struct tlb_sticky *st, struct sockaddr_storage *addr);
+
+void tlb_sticky_update(struct tlb_sticky *st, struct sockaddr_storage *addr, u32 target_id);
+
+void tlb_sticky_get_stats(struct tlb_sticky *st, struct tlb_sticky_stats *stats);
@@ -0,0 +1,71 @@
+#include "subset.h"
+#include "server.h"
+
+void tlb_subset_init(struct tlb_subset *subset)
+{
+	subset->gen = -1;
+	subset->nr = 0;
+	subset->min_score = 0;
+}
+
+/* the id breaks ties, so no two targets score the same */
+static u64 tlb_subset_score(struct tlb_target *target, u32 group)
+{
+	return ((u64)jhash_2words(target->key_hash, group, 0) << 32) | target->id;
+}
+
+static void tlb_subset_insert(struct tlb_subset *subset, u32 size, u64 score)
+{
+	int i;
+
+	if (subset->nr == size) {
+		if (score <= subset->scores[size - 1])
+			return;
+		subset->nr--;
+	}
+
+	/* kept in descending order */
+	for (i = subset->nr; i > 0 && subset->scores[i - 1] < score; i--)
+		subset->scores[i] = subset->scores[i - 1];
+	subset->scores[i] = score;
+	subset->nr++;
+}
+
+static void tlb_subset_update(struct tlb_server *srv, struct tlb_subset *subset, u32 size, u32 group, int gen)
+{
+	struct tlb_target *target;
+
+	subset->group = group;
+	subset->nr = 0;
+	for (target = tlb_server_next_target(srv, NULL); target; target = tlb_server_next_target(srv, target))
+		tlb_subset_insert(subset, size, tlb_subset_score(target, group));
+
+	/* with fewer targets than size every one is in */
+	subset->min_score = subset->nr == size ? subset->scores[size - 1] : 0;
+	subset->gen = gen;
+}
+
+/* NULL if subsetting is off or thread isn't one of srv's, under target_lock */
+struct tlb_subset *tlb_server_subset(struct tlb_server *srv, struct coroutine_thread *thread)
+{
+	struct tlb_subset *subset;
+	int i, gen;
+
+	if (!srv->subset_size || !srv->subsets || !thread)
+		return NULL;
+
+	i = tlb_server_thread_index(srv, thread);
+	if (i < 0 || i >= srv->nr_con_thread)
+		return NULL;
+
+	subset = &srv->subsets[i];
+	gen = atomic_read(&srv->target_gen);
+	if (subset->gen != gen)
+		tlb_subset_update(srv, subset, srv->subset_size, i / srv->subset_threads, gen);
+	return subset;
+}
+
+bool tlb_subset_contains(struct tlb_subset *subset, struct tlb_target *target)
+{
+	return tlb_subset_score(target, subset->group) >= subset->min_score;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "base.h"
+
+struct tlb_server;
+struct tlb_target;
+struct coroutine_thread;
+
+#define TLB_SUBSET_MAX_SIZE 256
+
+/*
+ * The targets a group of coroutine threads balances over: the size highest
+ * rendezvous scores of (target, group). Every thread of a group computes the
+ * same subset, and adding or removing a target moves at most one member of
+ * each subset. Only the owning thread touches it, under target_lock.
+ */
+struct tlb_subset {
+	/* target_gen it was computed at */
+	int gen;
+	u32 group;
+	int nr;
+	u64 min_score;
+	u64 scores[TLB_SUBSET_MAX_SIZE];
+};
+
+void tlb_subset_init(struct tlb_subset *subset);
+
+struct tlb_subset *tlb_server_subset(struct tlb_server *srv, struct coroutine_thread *thread);
+
+bool tlb_subset_contains(struct tlb_subset *subset, struct tlb_target *target);
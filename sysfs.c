@@ -34,11 +34,28 @@ static struct tlb_context *tlb_from_kobject(struct kobject *kobj)
 	return container_of(kobj, struct tlb_context, kobj_holder.kobj);
 }
 
+/* whole records only, for scripts/blocklist_sync.sh */
+static ssize_t tlb_attr_blocklist_dump_read(struct file *file, struct kobject *kobj,
+					    struct bin_attribute *attr, char *buf,
+					    loff_t off, size_t count)
+{
+	struct tlb_context *tlb = tlb_from_kobject(kobj);
+
+	return tlb_blocklist_dump(&tlb->srv.blocklist, buf, off, count);
+}
+
+static struct bin_attribute tlb_attr_blocklist_dump = {
+	.attr = { .name = "blocklist_dump", .mode = S_IRUGO },
+	.size = TLB_BLOCKLIST_ENTRIES * sizeof(struct tlb_block_record),
+	.read = tlb_attr_blocklist_dump_read,
+};
+
 int tlb_sysfs_init(struct tlb_kobject_holder *holder, struct kobject *root,
 		     struct kobj_type *ktype, const char *fmt, ...)
 {
 	char name[256];
 	va_list args;
+	int r;
 
 	ktype->release = tlb_kobject_release;
 
@@ -48,7 +65,17 @@ int tlb_sysfs_init(struct tlb_kobject_holder *holder, struct kobject *root,
 	vsnprintf(name, ARRAY_SIZE(name), fmt, args);
 	va_end(args);
 
-	return kobject_init_and_add(&holder->kobj, ktype, root, "%s", name);
+	r = kobject_init_and_add(&holder->kobj, ktype, root, "%s", name);
+	if (r)
+		return r;
+
+	r = sysfs_create_bin_file(&holder->kobj, &tlb_attr_blocklist_dump);
+	if (r) {
+		tlb_sysfs_deinit(holder);
+		return r;
+	}
+
+	return 0;
 }
 
 void tlb_sysfs_deinit(struct tlb_kobject_holder *holder)
@@ -109,7 +136,9 @@ static ssize_t tlb_attr_add_target_store(struct tlb_context *tlb,
 	int r, port;
 
 	r = sscanf(buf, "%63s %d", host, &port);
-	if (r != 2)
+	if (r == 1 && ksock_is_unix_host(host))
+		port = 0;
+	else if (r != 2)
 		return -EINVAL;
 
 	host[63] = '\0';
@@ -127,7 +156,9 @@ static ssize_t tlb_attr_remove_target_store(struct tlb_context *tlb,
 	int r, port;
 
 	r = sscanf(buf, "%63s %d", host, &port);
-	if (r != 2)
+	if (r == 1 && ksock_is_unix_host(host))
+		port = 0;
+	else if (r != 2)
 		return -EINVAL;
 
 	host[63] = '\0';
@@ -199,6 +230,1124 @@ fail_nomem:
 	return -ENOMEM;
 }
 
+static ssize_t tlb_attr_transparent_store(struct tlb_context *tlb,
+					  const char *buf, size_t count)
+{
+	bool transparent;
+	int r;
+
+	r = kstrtobool(buf, &transparent);
+	if (r)
+		return r;
+
+	tlb->srv.transparent = transparent;
+	return count;
+}
+
+static ssize_t tlb_attr_transparent_show(struct tlb_context *tlb,
+					 char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%d\n", tlb->srv.transparent ? 1 : 0);
+}
+
+/* "nodelay=1 sndbuf=N rcvbuf=N notsent_lowat=N keepalive=idle,intvl,cnt user_timeout=ms quickack=1 cc=name" */
+static int tlb_sockopts_parse(const char *buf, struct ksock_opts *opts)
+{
+	char line[256], *p, *token;
+	int r;
+
+	if (strscpy(line, buf, sizeof(line)) < 0)
+		return -EINVAL;
+
+	memset(opts, 0, sizeof(*opts));
+	p = strim(line);
+	while ((token = strsep(&p, " \t")) != NULL) {
+		if (!*token)
+			continue;
+
+		if (sscanf(token, "nodelay=%d", &opts->nodelay) == 1 ||
+		    sscanf(token, "sndbuf=%d", &opts->sndbuf) == 1 ||
+		    sscanf(token, "rcvbuf=%d", &opts->rcvbuf) == 1 ||
+		    sscanf(token, "notsent_lowat=%d", &opts->notsent_lowat) == 1 ||
+		    sscanf(token, "user_timeout=%d", &opts->user_timeout_ms) == 1 ||
+		    sscanf(token, "quickack=%d", &opts->quickack) == 1)
+			continue;
+
+		r = sscanf(token, "keepalive=%d,%d,%d", &opts->keepalive_idle, &opts->keepalive_intvl,
+			   &opts->keepalive_cnt);
+		if (r >= 1)
+			continue;
+
+		if (!strncmp(token, "cc=", 3)) {
+			if (strscpy(opts->congestion, token + 3, sizeof(opts->congestion)) < 0)
+				return -EINVAL;
+			continue;
+		}
+
+		return -EINVAL;
+	}
+
+	return ksock_check_opts(opts);
+}
+
+static ssize_t tlb_sockopts_store(struct tlb_server *srv, struct ksock_opts *to,
+				  const char *buf, size_t count)
+{
+	struct ksock_opts opts;
+	int r;
+
+	r = tlb_sockopts_parse(buf, &opts);
+	if (r)
+		return r;
+
+	spin_lock(&srv->sockopt_lock);
+	*to = opts;
+	spin_unlock(&srv->sockopt_lock);
+	return count;
+}
+
+static ssize_t tlb_sockopts_show(struct tlb_server *srv, struct ksock_opts *from, char *buf)
+{
+	struct ksock_opts opts;
+
+	tlb_server_get_opts(srv, from, &opts);
+	return scnprintf(buf, PAGE_SIZE,
+			 "nodelay=%d sndbuf=%d rcvbuf=%d notsent_lowat=%d keepalive=%d,%d,%d user_timeout=%d quickack=%d cc=%s\n",
+			 opts.nodelay, opts.sndbuf, opts.rcvbuf, opts.notsent_lowat, opts.keepalive_idle,
+			 opts.keepalive_intvl, opts.keepalive_cnt, opts.user_timeout_ms, opts.quickack,
+			 opts.congestion);
+}
+
+static ssize_t tlb_attr_client_sockopts_store(struct tlb_context *tlb,
+					      const char *buf, size_t count)
+{
+	return tlb_sockopts_store(&tlb->srv, &tlb->srv.client_opts, buf, count);
+}
+
+static ssize_t tlb_attr_client_sockopts_show(struct tlb_context *tlb,
+					     char *buf)
+{
+	return tlb_sockopts_show(&tlb->srv, &tlb->srv.client_opts, buf);
+}
+
+static ssize_t tlb_attr_target_sockopts_store(struct tlb_context *tlb,
+					      const char *buf, size_t count)
+{
+	return tlb_sockopts_store(&tlb->srv, &tlb->srv.target_opts, buf, count);
+}
+
+static ssize_t tlb_attr_target_sockopts_show(struct tlb_context *tlb,
+					     char *buf)
+{
+	return tlb_sockopts_show(&tlb->srv, &tlb->srv.target_opts, buf);
+}
+
+static ssize_t tlb_attr_source_pool_store(struct tlb_context *tlb,
+					  const char *buf, size_t count)
+{
+	struct sockaddr_storage addr;
+	char op[8], host[64];
+	int r;
+
+	if (sscanf(buf, "%7s %63s", op, host) != 2)
+		return -EINVAL;
+
+	r = ksock_resolve_addr(host, 0, &addr);
+	if (r)
+		return r;
+
+	if (!strcmp(op, "add"))
+		r = tlb_srcpool_add(&tlb->srv.srcpool, &addr);
+	else if (!strcmp(op, "del"))
+		r = tlb_srcpool_remove(&tlb->srv.srcpool, &addr);
+	else
+		r = -EINVAL;
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_source_pool_show(struct tlb_context *tlb,
+					 char *buf)
+{
+	return tlb_srcpool_show(&tlb->srv.srcpool, buf, PAGE_SIZE);
+}
+
+static const char * const tlb_target_close_names[] = {
+	[TLB_TARGET_CLOSE_FIN] = "fin",
+	[TLB_TARGET_CLOSE_RST] = "rst",
+};
+
+static ssize_t tlb_attr_target_close_store(struct tlb_context *tlb,
+					   const char *buf, size_t count)
+{
+	int i;
+
+	i = sysfs_match_string(tlb_target_close_names, buf);
+	if (i < 0)
+		return i;
+
+	WRITE_ONCE(tlb->srv.target_close, i);
+	return count;
+}
+
+static ssize_t tlb_attr_target_close_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%s %llu\n", tlb_target_close_names[READ_ONCE(tlb->srv.target_close)],
+			 atomic64_read(&tlb->srv.target_resets));
+}
+
+/* per arena: 2MB chunks in use and allocations that fell back to the slab */
+static ssize_t tlb_attr_arena_stats_show(struct tlb_context *tlb,
+					 char *buf)
+{
+	struct tlb_arena *arenas[] = { coroutine_stack_arena(), &g_con_buf_arena };
+	ssize_t off = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(arenas); i++)
+		off += scnprintf(buf + off, PAGE_SIZE - off, "%s %llu %llu\n", arenas[i]->name,
+				 atomic64_read(&arenas[i]->nr_chunks), atomic64_read(&arenas[i]->nr_fallbacks));
+	return off;
+}
+
+static const char * const tlb_mode_names[] = {
+	[TLB_SRV_MODE_TCP] = "tcp",
+	[TLB_SRV_MODE_H2] = "h2",
+	[TLB_SRV_MODE_MEMCACHE] = "memcache",
+	[TLB_SRV_MODE_REDIS] = "redis",
+	[TLB_SRV_MODE_HTTP] = "http",
+};
+
+static ssize_t tlb_attr_mode_store(struct tlb_context *tlb,
+				   const char *buf, size_t count)
+{
+	int mode;
+
+	mode = sysfs_match_string(tlb_mode_names, buf);
+	if (mode < 0)
+		return mode;
+
+	WRITE_ONCE(tlb->srv.mode, mode);
+	return count;
+}
+
+static ssize_t tlb_attr_mode_show(struct tlb_context *tlb,
+				  char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%s\n", tlb_mode_names[READ_ONCE(tlb->srv.mode)]);
+}
+
+static ssize_t tlb_attr_h2_pool_size_store(struct tlb_context *tlb,
+					   const char *buf, size_t count)
+{
+	unsigned int pool_size;
+	int r;
+
+	r = kstrtouint(buf, 10, &pool_size);
+	if (r)
+		return r;
+
+	if (pool_size == 0)
+		return -EINVAL;
+
+	WRITE_ONCE(tlb->srv.h2_pool_size, pool_size);
+	return count;
+}
+
+static ssize_t tlb_attr_h2_pool_size_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(tlb->srv.h2_pool_size));
+}
+
+static ssize_t tlb_attr_mirror_store(struct tlb_context *tlb,
+				     const char *buf, size_t count)
+{
+	char host[64];
+	unsigned int percent;
+	int r, port;
+
+	if (sysfs_streq(buf, "none")) {
+		tlb_server_clear_mirror(&tlb->srv);
+		return count;
+	}
+
+	r = sscanf(buf, "%63s %d %u", host, &port, &percent);
+	if (r == 2 && ksock_is_unix_host(host)) {
+		percent = port;
+		port = 0;
+	} else if (r != 3)
+		return -EINVAL;
+
+	r = tlb_server_set_mirror(&tlb->srv, host, port, percent);
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_mirror_show(struct tlb_context *tlb,
+				    char *buf)
+{
+	struct tlb_server *srv = &tlb->srv;
+	ssize_t r;
+
+	spin_lock(&srv->mirror_lock);
+	if (srv->mirror)
+		r = scnprintf(buf, PAGE_SIZE, "%s %d %u\n", srv->mirror->host, srv->mirror->port, srv->mirror_percent);
+	else
+		r = scnprintf(buf, PAGE_SIZE, "none\n");
+	spin_unlock(&srv->mirror_lock);
+	return r;
+}
+
+static ssize_t tlb_attr_mirror_stats_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu\n", atomic64_read(&tlb->srv.mirror_cons),
+			 atomic64_read(&tlb->srv.mirror_drops));
+}
+
+static ssize_t tlb_admission_limit_store(struct tlb_context *tlb, bool prefix,
+					 const char *buf, size_t count)
+{
+	struct tlb_admission_limit limit;
+
+	if (sscanf(buf, "%llu %llu %u", &limit.rate, &limit.burst, &limit.max_cons) != 3)
+		return -EINVAL;
+
+	if (limit.rate && !limit.burst)
+		limit.burst = limit.rate;
+
+	tlb_admission_set_limit(&tlb->srv.admission, prefix, &limit);
+	return count;
+}
+
+static ssize_t tlb_admission_limit_show(struct tlb_context *tlb, bool prefix,
+					char *buf)
+{
+	struct tlb_admission_limit limit;
+
+	tlb_admission_get_limit(&tlb->srv.admission, prefix, &limit);
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu %u\n", limit.rate, limit.burst, limit.max_cons);
+}
+
+static ssize_t tlb_attr_ip_limit_store(struct tlb_context *tlb,
+				       const char *buf, size_t count)
+{
+	return tlb_admission_limit_store(tlb, false, buf, count);
+}
+
+static ssize_t tlb_attr_ip_limit_show(struct tlb_context *tlb,
+				      char *buf)
+{
+	return tlb_admission_limit_show(tlb, false, buf);
+}
+
+static ssize_t tlb_attr_prefix_limit_store(struct tlb_context *tlb,
+					   const char *buf, size_t count)
+{
+	return tlb_admission_limit_store(tlb, true, buf, count);
+}
+
+static ssize_t tlb_attr_prefix_limit_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	return tlb_admission_limit_show(tlb, true, buf);
+}
+
+static ssize_t tlb_attr_limit_prefix_len_store(struct tlb_context *tlb,
+					       const char *buf, size_t count)
+{
+	int r, prefix4, prefix6;
+
+	if (sscanf(buf, "%d %d", &prefix4, &prefix6) != 2)
+		return -EINVAL;
+
+	r = tlb_admission_set_prefix(&tlb->srv.admission, prefix4, prefix6);
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_limit_prefix_len_show(struct tlb_context *tlb,
+					      char *buf)
+{
+	struct tlb_admission *adm = &tlb->srv.admission;
+
+	return scnprintf(buf, PAGE_SIZE, "%d %d\n", READ_ONCE(adm->prefix4), READ_ONCE(adm->prefix6));
+}
+
+static ssize_t tlb_attr_admission_stats_show(struct tlb_context *tlb,
+					     char *buf)
+{
+	struct tlb_admission_stats stats;
+
+	tlb_admission_get_stats(&tlb->srv.admission, &stats);
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu %llu %llu\n",
+			 stats.accepted, stats.rate_limited, stats.con_limited, stats.table_full);
+}
+
+static ssize_t tlb_attr_blocklist_store(struct tlb_context *tlb,
+					const char *buf, size_t count)
+{
+	struct sockaddr_storage addr;
+	char op[8], host[64];
+	unsigned int ttl_ms = 0;
+	int r, n, prefix_len;
+
+	n = sscanf(buf, "%7s %63[^/]/%d %u", op, host, &prefix_len, &ttl_ms);
+	if (n < 3)
+		return -EINVAL;
+
+	r = ksock_resolve_addr(host, 0, &addr);
+	if (r)
+		return r;
+
+	if (!strcmp(op, "add"))
+		r = tlb_blocklist_add(&tlb->srv.blocklist, &addr, prefix_len, ttl_ms);
+	else if (!strcmp(op, "del"))
+		r = tlb_blocklist_del(&tlb->srv.blocklist, &addr, prefix_len);
+	else
+		r = -EINVAL;
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_blocklist_show(struct tlb_context *tlb,
+				       char *buf)
+{
+	return tlb_blocklist_show(&tlb->srv.blocklist, buf, PAGE_SIZE);
+}
+
+static ssize_t tlb_attr_flood_block_ms_store(struct tlb_context *tlb,
+					     const char *buf, size_t count)
+{
+	unsigned int ms;
+	int r;
+
+	r = kstrtouint(buf, 10, &ms);
+	if (r)
+		return r;
+
+	WRITE_ONCE(tlb->srv.blocklist.flood_block_ms, ms);
+	return count;
+}
+
+static ssize_t tlb_attr_flood_block_ms_show(struct tlb_context *tlb,
+					    char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(tlb->srv.blocklist.flood_block_ms));
+}
+
+static ssize_t tlb_attr_block_stats_show(struct tlb_context *tlb,
+					 char *buf)
+{
+	struct tlb_block_stats stats;
+
+	tlb_blocklist_get_stats(&tlb->srv.blocklist, &stats);
+	return scnprintf(buf, PAGE_SIZE, "%d %llu %llu %llu\n", stats.nr_blocks, stats.blocked,
+			 stats.auto_blocks, stats.full);
+}
+
+static ssize_t tlb_attr_prio_store(struct tlb_context *tlb,
+				   const char *buf, size_t count)
+{
+	int i;
+
+	i = sysfs_match_string(tlb_prio_names, buf);
+	if (i < 0)
+		return i;
+
+	WRITE_ONCE(tlb->srv.prio.listener_prio, i);
+	return count;
+}
+
+static ssize_t tlb_attr_prio_show(struct tlb_context *tlb,
+				  char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%s\n", tlb_prio_names[READ_ONCE(tlb->srv.prio.listener_prio)]);
+}
+
+static ssize_t tlb_attr_prio_rules_store(struct tlb_context *tlb,
+					 const char *buf, size_t count)
+{
+	struct sockaddr_storage addr;
+	char op[8], host[64], class[16];
+	int r, n, prefix_len, i = 0;
+
+	n = sscanf(buf, "%7s %63[^/]/%d %15s", op, host, &prefix_len, class);
+	if (n < 3)
+		return -EINVAL;
+
+	if (!strcmp(op, "add")) {
+		if (n != 4)
+			return -EINVAL;
+		i = match_string(tlb_prio_names, ARRAY_SIZE(tlb_prio_names), class);
+		if (i < 0)
+			return i;
+	} else if (strcmp(op, "del"))
+		return -EINVAL;
+
+	r = ksock_resolve_addr(host, 0, &addr);
+	if (r)
+		return r;
+
+	if (!strcmp(op, "add"))
+		r = tlb_prio_add_rule(&tlb->srv.prio, &addr, prefix_len, i);
+	else
+		r = tlb_prio_del_rule(&tlb->srv.prio, &addr, prefix_len);
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_prio_rules_show(struct tlb_context *tlb,
+					char *buf)
+{
+	return tlb_prio_show_rules(&tlb->srv.prio, buf, PAGE_SIZE);
+}
+
+static ssize_t tlb_attr_target_prio_store(struct tlb_context *tlb,
+					  const char *buf, size_t count)
+{
+	char host[64], class[16];
+	int r, port, i;
+
+	if (sscanf(buf, "%63s %d %15s", host, &port, class) != 3)
+		return -EINVAL;
+
+	if (!strcmp(class, "none"))
+		i = -1;
+	else {
+		i = match_string(tlb_prio_names, ARRAY_SIZE(tlb_prio_names), class);
+		if (i < 0)
+			return i;
+	}
+
+	r = tlb_server_set_target_prio(&tlb->srv, host, port, i);
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_target_prio_show(struct tlb_context *tlb,
+					 char *buf)
+{
+	struct tlb_server *srv = &tlb->srv;
+	struct tlb_target *target;
+	ssize_t off = 0;
+	int prio;
+
+	read_lock(&srv->target_lock);
+	for (target = tlb_server_next_target(srv, NULL); target; target = tlb_server_next_target(srv, target)) {
+		prio = READ_ONCE(target->prio);
+		if (prio >= 0)
+			off += scnprintf(buf + off, PAGE_SIZE - off, "%s %d %s\n", target->host, target->port,
+					 tlb_prio_names[prio]);
+	}
+	read_unlock(&srv->target_lock);
+	return off;
+}
+
+static ssize_t tlb_attr_routes_store(struct tlb_context *tlb,
+				     const char *buf, size_t count)
+{
+	struct tlb_route_rule rule;
+	char *str;
+	int r, index;
+
+	if (sscanf(buf, "del %d", &index) == 1)
+		r = tlb_routes_del(&tlb->srv.routes, index);
+	else if (sysfs_streq(buf, "clear"))
+		r = tlb_routes_clear(&tlb->srv.routes);
+	else if (!strncmp(buf, "add ", 4)) {
+		str = kstrndup(buf + 4, count - 4, GFP_KERNEL);
+		if (!str)
+			return -ENOMEM;
+		r = tlb_routes_parse_rule(str, &rule);
+		kfree(str);
+		if (!r)
+			r = tlb_routes_add(&tlb->srv.routes, &rule);
+	} else
+		r = -EINVAL;
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_routes_show(struct tlb_context *tlb,
+				    char *buf)
+{
+	return tlb_routes_show(&tlb->srv.routes, buf, PAGE_SIZE);
+}
+
+static ssize_t tlb_attr_route_stats_show(struct tlb_context *tlb,
+					 char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu\n", atomic64_read(&tlb->srv.routes.matched),
+			 atomic64_read(&tlb->srv.routes.unmatched));
+}
+
+static ssize_t tlb_attr_target_group_store(struct tlb_context *tlb,
+					   const char *buf, size_t count)
+{
+	char host[64], group[TLB_GROUP_NAME_SIZE];
+	int r, port;
+
+	if (sscanf(buf, "%63s %d %31s", host, &port, group) != 3)
+		return -EINVAL;
+
+	r = tlb_server_set_target_group(&tlb->srv, host, port, strcmp(group, "none") ? group : "");
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_target_group_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	struct tlb_server *srv = &tlb->srv;
+	struct tlb_target *target;
+	ssize_t off = 0;
+
+	read_lock(&srv->target_lock);
+	for (target = tlb_server_next_target(srv, NULL); target; target = tlb_server_next_target(srv, target)) {
+		if (target->group[0])
+			off += scnprintf(buf + off, PAGE_SIZE - off, "%s %d %s\n", target->host, target->port,
+					 target->group);
+	}
+	read_unlock(&srv->target_lock);
+	return off;
+}
+
+static ssize_t tlb_attr_shape_store(struct tlb_context *tlb,
+				    const char *buf, size_t count)
+{
+	u64 rate, burst;
+
+	if (sscanf(buf, "%llu %llu", &rate, &burst) != 2)
+		return -EINVAL;
+
+	tlb_shaper_set(&tlb->srv.shaper, rate, burst);
+	return count;
+}
+
+static ssize_t tlb_attr_shape_show(struct tlb_context *tlb,
+				   char *buf)
+{
+	u64 rate, burst;
+
+	tlb_shaper_get(&tlb->srv.shaper, &rate, &burst);
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu\n", rate, burst);
+}
+
+static ssize_t tlb_attr_con_shape_store(struct tlb_context *tlb,
+					const char *buf, size_t count)
+{
+	u64 rate, burst;
+
+	if (sscanf(buf, "%llu %llu", &rate, &burst) != 2)
+		return -EINVAL;
+
+	WRITE_ONCE(tlb->srv.con_rate, rate);
+	WRITE_ONCE(tlb->srv.con_burst, burst);
+	return count;
+}
+
+static ssize_t tlb_attr_con_shape_show(struct tlb_context *tlb,
+				       char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu\n", READ_ONCE(tlb->srv.con_rate),
+			 READ_ONCE(tlb->srv.con_burst));
+}
+
+static ssize_t tlb_attr_target_shape_store(struct tlb_context *tlb,
+					   const char *buf, size_t count)
+{
+	char host[64];
+	u64 rate, burst;
+	int r, port;
+
+	if (sscanf(buf, "%63s %d %llu %llu", host, &port, &rate, &burst) != 4)
+		return -EINVAL;
+
+	r = tlb_server_set_target_shape(&tlb->srv, host, port, rate, burst);
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_target_shape_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	struct tlb_server *srv = &tlb->srv;
+	struct tlb_target *target;
+	ssize_t off = 0;
+	u64 rate, burst;
+
+	read_lock(&srv->target_lock);
+	for (target = tlb_server_next_target(srv, NULL); target; target = tlb_server_next_target(srv, target)) {
+		tlb_shaper_get(&target->shaper, &rate, &burst);
+		if (rate)
+			off += scnprintf(buf + off, PAGE_SIZE - off, "%s %d %llu %llu %llu\n", target->host,
+					 target->port, rate, burst, atomic64_read(&target->shaper.waits));
+	}
+	read_unlock(&srv->target_lock);
+	return off;
+}
+
+static ssize_t tlb_attr_target_fault_store(struct tlb_context *tlb,
+					   const char *buf, size_t count)
+{
+	char host[64];
+	unsigned int fail_percent, delay_ms;
+	u64 reset_bytes;
+	int r, port;
+
+	if (sscanf(buf, "%63s %d %u %u %llu", host, &port, &fail_percent, &delay_ms, &reset_bytes) != 5)
+		return -EINVAL;
+
+	r = tlb_server_set_target_fault(&tlb->srv, host, port, fail_percent, delay_ms, reset_bytes);
+	if (r)
+		return r;
+
+	return count;
+}
+
+/* counters stay once the fault is cleared */
+static ssize_t tlb_attr_target_fault_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	struct tlb_server *srv = &tlb->srv;
+	struct tlb_target *target;
+	struct tlb_target_fault *fault;
+	ssize_t off = 0;
+
+	read_lock(&srv->target_lock);
+	for (target = tlb_server_next_target(srv, NULL); target; target = tlb_server_next_target(srv, target)) {
+		fault = &target->fault;
+		if (!READ_ONCE(fault->fail_percent) && !READ_ONCE(fault->delay_ms) && !READ_ONCE(fault->reset_bytes) &&
+		    !atomic64_read(&fault->fails) && !atomic64_read(&fault->delays) && !atomic64_read(&fault->resets))
+			continue;
+		off += scnprintf(buf + off, PAGE_SIZE - off, "%s %d %u %u %llu %llu %llu %llu\n", target->host,
+				 target->port, READ_ONCE(fault->fail_percent), READ_ONCE(fault->delay_ms),
+				 READ_ONCE(fault->reset_bytes), atomic64_read(&fault->fails),
+				 atomic64_read(&fault->delays), atomic64_read(&fault->resets));
+	}
+	read_unlock(&srv->target_lock);
+	return off;
+}
+
+/* times a connection had to wait for the listener and connection limits */
+static ssize_t tlb_attr_shape_stats_show(struct tlb_context *tlb,
+					 char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu\n", atomic64_read(&tlb->srv.shaper.waits),
+			 atomic64_read(&tlb->srv.con_shape_waits));
+}
+
+static ssize_t tlb_attr_split_rate_store(struct tlb_context *tlb,
+					 const char *buf, size_t count)
+{
+	u64 rate;
+	int r;
+
+	r = kstrtou64(buf, 10, &rate);
+	if (r)
+		return r;
+
+	WRITE_ONCE(tlb->srv.split_rate, rate);
+	return count;
+}
+
+static ssize_t tlb_attr_split_rate_show(struct tlb_context *tlb,
+					char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", READ_ONCE(tlb->srv.split_rate));
+}
+
+static ssize_t tlb_attr_split_stats_show(struct tlb_context *tlb,
+					 char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", atomic64_read(&tlb->srv.split_cons));
+}
+
+static ssize_t tlb_attr_select_bpf_store(struct tlb_context *tlb,
+					 const char *buf, size_t count)
+{
+	bool enabled;
+	int r;
+
+	r = kstrtobool(buf, &enabled);
+	if (r)
+		return r;
+
+	WRITE_ONCE(tlb->srv.select_bpf, enabled);
+	return count;
+}
+
+static ssize_t tlb_attr_select_bpf_show(struct tlb_context *tlb,
+					char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(tlb->srv.select_bpf));
+}
+
+static ssize_t tlb_attr_select_stats_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu\n", atomic64_read(&tlb->srv.select_picks),
+			 atomic64_read(&tlb->srv.select_fallbacks));
+}
+
+static ssize_t tlb_attr_replay_size_store(struct tlb_context *tlb,
+					  const char *buf, size_t count)
+{
+	unsigned int size;
+	int r;
+
+	r = kstrtouint(buf, 10, &size);
+	if (r)
+		return r;
+
+	if (size > TLB_REPLAY_MAX_SIZE)
+		return -EINVAL;
+
+	WRITE_ONCE(tlb->srv.replay_size, size);
+	return count;
+}
+
+static ssize_t tlb_attr_replay_size_show(struct tlb_context *tlb,
+					 char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(tlb->srv.replay_size));
+}
+
+static ssize_t tlb_attr_replay_stats_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu\n", atomic64_read(&tlb->srv.replays),
+			 atomic64_read(&tlb->srv.replay_fails));
+}
+
+static ssize_t tlb_attr_subset_store(struct tlb_context *tlb,
+				     const char *buf, size_t count)
+{
+	unsigned int size, threads = 1;
+	int r;
+
+	if (sscanf(buf, "%u %u", &size, &threads) < 1)
+		return -EINVAL;
+
+	r = tlb_server_set_subset(&tlb->srv, size, threads);
+	if (r)
+		return r;
+	return count;
+}
+
+static ssize_t tlb_attr_subset_show(struct tlb_context *tlb,
+				    char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u %u\n", READ_ONCE(tlb->srv.subset_size),
+			 READ_ONCE(tlb->srv.subset_threads));
+}
+
+static ssize_t tlb_attr_subset_stats_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", atomic64_read(&tlb->srv.subset_misses));
+}
+
+static ssize_t tlb_attr_http_cache_store(struct tlb_context *tlb,
+					 const char *buf, size_t count)
+{
+	unsigned int size;
+	int r;
+
+	r = kstrtouint(buf, 10, &size);
+	if (r)
+		return r;
+
+	WRITE_ONCE(tlb->srv.http_cache_size, size);
+	return count;
+}
+
+static ssize_t tlb_attr_http_cache_show(struct tlb_context *tlb,
+					char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(tlb->srv.http_cache_size));
+}
+
+static ssize_t tlb_attr_http_cache_stats_show(struct tlb_context *tlb,
+					      char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu %llu %llu\n", atomic64_read(&tlb->srv.http_cache_hits),
+			 atomic64_read(&tlb->srv.http_cache_misses), atomic64_read(&tlb->srv.http_cache_stores),
+			 atomic64_read(&tlb->srv.http_cache_evictions));
+}
+
+static ssize_t tlb_attr_sticky_store(struct tlb_context *tlb,
+				     const char *buf, size_t count)
+{
+	int r, nr_entries, prefix4, prefix6;
+	unsigned int ttl_ms;
+
+	if (sscanf(buf, "%d %u %d %d", &nr_entries, &ttl_ms, &prefix4, &prefix6) != 4)
+		return -EINVAL;
+
+	r = tlb_server_set_sticky(&tlb->srv, nr_entries, ttl_ms, prefix4, prefix6);
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_sticky_show(struct tlb_context *tlb,
+				    char *buf)
+{
+	struct tlb_sticky *st = &tlb->srv.sticky;
+
+	return scnprintf(buf, PAGE_SIZE, "%d %u %d %d\n", READ_ONCE(st->nr_entries), READ_ONCE(st->ttl_ms),
+			 READ_ONCE(st->prefix4), READ_ONCE(st->prefix6));
+}
+
+static ssize_t tlb_attr_sticky_stats_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	struct tlb_sticky_stats stats;
+
+	tlb_sticky_get_stats(&tlb->srv.sticky, &stats);
+	return scnprintf(buf, PAGE_SIZE, "hits %llu misses %llu expired %llu stale %llu\n",
+			 stats.hits, stats.misses, stats.expired, stats.stale);
+}
+
+static const char * const tlb_overload_action_names[] = {
+	[TLB_OVERLOAD_RESET] = "reset",
+	[TLB_OVERLOAD_CLOSE] = "close",
+	[TLB_OVERLOAD_PAUSE] = "pause",
+};
+
+static ssize_t tlb_attr_overload_store(struct tlb_context *tlb,
+				       const char *buf, size_t count)
+{
+	unsigned int queue_len, latency_us;
+	char action[16];
+	int i;
+
+	if (sscanf(buf, "%u %u %15s", &queue_len, &latency_us, action) != 3)
+		return -EINVAL;
+
+	i = match_string(tlb_overload_action_names, ARRAY_SIZE(tlb_overload_action_names), action);
+	if (i < 0)
+		return i;
+
+	WRITE_ONCE(tlb->srv.overload_queue_len, queue_len);
+	WRITE_ONCE(tlb->srv.overload_latency_us, latency_us);
+	WRITE_ONCE(tlb->srv.overload_action, i);
+	return count;
+}
+
+static ssize_t tlb_attr_overload_show(struct tlb_context *tlb,
+				      char *buf)
+{
+	struct tlb_server *srv = &tlb->srv;
+
+	return scnprintf(buf, PAGE_SIZE, "%u %u %s\n", READ_ONCE(srv->overload_queue_len),
+			 READ_ONCE(srv->overload_latency_us),
+			 tlb_overload_action_names[READ_ONCE(srv->overload_action)]);
+}
+
+/* shed and paused counters, then queue length and wakeup latency per thread */
+static ssize_t tlb_attr_overload_stats_show(struct tlb_context *tlb,
+					    char *buf)
+{
+	struct tlb_server *srv = &tlb->srv;
+	struct coroutine_thread *thread;
+	ssize_t off;
+	int i;
+
+	off = scnprintf(buf, PAGE_SIZE, "%llu %llu\n", atomic64_read(&srv->shed_cons),
+			atomic64_read(&srv->accept_pauses));
+
+	mutex_lock(&srv->lock);
+	if (srv->state == TLB_SRV_RUNNING) {
+		for (i = 0; i < srv->nr_con_thread; i++) {
+			thread = &srv->con_thread[i];
+			off += scnprintf(buf + off, PAGE_SIZE - off, "%u %d %llu\n", thread->cpu,
+					 coroutine_thread_queue_len(thread),
+					 coroutine_thread_latency_ns(thread) / NSEC_PER_USEC);
+		}
+	}
+	mutex_unlock(&srv->lock);
+	return off;
+}
+
+static ssize_t tlb_attr_max_cons_store(struct tlb_context *tlb,
+					const char *buf, size_t count)
+{
+	unsigned int max_cons;
+	int r;
+
+	r = kstrtouint(buf, 10, &max_cons);
+	if (r)
+		return r;
+
+	WRITE_ONCE(tlb->srv.max_cons, max_cons);
+	wake_up(&tlb->srv.cons_waitq);
+	return count;
+}
+
+static ssize_t tlb_attr_max_cons_show(struct tlb_context *tlb,
+				       char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(tlb->srv.max_cons));
+}
+
+static ssize_t tlb_attr_con_stats_show(struct tlb_context *tlb,
+				       char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%d %llu\n", atomic_read(&tlb->srv.nr_cons),
+			 atomic64_read(&tlb->srv.accept_waits));
+}
+
+static ssize_t tlb_attr_idle_timeout_store(struct tlb_context *tlb,
+					   const char *buf, size_t count)
+{
+	unsigned int client_ms, target_ms;
+
+	if (sscanf(buf, "%u %u", &client_ms, &target_ms) != 2)
+		return -EINVAL;
+
+	WRITE_ONCE(tlb->srv.client_idle_ms, client_ms);
+	WRITE_ONCE(tlb->srv.target_idle_ms, target_ms);
+	return count;
+}
+
+static ssize_t tlb_attr_idle_timeout_show(struct tlb_context *tlb,
+					  char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u %u\n", READ_ONCE(tlb->srv.client_idle_ms),
+			 READ_ONCE(tlb->srv.target_idle_ms));
+}
+
+static ssize_t tlb_attr_min_rate_store(struct tlb_context *tlb,
+				       const char *buf, size_t count)
+{
+	unsigned int rate, window_ms;
+
+	if (sscanf(buf, "%u %u", &rate, &window_ms) != 2)
+		return -EINVAL;
+	if (rate && !window_ms)
+		return -EINVAL;
+
+	WRITE_ONCE(tlb->srv.min_rate, rate);
+	WRITE_ONCE(tlb->srv.min_rate_window_ms, window_ms);
+	return count;
+}
+
+static ssize_t tlb_attr_min_rate_show(struct tlb_context *tlb,
+				      char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u %u\n", READ_ONCE(tlb->srv.min_rate),
+			 READ_ONCE(tlb->srv.min_rate_window_ms));
+}
+
+static ssize_t tlb_attr_timeout_stats_show(struct tlb_context *tlb,
+					   char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu\n", atomic64_read(&tlb->srv.idle_timeouts),
+			 atomic64_read(&tlb->srv.slow_timeouts));
+}
+
+static ssize_t tlb_attr_start_udp_server_store(struct tlb_context *tlb,
+					const char *buf, size_t count)
+{
+	char host[64];
+	int r, port;
+
+	r = sscanf(buf, "%63s %d", host, &port);
+	if (r != 2)
+		return -EINVAL;
+
+	r = tlb_udp_server_start(&tlb->srv.udp, host, port);
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_start_udp_server_show(struct tlb_context *tlb,
+				     char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "\n");
+}
+
+static ssize_t tlb_attr_stop_udp_server_store(struct tlb_context *tlb,
+					const char *buf, size_t count)
+{
+	int r;
+
+	r = tlb_udp_server_stop(&tlb->srv.udp);
+	if (r)
+		return r;
+
+	return count;
+}
+
+static ssize_t tlb_attr_stop_udp_server_show(struct tlb_context *tlb,
+				     char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "\n");
+}
+
+static ssize_t tlb_attr_udp_flow_timeout_ms_store(struct tlb_context *tlb,
+					const char *buf, size_t count)
+{
+	unsigned int timeout_ms;
+	int r;
+
+	r = kstrtouint(buf, 10, &timeout_ms);
+	if (r)
+		return r;
+
+	if (timeout_ms == 0)
+		return -EINVAL;
+
+	WRITE_ONCE(tlb->srv.udp.flow_timeout_ms, timeout_ms);
+	return count;
+}
+
+static ssize_t tlb_attr_udp_flow_timeout_ms_show(struct tlb_context *tlb,
+				     char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(tlb->srv.udp.flow_timeout_ms));
+}
+
+static ssize_t tlb_attr_udp_stats_show(struct tlb_context *tlb,
+				     char *buf)
+{
+	struct tlb_udp_stats stats;
+	int r;
+
+	r = tlb_udp_server_get_stats(&tlb->srv.udp, &stats);
+	if (r)
+		return r;
+
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu %llu %llu %llu\n",
+			 stats.flows, stats.total_flows, stats.rx_packets, stats.tx_packets, stats.drops);
+}
+
 static ssize_t tlb_attr_show(struct kobject *kobj,
 				struct attribute *attr,
 				char *page)
@@ -240,6 +1389,57 @@ static TLB_ATTR_RW(stop_server);
 static TLB_ATTR_RW(add_target);
 static TLB_ATTR_RW(remove_target);
 static TLB_ATTR_RO(targets);
+static TLB_ATTR_RW(transparent);
+static TLB_ATTR_RW(client_sockopts);
+static TLB_ATTR_RW(target_sockopts);
+static TLB_ATTR_RW(source_pool);
+static TLB_ATTR_RW(target_close);
+static TLB_ATTR_RO(arena_stats);
+static TLB_ATTR_RW(mode);
+static TLB_ATTR_RW(h2_pool_size);
+static TLB_ATTR_RW(mirror);
+static TLB_ATTR_RO(mirror_stats);
+static TLB_ATTR_RW(ip_limit);
+static TLB_ATTR_RW(prefix_limit);
+static TLB_ATTR_RW(limit_prefix_len);
+static TLB_ATTR_RO(admission_stats);
+static TLB_ATTR_RW(blocklist);
+static TLB_ATTR_RW(flood_block_ms);
+static TLB_ATTR_RO(block_stats);
+static TLB_ATTR_RW(prio);
+static TLB_ATTR_RW(prio_rules);
+static TLB_ATTR_RW(target_prio);
+static TLB_ATTR_RW(routes);
+static TLB_ATTR_RO(route_stats);
+static TLB_ATTR_RW(target_group);
+static TLB_ATTR_RW(shape);
+static TLB_ATTR_RW(con_shape);
+static TLB_ATTR_RW(target_shape);
+static TLB_ATTR_RO(shape_stats);
+static TLB_ATTR_RW(target_fault);
+static TLB_ATTR_RW(split_rate);
+static TLB_ATTR_RO(split_stats);
+static TLB_ATTR_RW(sticky);
+static TLB_ATTR_RO(sticky_stats);
+static TLB_ATTR_RW(select_bpf);
+static TLB_ATTR_RO(select_stats);
+static TLB_ATTR_RW(replay_size);
+static TLB_ATTR_RO(replay_stats);
+static TLB_ATTR_RW(subset);
+static TLB_ATTR_RO(subset_stats);
+static TLB_ATTR_RW(http_cache);
+static TLB_ATTR_RO(http_cache_stats);
+static TLB_ATTR_RW(overload);
+static TLB_ATTR_RO(overload_stats);
+static TLB_ATTR_RW(max_cons);
+static TLB_ATTR_RO(con_stats);
+static TLB_ATTR_RW(idle_timeout);
+static TLB_ATTR_RW(min_rate);
+static TLB_ATTR_RO(timeout_stats);
+static TLB_ATTR_RW(start_udp_server);
+static TLB_ATTR_RW(stop_udp_server);
+static TLB_ATTR_RW(udp_flow_timeout_ms);
+static TLB_ATTR_RO(udp_stats);
 
 static struct attribute *tlb_attrs[] = {
 	&tlb_attr_start_server.attr,
@@ -247,6 +1447,57 @@ static struct attribute *tlb_attrs[] = {
 	&tlb_attr_add_target.attr,
 	&tlb_attr_remove_target.attr,
 	&tlb_attr_targets.attr,
+	&tlb_attr_transparent.attr,
+	&tlb_attr_client_sockopts.attr,
+	&tlb_attr_target_sockopts.attr,
+	&tlb_attr_source_pool.attr,
+	&tlb_attr_target_close.attr,
+	&tlb_attr_arena_stats.attr,
+	&tlb_attr_mode.attr,
+	&tlb_attr_h2_pool_size.attr,
+	&tlb_attr_mirror.attr,
+	&tlb_attr_mirror_stats.attr,
+	&tlb_attr_ip_limit.attr,
+	&tlb_attr_prefix_limit.attr,
+	&tlb_attr_limit_prefix_len.attr,
+	&tlb_attr_admission_stats.attr,
+	&tlb_attr_blocklist.attr,
+	&tlb_attr_flood_block_ms.attr,
+	&tlb_attr_block_stats.attr,
+	&tlb_attr_prio.attr,
+	&tlb_attr_prio_rules.attr,
+	&tlb_attr_target_prio.attr,
+	&tlb_attr_routes.attr,
+	&tlb_attr_route_stats.attr,
+	&tlb_attr_target_group.attr,
+	&tlb_attr_shape.attr,
+	&tlb_attr_con_shape.attr,
+	&tlb_attr_target_shape.attr,
+	&tlb_attr_shape_stats.attr,
+	&tlb_attr_target_fault.attr,
+	&tlb_attr_split_rate.attr,
+	&tlb_attr_split_stats.attr,
+	&tlb_attr_sticky.attr,
+	&tlb_attr_sticky_stats.attr,
+	&tlb_attr_select_bpf.attr,
+	&tlb_attr_select_stats.attr,
+	&tlb_attr_replay_size.attr,
+	&tlb_attr_replay_stats.attr,
+	&tlb_attr_subset.attr,
+	&tlb_attr_subset_stats.attr,
+	&tlb_attr_http_cache.attr,
+	&tlb_attr_http_cache_stats.attr,
+	&tlb_attr_overload.attr,
+	&tlb_attr_overload_stats.attr,
+	&tlb_attr_max_cons.attr,
+	&tlb_attr_con_stats.attr,
+	&tlb_attr_idle_timeout.attr,
+	&tlb_attr_min_rate.attr,
+	&tlb_attr_timeout_stats.attr,
+	&tlb_attr_start_udp_server.attr,
+	&tlb_attr_stop_udp_server.attr,
+	&tlb_attr_udp_flow_timeout_ms.attr,
+	&tlb_attr_udp_stats.attr,
 	NULL,
 };
 
@@ -2,6 +2,9 @@
 #include "base.h"
 #include "server.h"
 #include "trace.h"
+#include "select.h"
+
+static atomic_t tlb_target_next_id = ATOMIC_INIT(0);
 
 static int tlb_target_init(struct tlb_target *target, const char *host, int port)
 {
@@ -10,7 +13,9 @@ static int tlb_target_init(struct tlb_target *target, const char *host, int port
 	if (strlen(host) >= ARRAY_SIZE(target->host))
 		return -EINVAL;
 
-	if (port <= 0 || port > 65535)
+	if (ksock_is_unix_host(host))
+		port = 0;
+	else if (port <= 0 || port > 65535)
 		return -EINVAL;
 
 	memset(target, 0, sizeof(*target));
@@ -20,16 +25,20 @@ static int tlb_target_init(struct tlb_target *target, const char *host, int port
 
 	snprintf(target->host, ARRAY_SIZE(target->host), "%s", host);
 	target->port = port;
+	target->id = atomic_inc_return(&tlb_target_next_id);
+	target->key_hash = jhash(target->host, strlen(target->host), port);
 	atomic_set(&target->ref_count, 1);
 	atomic64_set(&target->active_cons, 0);
 	atomic64_set(&target->total_cons, 0);
 	target->min_con_time_us = U64_MAX;
+	target->prio = -1;
+	tlb_shaper_init(&target->shaper, 0, 0);
 
 	resample_init(&target->con_time_sample, target->con_time_sample_value, ARRAY_SIZE(target->con_time_sample_value));
 	return 0;
 }
 
-static void tlb_target_get(struct tlb_target *target)
+void tlb_target_get(struct tlb_target *target)
 {
 	atomic_inc(&target->ref_count);
 }
@@ -63,7 +72,8 @@ static void tlb_target_con_state_change(struct sock *sk)
 	coroutine_signal(con->co);
 }
 
-int tlb_target_connect(struct tlb_target *target, struct coroutine *co, struct tlb_target_con **pcon)
+int tlb_target_connect(struct tlb_target *target, struct coroutine *co, struct sockaddr_storage *src_addr,
+		       int bind_flags, struct ksock_opts *opts, struct tlb_target_con **pcon)
 {
 	struct tlb_target_con *con;
 	struct ksock_callbacks callbacks;
@@ -75,12 +85,14 @@ int tlb_target_connect(struct tlb_target *target, struct coroutine *co, struct t
 	memset(con, 0, sizeof(*con));
 	coroutine_ref(co);
 	con->co = co;
+	con->target = target;
+	coroutine_timer_init(&con->timeout.timer, co);
 	callbacks.user_data = con;
 	callbacks.data_ready = tlb_target_con_data_ready;
 	callbacks.write_space = tlb_target_con_write_space;
 	callbacks.state_change = tlb_target_con_state_change;
 
-	r = ksock_connect_addr(&con->sock, &target->addr, &callbacks);
+	r = ksock_connect_addr(&con->sock, &target->addr, src_addr, bind_flags, opts, &callbacks);
 	if (r) {
 		coroutine_deref(con->co);
 		kmem_cache_free(g_target_con_cache, con);
@@ -95,13 +107,21 @@ int tlb_target_connect(struct tlb_target *target, struct coroutine *co, struct t
 
 void tlb_target_con_close(struct tlb_target_con *con)
 {
+	tlb_timeout_cancel(&con->timeout);
 	if (con->sock) {
 		trace_con_sock_release(con);
-		ksock_release(con->sock);
+		/* whoever sends the first FIN keeps the TIME_WAIT, an RST leaves none */
+		if (!con->closed && con->srv && READ_ONCE(con->srv->target_close) == TLB_TARGET_CLOSE_RST) {
+			atomic64_inc(&con->srv->target_resets);
+			ksock_reset(con->sock);
+		} else
+			ksock_release(con->sock);
 		trace_con_sock_release_return(con);
 	}
+	if (con->src)
+		tlb_src_put(con->src);
 	if (con->buf)
-		kmem_cache_free(g_con_buf_cache, con->buf);
+		tlb_arena_free(&g_con_buf_arena, con->buf);
 
 	trace_target_con_delete(con, con->co);
 
@@ -113,6 +133,7 @@ void tlb_server_init_targets(struct tlb_server *srv)
 {
 	rwlock_init(&srv->target_lock);
 	srv->target_tree = RB_ROOT;
+	atomic_set(&srv->target_gen, 0);
 }
 
 void tlb_server_deinit_targets(struct tlb_server *srv)
@@ -158,6 +179,10 @@ static struct tlb_target *tlb_server_lookup_target(struct tlb_server *srv, const
 	struct tlb_target *target;
 	int cmp;
 
+	/* unix targets are kept with port 0 whatever port was given */
+	if (ksock_is_unix_host(host))
+		port = 0;
+
 	while (node) {
 		target = rb_entry(node, struct tlb_target, target_tree_entry);
 		cmp = cmp_host_port(host, port, target->host, target->port);
@@ -201,26 +226,39 @@ static int tlb_server_insert_target(struct tlb_server *srv, struct tlb_target *n
 	rb_link_node(&new_target->target_tree_entry, parent, node);
 	rb_insert_color(&new_target->target_tree_entry, &srv->target_tree);
 	tlb_target_get(new_target);
+	atomic_inc(&srv->target_gen);
 
 	write_unlock(&srv->target_lock);
 	return 0;
 }
 
-int tlb_server_add_target(struct tlb_server *srv, const char *host, int port)
+struct tlb_target *tlb_target_create(const char *host, int port)
 {
 	struct tlb_target *target;
 	int r;
 
 	target = kmalloc(sizeof(*target), GFP_KERNEL);
 	if (!target)
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
 
 	r = tlb_target_init(target, host, port);
 	if (r) {
 		kfree(target);
-		return r;
+		return ERR_PTR(r);
 	}
 
+	return target;
+}
+
+int tlb_server_add_target(struct tlb_server *srv, const char *host, int port)
+{
+	struct tlb_target *target;
+	int r;
+
+	target = tlb_target_create(host, port);
+	if (IS_ERR(target))
+		return PTR_ERR(target);
+
 	r = tlb_server_insert_target(srv, target);
 	tlb_target_put(target);
 	return r;
@@ -236,25 +274,156 @@ int tlb_server_remove_target(struct tlb_server *srv, const char *host, int port)
 		write_unlock(&srv->target_lock);
 		return -ENOENT;
 	}
+	WRITE_ONCE(target->removed, true);
+	atomic_inc(&srv->target_gen);
 	tlb_target_put(target);
 	write_unlock(&srv->target_lock);
 	return 0;
 }
 
-struct tlb_target* tlb_server_select_target(struct tlb_server *srv)
+int tlb_server_set_target_prio(struct tlb_server *srv, const char *host, int port, int prio)
+{
+	struct tlb_target *target;
+
+	read_lock(&srv->target_lock);
+	target = tlb_server_lookup_target(srv, host, port, false);
+	read_unlock(&srv->target_lock);
+	if (!target)
+		return -ENOENT;
+
+	WRITE_ONCE(target->prio, prio);
+	tlb_target_put(target);
+	return 0;
+}
+
+int tlb_server_set_target_group(struct tlb_server *srv, const char *host, int port, const char *group)
+{
+	struct tlb_target *target;
+	int r = 0;
+
+	write_lock(&srv->target_lock);
+	target = tlb_server_lookup_target(srv, host, port, false);
+	if (!target)
+		r = -ENOENT;
+	else if (strscpy(target->group, group, sizeof(target->group)) < 0)
+		r = -EINVAL;
+	write_unlock(&srv->target_lock);
+	if (target)
+		tlb_target_put(target);
+	return r;
+}
+
+int tlb_server_set_target_shape(struct tlb_server *srv, const char *host, int port, u64 rate, u64 burst)
+{
+	struct tlb_target *target;
+
+	read_lock(&srv->target_lock);
+	target = tlb_server_lookup_target(srv, host, port, false);
+	read_unlock(&srv->target_lock);
+	if (!target)
+		return -ENOENT;
+
+	tlb_shaper_set(&target->shaper, rate, burst);
+	tlb_target_put(target);
+	return 0;
+}
+
+int tlb_server_set_target_fault(struct tlb_server *srv, const char *host, int port, unsigned int fail_percent,
+				unsigned int delay_ms, u64 reset_bytes)
+{
+	struct tlb_target *target;
+
+	if (fail_percent > 100)
+		return -EINVAL;
+
+	read_lock(&srv->target_lock);
+	target = tlb_server_lookup_target(srv, host, port, false);
+	read_unlock(&srv->target_lock);
+	if (!target)
+		return -ENOENT;
+
+	WRITE_ONCE(target->fault.fail_percent, fail_percent);
+	WRITE_ONCE(target->fault.delay_ms, delay_ms);
+	WRITE_ONCE(target->fault.reset_bytes, reset_bytes);
+	tlb_target_put(target);
+	return 0;
+}
+
+/* sleeps the added delay in the connecting coroutine, then maybe fails */
+int tlb_target_fault_connect(struct tlb_target *target, struct coroutine *co)
+{
+	struct tlb_target_fault *fault = &target->fault;
+	unsigned int delay_ms = READ_ONCE(fault->delay_ms);
+	unsigned int fail_percent = READ_ONCE(fault->fail_percent);
+
+	if (delay_ms) {
+		atomic64_inc(&fault->delays);
+		coroutine_sleep(co, msecs_to_jiffies(delay_ms));
+	}
+
+	if (fail_percent && prandom_u32_max(100) < fail_percent) {
+		atomic64_inc(&fault->fails);
+		return -ECONNREFUSED;
+	}
+
+	return 0;
+}
+
+static struct tlb_target *tlb_least_con_target(struct tlb_target *least, struct tlb_target *target)
+{
+	if (!least || atomic64_read(&target->active_cons) < atomic64_read(&least->active_cons))
+		return target;
+	return least;
+}
+
+/*
+ * group NULL takes any target, inet skips unix targets. With subsetting,
+ * targets outside the thread's subset are only picked when the subset has
+ * none of the group's.
+ */
+static struct tlb_target *__tlb_server_select_target(struct tlb_server *srv, struct coroutine_thread *thread,
+						     struct sockaddr_storage *client, const char *group,
+						     u32 sticky_id, struct tlb_target *skip, bool inet)
 {
 	struct rb_node *node;
 	struct tlb_target *target;
-	struct tlb_target *least_con_target = NULL;
+	struct tlb_target *least_con_target = NULL, *outside = NULL;
+	struct tlb_select_ctx *ctx = NULL;
+	struct tlb_subset *subset;
 
 	read_lock(&srv->target_lock);
+	subset = tlb_server_subset(srv, thread);
+	if (READ_ONCE(srv->select_bpf))
+		ctx = tlb_select_begin(srv, client);
 	for (node = rb_first(&srv->target_tree); node != NULL; node = rb_next(node)) {
 		target = rb_entry(node, struct tlb_target, target_tree_entry);
-		if (!least_con_target)
+		if (target == skip || (group && strcmp(target->group, group)))
+			continue;
+		if (inet && target->addr.ss_family != AF_INET && target->addr.ss_family != AF_INET6)
+			continue;
+		if (sticky_id && target->id == sticky_id) {
+			least_con_target = target;
+			ctx = NULL;
+			break;
+		}
+		if (subset && !tlb_subset_contains(subset, target)) {
+			outside = tlb_least_con_target(outside, target);
+			continue;
+		}
+		if (ctx)
+			tlb_select_add(ctx, target);
+		least_con_target = tlb_least_con_target(least_con_target, target);
+	}
+	if (!least_con_target && outside) {
+		least_con_target = outside;
+		atomic64_inc(&srv->subset_misses);
+	}
+
+	/* the program overrides least connections, not a sticky target */
+	if (ctx) {
+		target = tlb_select_run(srv, ctx);
+		if (target)
 			least_con_target = target;
-		else
-			if (atomic64_read(&target->active_cons) < atomic64_read(&least_con_target->active_cons))
-				least_con_target = target;
 	}
 
 	if (least_con_target)
@@ -264,6 +433,64 @@ struct tlb_target* tlb_server_select_target(struct tlb_server *srv)
 	return least_con_target;
 }
 
+static struct tlb_target *tlb_server_select_sticky_target(struct tlb_server *srv, struct coroutine_thread *thread,
+							  struct sockaddr_storage *client, bool inet)
+{
+	struct tlb_target *target;
+	u32 sticky_id = client ? tlb_sticky_lookup(&srv->sticky, client) : 0;
+
+	target = __tlb_server_select_target(srv, thread, client, NULL, sticky_id, NULL, inet);
+	if (!target || !client)
+		return target;
+
+	if (target->id == sticky_id) {
+		atomic64_inc(&srv->sticky.hits);
+	} else {
+		if (sticky_id)
+			atomic64_inc(&srv->sticky.stale);
+		tlb_sticky_update(&srv->sticky, client, target->id);
+	}
+
+	return target;
+}
+
+/* client may be NULL, else its sticky target wins over the least loaded one */
+struct tlb_target* tlb_server_select_target(struct tlb_server *srv, struct coroutine_thread *thread,
+					    struct sockaddr_storage *client)
+{
+	return tlb_server_select_sticky_target(srv, thread, client, false);
+}
+
+/* datagrams can't be relayed to a unix stream socket */
+struct tlb_target* tlb_server_select_udp_target(struct tlb_server *srv, struct sockaddr_storage *client)
+{
+	return tlb_server_select_sticky_target(srv, NULL, client, true);
+}
+
+/* a routed connection doesn't stick, its client may hit other groups too */
+struct tlb_target* tlb_server_select_group_target(struct tlb_server *srv, struct coroutine_thread *thread,
+						  struct sockaddr_storage *client, const char *group)
+{
+	return __tlb_server_select_target(srv, thread, client, group, 0, NULL, false);
+}
+
+/* the least loaded target but prev, or prev again if it's the only one left */
+struct tlb_target* tlb_server_select_other_target(struct tlb_server *srv, struct coroutine_thread *thread,
+						  struct sockaddr_storage *client, const char *group,
+						  struct tlb_target *prev)
+{
+	struct tlb_target *target;
+
+	target = __tlb_server_select_target(srv, thread, client, group, 0, prev, false);
+	if (!target)
+		return __tlb_server_select_target(srv, thread, client, group, 0, NULL, false);
+	if (group)
+		return target;
+
+	tlb_sticky_update(&srv->sticky, client, target->id);
+	return target;
+}
+
 struct tlb_target* tlb_server_next_target(struct tlb_server *srv, struct tlb_target* prev)
 {
 	struct rb_node *node;
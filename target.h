@@ -3,10 +3,30 @@
 #include "ksock.h"
 #include "coroutine.h"
 #include "resample.h"
+#include "timeout.h"
+#include "shaper.h"
+#include "srcpool.h"
+#include "route.h"
 
 struct tlb_server;
+struct tlb_replay;
+
+/* injected into new connections to measure failover, all zero is off */
+struct tlb_target_fault {
+	unsigned int fail_percent;
+	unsigned int delay_ms;
+	/* the target side resets after sending this many bytes */
+	u64 reset_bytes;
+	atomic64_t fails;
+	atomic64_t delays;
+	atomic64_t resets;
+};
 
 struct tlb_target {
+	/* unique for the module lifetime, a re-added target gets a new one */
+	u32 id;
+	/* of host and port, stable across re-adds */
+	u32 key_hash;
 	char host[64];
 	int port;
 	struct sockaddr_storage addr;
@@ -14,6 +34,13 @@ struct tlb_target {
 	atomic64_t total_cons;
 	atomic64_t active_cons;
 	struct rb_node target_tree_entry;
+	bool removed;
+	/* scheduling class of its connections, -1 keeps the client's */
+	int prio;
+	/* routed HTTP connections pick among their group only, "" is none */
+	char group[TLB_GROUP_NAME_SIZE];
+	struct tlb_shaper shaper;
+	struct tlb_target_fault fault;
 
 	spinlock_t lock;
 	u64 min_con_time_us;
@@ -28,14 +55,39 @@ struct tlb_target {
 struct tlb_target_con {
 	struct socket *sock;
 	struct coroutine *co;
+	/* the client side holds the reference */
+	struct tlb_target *target;
+	struct tlb_server *srv;
+	struct tlb_src *src;
+	/* the target sent its FIN first */
+	bool closed;
 	struct socket *src_sock;
+	struct tlb_shaper **shapers;
+	/* NULL unless the client's first bytes can still be replayed */
+	struct tlb_replay *replay;
 	char *buf;
 	int buf_len;
+	struct tlb_timeout timeout;
+
+	/* bytes the target may still send before an injected reset, 0 is none */
+	u64 fault_left;
+	/* the injected reset fired, the client is closed with an RST */
+	bool fault_reset;
+
+	/* throughput over the current window until moved to a sibling thread */
+	u64 split_bytes;
+	u64 split_start_ns;
+	bool split;
 };
 
+struct tlb_target *tlb_target_create(const char *host, int port);
+
+void tlb_target_get(struct tlb_target *target);
+
 void tlb_target_put(struct tlb_target *target);
 
-int tlb_target_connect(struct tlb_target *target, struct coroutine *co, struct tlb_target_con **pcon);
+int tlb_target_connect(struct tlb_target *target, struct coroutine *co, struct sockaddr_storage *src_addr,
+		       int bind_flags, struct ksock_opts *opts, struct tlb_target_con **pcon);
 
 void tlb_target_con_close(struct tlb_target_con *con);
 
@@ -47,6 +99,28 @@ int tlb_server_add_target(struct tlb_server *srv, const char *host, int port);
 
 int tlb_server_remove_target(struct tlb_server *srv, const char *host, int port);
 
-struct tlb_target* tlb_server_select_target(struct tlb_server *srv);
+int tlb_server_set_target_prio(struct tlb_server *srv, const char *host, int port, int prio);
+
+int tlb_server_set_target_group(struct tlb_server *srv, const char *host, int port, const char *group);
+
+int tlb_server_set_target_shape(struct tlb_server *srv, const char *host, int port, u64 rate, u64 burst);
+
+int tlb_server_set_target_fault(struct tlb_server *srv, const char *host, int port, unsigned int fail_percent,
+				unsigned int delay_ms, u64 reset_bytes);
+
+int tlb_target_fault_connect(struct tlb_target *target, struct coroutine *co);
+
+/* thread is the caller's coroutine thread, NULL outside of them */
+struct tlb_target* tlb_server_select_target(struct tlb_server *srv, struct coroutine_thread *thread,
+					    struct sockaddr_storage *client);
+
+struct tlb_target* tlb_server_select_udp_target(struct tlb_server *srv, struct sockaddr_storage *client);
+
+struct tlb_target* tlb_server_select_group_target(struct tlb_server *srv, struct coroutine_thread *thread,
+						  struct sockaddr_storage *client, const char *group);
+
+struct tlb_target* tlb_server_select_other_target(struct tlb_server *srv, struct coroutine_thread *thread,
+						  struct sockaddr_storage *client, const char *group,
+						  struct tlb_target *prev);
 
 struct tlb_target* tlb_server_next_target(struct tlb_server *srv, struct tlb_target* prev);
@@ -0,0 +1,48 @@
+#include "tbucket.h"
+
+void tlb_tbucket_init(struct tlb_tbucket *tb, u64 burst, u64 now_ns)
+{
+	tb->tokens = burst * NSEC_PER_SEC;
+	tb->last_ns = now_ns;
+}
+
+static void tlb_tbucket_refill(struct tlb_tbucket *tb, u64 rate, u64 burst, u64 now_ns)
+{
+	u64 cap = burst * NSEC_PER_SEC;
+	u64 elapsed;
+
+	if (now_ns <= tb->last_ns)
+		return;
+
+	elapsed = now_ns - tb->last_ns;
+	tb->last_ns = now_ns;
+	if (elapsed >= div64_u64(cap - min(tb->tokens, cap), rate) + 1)
+		tb->tokens = cap;
+	else
+		tb->tokens += elapsed * rate;
+}
+
+/* rate and burst of zero mean unlimited */
+bool tlb_tbucket_take(struct tlb_tbucket *tb, u64 rate, u64 burst, u64 n, u64 now_ns)
+{
+	if (!rate)
+		return true;
+
+	tlb_tbucket_refill(tb, rate, max(burst, n), now_ns);
+	if (tb->tokens < n * NSEC_PER_SEC)
+		return false;
+
+	tb->tokens -= n * NSEC_PER_SEC;
+	return true;
+}
+
+/* how long until n tokens are there, after a failed take */
+u64 tlb_tbucket_wait_ns(struct tlb_tbucket *tb, u64 rate, u64 n)
+{
+	u64 need = n * NSEC_PER_SEC;
+
+	if (!rate || tb->tokens >= need)
+		return 0;
+
+	return div64_u64(need - tb->tokens + rate - 1, rate);
+}
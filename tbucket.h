@@ -0,0 +1,18 @@
+#pragma once
+
+#include "base.h"
+
+/*
+ * Token bucket with nanosecond refill. Tokens are kept scaled by
+ * NSEC_PER_SEC so rate (tokens per second) needs no division on refill.
+ */
+struct tlb_tbucket {
+	u64 tokens;
+	u64 last_ns;
+};
+
+void tlb_tbucket_init(struct tlb_tbucket *tb, u64 burst, u64 now_ns);
+
+bool tlb_tbucket_take(struct tlb_tbucket *tb, u64 rate, u64 burst, u64 n, u64 now_ns);
+
+u64 tlb_tbucket_wait_ns(struct tlb_tbucket *tb, u64 rate, u64 n);
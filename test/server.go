@@ -5,15 +5,20 @@ import (
 	"encoding/json"
 	"flag"
 	"fmt"
+	"io"
 	"log"
 	"net/http"
 	"net/http/pprof"
 	"os"
 	"os/signal"
+	"strconv"
 	"syscall"
+	"time"
 
 	"github.com/gorilla/mux"
 	uuid "github.com/satori/go.uuid"
+	"golang.org/x/net/http2"
+	"golang.org/x/net/http2/h2c"
 )
 
 type Service struct {
@@ -136,6 +141,35 @@ func blankHandler(w http.ResponseWriter, r *http.Request) {
 	}()
 }
 
+func echoHandler(w http.ResponseWriter, r *http.Request) {
+	io.Copy(w, r.Body)
+}
+
+// Writes size bytes, the X-Written-At trailer is when the last one went out
+func downloadHandler(w http.ResponseWriter, r *http.Request) {
+	size, err := strconv.Atoi(r.URL.Query().Get("size"))
+	if err != nil {
+		w.WriteHeader(http.StatusBadRequest)
+		return
+	}
+
+	w.Header().Set("Trailer", "X-Written-At")
+	chunk := make([]byte, 64*1024)
+	for size > 0 {
+		n := len(chunk)
+		if n > size {
+			n = size
+		}
+		_, err = w.Write(chunk[:n])
+		if err != nil {
+			return
+		}
+		size -= n
+	}
+	w.(http.Flusher).Flush()
+	w.Header().Set("X-Written-At", strconv.FormatInt(time.Now().UnixNano(), 10))
+}
+
 func notFoundHandler(w http.ResponseWriter, r *http.Request) {
 	var err error
 
@@ -153,6 +187,8 @@ func getHttpHandler() *mux.Router {
 
 	r.HandleFunc("/", rootHandler).Methods("GET")
 	r.HandleFunc("/blank", blankHandler).Methods("GET")
+	r.HandleFunc("/echo", echoHandler).Methods("POST")
+	r.HandleFunc("/download", downloadHandler).Methods("GET")
 
 	r.NotFoundHandler = http.HandlerFunc(notFoundHandler)
 
@@ -199,7 +235,8 @@ func main() {
 	svc.signalChannel = make(chan os.Signal, 1)
 	svc.errorChannel = make(chan error, 1)
 	signal.Notify(svc.signalChannel, syscall.SIGINT, syscall.SIGTERM)
-	svc.httpServer = &http.Server{Addr: address, Handler: getHttpHandler()}
+	// HTTP/1.1 and h2c with prior knowledge, for tlb's h2 mode
+	svc.httpServer = &http.Server{Addr: address, Handler: h2c.NewHandler(getHttpHandler(), &http2.Server{})}
 	if debugAddress != "" {
 		svc.debugHttpServer = &http.Server{Addr: debugAddress, Handler: getDebugHttpHandler()}
 	}
@@ -1,16 +1,43 @@
 package main
 
 import (
+	"bufio"
+	"bytes"
+	"crypto/tls"
 	"flag"
+	"fmt"
+	"io"
+	"io/ioutil"
 	"net"
 	"net/http"
+	"sort"
 	"strconv"
+	"strings"
+	"sync"
 	"testing"
 	"time"
+
+	"golang.org/x/net/http2"
+	"golang.org/x/net/http2/hpack"
 )
 
 var serverAddress = flag.String("serverAddress", "127.0.0.1:7777", "server address")
 
+var (
+	failoverTarget = flag.String("failoverTarget", "", "target to inject faults into, \"host port\"")
+	failoverFault  = flag.String("failoverFault", "100 0 0", "fail_percent delay_ms reset_bytes")
+	failoverRate   = flag.Int("failoverRate", 500, "requests per second")
+	failoverPhase  = flag.Duration("failoverPhase", 5*time.Second, "duration of each phase")
+	tlbSysfs       = flag.String("tlbSysfs", "/sys/fs/tlb", "tlb sysfs directory")
+)
+
+var (
+	h2Mode  = flag.Bool("h2", false, "tlb runs in h2 mode")
+	h2Stall = flag.Duration("h2Stall", 2*time.Second, "how long the stalled client doesn't read")
+)
+
+var redisMode = flag.Bool("redis", false, "tlb runs in redis mode over several targets")
+
 func TestServer(t *testing.T) {
 	t.Parallel()
 	t.Logf("serverAddress %s", *serverAddress)
@@ -36,3 +63,353 @@ func TestServer(t *testing.T) {
 		})
 	}
 }
+
+type failoverSample struct {
+	start   time.Time
+	latency time.Duration
+	err     error
+}
+
+func writeSysfs(t *testing.T, name string, value string) {
+	err := ioutil.WriteFile(*tlbSysfs+"/"+name, []byte(value), 0)
+	if err != nil {
+		t.Fatalf("write %s failed with err %v", name, err)
+	}
+}
+
+func failoverGet(client *http.Client) error {
+	resp, err := client.Get("http://" + *serverAddress + "/blank")
+	if err != nil {
+		return err
+	}
+	defer resp.Body.Close()
+	_, err = io.Copy(ioutil.Discard, resp.Body)
+	return err
+}
+
+func reportPhase(t *testing.T, name string, samples []failoverSample, from time.Time, to time.Time) int {
+	var latencies []time.Duration
+	var errors int
+	var lastError time.Time
+
+	for _, s := range samples {
+		if s.start.Before(from) || !s.start.Before(to) {
+			continue
+		}
+		if s.err != nil {
+			errors++
+			lastError = s.start
+			continue
+		}
+		latencies = append(latencies, s.latency)
+	}
+	sort.Slice(latencies, func(i, j int) bool { return latencies[i] < latencies[j] })
+
+	percentile := func(p int) time.Duration {
+		if len(latencies) == 0 {
+			return 0
+		}
+		return latencies[(len(latencies)-1)*p/100]
+	}
+
+	var errorsFor time.Duration
+	if errors != 0 {
+		errorsFor = lastError.Sub(from)
+	}
+	t.Logf("%s: requests %d errors %d errors_for %v p50 %v p99 %v max %v", name, len(latencies)+errors, errors,
+		errorsFor, percentile(50), percentile(99), percentile(100))
+	return errors
+}
+
+// fails, delays and resets injected into target so far, from target_fault
+func faultCounters(t *testing.T, target string) (counters [3]uint64) {
+	stats, err := ioutil.ReadFile(*tlbSysfs + "/target_fault")
+	if err != nil {
+		t.Fatalf("read target_fault: %v", err)
+	}
+	for _, line := range strings.Split(string(stats), "\n") {
+		fields := strings.Fields(line)
+		if len(fields) != 8 || strings.Join(fields[:2], " ") != strings.Join(strings.Fields(target), " ") {
+			continue
+		}
+		for i := range counters {
+			counters[i], _ = strconv.ParseUint(fields[5+i], 10, 64)
+		}
+	}
+	return counters
+}
+
+// Runs a steady load through tlb, breaks one target for a phase and heals
+// it. errors_for of the fault phase is how long tlb kept routing to the
+// broken target. Needs root and a running tlb, see scripts/run.sh.
+func TestFailover(t *testing.T) {
+	if *failoverTarget == "" {
+		t.Skip("no -failoverTarget")
+	}
+
+	client := &http.Client{
+		Timeout: time.Second * 10,
+		Transport: &http.Transport{
+			Dial: (&net.Dialer{
+				Timeout: 5 * time.Second,
+			}).Dial,
+			DisableKeepAlives: true,
+		}}
+
+	var mutex sync.Mutex
+	var wg sync.WaitGroup
+	var samples []failoverSample
+
+	begin := time.Now()
+	faultAt := begin.Add(*failoverPhase)
+	healAt := faultAt.Add(*failoverPhase)
+	end := healAt.Add(*failoverPhase)
+	faulted, healed := false, false
+	var before, after [3]uint64
+
+	defer writeSysfs(t, "target_fault", *failoverTarget+" 0 0 0")
+
+	ticker := time.NewTicker(time.Second / time.Duration(*failoverRate))
+	for now := range ticker.C {
+		if !now.Before(end) {
+			break
+		}
+		if !faulted && !now.Before(faultAt) {
+			before = faultCounters(t, *failoverTarget)
+			writeSysfs(t, "target_fault", *failoverTarget+" "+*failoverFault)
+			faulted = true
+		}
+		if !healed && !now.Before(healAt) {
+			after = faultCounters(t, *failoverTarget)
+			writeSysfs(t, "target_fault", *failoverTarget+" 0 0 0")
+			healed = true
+		}
+
+		wg.Add(1)
+		go func(start time.Time) {
+			defer wg.Done()
+			err := failoverGet(client)
+			mutex.Lock()
+			samples = append(samples, failoverSample{start: start, latency: time.Since(start), err: err})
+			mutex.Unlock()
+		}(now)
+	}
+	ticker.Stop()
+	wg.Wait()
+
+	if errors := reportPhase(t, "baseline", samples, begin, faultAt); errors != 0 {
+		t.Errorf("baseline: %d errors before any fault", errors)
+	}
+	reportPhase(t, "fault", samples, faultAt, healAt)
+	reportPhase(t, "recovery", samples, healAt, end)
+	if after == before {
+		t.Errorf("fault: no fails, delays or resets injected into %s", *failoverTarget)
+	}
+
+	stats, err := ioutil.ReadFile(*tlbSysfs + "/target_fault")
+	if err == nil {
+		t.Logf("target_fault (host port fail_percent delay_ms reset_bytes fails delays resets):\n%s", stats)
+	}
+	stats, err = ioutil.ReadFile(*tlbSysfs + "/replay_stats")
+	if err == nil {
+		t.Logf("replay_stats (replays failed): %s", stats)
+	}
+}
+
+func h2Client() *http.Client {
+	return &http.Client{
+		Timeout: time.Second * 10,
+		Transport: &http2.Transport{
+			AllowHTTP: true,
+			DialTLS: func(network, addr string, cfg *tls.Config) (net.Conn, error) {
+				return net.DialTimeout(network, addr, 5*time.Second)
+			},
+		}}
+}
+
+// Concurrent streams of one h2c connection, each balanced on its own.
+// Needs "echo h2 > /sys/fs/tlb/mode" with scripts/run.sh.
+func TestH2RoundTrip(t *testing.T) {
+	if !*h2Mode {
+		t.Skip("no -h2")
+	}
+
+	client := h2Client()
+	body := bytes.Repeat([]byte("tlb"), 100000)
+	var wg sync.WaitGroup
+	for i := 0; i < 16; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for j := 0; j < 10; j++ {
+				resp, err := client.Post("http://"+*serverAddress+"/echo", "application/octet-stream",
+					bytes.NewReader(body))
+				if err != nil {
+					t.Errorf("Post failed with err %v", err)
+					return
+				}
+				got, err := ioutil.ReadAll(resp.Body)
+				resp.Body.Close()
+				if err != nil {
+					t.Errorf("read failed with err %v", err)
+					return
+				}
+				if resp.ProtoMajor != 2 || !bytes.Equal(got, body) {
+					t.Errorf("echo: proto %s status %d len %d, want HTTP/2.0 200 len %d", resp.Proto,
+						resp.StatusCode, len(got), len(body))
+					return
+				}
+			}
+		}()
+	}
+	wg.Wait()
+}
+
+// A client that stops reading its socket must stall the target rather than
+// have tlb queue the response: the target can't finish writing before the
+// client reads again. Windows are opened wide so only tlb can hold it back.
+func TestH2StalledClient(t *testing.T) {
+	if !*h2Mode {
+		t.Skip("no -h2")
+	}
+
+	const size = 64 << 20
+	conn, err := net.DialTimeout("tcp", *serverAddress, 5*time.Second)
+	if err != nil {
+		t.Fatalf("Dial failed with err %v", err)
+	}
+	defer conn.Close()
+	conn.(*net.TCPConn).SetReadBuffer(64 << 10)
+
+	framer := http2.NewFramer(conn, conn)
+	framer.ReadMetaHeaders = hpack.NewDecoder(4096, nil)
+	var block bytes.Buffer
+	enc := hpack.NewEncoder(&block)
+	for _, f := range [][2]string{{":method", "GET"}, {":scheme", "http"}, {":authority", *serverAddress},
+		{":path", "/download?size=" + strconv.Itoa(size)}} {
+		enc.WriteField(hpack.HeaderField{Name: f[0], Value: f[1]})
+	}
+
+	_, err = conn.Write([]byte(http2.ClientPreface))
+	if err == nil {
+		err = framer.WriteSettings(http2.Setting{ID: http2.SettingInitialWindowSize, Val: 1<<31 - 1})
+	}
+	if err == nil {
+		err = framer.WriteWindowUpdate(0, 1<<31-1-65535)
+	}
+	if err == nil {
+		err = framer.WriteHeaders(http2.HeadersFrameParam{StreamID: 1, BlockFragment: block.Bytes(),
+			EndStream: true, EndHeaders: true})
+	}
+	if err != nil {
+		t.Fatalf("request failed with err %v", err)
+	}
+
+	time.Sleep(*h2Stall)
+	resumed := time.Now()
+
+	var received int
+	var writtenAt int64
+	conn.SetReadDeadline(time.Now().Add(30 * time.Second))
+	for done := false; !done; {
+		frame, err := framer.ReadFrame()
+		if err != nil {
+			t.Fatalf("read failed after %d bytes with err %v", received, err)
+		}
+		switch f := frame.(type) {
+		case *http2.DataFrame:
+			received += len(f.Data())
+			done = f.StreamEnded()
+		case *http2.MetaHeadersFrame:
+			for _, hf := range f.RegularFields() {
+				if hf.Name == "x-written-at" {
+					writtenAt, _ = strconv.ParseInt(hf.Value, 10, 64)
+				}
+			}
+			done = f.StreamEnded()
+		case *http2.SettingsFrame:
+			if !f.IsAck() {
+				framer.WriteSettingsAck()
+			}
+		case *http2.RSTStreamFrame, *http2.GoAwayFrame:
+			t.Fatalf("stream aborted after %d bytes: %v", received, f)
+		}
+	}
+
+	if received != size {
+		t.Errorf("received %d bytes, want %d", received, size)
+	}
+	if writtenAt == 0 {
+		t.Errorf("no X-Written-At trailer")
+	} else if written := time.Unix(0, writtenAt); written.Before(resumed) {
+		t.Errorf("target wrote all %d bytes %v before the client read any, tlb queued them", size,
+			resumed.Sub(written))
+	}
+}
+
+// Sends one command, returns a status, error or integer line as is and a
+// bulk string's content
+func redisCommand(rw *bufio.ReadWriter, args ...string) (string, error) {
+	fmt.Fprintf(rw, "*%d\r\n", len(args))
+	for _, arg := range args {
+		fmt.Fprintf(rw, "$%d\r\n%s\r\n", len(arg), arg)
+	}
+	err := rw.Flush()
+	if err != nil {
+		return "", err
+	}
+
+	line, err := rw.ReadString('\n')
+	if err != nil {
+		return "", err
+	}
+	line = strings.TrimSuffix(line, "\r\n")
+	if !strings.HasPrefix(line, "$") {
+		return line, nil
+	}
+	n, err := strconv.Atoi(line[1:])
+	if err != nil || n < 0 {
+		return line, err
+	}
+	buf := make([]byte, n+2)
+	_, err = io.ReadFull(rw, buf)
+	return string(buf[:n]), err
+}
+
+// BITOP has to run where its keys are, not where its operation name hashes
+// to: over enough hash tags some keys live on another target than "AND".
+func TestRedisBitop(t *testing.T) {
+	if !*redisMode {
+		t.Skip("no -redis")
+	}
+
+	conn, err := net.DialTimeout("tcp", *serverAddress, 5*time.Second)
+	if err != nil {
+		t.Fatalf("Dial failed with err %v", err)
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(10 * time.Second))
+	rw := bufio.NewReadWriter(bufio.NewReader(conn), bufio.NewWriter(conn))
+
+	for i := 0; i < 32; i++ {
+		tag := "{bitop" + strconv.Itoa(i) + "}"
+		for _, cmd := range [][]string{{"SET", tag + "a", "\x0f"}, {"SET", tag + "b", "\xff"},
+			{"BITOP", "AND", tag + "dest", tag + "a", tag + "b"}} {
+			reply, err := redisCommand(rw, cmd...)
+			if err != nil {
+				t.Fatalf("%v failed with err %v", cmd, err)
+			}
+			if strings.HasPrefix(reply, "-") {
+				t.Fatalf("%v: %s", cmd, reply)
+			}
+		}
+
+		reply, err := redisCommand(rw, "GET", tag+"dest")
+		if err != nil {
+			t.Fatalf("GET failed with err %v", err)
+		}
+		if reply != "\x0f" {
+			t.Errorf("GET %sdest: %q, want the BITOP result on the target of %s", tag, reply, tag)
+		}
+	}
+}
@@ -0,0 +1,60 @@
+#include "timeout.h"
+#include "server.h"
+
+void tlb_timeout_init(struct tlb_timeout *to, struct tlb_server *srv, struct coroutine *co,
+		      unsigned int idle_ms, unsigned int min_rate, unsigned int window_ms)
+{
+	coroutine_timer_init(&to->timer, co);
+	to->srv = srv;
+	to->peer = NULL;
+	to->idle = idle_ms ? msecs_to_jiffies(idle_ms) : 0;
+	to->min_rate = window_ms ? min_rate : 0;
+	to->window = msecs_to_jiffies(window_ms);
+	to->last_active = jiffies;
+	to->window_start = to->last_active;
+	to->window_bytes = 0;
+}
+
+/*
+ * A silent peer is left to the idle timeout: only a window that carried some
+ * data, but too little of it, counts as a slow client.
+ */
+int tlb_timeout_check(struct tlb_timeout *to)
+{
+	unsigned long now = jiffies;
+	unsigned long deadline = 0, end;
+	u64 elapsed_ms;
+
+	if (to->idle) {
+		deadline = READ_ONCE(to->last_active) + to->idle;
+		if (!time_before(now, deadline)) {
+			atomic64_inc(&to->srv->idle_timeouts);
+			return -ETIMEDOUT;
+		}
+	}
+
+	if (to->min_rate) {
+		end = to->window_start + to->window;
+		if (!time_before(now, end)) {
+			elapsed_ms = jiffies_to_msecs(now - to->window_start);
+			if (to->window_bytes && to->window_bytes * MSEC_PER_SEC < to->min_rate * elapsed_ms) {
+				atomic64_inc(&to->srv->slow_timeouts);
+				return -ETIMEDOUT;
+			}
+			to->window_start = now;
+			to->window_bytes = 0;
+			end = now + to->window;
+		}
+		if (!deadline || time_before(end, deadline))
+			deadline = end;
+	}
+
+	if (deadline)
+		coroutine_timer_arm(&to->timer, deadline);
+	return 0;
+}
+
+void tlb_timeout_cancel(struct tlb_timeout *to)
+{
+	coroutine_timer_cancel(&to->timer);
+}
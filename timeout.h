@@ -0,0 +1,42 @@
+#pragma once
+
+#include "base.h"
+#include "coroutine.h"
+
+struct tlb_server;
+
+/*
+ * Idle and minimum rate limits of one receiving side of a connection. The
+ * data path only bumps counters, the deadline is rechecked when the owning
+ * coroutine would block.
+ */
+struct tlb_timeout {
+	struct coroutine_timer timer;
+	struct tlb_server *srv;
+	/* the other side, data forwarded to it counts as its activity */
+	struct tlb_timeout *peer;
+	unsigned long idle;
+	unsigned long window;
+	u64 min_rate;
+
+	unsigned long last_active;
+	unsigned long window_start;
+	u64 window_bytes;
+};
+
+void tlb_timeout_init(struct tlb_timeout *to, struct tlb_server *srv, struct coroutine *co,
+		      unsigned int idle_ms, unsigned int min_rate, unsigned int window_ms);
+
+static inline void tlb_timeout_account(struct tlb_timeout *to, int bytes)
+{
+	unsigned long now = jiffies;
+
+	WRITE_ONCE(to->last_active, now);
+	to->window_bytes += bytes;
+	if (to->peer)
+		WRITE_ONCE(to->peer->last_active, now);
+}
+
+int tlb_timeout_check(struct tlb_timeout *to);
+
+void tlb_timeout_cancel(struct tlb_timeout *to);
@@ -0,0 +1,455 @@
+#include "udp.h"
+#include "server.h"
+#include "trace.h"
+
+#include <linux/jhash.h>
+
+static u32 tlb_udp_addr_hash(struct sockaddr_storage *addr)
+{
+	struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+	if (addr->ss_family == AF_INET)
+		return jhash_2words(in4->sin_addr.s_addr, in4->sin_port, 0);
+
+	return jhash2(in6->sin6_addr.s6_addr32, 4, in6->sin6_port);
+}
+
+static bool tlb_udp_addr_equal(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	struct sockaddr_in *a4 = (struct sockaddr_in *)a, *b4 = (struct sockaddr_in *)b;
+	struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)a, *b6 = (struct sockaddr_in6 *)b;
+
+	if (a->ss_family != b->ss_family)
+		return false;
+
+	if (a->ss_family == AF_INET)
+		return a4->sin_addr.s_addr == b4->sin_addr.s_addr && a4->sin_port == b4->sin_port;
+
+	return ipv6_addr_equal(&a6->sin6_addr, &b6->sin6_addr) && a6->sin6_port == b6->sin6_port;
+}
+
+static struct hlist_head *tlb_udp_flow_bucket(struct tlb_udp_worker *worker, struct sockaddr_storage *addr)
+{
+	return &worker->flow_hash[tlb_udp_addr_hash(addr) & ((1 << TLB_UDP_FLOW_HASH_BITS) - 1)];
+}
+
+static struct tlb_udp_flow *tlb_udp_lookup_flow(struct tlb_udp_worker *worker, struct sockaddr_storage *addr)
+{
+	struct tlb_udp_flow *flow;
+
+	hlist_for_each_entry(flow, tlb_udp_flow_bucket(worker, addr), hash_entry) {
+		if (tlb_udp_addr_equal(&flow->client_addr, addr))
+			return flow;
+	}
+
+	return NULL;
+}
+
+static void tlb_udp_flow_data_ready(struct sock *sk)
+{
+	struct tlb_udp_flow *flow;
+	struct tlb_udp_worker *worker;
+	unsigned long flags;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	flow = sk->sk_user_data;
+	if (!flow)
+		goto unlock;
+
+	worker = flow->worker;
+	spin_lock_irqsave(&worker->ready_lock, flags);
+	if (list_empty(&flow->ready_entry))
+		list_add_tail(&flow->ready_entry, &worker->ready_list);
+	spin_unlock_irqrestore(&worker->ready_lock, flags);
+
+	coroutine_signal(worker->co);
+unlock:
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void tlb_udp_sock_nop(struct sock *sk)
+{
+}
+
+static void tlb_udp_flow_delete(struct tlb_udp_flow *flow)
+{
+	struct tlb_udp_worker *worker = flow->worker;
+	unsigned long flags;
+
+	ksock_clear_callbacks(flow->sock);
+
+	spin_lock_irqsave(&worker->ready_lock, flags);
+	list_del_init(&flow->ready_entry);
+	spin_unlock_irqrestore(&worker->ready_lock, flags);
+
+	hlist_del_init(&flow->hash_entry);
+	list_del_init(&flow->lru_entry);
+	worker->nr_flows--;
+
+	sock_release(flow->sock);
+	atomic64_dec(&flow->target->active_cons);
+	tlb_target_put(flow->target);
+	kmem_cache_free(g_udp_flow_cache, flow);
+}
+
+static struct tlb_udp_flow *tlb_udp_flow_create(struct tlb_udp_worker *worker, struct sockaddr_storage *addr)
+{
+	struct tlb_udp_flow *flow;
+	struct ksock_callbacks callbacks;
+	int r;
+
+	if (worker->nr_flows >= TLB_UDP_MAX_FLOWS)
+		tlb_udp_flow_delete(list_first_entry(&worker->lru_list, struct tlb_udp_flow, lru_entry));
+
+	flow = kmem_cache_alloc(g_udp_flow_cache, GFP_KERNEL);
+	if (!flow)
+		return ERR_PTR(-ENOMEM);
+	memset(flow, 0, sizeof(*flow));
+	flow->client_addr = *addr;
+	flow->worker = worker;
+	INIT_HLIST_NODE(&flow->hash_entry);
+	INIT_LIST_HEAD(&flow->lru_entry);
+	INIT_LIST_HEAD(&flow->ready_entry);
+
+	flow->target = tlb_server_select_udp_target(worker->udp->srv, &flow->client_addr);
+	if (!flow->target) {
+		r = -ENOENT;
+		goto free_flow;
+	}
+
+	callbacks.user_data = flow;
+	callbacks.data_ready = tlb_udp_flow_data_ready;
+	callbacks.write_space = tlb_udp_sock_nop;
+	callbacks.state_change = tlb_udp_sock_nop;
+	r = ksock_connect_udp(&flow->sock, &flow->target->addr, &callbacks);
+	if (r)
+		goto put_target;
+
+	atomic64_inc(&flow->target->total_cons);
+	atomic64_inc(&flow->target->active_cons);
+
+	hlist_add_head(&flow->hash_entry, tlb_udp_flow_bucket(worker, addr));
+	list_add_tail(&flow->lru_entry, &worker->lru_list);
+	worker->nr_flows++;
+	worker->total_flows++;
+	return flow;
+
+put_target:
+	tlb_target_put(flow->target);
+free_flow:
+	kmem_cache_free(g_udp_flow_cache, flow);
+	return ERR_PTR(r);
+}
+
+static void tlb_udp_flow_touch(struct tlb_udp_flow *flow)
+{
+	flow->last_active = jiffies;
+	list_move_tail(&flow->lru_entry, &flow->worker->lru_list);
+}
+
+/* client -> target: returns true if the batch was exhausted */
+static bool tlb_udp_worker_rx(struct tlb_udp_worker *worker)
+{
+	struct sockaddr_storage addr;
+	struct tlb_udp_flow *flow;
+	int i, r;
+
+	for (i = 0; i < TLB_UDP_BATCH; i++) {
+		r = ksock_recvfrom(worker->sock, worker->buf, TLB_UDP_BUF_SIZE, &addr);
+		if (r < 0)
+			return false;
+
+		worker->rx_packets++;
+		flow = tlb_udp_lookup_flow(worker, &addr);
+		if (!flow) {
+			flow = tlb_udp_flow_create(worker, &addr);
+			if (IS_ERR(flow)) {
+				worker->drops++;
+				continue;
+			}
+		}
+		tlb_udp_flow_touch(flow);
+
+		r = ksock_sendto(flow->sock, worker->buf, r, NULL);
+		if (r < 0)
+			worker->drops++;
+	}
+
+	return true;
+}
+
+/* target -> client for the flows marked ready by data_ready */
+static bool tlb_udp_worker_tx(struct tlb_udp_worker *worker)
+{
+	struct tlb_udp_flow *flow;
+	struct list_head ready_list;
+	unsigned long flags;
+	bool more = false;
+	int i, r;
+
+	INIT_LIST_HEAD(&ready_list);
+	spin_lock_irqsave(&worker->ready_lock, flags);
+	list_splice_init(&worker->ready_list, &ready_list);
+	spin_unlock_irqrestore(&worker->ready_lock, flags);
+
+	while (!list_empty(&ready_list)) {
+		flow = list_first_entry(&ready_list, struct tlb_udp_flow, ready_entry);
+		spin_lock_irqsave(&worker->ready_lock, flags);
+		list_del_init(&flow->ready_entry);
+		spin_unlock_irqrestore(&worker->ready_lock, flags);
+
+		for (i = 0; i < TLB_UDP_BATCH; i++) {
+			r = ksock_recv(flow->sock, worker->buf, TLB_UDP_BUF_SIZE);
+			if (r < 0)
+				break;
+
+			r = ksock_sendto(worker->sock, worker->buf, r, &flow->client_addr);
+			if (r < 0)
+				worker->drops++;
+			else
+				worker->tx_packets++;
+		}
+		tlb_udp_flow_touch(flow);
+
+		if (i == TLB_UDP_BATCH) {
+			spin_lock_irqsave(&worker->ready_lock, flags);
+			if (list_empty(&flow->ready_entry))
+				list_add_tail(&flow->ready_entry, &worker->ready_list);
+			spin_unlock_irqrestore(&worker->ready_lock, flags);
+			more = true;
+		}
+	}
+
+	return more;
+}
+
+static void tlb_udp_worker_expire(struct tlb_udp_worker *worker)
+{
+	unsigned long timeout = msecs_to_jiffies(READ_ONCE(worker->udp->flow_timeout_ms));
+	struct tlb_udp_flow *flow;
+
+	while (!list_empty(&worker->lru_list)) {
+		flow = list_first_entry(&worker->lru_list, struct tlb_udp_flow, lru_entry);
+		if (time_before(jiffies, flow->last_active + timeout))
+			break;
+
+		tlb_udp_flow_delete(flow);
+	}
+}
+
+static void *tlb_udp_worker_coroutine(struct coroutine *co, void *arg)
+{
+	struct tlb_udp_worker *worker = arg;
+	bool more;
+
+	while (!READ_ONCE(worker->stopping)) {
+		more = tlb_udp_worker_rx(worker);
+		more |= tlb_udp_worker_tx(worker);
+		tlb_udp_worker_expire(worker);
+
+		/* let the other coroutines of this thread run between batches */
+		if (more)
+			coroutine_signal(co);
+		coroutine_yield(co);
+	}
+
+	return NULL;
+}
+
+static void tlb_udp_worker_data_ready(struct sock *sk)
+{
+	struct tlb_udp_worker *worker;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	worker = sk->sk_user_data;
+	if (worker)
+		coroutine_signal(worker->co);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void tlb_udp_worker_timer(struct timer_list *timer)
+{
+	struct tlb_udp_worker *worker = from_timer(worker, timer, expire_timer);
+
+	if (READ_ONCE(worker->stopping))
+		return;
+
+	coroutine_signal(worker->co);
+	mod_timer(&worker->expire_timer, jiffies + msecs_to_jiffies(1000));
+}
+
+static int tlb_udp_worker_start(struct tlb_udp_worker *worker, struct tlb_udp_server *udp,
+				struct coroutine_thread *thread, struct sockaddr_storage *addr)
+{
+	struct ksock_callbacks callbacks;
+	int i, r;
+
+	worker->udp = udp;
+	INIT_LIST_HEAD(&worker->lru_list);
+	INIT_LIST_HEAD(&worker->ready_list);
+	spin_lock_init(&worker->ready_lock);
+	for (i = 0; i < ARRAY_SIZE(worker->flow_hash); i++)
+		INIT_HLIST_HEAD(&worker->flow_hash[i]);
+
+	worker->buf = kmalloc(TLB_UDP_BUF_SIZE, GFP_KERNEL);
+	if (!worker->buf)
+		return -ENOMEM;
+
+	worker->co = coroutine_create(thread);
+	if (!worker->co) {
+		r = -ENOMEM;
+		goto free_buf;
+	}
+
+	callbacks.user_data = worker;
+	callbacks.data_ready = tlb_udp_worker_data_ready;
+	callbacks.write_space = tlb_udp_sock_nop;
+	callbacks.state_change = tlb_udp_sock_nop;
+	r = ksock_bind_udp(&worker->sock, addr, &callbacks);
+	if (r)
+		goto deref_co;
+
+	timer_setup(&worker->expire_timer, tlb_udp_worker_timer, 0);
+	mod_timer(&worker->expire_timer, jiffies + msecs_to_jiffies(1000));
+	coroutine_start(worker->co, tlb_udp_worker_coroutine, worker);
+	return 0;
+
+deref_co:
+	coroutine_deref(worker->co);
+free_buf:
+	kfree(worker->buf);
+	return r;
+}
+
+static void tlb_udp_worker_stop(struct tlb_udp_worker *worker)
+{
+	struct tlb_udp_flow *flow;
+
+	WRITE_ONCE(worker->stopping, true);
+	del_timer_sync(&worker->expire_timer);
+	ksock_clear_callbacks(worker->sock);
+
+	/* waits until the coroutine yields, it won't be entered again */
+	coroutine_cancel(worker->co);
+
+	while (!list_empty(&worker->lru_list)) {
+		flow = list_first_entry(&worker->lru_list, struct tlb_udp_flow, lru_entry);
+		tlb_udp_flow_delete(flow);
+	}
+
+	sock_release(worker->sock);
+	coroutine_deref(worker->co);
+	kfree(worker->buf);
+}
+
+void tlb_udp_server_init(struct tlb_udp_server *udp, struct tlb_server *srv)
+{
+	memset(udp, 0, sizeof(*udp));
+	udp->srv = srv;
+	udp->flow_timeout_ms = TLB_UDP_FLOW_TIMEOUT_MS;
+}
+
+int tlb_udp_server_start(struct tlb_udp_server *udp, const char *host, int port)
+{
+	struct tlb_server *srv = udp->srv;
+	struct sockaddr_storage addr;
+	int r, i;
+
+	if (strlen(host) >= ARRAY_SIZE(udp->host) || port <= 0 || port > 65535)
+		return -EINVAL;
+
+	r = ksock_resolve_addr(host, port, &addr);
+	if (r)
+		return r;
+
+	mutex_lock(&srv->lock);
+	if (srv->state != TLB_SRV_RUNNING) {
+		r = -ENOENT;
+		goto unlock;
+	}
+	if (udp->running) {
+		r = -EEXIST;
+		goto unlock;
+	}
+
+	udp->worker = vzalloc(srv->nr_con_thread * sizeof(*udp->worker));
+	if (!udp->worker) {
+		r = -ENOMEM;
+		goto unlock;
+	}
+
+	for (udp->nr_worker = 0; udp->nr_worker < srv->nr_con_thread; udp->nr_worker++) {
+		r = tlb_udp_worker_start(&udp->worker[udp->nr_worker], udp,
+					 &srv->con_thread[udp->nr_worker], &addr);
+		if (r)
+			goto stop_workers;
+	}
+
+	snprintf(udp->host, ARRAY_SIZE(udp->host), "%s", host);
+	udp->port = port;
+	udp->running = true;
+	mutex_unlock(&srv->lock);
+	return 0;
+
+stop_workers:
+	for (i = 0; i < udp->nr_worker; i++)
+		tlb_udp_worker_stop(&udp->worker[i]);
+	vfree(udp->worker);
+	udp->worker = NULL;
+	udp->nr_worker = 0;
+unlock:
+	mutex_unlock(&srv->lock);
+	return r;
+}
+
+/* caller holds srv->lock */
+int __tlb_udp_server_stop(struct tlb_udp_server *udp)
+{
+	int i;
+
+	if (!udp->running)
+		return -ENOENT;
+
+	for (i = 0; i < udp->nr_worker; i++)
+		tlb_udp_worker_stop(&udp->worker[i]);
+	vfree(udp->worker);
+	udp->worker = NULL;
+	udp->nr_worker = 0;
+	udp->running = false;
+	return 0;
+}
+
+int tlb_udp_server_stop(struct tlb_udp_server *udp)
+{
+	int r;
+
+	mutex_lock(&udp->srv->lock);
+	r = __tlb_udp_server_stop(udp);
+	mutex_unlock(&udp->srv->lock);
+	return r;
+}
+
+int tlb_udp_server_get_stats(struct tlb_udp_server *udp, struct tlb_udp_stats *stats)
+{
+	struct tlb_udp_worker *worker;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	mutex_lock(&udp->srv->lock);
+	if (!udp->running) {
+		mutex_unlock(&udp->srv->lock);
+		return -ENOENT;
+	}
+
+	for (i = 0; i < udp->nr_worker; i++) {
+		worker = &udp->worker[i];
+		stats->flows += READ_ONCE(worker->nr_flows);
+		stats->total_flows += READ_ONCE(worker->total_flows);
+		stats->rx_packets += READ_ONCE(worker->rx_packets);
+		stats->tx_packets += READ_ONCE(worker->tx_packets);
+		stats->drops += READ_ONCE(worker->drops);
+	}
+	mutex_unlock(&udp->srv->lock);
+	return 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "base.h"
+#include "ksock.h"
+#include "coroutine.h"
+
+struct tlb_server;
+struct tlb_target;
+struct tlb_udp_worker;
+
+#define TLB_UDP_BUF_SIZE (64 * 1024)
+#define TLB_UDP_BATCH 32
+#define TLB_UDP_FLOW_HASH_BITS 12
+#define TLB_UDP_MAX_FLOWS (64 * 1024)
+#define TLB_UDP_FLOW_TIMEOUT_MS 30000
+
+struct tlb_udp_flow {
+	struct sockaddr_storage client_addr;
+	struct tlb_udp_worker *worker;
+	struct tlb_target *target;
+	struct socket *sock;
+	unsigned long last_active;
+	struct hlist_node hash_entry;
+	struct list_head lru_entry;
+	struct list_head ready_entry;
+};
+
+/*
+ * One worker per coroutine thread: a SO_REUSEPORT socket, a flow table and
+ * a single coroutine that relays both directions. Flows are only touched
+ * from that coroutine, so the table needs no locking; only ready_list is
+ * shared with the softirq data_ready callbacks of the target sockets.
+ */
+struct tlb_udp_worker {
+	struct tlb_udp_server *udp;
+	struct socket *sock;
+	struct coroutine *co;
+	char *buf;
+
+	struct hlist_head flow_hash[1 << TLB_UDP_FLOW_HASH_BITS];
+	struct list_head lru_list;
+	int nr_flows;
+
+	struct list_head ready_list;
+	spinlock_t ready_lock;
+
+	struct timer_list expire_timer;
+	bool stopping;
+
+	u64 rx_packets;
+	u64 tx_packets;
+	u64 drops;
+	u64 total_flows;
+};
+
+struct tlb_udp_server {
+	char host[64];
+	int port;
+	bool running;
+	unsigned int flow_timeout_ms;
+	struct tlb_server *srv;
+	struct tlb_udp_worker *worker;
+	int nr_worker;
+};
+
+struct tlb_udp_stats {
+	u64 flows;
+	u64 total_flows;
+	u64 rx_packets;
+	u64 tx_packets;
+	u64 drops;
+};
+
+void tlb_udp_server_init(struct tlb_udp_server *udp, struct tlb_server *srv);
+
+int tlb_udp_server_start(struct tlb_udp_server *udp, const char *host, int port);
+
+int __tlb_udp_server_stop(struct tlb_udp_server *udp);
+
+int tlb_udp_server_stop(struct tlb_udp_server *udp);
+
+int tlb_udp_server_get_stats(struct tlb_udp_server *udp, struct tlb_udp_stats *stats);